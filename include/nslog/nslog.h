@@ -16,6 +16,14 @@
 #define NSLOG_NSLOG_H_
 
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /**
  * Log levels
@@ -96,6 +104,17 @@ typedef struct nslog_category_s {
 	char *name; /**< The fully qualified category name (owned by nslog) */
 	int namelen; /**< The length of the category name */
 	struct nslog_category_s *next; /**< Link to next category (internal) */
+	/**
+	 * The fully qualified category name, if it was built at compile time
+	 * (static).  This is set by the C++ category macros in nslog.hpp so
+	 * that name needn't be allocated.
+	 */
+	const char *static_name;
+	/**
+	 * The category's minimum level in the level map, and which map that
+	 * was (internal)
+	 */
+	unsigned int levelmap;
 } nslog_category_t;
 
 /**
@@ -114,6 +133,26 @@ typedef struct nslog_entry_context_s {
 	const char *funcname; /**< The source function where the log entry is */
 	int funcnamelen; /**< The source function name's length */
 	int lineno; /**< The line number at which the log entry is */
+	/**
+	 * Call-site data, computed once by nslog on first use (internal)
+	 *
+	 * Filters use these to reject most string comparisons with a
+	 * simple integer compare.
+	 */
+	struct {
+		int computed; /**< 1 if the data below is valid */
+		int leafoffset; /**< Offset of the filename's leafname */
+		int dirnamelen; /**< Length of the filename's dirname (0 if none) */
+		unsigned int filenamehash; /**< Hash of the whole filename */
+		unsigned int leafhash; /**< Hash of the filename's leafname */
+		unsigned int dirnamehash; /**< Hash of the filename's dirname */
+		unsigned int funcnamehash; /**< Hash of the function name */
+		int format; /**< How the site's messages are formatted */
+		unsigned int prefixgen; /**< When the prefix was rendered */
+		struct nslog_prefix_s *prefix; /**< The rendered line prefix */
+		/** The call site this context is a copy of, if any */
+		struct nslog_entry_context_s *origin;
+	} site;
 } nslog_entry_context_t;
 
 /**
@@ -125,8 +164,36 @@ typedef struct nslog_entry_context_s {
  * \param catname The category leaf name (as a bareword)
  */
 #define NSLOG_DECLARE_CATEGORY(catname)				\
+	NSLOG_DECLARE_CATEGORY_LEVEL(catname, DEEPDEBUG)
+
+/**
+ * Declare a category with its own compiled minimum level
+ *
+ * As \ref NSLOG_DECLARE_CATEGORY, but entries in the category below the
+ * given level are compiled out, as if \ref NSLOG_COMPILED_MIN_LEVEL were
+ * set to it for that category alone.  The category must be defined with
+ * the same level by \ref NSLOG_DEFINE_CATEGORY_LEVEL or
+ * \ref NSLOG_DEFINE_SUBCATEGORY_LEVEL.  Subcategories do not inherit their
+ * parent's level.
+ *
+ * \param catname The category leaf name (as a bareword)
+ * \param level The lowest level compiled in (as a bareword such as INFO)
+ */
+#define NSLOG_DECLARE_CATEGORY_LEVEL(catname, level)			\
+	extern char __nslog_catmin_##catname[NSLOG_LEVEL_##level + 1];	\
 	extern nslog_category_t __nslog_category_##catname
 
+/**
+ * Whether entries at a level in a category are compiled in (internal)
+ *
+ * The category's compiled minimum level is carried in the size of an
+ * array, so that this is a constant expression wherever the category is
+ * declared, and statements it rules out generate no code at all.
+ */
+#define NSLOG__COMPILED_IN(catname, level)				\
+	(NSLOG_LEVEL_##level >= NSLOG_COMPILED_MIN_LEVEL &&		\
+	 NSLOG_LEVEL_##level >= (int)sizeof(__nslog_catmin_##catname) - 1)
+
 /**
  * Define a category
  *
@@ -137,6 +204,18 @@ typedef struct nslog_entry_context_s {
  * \param description The category description (as a static string)
  */
 #define NSLOG_DEFINE_CATEGORY(catname, description)	\
+	NSLOG_DEFINE_CATEGORY_LEVEL(catname, description, DEEPDEBUG)
+
+/**
+ * Define a category with its own compiled minimum level
+ *
+ * \param catname The category name (as a bareword)
+ * \param description The category description (as a static string)
+ * \param level The lowest level compiled in, as given to
+ *              \ref NSLOG_DECLARE_CATEGORY_LEVEL
+ */
+#define NSLOG_DEFINE_CATEGORY_LEVEL(catname, description, level)	\
+	char __nslog_catmin_##catname[NSLOG_LEVEL_##level + 1];		\
 	nslog_category_t __nslog_category_##catname = { \
 		#catname,				\
 		description,				\
@@ -144,6 +223,8 @@ typedef struct nslog_entry_context_s {
 		NULL,					\
 		0,					\
 		NULL,					\
+		NULL,					\
+		0,					\
 	}
 
 /**
@@ -160,6 +241,21 @@ typedef struct nslog_entry_context_s {
  * \param description The category description (as a static string)
  */
 #define NSLOG_DEFINE_SUBCATEGORY(parentcatname, catname, description)	\
+	NSLOG_DEFINE_SUBCATEGORY_LEVEL(parentcatname, catname, description, \
+				       DEEPDEBUG)
+
+/**
+ * Define a sub-category with its own compiled minimum level
+ *
+ * \param parentcatname The category name of the parent category (as a bareword)
+ * \param catname The category name (as a bareword)
+ * \param description The category description (as a static string)
+ * \param level The lowest level compiled in, as given to
+ *              \ref NSLOG_DECLARE_CATEGORY_LEVEL
+ */
+#define NSLOG_DEFINE_SUBCATEGORY_LEVEL(parentcatname, catname, description, \
+				       level)				\
+	char __nslog_catmin_##catname[NSLOG_LEVEL_##level + 1];		\
 	nslog_category_t __nslog_category_##catname = {			\
 		#catname,						\
 		description,						\
@@ -167,6 +263,36 @@ typedef struct nslog_entry_context_s {
 		NULL,							\
 		0,							\
 		NULL,							\
+		NULL,							\
+		0,							\
+	}
+
+/* C++ warns of every member a { 0 } initialiser leaves out */
+#ifdef __cplusplus
+#define NSLOG__SITE_INIT {}
+#else
+#define NSLOG__SITE_INIT { 0 }
+#endif
+
+/**
+ * Initialiser for a call-site's log entry context (internal)
+ *
+ * This is used by the logging macros to build the static
+ * \ref nslog_entry_context_t for each call site.
+ *
+ * \param catname The category name (as a bareword)
+ * \param level The level at which this is logged (as a bareword)
+ */
+#define NSLOG__ENTRY_CONTEXT(catname, level)				\
+	{								\
+		&__nslog_category_##catname,				\
+		NSLOG_LEVEL_##level,					\
+		__FILE__,						\
+		sizeof(__FILE__) - 1,					\
+		__PRETTY_FUNCTION__,					\
+		sizeof(__PRETTY_FUNCTION__) - 1,			\
+		__LINE__,						\
+		NSLOG__SITE_INIT,					\
 	}
 
 /**
@@ -183,16 +309,9 @@ typedef struct nslog_entry_context_s {
  */
 #define NSLOG(catname, level, logmsg, args...)				\
 	do {								\
-		if (NSLOG_LEVEL_##level >= NSLOG_COMPILED_MIN_LEVEL) {	\
-			static nslog_entry_context_t _nslog_ctx = {	\
-				&__nslog_category_##catname,		\
-				NSLOG_LEVEL_##level,			\
-				__FILE__,				\
-				sizeof(__FILE__) - 1,			\
-				__PRETTY_FUNCTION__,			\
-				sizeof(__PRETTY_FUNCTION__) - 1,	\
-				__LINE__,				\
-			};						\
+		if (NSLOG__COMPILED_IN(catname, level)) {		\
+			static nslog_entry_context_t _nslog_ctx =	\
+				NSLOG__ENTRY_CONTEXT(catname, level);	\
 			nslog__log(&_nslog_ctx, logmsg, ##args);	\
 		}							\
 	} while(0)
@@ -211,6 +330,278 @@ void nslog__log(nslog_entry_context_t *ctx,
 		const char *pattern,
 		...) __attribute__ ((format (printf, 2, 3)));
 
+/**
+ * Log something from a signal handler
+ *
+ * Unlike \ref NSLOG this neither allocates memory nor takes locks, so it
+ * may be used in a handler for a signal such as SIGSEGV.  The message is
+ * not formatted: it is recorded, along with the entry's context and
+ * timestamp, in a fixed size ring buffer.  The ring is written out by
+ * \ref nslog_signal_flush and is not passed to the logging callbacks.
+ * Level gates apply, but filters do not.
+ *
+ * \param catname The category name (as a bareword)
+ * \param level The level at which this is logged (as a bareword)
+ * \param msg The log message, which must remain valid (typically a string
+ *            literal)
+ */
+#define NSLOG_SIGNAL(catname, level, msg)				\
+	NSLOG__SIGNAL(catname, level, msg, 0, false)
+
+/**
+ * Log something, with a value, from a signal handler
+ *
+ * As \ref NSLOG_SIGNAL but the value (such as a signal number or fault
+ * address) is written, in hexadecimal, after the message.
+ *
+ * \param catname The category name (as a bareword)
+ * \param level The level at which this is logged (as a bareword)
+ * \param msg The log message, which must remain valid
+ * \param value The value, as an unsigned integer up to 64 bits
+ */
+#define NSLOG_SIGNAL_VALUE(catname, level, msg, value)			\
+	NSLOG__SIGNAL(catname, level, msg, (uint64_t)(value), true)
+
+/**
+ * Implementation of \ref NSLOG_SIGNAL and \ref NSLOG_SIGNAL_VALUE (internal)
+ */
+#define NSLOG__SIGNAL(catname, level, msg, value, has_value)		\
+	do {								\
+		if (NSLOG__COMPILED_IN(catname, level)) {		\
+			static nslog_entry_context_t _nslog_ctx =	\
+				NSLOG__ENTRY_CONTEXT(catname, level);	\
+			nslog__log_signal(&_nslog_ctx, msg, value,	\
+					  has_value);			\
+		}							\
+	} while(0)
+
+/**
+ * Internal signal handler logging function
+ *
+ * This is the function which implements \ref NSLOG_SIGNAL.
+ *
+ * \param ctx The log entry context for the log
+ * \param msg The message
+ * \param value The value to follow the message, if has_value is set
+ * \param has_value Whether there is a value
+ */
+void nslog__log_signal(nslog_entry_context_t *ctx,
+		       const char *msg,
+		       uint64_t value,
+		       bool has_value);
+
+/**
+ * Structured log field types
+ */
+typedef enum {
+	NSLOG_KV_TYPE_INT = 0, /**< A signed integer (value.i) */
+	NSLOG_KV_TYPE_DOUBLE = 1, /**< A floating point value (value.d) */
+	NSLOG_KV_TYPE_STRING = 2, /**< A NUL terminated string (value.s) */
+	NSLOG_KV_TYPE_POINTER = 3, /**< A pointer (value.p) */
+} nslog_kv_type;
+
+/**
+ * Structured log field
+ *
+ * Structured log entries made with \ref NSLOG_KV carry an array of these.
+ * Like the entry context, the fields are ephemeral and must be copied if
+ * they are needed beyond the scope of the log callback.
+ */
+typedef struct nslog_kv_field_s {
+	const char *key; /**< The field name */
+	nslog_kv_type type; /**< Which member of value is valid */
+	union {
+		long long i;
+		double d;
+		const char *s;
+		const void *p;
+	} value; /**< The field value */
+} nslog_kv_field_t;
+
+/**
+ * Construct an integer field for \ref NSLOG_KV
+ *
+ * \param key The field name (a string)
+ * \param val The field value
+ */
+#define NSLOG_KV_INT(key, val) \
+	{ (key), NSLOG_KV_TYPE_INT, { .i = (long long)(val) } }
+
+/**
+ * Construct a floating point field for \ref NSLOG_KV
+ *
+ * \param key The field name (a string)
+ * \param val The field value
+ */
+#define NSLOG_KV_DOUBLE(key, val) \
+	{ (key), NSLOG_KV_TYPE_DOUBLE, { .d = (double)(val) } }
+
+/**
+ * Construct a string field for \ref NSLOG_KV
+ *
+ * \param key The field name (a string)
+ * \param val The field value (a NUL terminated string)
+ */
+#define NSLOG_KV_STR(key, val) \
+	{ (key), NSLOG_KV_TYPE_STRING, { .s = (val) } }
+
+/**
+ * Construct a pointer field for \ref NSLOG_KV
+ *
+ * \param key The field name (a string)
+ * \param val The field value
+ */
+#define NSLOG_KV_PTR(key, val) \
+	{ (key), NSLOG_KV_TYPE_POINTER, { .p = (const void *)(val) } }
+
+/**
+ * Log something with structured fields
+ *
+ * This is like \ref NSLOG except that rather than a printf format string and
+ * its arguments, the log entry is a fixed message and a set of typed fields
+ * constructed with \ref NSLOG_KV_INT, \ref NSLOG_KV_DOUBLE,
+ * \ref NSLOG_KV_STR and \ref NSLOG_KV_PTR.  No formatting is done when
+ * the entry is made; the fields are handed to the \ref nslog_kv_callback
+ * as they are.
+ *
+ * For example:
+ *
+ * `NSLOG_KV(netfetch, INFO, "fetched", NSLOG_KV_STR("url", url),
+ *           NSLOG_KV_INT("status", code));`
+ *
+ * \param catname The category name (as a bareword)
+ * \param level The level at which this is logged (as a bareword such as WARNING)
+ * \param logmsg The log message itself (not a format string)
+ * \param fields The fields for the log entry, if any
+ */
+#define NSLOG_KV(catname, level, logmsg, fields...)			\
+	do {								\
+		if (NSLOG__COMPILED_IN(catname, level)) {		\
+			static nslog_entry_context_t _nslog_ctx =	\
+				NSLOG__ENTRY_CONTEXT(catname, level);	\
+			/* The first field is a placeholder, so that the \
+			 * array is never empty			\
+			 */						\
+			const nslog_kv_field_t _nslog_fields[] = {	\
+				NSLOG_KV_INT(NULL, 0), ##fields		\
+			};						\
+			const int _nslog_nfields =			\
+				sizeof(_nslog_fields) /			\
+				sizeof(_nslog_fields[0]) - 1;		\
+			nslog__log_kv(&_nslog_ctx, logmsg,		\
+				      (_nslog_nfields == 0) ?		\
+				      NULL : _nslog_fields + 1,		\
+				      _nslog_nfields);			\
+		}							\
+	} while(0)
+
+/**
+ * Internal structured logging function
+ *
+ * While clients of nslog will not call this function directly (preferring to
+ * use the \ref NSLOG_KV macro, this is the actual function which implements
+ * it.
+ *
+ * \param ctx The log entry context for the log
+ * \param msg The log message
+ * \param fields The fields for the log entry, or NULL if there are none
+ * \param nfields The number of fields
+ */
+void nslog__log_kv(nslog_entry_context_t *ctx,
+		   const char *msg,
+		   const nslog_kv_field_t *fields,
+		   int nfields);
+
+/**
+ * A counting site's state: not yet looked at by nslog (internal)
+ */
+#define NSLOG__COUNT_NEW 0
+/**
+ * A counting site's state: events are being ignored (internal)
+ */
+#define NSLOG__COUNT_OFF 1
+/**
+ * A counting site's state: events are being counted (internal)
+ *
+ * The state is this plus the generation of the site's counters, which
+ * changes when \ref nslog_cleanup frees them.
+ */
+#define NSLOG__COUNT_ON 2
+
+/**
+ * A counting site (internal)
+ *
+ * Each \ref NSLOG_COUNT has one of these, holding the counts of each thread
+ * which has counted there.
+ */
+typedef struct nslog_count_site_s {
+	nslog_entry_context_t *context; /**< The site's log entry context */
+	const char *msg; /**< What is being counted */
+	int state; /**< NSLOG__COUNT_NEW, NSLOG__COUNT_OFF or at least NSLOG__COUNT_ON */
+	struct nslog_counter_s *counters; /**< Each thread's count */
+	uint64_t reported; /**< The total as of the last summary */
+	struct nslog_count_site_s *next; /**< The next counting site */
+} nslog_count_site_t;
+
+/**
+ * Count an event
+ *
+ * Some events happen far too often to log each of them.  Instead, each
+ * thread counts them at the site, which costs a single increment of a
+ * thread-local counter, and the counts are summarised, with one log entry
+ * per site giving the number of events since the last summary, while
+ * counting is started (see \ref nslog_count_start).  The summary is logged
+ * from the site, so it is filtered and delivered like any other entry.
+ *
+ * While counting is stopped, or if the site's entries are gated, filtered
+ * out or below its category's level in the level map, events aren't counted
+ * at all.  Whether that is the case is looked at again as each summary is
+ * made.
+ *
+ * \param catname The category name (as a bareword)
+ * \param level The level at which this is logged (as a bareword such as WARNING)
+ * \param msg What is being counted (not a format string)
+ */
+#define NSLOG_COUNT(catname, level, msg)				\
+	do {								\
+		if (NSLOG__COMPILED_IN(catname, level)) {		\
+			static nslog_entry_context_t _nslog_ctx =	\
+				NSLOG__ENTRY_CONTEXT(catname, level);	\
+			static nslog_count_site_t _nslog_site = {	\
+				&_nslog_ctx, msg, NSLOG__COUNT_NEW,	\
+				NULL, 0, NULL				\
+			};						\
+			static __thread uint64_t *_nslog_count;		\
+			static __thread int _nslog_count_state;		\
+			int _nslog_state = __atomic_load_n(		\
+				&_nslog_site.state, __ATOMIC_RELAXED);	\
+			if (_nslog_state == _nslog_count_state &&	\
+			    _nslog_count != NULL)			\
+				__atomic_store_n(_nslog_count,		\
+						 *_nslog_count + 1,	\
+						 __ATOMIC_RELAXED);	\
+			else if (_nslog_state != NSLOG__COUNT_OFF)	\
+				_nslog_count = nslog__count(		\
+					&_nslog_site,			\
+					&_nslog_count_state);		\
+		}							\
+	} while(0)
+
+/**
+ * Internal counting function
+ *
+ * While clients of nslog will not call this function directly (preferring to
+ * use the \ref NSLOG_COUNT macro), this is what counts an event at a site
+ * the first time the thread counts there.
+ *
+ * \param site The counting site
+ * \param state Filled out with the site's state the counter may be used
+ *              in (it may not be once the state changes)
+ * \return The thread's counter at the site, or NULL if the event wasn't
+ *         counted
+ */
+uint64_t *nslog__count(nslog_count_site_t *site, int *state);
+
 /**
  * Log error types
  *
@@ -223,6 +614,8 @@ typedef enum {
 	NSLOG_NO_MEMORY = 1, /**< nslog ran out of memory.  Worry, a great deal */
 	NSLOG_UNCORKED = 2, /**< nslog is already uncorked, don't rush it */
 	NSLOG_PARSE_ERROR = 3, /**< nslog failed to parse the given log filter */
+	NSLOG_IO_ERROR = 4, /**< nslog failed to read or write a file */
+	NSLOG_NOT_SUPPORTED = 5, /**< nslog can't do that on this platform */
 } nslog_error;
 
 /**
@@ -254,6 +647,509 @@ typedef void (*nslog_callback)(void *context, nslog_entry_context_t *ctx,
  */
 nslog_error nslog_set_render_callback(nslog_callback cb, void *context);
 
+/**
+ * Clock sources for log entry timestamps
+ */
+typedef enum {
+	/**
+	 * Wall clock time, at the kernel's coarse (tick) resolution.  This is
+	 * the default, and is the cheapest source to read.
+	 */
+	NSLOG_CLOCK_REALTIME_COARSE = 0,
+	/**
+	 * Monotonic time since an unspecified point (usually boot).
+	 */
+	NSLOG_CLOCK_MONOTONIC = 1,
+	/**
+	 * The CPU's timestamp counter, calibrated against, and in the same
+	 * epoch as, \ref NSLOG_CLOCK_MONOTONIC.  Only available on x86 CPUs whose
+	 * counter is invariant.
+	 */
+	NSLOG_CLOCK_TSC = 2,
+} nslog_clock;
+
+/**
+ * Select the clock source for log entry timestamps
+ *
+ * Selecting \ref NSLOG_CLOCK_TSC calibrates the timestamp counter, which
+ * takes a few milliseconds.  It is only supported where the counter is
+ * invariant, ticking at a constant rate whatever the CPU's frequency or
+ * sleep state.  This may be called while other threads are logging.
+ *
+ * \param clock The clock source to use
+ * \return Whether or not this succeeded, \ref NSLOG_NOT_SUPPORTED if the
+ *         clock source is unavailable (the previous source is kept)
+ */
+nslog_error nslog_set_clock(nslog_clock clock);
+
+/**
+ * Log entry
+ *
+ * This extends the (static) \ref nslog_entry_context_t of a call site with
+ * the details of one particular log entry.  Like the context it is
+ * ephemeral.
+ */
+typedef struct nslog_entry_s {
+	nslog_entry_context_t *context; /**< The call site of the entry */
+	uint64_t timestamp; /**< When the entry was made, in nanoseconds */
+	nslog_clock clock; /**< The clock source timestamp came from */
+	uint64_t seq; /**< The order the entry was made in, among all threads */
+} nslog_entry_t;
+
+/**
+ * Callback type for logging with entry details
+ *
+ * This is like \ref nslog_callback, except that it is given the
+ * \ref nslog_entry_t for the log entry, so clients don't need to read the
+ * clock themselves.  Entries which were logged while nslog was corked carry
+ * the time they were logged, not the time they were uncorked.
+ *
+ * \param context The context pointer registered for the callback
+ * \param entry The log entry
+ * \param fmt The log message (printf style format string)
+ * \param args The printf arguments for the log entry
+ */
+typedef void (*nslog_entry_callback)(void *context, nslog_entry_t *entry,
+				     const char *fmt, va_list args);
+
+/**
+ * Set the entry callback for logging
+ *
+ * The entry callback is called for every log entry in addition to the
+ * render callback (if any).
+ *
+ * \param cb The callback function pointer (or NULL to remove it)
+ * \param context The context pointer to provide to the callback
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_set_entry_callback(nslog_entry_callback cb, void *context);
+
+/**
+ * Callback type for receiving rendered log messages
+ *
+ * Rather than a format string and its arguments, this is given the
+ * rendered message, which is rendered once however many of these callbacks
+ * are registered.  Entries which were logged while nslog was corked (and so
+ * were rendered then) are passed straight through.
+ *
+ * \param context The context pointer registered for the callback
+ * \param entry The log entry
+ * \param msg The rendered log message (NUL terminated)
+ * \param len The length of the message
+ */
+typedef void (*nslog_message_callback)(void *context, nslog_entry_t *entry,
+				       const char *msg, size_t len);
+
+/**
+ * Add a message callback for logging
+ *
+ * Any number of message callbacks, up to a small limit, may be registered,
+ * in addition to the render and entry callbacks.  Each is called for every
+ * log entry, in the order they were added.
+ *
+ * Message callbacks may be added and removed while other threads are
+ * logging, though not from within a message callback.
+ *
+ * \param cb The callback function pointer
+ * \param context The context pointer to provide to the callback
+ * \return NSLOG_NO_ERROR on success, or NSLOG_NO_MEMORY if there are
+ *         already as many message callbacks as are allowed
+ */
+nslog_error nslog_add_message_callback(nslog_message_callback cb,
+				       void *context);
+
+/**
+ * Remove a message callback
+ *
+ * This returns once no thread is still delivering to the callback, so its
+ * context may then be freed.
+ *
+ * \param cb The callback function pointer, as added
+ * \param context The context pointer, as added
+ * \return NSLOG_NO_ERROR on success, or NSLOG_NO_MEMORY if the remaining
+ *         callbacks couldn't be copied
+ */
+nslog_error nslog_remove_message_callback(nslog_message_callback cb,
+					  void *context);
+
+/**
+ * Set the template for call sites' line prefixes
+ *
+ * The template is copied, and the characters in it are copied into each
+ * prefix except for these directives:
+ *
+ * - `%l` The short level name (as \ref nslog_short_level_name)
+ * - `%L` The level name (as \ref nslog_level_name)
+ * - `%c` The category name
+ * - `%f` The filename
+ * - `%b` The filename's leafname
+ * - `%n` The line number
+ * - `%F` The function name
+ * - `%%` A percent sign
+ *
+ * The default template is `"%l %c %f:%n %F: "`.  Prefixes rendered with the
+ * previous template are not freed until \ref nslog_cleanup.
+ *
+ * \param tmpl The template, or NULL to restore the default
+ * \return NSLOG_NO_ERROR on success, NSLOG_PARSE_ERROR if the template has
+ *         an unknown directive, or NSLOG_NO_MEMORY
+ */
+nslog_error nslog_set_prefix_template(const char *tmpl);
+
+/**
+ * Get a call site's line prefix
+ *
+ * A line prefix is made up of the parts of a log line which are the same
+ * for every entry from a call site, as laid out by the template set with
+ * \ref nslog_set_prefix_template.  It is rendered the first time it is
+ * asked for and kept with the site, so sinks writing text lines can copy
+ * it out rather than formatting it for each entry:
+ *
+ *     static void sink(void *context, nslog_entry_t *entry,
+ *                      const char *msg, size_t len)
+ *     {
+ *             const char *prefix;
+ *             size_t prefixlen;
+ *             if (nslog_site_prefix(entry->context, &prefix,
+ *                                   &prefixlen) == NSLOG_NO_ERROR)
+ *                     fwrite(prefix, 1, prefixlen, context);
+ *             fwrite(msg, 1, len, context);
+ *             fputc('\n', context);
+ *     }
+ *
+ * The prefix remains valid until \ref nslog_cleanup is called.
+ *
+ * \param ctx The call site
+ * \param prefix Filled out with the prefix (NUL terminated)
+ * \param len Filled out with the length of the prefix
+ * \return NSLOG_NO_ERROR on success, or NSLOG_NO_MEMORY
+ */
+nslog_error nslog_site_prefix(nslog_entry_context_t *ctx,
+			      const char **prefix,
+			      size_t *len);
+
+/**
+ * Callback type for structured logging
+ *
+ * Entries made with \ref NSLOG_KV are delivered to this callback, if one
+ * is registered, with their fields intact.  They are also rendered in
+ * logfmt style with \ref nslog_kv_render and passed to the message
+ * callbacks and the \ref nslog_entry_callback, and, if no structured
+ * callback is registered, to the \ref nslog_callback.
+ *
+ * \param context The context pointer registered for the callback
+ * \param ctx The log entry context
+ * \param msg The log message
+ * \param fields The fields for the log entry, or NULL if there are none
+ * \param nfields The number of fields
+ */
+typedef void (*nslog_kv_callback)(void *context, nslog_entry_context_t *ctx,
+				  const char *msg,
+				  const nslog_kv_field_t *fields,
+				  int nfields);
+
+/**
+ * Set the structured callback for logging
+ *
+ * \param cb The callback function pointer (or NULL to remove it)
+ * \param context The context pointer to provide to the callback
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_set_kv_callback(nslog_kv_callback cb, void *context);
+
+/**
+ * Structured entry rendering styles
+ */
+typedef enum {
+	NSLOG_KV_FORMAT_LOGFMT = 0, /**< `msg key=value key="spaced value"` */
+	NSLOG_KV_FORMAT_JSON = 1, /**< `{"msg":"msg","key":value}` */
+} nslog_kv_format;
+
+/**
+ * Render a structured log entry as text
+ *
+ * This behaves like `snprintf()`: at most `len` bytes (including the
+ * terminating NUL) are written to `buf`, and the return value is the
+ * length the whole rendering would have had.
+ *
+ * \param buf The buffer to render into (may be NULL if len is 0)
+ * \param len The size of the buffer
+ * \param format The rendering style to use
+ * \param msg The log message
+ * \param fields The fields for the log entry
+ * \param nfields The number of fields
+ * \return The length of the full rendering, excluding the NUL
+ */
+int nslog_kv_render(char *buf, size_t len, nslog_kv_format format,
+		    const char *msg,
+		    const nslog_kv_field_t *fields,
+		    int nfields);
+
+/**
+ * Enable or disable logging at a level
+ *
+ * Entries made at a disabled level are dropped as soon as they are made,
+ * before they are filtered or even corked.  All levels are enabled to begin
+ * with.  Unlike \ref NSLOG_COMPILED_MIN_LEVEL this can be changed while the
+ * program runs, and unlike filters it costs next to nothing to check.
+ *
+ * \param level The level to enable or disable
+ * \param enabled Whether entries at the level should be logged
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_set_level_enabled(nslog_level level, bool enabled);
+
+/**
+ * Find out whether logging at a level is enabled
+ *
+ * \param level The level to check
+ * \return Whether entries at the level are logged
+ */
+bool nslog_level_enabled(nslog_level level);
+
+/**
+ * Set the level map
+ *
+ * A level map gives categories a minimum level, below which their entries
+ * are dropped just as if they had been filtered out.  It is a list of
+ * `category:LEVEL` pairs separated by commas, for example
+ * `render:WARN, render/layout:DEBUG, net:INFO`.  Each applies to the
+ * category and all of its subcategories, the longest matching category
+ * winning, so here `render/layout/text` logs at DEBUG and above while
+ * `render/paint` logs at WARNING and above.  A category of `*` sets the
+ * level of categories nothing else matches; otherwise they are unaffected.
+ * Levels are named as by \ref nslog_level_name or
+ * \ref nslog_short_level_name, in either case.
+ *
+ * Each category looks its level up only once per map, so checking an
+ * entry against the map costs the same however many categories it lists.
+ * The map applies alongside the active filter; an entry must pass both.
+ *
+ * \param map The level map, or NULL (or an empty string) for none
+ * \return NSLOG_PARSE_ERROR if the map is malformed (the current map is
+ *         kept), otherwise whether or not this succeeded
+ */
+nslog_error nslog_set_level_map(const char *map);
+
+/**
+ * Callback type for flushing log sinks
+ *
+ * \param context The context pointer registered for the callback
+ */
+typedef void (*nslog_flush_callback)(void *context);
+
+/**
+ * Set the flush callback
+ *
+ * Clients whose log callbacks buffer their output (for example in a
+ * \ref nslog_binary_sink_t) can register a callback to write it out
+ * when \ref nslog_flush is called.
+ *
+ * \param cb The callback function pointer (or NULL to remove it)
+ * \param context The context pointer to provide to the callback
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_set_flush_callback(nslog_flush_callback cb, void *context);
+
+/**
+ * Flush the log sinks
+ *
+ * This calls the flush callback, if one is registered.
+ *
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_flush(void);
+
+/**
+ * Logging statistics
+ *
+ * Counts of log entries since the program started.
+ */
+typedef struct nslog_stats_s {
+	unsigned long entries; /**< Entries made */
+	unsigned long gated; /**< Entries dropped by a disabled level */
+	unsigned long filtered; /**< Entries dropped by the active filter */
+	unsigned long delivered; /**< Entries passed to the callbacks */
+} nslog_stats_t;
+
+/**
+ * Retrieve the logging statistics
+ *
+ * Each thread keeps its own counts, which are summed here, so while other
+ * threads are logging the sums may be a moment out of step with each
+ * other.
+ *
+ * \param stats Filled out with the statistics
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_get_stats(nslog_stats_t *stats);
+
+/**
+ * The sinks whose timings are measured
+ *
+ * All the message callbacks are measured together as one sink.
+ */
+typedef enum {
+	NSLOG_SINK_RENDER = 0, /**< The \ref nslog_callback */
+	NSLOG_SINK_ENTRY = 1, /**< The \ref nslog_entry_callback */
+	NSLOG_SINK_KV = 2, /**< The \ref nslog_kv_callback */
+	NSLOG_SINK_MESSAGE = 3, /**< The \ref nslog_message_callback list */
+} nslog_sink;
+
+/** The number of sinks whose timings are measured */
+#define NSLOG_SINKS 4
+
+/**
+ * The number of buckets in a sink's latency histogram
+ *
+ * Bucket `b` counts the calls taking at least
+ * \ref nslog_sink_bucket_floor (`b`) nanoseconds and less than the floor of
+ * the next bucket.  The buckets are log-linear: four to each power of two,
+ * so each is within a quarter of its floor, up to the last bucket which
+ * also counts everything slower.
+ */
+#define NSLOG_SINK_BUCKETS 128
+
+/**
+ * Sink statistics
+ *
+ * Counts and timings of calls to a sink since the statistics were enabled.
+ */
+typedef struct nslog_sink_stats_s {
+	nslog_sink sink; /**< The sink these are for */
+	uint64_t entries; /**< Calls made to the sink */
+	uint64_t bytes; /**< Bytes of rendered message passed to the sink */
+	uint64_t total_ns; /**< Total time spent in the sink */
+	uint64_t max_ns; /**< The longest single call (the worst stall) */
+	uint64_t elapsed_ns; /**< Time since the statistics were enabled */
+	uint64_t buckets[NSLOG_SINK_BUCKETS]; /**< The latency histogram */
+} nslog_sink_stats_t;
+
+/**
+ * Start measuring the sinks
+ *
+ * Each call to a sink is timed and counted, with atomic updates so that
+ * threads don't contend on a lock.  When not enabled this costs a single
+ * flag check per delivery.  Enabling resets any previous statistics.
+ *
+ * If `interval` is not zero then, whenever that long has passed, an INFO
+ * entry is logged in the `nslog` category for each sink used, giving its
+ * entries and bytes per second over the interval and its mean and maximum
+ * latencies.  Those entries are delivered (and measured) like any other.
+ *
+ * \param interval Nanoseconds between reports, or 0 for none
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_sink_stats_enable(uint64_t interval);
+
+/**
+ * Stop measuring the sinks
+ *
+ * The statistics gathered so far can still be retrieved.
+ *
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_sink_stats_disable(void);
+
+/**
+ * Retrieve a sink's statistics
+ *
+ * The fields are each read atomically but not all together, so they may be
+ * very slightly inconsistent while entries are being delivered.
+ *
+ * \param sink The sink to retrieve the statistics of
+ * \param stats Filled out with the statistics
+ * \return NSLOG_NOT_SUPPORTED if there is no such sink
+ */
+nslog_error nslog_get_sink_stats(nslog_sink sink, nslog_sink_stats_t *stats);
+
+/**
+ * The lowest latency counted in a histogram bucket
+ *
+ * \param bucket The bucket, from 0 to \ref NSLOG_SINK_BUCKETS - 1
+ * \return The bucket's lowest latency in nanoseconds
+ */
+uint64_t nslog_sink_bucket_floor(unsigned int bucket);
+
+/**
+ * Callback type for listing categories
+ *
+ * \param context The context pointer given to \ref nslog_category_foreach
+ * \param cat The category
+ */
+typedef void (*nslog_category_callback)(void *context, nslog_category_t *cat);
+
+/**
+ * Call a function for each known category
+ *
+ * Categories become known to nslog the first time an entry is logged in
+ * them (or one of their subcategories) after uncorking, so categories which
+ * are yet to be used are not listed.  This is safe to call while other
+ * threads are logging.
+ *
+ * \param cb The function to call for each category
+ * \param context The context pointer to provide to the function
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_category_foreach(nslog_category_callback cb, void *context);
+
+/**
+ * Control socket handle
+ *
+ * A control socket lets the logging of a running program be administered
+ * from outside it.
+ */
+typedef struct nslog_control_s nslog_control_t;
+
+/**
+ * Start a control socket
+ *
+ * A Unix domain socket is created at the given path, accessible only to the
+ * user running the program, and serviced by a background thread.  Clients
+ * connect and send commands, one per line, and each command's response
+ * ends with a line reading `OK` or one starting `ERR`.  The commands are:
+ *
+ * - `filter TEXT` parses TEXT and makes it the active filter;
+ *   `filter` alone clears the active filter
+ * - `categories` lists the known categories (see
+ *   \ref nslog_category_foreach), one per line
+ * - `stats` lists the \ref nslog_stats_t counts, one `name value` per line
+ * - `flush` calls \ref nslog_flush
+ * - `level LEVEL on` and `level LEVEL off` enable and disable logging at
+ *   a level (see \ref nslog_set_level_enabled); `level` alone lists
+ *   whether each level is enabled
+ * - `levelmap MAP` sets the level map (see \ref nslog_set_level_map);
+ *   `levelmap` alone clears it
+ * - `history FILTER` lists the entries in the recent history (see
+ *   \ref nslog_history_query) which match FILTER, oldest first, one per
+ *   line as an append sink writes them (see \ref nslog_append_sink_t);
+ *   `history` alone lists them all
+ *
+ * Levels are named as by \ref nslog_level_name or
+ * \ref nslog_short_level_name, in either case.  Commands are serviced
+ * entirely on the background thread; the flush callback is called there.
+ *
+ * This is only supported on systems with Unix domain sockets; elsewhere it
+ * returns \ref NSLOG_NOT_SUPPORTED.
+ *
+ * \param path The path to create the socket at.  Any socket already there
+ *             is replaced.
+ * \param control A pointer to fill out with the new control socket
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_control_start(const char *path, nslog_control_t **control);
+
+/**
+ * Stop a control socket
+ *
+ * The background thread is stopped, any connected client is disconnected,
+ * and the socket is removed.
+ *
+ * \param control The control socket to stop
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_control_stop(nslog_control_t *control);
+
 /**
  * Uncork the log
  *
@@ -264,10 +1160,87 @@ nslog_error nslog_set_render_callback(nslog_callback cb, void *context);
  *
  * Any stored log messages will be drained before this function returns.
  *
+ * While corked, each thread stores its messages separately, so threads
+ * logging before the client is ready don't hold one another up.  The
+ * messages are delivered in the order they were logged across all threads,
+ * except that those at or above the priority level (see
+ * \ref nslog_set_priority_level) are delivered first.  Messages logged by
+ * other threads while this runs are delivered directly, so may be
+ * delivered before the last of the stored ones.
+ *
  * \return Whether or not the uncorking succeeded.
  */
 nslog_error nslog_uncork(void);
 
+/**
+ * Set the level of entries which are delivered first on uncorking
+ *
+ * Corked entries at or above this level are kept apart from the others
+ * and, when nslog is uncorked, are all delivered before any of the others,
+ * so that errors logged during startup aren't stuck behind a flood of
+ * debug output.  The \ref nslog_entry_t::seq of each entry gives the order
+ * in which they were logged.  The default, \ref NSLOG_LEVEL_DEEPDEBUG,
+ * delivers all the corked entries in the order they were logged.
+ *
+ * The level applies to entries corked after it is set.
+ *
+ * \param level The lowest level of entry to deliver first
+ * \return NSLOG_NO_ERROR on success, or NSLOG_NOT_SUPPORTED for a bad level
+ */
+nslog_error nslog_set_priority_level(nslog_level level);
+
+/**
+ * Hold back entries below a level until something goes wrong
+ *
+ * Once nslog is uncorked, entries below the given level which pass the
+ * active filter are not delivered straight away.  Instead each thread
+ * keeps the most recent of them, up to the given number, and when an
+ * entry at or above the trigger level is delivered on that thread, the
+ * entries held back are delivered (oldest first) just before it.  This
+ * gives the context leading up to an error without the cost of writing
+ * out every debug entry.  Entries which are never followed by a trigger
+ * are discarded.
+ *
+ * Held entries are rendered when they are logged, like corked entries,
+ * and keep their original timestamps and \ref nslog_entry_t::seq.
+ * Changing the backlog, or stopping it, discards whatever was held under
+ * the old settings; other threads free what they held when they next log.
+ *
+ * \param level Entries below this level are held back
+ * \param trigger Entries at or above this level deliver those held back
+ *                (this must be at least level)
+ * \param entries The most entries each thread holds back, or 0 to stop
+ *                holding entries back
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_set_backlog(nslog_level level, nslog_level trigger,
+			      unsigned int entries);
+
+/**
+ * Write out entries which would otherwise be lost in a crash
+ *
+ * Everything logged with \ref NSLOG_SIGNAL since the last flush (up to the
+ * capacity of the ring buffer) is written to the file descriptor, one
+ * line per entry, as are any entries still held because nslog is corked.
+ * Only async-signal-safe calls are made, using write(2) directly, so this
+ * is intended to be called from a crash handler, for example:
+ *
+ *     static void crash_handler(int sig)
+ *     {
+ *             NSLOG_SIGNAL_VALUE(myapp, CRITICAL, "fatal signal", sig);
+ *             nslog_signal_flush(STDERR_FILENO);
+ *             signal(sig, SIG_DFL);
+ *             raise(sig);
+ *     }
+ *
+ * It may also be called from ordinary code, for example after handling a
+ * signal which is not fatal.
+ *
+ * \param fd The file descriptor to write to
+ * \return NSLOG_NO_ERROR on success, or NSLOG_IO_ERROR if writing failed
+ */
+nslog_error nslog_signal_flush(int fd);
+
 /**
  * Finalise log categories, release filter handles, etc.
  *
@@ -277,7 +1250,8 @@ nslog_error nslog_uncork(void);
  * ensure that any memory allocated inside the nslog library is released.
  *
  * This does not remove the active log callback, so logging calls after this
- * returns will still work (though will be unfiltered).  Of course, they will
+ * returns, on any thread, will still work (though will be unfiltered).
+ * Nothing may be logged while this runs, however.  Of course, they will
  * cause memory to be allocated once more.  This function can be called as
  * many times as desired, it is idempotent.
  *
@@ -298,6 +1272,10 @@ void nslog_cleanup(void);
  * Log filters are reference counted and filter builders will return
  * a log filter with a reference, and will take automatically reference
  * any filters passed in, so remember to unref them if you're done.
+ *
+ * Filters are immutable and structurally identical filters are shared, so
+ * building the same filter twice returns two references to one instance,
+ * and two filters are equal exactly when their handles are.
  */
 typedef struct nslog_filter_s nslog_filter_t;
 
@@ -476,6 +1454,9 @@ nslog_filter_t *nslog_filter_unref(nslog_filter_t *filter);
  * If you don't pass `NULL` in prev, then the currently
  * active filter is returned for you to reuse later.
  *
+ * This may be called while other threads are logging.  The filter being
+ * replaced stays alive until no thread can still be matching against it.
+ *
  * \param filter A pointer to a filter to be set active
  * \param prev A pointer which will be optionally filled out
  * \return Whether or not this succeeds
@@ -493,10 +1474,105 @@ nslog_error nslog_filter_set_active(nslog_filter_t *filter,
  * The caller owns the returned string and must `free()` it.
  *
  * \param filter A pointer to a filter to be rendered as text
- * \return A string representing the filter
+ * \return A string representing the filter, or NULL if out of memory
  */
 char *nslog_filter_sprintf(nslog_filter_t *filter);
 
+/**
+ * Render a filter in its compact binary form.
+ *
+ * The binary form is versioned and position-independent, so it can be
+ * written to a file and mapped into memory, or sent over a socket to another
+ * process, and then turned back into a filter with
+ * \ref nslog_filter_deserialise.  It is much quicker to decode than the
+ * textual form is to parse, and parts of the filter which are shared are
+ * only written once.
+ *
+ * The caller owns the returned data and must `free()` it.
+ *
+ * \param filter A pointer to a filter to be serialised
+ * \param data A pointer to fill out with the binary form
+ * \param len A pointer to fill out with the length of the binary form
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_filter_serialise(nslog_filter_t *filter,
+				   void **data, size_t *len);
+
+/**
+ * Turn a filter's binary form back into a filter.
+ *
+ * The data is checked as it is decoded, so it is safe to pass in data from
+ * an untrusted source; anything malformed results in \ref NSLOG_PARSE_ERROR
+ * and binary forms from a newer version of nslog result in
+ * \ref NSLOG_NOT_SUPPORTED.
+ *
+ * The caller owns the reference returned to it and must
+ * unreference the filter when done with it.
+ *
+ * \param data A pointer to the binary form of a filter
+ * \param len The length of the binary form
+ * \param filter A pointer to fill out with the decoded filter
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_filter_deserialise(const void *data, size_t len,
+				     nslog_filter_t **filter);
+
+/**
+ * Filter file watch handle
+ *
+ * A filter file watch keeps the active filter in step with the contents of a
+ * file, reloading it whenever the file changes.
+ */
+typedef struct nslog_filter_watch_s nslog_filter_watch_t;
+
+/**
+ * Start watching a filter file.
+ *
+ * The file is loaded immediately and then, on a background thread, each
+ * time it is written or replaced.  Each time the file's text is parsed and,
+ * if that succeeds, made the active filter as if by
+ * \ref nslog_filter_set_active.  If the file can't be read or doesn't parse,
+ * the active filter is left as it was.  An empty file clears the active
+ * filter.  The file needn't exist when the watch starts.
+ *
+ * Changing the active filter is safe while other threads are logging, and
+ * the filter it replaces is released once no thread can be using it.
+ *
+ * This is only supported on Linux; elsewhere it returns
+ * \ref NSLOG_NOT_SUPPORTED.
+ *
+ * \param path The path to the filter file
+ * \param watch A pointer to fill out with the new watch
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_filter_watch_start(const char *path,
+				     nslog_filter_watch_t **watch);
+
+/**
+ * Retrieve a filter file watch's reload counts.
+ *
+ * \param watch The watch to query
+ * \param loads Filled out with the number of times the file has been
+ *              loaded and made the active filter, if not NULL
+ * \param errors Filled out with the number of times the file couldn't be
+ *               read or parsed, if not NULL
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_filter_watch_status(nslog_filter_watch_t *watch,
+				      unsigned int *loads,
+				      unsigned int *errors);
+
+/**
+ * Stop watching a filter file.
+ *
+ * The background thread is stopped and the watch is destroyed.  The active
+ * filter is left as the watch last set it.
+ *
+ * \param watch The watch to stop
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_filter_watch_stop(nslog_filter_watch_t *watch);
+
 /**
  * Parse a filter's textual form.
  *
@@ -507,6 +1583,8 @@ char *nslog_filter_sprintf(nslog_filter_t *filter);
  * The caller owns the reference returned to it and must
  * unreference the filter when done with it.
  *
+ * Parsing is reentrant, so filters can be parsed on several threads at once.
+ *
  * \param input A pointer to filter text to be parsed
  * \param output A pointer to fill out with the parsed filter
  * \return Whether or not this succeeds
@@ -514,4 +1592,301 @@ char *nslog_filter_sprintf(nslog_filter_t *filter);
 nslog_error nslog_filter_from_text(const char *input,
 				   nslog_filter_t **output);
 
+/**
+ * Parse a filter's textual form from a length-delimited buffer.
+ *
+ * This is like \ref nslog_filter_from_text but the input need not be NUL
+ * terminated, and is scanned a chunk at a time without first copying the
+ * whole input, which suits large filters read from files or sockets.
+ *
+ * \param input A pointer to filter text to be parsed
+ * \param len The length of the filter text
+ * \param output A pointer to fill out with the parsed filter
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_filter_from_buffer(const char *input,
+				     size_t len,
+				     nslog_filter_t **output);
+
+/**
+ * Set the size of the filter parse cache.
+ *
+ * When the cache is enabled, \ref nslog_filter_from_text and
+ * \ref nslog_filter_from_buffer remember the filters they parse, keyed by
+ * their text, and parsing the same text again returns a new reference to
+ * the filter already built rather than parsing it afresh.  Once the cache
+ * holds `entries` filters, the least recently used one is dropped to make
+ * room for the next.
+ *
+ * The cache is disabled (has size zero) by default.  Setting the size to
+ * zero disables it again and releases all the filters it holds.
+ *
+ * \param entries The maximum number of filters to cache
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_filter_cache_set_size(unsigned int entries);
+
+/**
+ * Retrieve the filter parse cache's statistics.
+ *
+ * Counts the parses satisfied from the cache and those which weren't, since
+ * the program started.  Parses made while the cache is disabled aren't
+ * counted.
+ *
+ * \param hits Filled out with the number of cache hits, if not NULL
+ * \param misses Filled out with the number of cache misses, if not NULL
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_filter_cache_stats(unsigned long *hits,
+				     unsigned long *misses);
+
+/**
+ * Binary log sink handle
+ *
+ * A binary log sink writes log entries in a compact binary form rather than
+ * rendering them as text.  Each distinct call site is described once, in a
+ * site record holding its category, level, filename, line, function and
+ * format string, and each entry thereafter is a site reference, a timestamp
+ * delta and the raw printf arguments.  The stream can be turned back into
+ * text with \ref nslog_binary_decode or the `nslog-decode` tool.
+ */
+typedef struct nslog_binary_sink_s nslog_binary_sink_t;
+
+/**
+ * Create a binary log sink
+ *
+ * The sink writes to the given file descriptor, which remains owned by the
+ * caller.  To log into the sink, register \ref nslog_binary_sink_render
+ * as the entry callback with the sink as its context:
+ *
+ * `nslog_set_entry_callback(nslog_binary_sink_render, sink)`
+ *
+ * The sink is locked while each entry is written, so it may be logged into
+ * from several threads at once.
+ *
+ * \param fd The file descriptor to write the stream to
+ * \param sink A pointer to a sink to be filled out
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_binary_sink_new(int fd, nslog_binary_sink_t **sink);
+
+/**
+ * Entry callback for binary log sinks
+ *
+ * This is an \ref nslog_entry_callback whose context must be an
+ * \ref nslog_binary_sink_t.
+ */
+void nslog_binary_sink_render(void *context, nslog_entry_t *entry,
+			      const char *fmt, va_list args);
+
+/**
+ * Flush any buffered records in a binary log sink to its file descriptor
+ *
+ * \param sink The sink to flush
+ * \return NSLOG_NO_ERROR, or the first error the sink met writing records
+ *         out since it was last flushed
+ */
+nslog_error nslog_binary_sink_flush(nslog_binary_sink_t *sink);
+
+/**
+ * Flush and destroy a binary log sink
+ *
+ * The sink must no longer be registered as the entry callback's context.
+ * The file descriptor is not closed.
+ *
+ * \param sink The sink to destroy
+ * \return Whether or not the final flush succeeded
+ */
+nslog_error nslog_binary_sink_destroy(nslog_binary_sink_t *sink);
+
+/**
+ * Decode a binary log stream as text
+ *
+ * Reads a stream written by a binary log sink and writes one line of text
+ * per log entry, of the form:
+ *
+ * `seconds.nanoseconds LEVL category filename:line function: message`
+ *
+ * The stream is decoded a record at a time, reading no further than the
+ * record being decoded, so a stream still being written (such as a pipe
+ * from a running program) is followed until it ends.
+ *
+ * \param in The stream to read
+ * \param out The stream to write text to
+ * \return Whether or not the whole stream was decoded
+ */
+nslog_error nslog_binary_decode(FILE *in, FILE *out);
+
+/**
+ * Append sink handle
+ *
+ * An append sink writes log entries as lines of text, each the entry's
+ * timestamp followed by its call site's line prefix (see
+ * \ref nslog_site_prefix) and its message, to a file opened with
+ * `O_APPEND`.  With the default prefix template these are the lines
+ * \ref nslog_binary_decode writes.  Each
+ * record (or, if batching, each run of whole records) goes out in a single
+ * write of no more than 4096 bytes, which the kernel doesn't interleave
+ * with other writes, so several processes may share a log file without
+ * corrupting each other's lines.
+ *
+ * A record too big to be written at once is split into framed fragments
+ * instead, which \ref nslog_append_unframe reassembles.  So is a record
+ * with a line starting with the byte 0x1e, which marks a fragment.
+ */
+typedef struct nslog_append_sink_s nslog_append_sink_t;
+
+/**
+ * Open an append sink
+ *
+ * The file is created if it doesn't exist.  To log into the sink, register
+ * \ref nslog_append_sink_render as a message callback with the sink as its
+ * context:
+ *
+ * `nslog_add_message_callback(nslog_append_sink_render, sink)`
+ *
+ * If `batch` is true, records are gathered until the next would overflow
+ * one write, or until \ref nslog_append_sink_flush is called, which makes
+ * far fewer system calls but leaves the latest records unwritten until
+ * then.  Otherwise each record is written as it is logged.
+ *
+ * \param path The file to append to
+ * \param batch Whether to batch records together
+ * \param sink A pointer to a sink to be filled out
+ * \return Whether or not this succeeds
+ */
+nslog_error nslog_append_sink_open(const char *path, bool batch,
+				   nslog_append_sink_t **sink);
+
+/**
+ * Message callback for append sinks
+ *
+ * This is an \ref nslog_message_callback whose context must be an
+ * \ref nslog_append_sink_t.  It may be called from several threads at
+ * once.
+ */
+void nslog_append_sink_render(void *context, nslog_entry_t *entry,
+			      const char *msg, size_t len);
+
+/**
+ * Write out any batched records in an append sink
+ *
+ * \param sink The sink to flush
+ * \return The first error writing to the sink since the last flush, if any
+ */
+nslog_error nslog_append_sink_flush(nslog_append_sink_t *sink);
+
+/**
+ * Flush and destroy an append sink, closing its file
+ *
+ * The sink must no longer be registered as a message callback's context.
+ *
+ * \param sink The sink to destroy
+ * \return Whether or not the final flush succeeded
+ */
+nslog_error nslog_append_sink_destroy(nslog_append_sink_t *sink);
+
+/**
+ * Reassemble the records an append sink had to split up
+ *
+ * Copies a file written by append sinks, replacing the fragments of each
+ * record too big to write at once with the whole record, where its last
+ * fragment was.
+ *
+ * \param in The file to read
+ * \param out The stream to write the records to
+ * \return NSLOG_PARSE_ERROR if a fragment was malformed or a record was
+ *         incomplete, otherwise whether or not this succeeded
+ */
+nslog_error nslog_append_unframe(FILE *in, FILE *out);
+
+/**
+ * Start keeping a history of recent log entries
+ *
+ * Once started, every entry which gets past the level gates (see
+ * \ref nslog_set_level_enabled) is recorded, whether or not the active
+ * filter or level map lets it through and whether or not nslog is
+ * corked, so that recent entries can be looked back over with
+ * \ref nslog_history_query.  The history holds the given number of the
+ * most recent entries, each with its message rendered and truncated to at
+ * most msgsize bytes; structured entries are rendered as logfmt.
+ *
+ * Starting the history again replaces it (and whatever it held) with an
+ * empty one of the new size.
+ *
+ * \param entries The number of entries to keep, or 0 to stop keeping them
+ * \param msgsize The longest message to keep, in bytes
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_history_start(unsigned int entries, size_t msgsize);
+
+/**
+ * Stop keeping a history of recent log entries, discarding it
+ *
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_history_stop(void);
+
+/**
+ * Look through the recent history for entries
+ *
+ * The callback is called, oldest first, for each entry in the history
+ * which matches the filter and whose timestamp is in the given range.  The
+ * entry's seq gives its order in the history.  Entries may be logged (and
+ * recorded) while this runs, but the callback must not start or stop the
+ * history.
+ *
+ * \param filter The filter entries must match, or NULL for every entry
+ * \param since The earliest timestamp to include
+ * \param until The timestamp to include entries up to (but not including),
+ *              or 0 for no limit
+ * \param cb The function to call for each entry
+ * \param context The context pointer to pass to cb
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_history_query(nslog_filter_t *filter,
+				uint64_t since,
+				uint64_t until,
+				nslog_message_callback cb,
+				void *context);
+
+/**
+ * Start counting events
+ *
+ * From now on, \ref NSLOG_COUNT counts events at sites whose entries would
+ * be logged.  If `interval` is not zero, a background thread summarises the
+ * counts each time that long has passed; otherwise they are only summarised
+ * by \ref nslog_count_flush.  Starting again changes the interval.
+ *
+ * \param interval Nanoseconds between summaries, or 0 for none
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_count_start(uint64_t interval);
+
+/**
+ * Summarise the counted events
+ *
+ * One entry is logged for each counting site with events since its last
+ * summary, of the form `msg x123 in the last 1.000s`.  Then whether each
+ * site should be counting is looked at again, in case the level gates,
+ * active filter or level map have changed.
+ *
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_count_flush(void);
+
+/**
+ * Stop counting events
+ *
+ * The background thread, if any, is stopped, and the events counted so far
+ * are summarised.
+ *
+ * \return Whether or not this succeeded
+ */
+nslog_error nslog_count_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* NSLOG_NSLOG_H_ */
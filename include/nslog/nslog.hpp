@@ -0,0 +1,495 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging for C++
+ *
+ * This is an optional layer over \ref nslog.h for C++17 and later.  It
+ * builds fully qualified category names at compile time, checks log
+ * messages' formats against their arguments at compile time, and lets a
+ * scope choose the category its log entries are made under.  Categories
+ * and log entries made with it are the same as those made from C.
+ */
+
+#ifndef NSLOG_NSLOG_HPP_
+#define NSLOG_NSLOG_HPP_
+
+#if __cplusplus < 201703L
+#error "nslog.hpp needs C++17 or later"
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+#include "nslog/nslog.h"
+
+namespace nslog {
+namespace detail {
+
+/**
+ * A string built at compile time
+ */
+template <std::size_t N>
+struct path {
+	char data[N + 1];
+};
+
+/**
+ * Make a compile time string from a string literal
+ */
+template <std::size_t N>
+constexpr path<N - 1> leaf(const char (&str)[N])
+{
+	path<N - 1> ret{};
+	for (std::size_t i = 0; i < N; i++)
+		ret.data[i] = str[i];
+	return ret;
+}
+
+/**
+ * Join a parent category's name to a child's leafname
+ */
+template <std::size_t A, std::size_t B>
+constexpr path<A + 1 + B> join(const path<A> &parent, const path<B> &child)
+{
+	path<A + 1 + B> ret{};
+	for (std::size_t i = 0; i < A; i++)
+		ret.data[i] = parent.data[i];
+	ret.data[A] = '/';
+	for (std::size_t i = 0; i <= B; i++)
+		ret.data[A + 1 + i] = child.data[i];
+	return ret;
+}
+
+/* printf length modifiers */
+enum lenmod { MOD_NONE, MOD_HH, MOD_H, MOD_L, MOD_LL, MOD_J, MOD_Z, MOD_T,
+	      MOD_BIGL };
+
+template <typename... T>
+struct type_list {
+};
+
+/**
+ * The types of a list of arguments, as passed through varargs
+ * (only ever used in decltype)
+ */
+template <typename... T>
+type_list<std::decay_t<T>...> arg_types(const T &...);
+
+template <typename T>
+constexpr bool integer_fits(int mod)
+{
+	switch (mod) {
+	case MOD_NONE:
+	case MOD_HH:
+	case MOD_H:
+		return sizeof(T) <= sizeof(int);
+	case MOD_L:
+		return sizeof(T) == sizeof(long);
+	case MOD_LL:
+		return sizeof(T) == sizeof(long long);
+	case MOD_J:
+		return sizeof(T) == sizeof(std::intmax_t);
+	case MOD_Z:
+		return sizeof(T) == sizeof(std::size_t);
+	case MOD_T:
+		return sizeof(T) == sizeof(std::ptrdiff_t);
+	}
+	return false;
+}
+
+/**
+ * Whether an argument of type T may be given for a conversion
+ *
+ * \param conv The conversion character, or '*' for a width or precision
+ * \param mod The conversion's length modifier
+ */
+template <typename T>
+constexpr bool accepts(char conv, int mod)
+{
+	constexpr bool integer = std::is_integral_v<T> || std::is_enum_v<T>;
+
+	switch (conv) {
+	case '*':
+	case 'c':
+		return integer && sizeof(T) <= sizeof(int);
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+		return integer && integer_fits<T>(mod);
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+	case 'a': case 'A':
+		if (mod == MOD_BIGL)
+			return std::is_same_v<T, long double>;
+		return std::is_same_v<T, double> || std::is_same_v<T, float>;
+	case 's':
+		return mod == MOD_NONE &&
+			(std::is_same_v<T, const char *> ||
+			 std::is_same_v<T, char *> ||
+			 std::is_same_v<T, std::string>);
+	case 'p':
+		return mod == MOD_NONE &&
+			(std::is_pointer_v<T> ||
+			 std::is_same_v<T, std::nullptr_t>);
+	}
+	return false;
+}
+
+/**
+ * Check a printf format against the types of its arguments
+ *
+ * This is evaluated by the compiler.  %n is never accepted.
+ */
+template <typename... T>
+constexpr bool check_format(const char *fmt, type_list<T...>)
+{
+	constexpr bool (*checks[])(char, int) = { &accepts<T>..., nullptr };
+	std::size_t arg = 0;
+
+	for (const char *p = fmt; *p != '\0'; p++) {
+		int mod = MOD_NONE;
+
+		if (*p != '%')
+			continue;
+		p++;
+		if (*p == '%')
+			continue;
+		while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' ||
+		       *p == '0' || *p == '\'')
+			p++;
+		if (*p == '*') {
+			if (arg >= sizeof...(T) || !checks[arg++]('*', 0))
+				return false;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+			p++;
+		if (*p == '.') {
+			p++;
+			if (*p == '*') {
+				if (arg >= sizeof...(T) ||
+				    !checks[arg++]('*', 0))
+					return false;
+				p++;
+			}
+			while (*p >= '0' && *p <= '9')
+				p++;
+		}
+		switch (*p) {
+		case 'h':
+			mod = (p[1] == 'h') ? MOD_HH : MOD_H;
+			p += (p[1] == 'h') ? 1 : 0;
+			p++;
+			break;
+		case 'l':
+			mod = (p[1] == 'l') ? MOD_LL : MOD_L;
+			p += (p[1] == 'l') ? 1 : 0;
+			p++;
+			break;
+		case 'j': mod = MOD_J; p++; break;
+		case 'z': mod = MOD_Z; p++; break;
+		case 't': mod = MOD_T; p++; break;
+		case 'L': mod = MOD_BIGL; p++; break;
+		}
+		if (*p == 'm')
+			continue; /* strerror(errno), with no argument */
+		if (*p == '\0' || *p == 'n')
+			return false;
+		if (arg >= sizeof...(T) || !checks[arg++](*p, mod))
+			return false;
+	}
+
+	return arg == sizeof...(T);
+}
+
+/* Arguments are passed to nslog as they would be to printf, except that
+ * strings are passed as their C strings.
+ */
+template <typename T>
+constexpr const T &pass(const T &value)
+{
+	return value;
+}
+
+inline const char *pass(const std::string &value)
+{
+	return value.c_str();
+}
+
+template <typename... Args>
+inline void log(nslog_entry_context_t *ctx, const char *fmt,
+		const Args &...args)
+{
+	nslog__log(ctx, fmt, pass(args)...);
+}
+
+} /* namespace detail */
+
+/**
+ * A scope whose log entries are made under a category
+ *
+ * While one of these exists, entries made on the same thread with
+ * \ref NSLOG_SCOPED are made under its category rather than the one given
+ * at the call site.  Scopes nest, the innermost winning.
+ */
+class scoped_category {
+public:
+	explicit scoped_category(nslog_category_t &category) noexcept
+		: m_prev(s_current)
+	{
+		s_current = &category;
+	}
+
+	~scoped_category()
+	{
+		s_current = m_prev;
+	}
+
+	scoped_category(const scoped_category &) = delete;
+	scoped_category &operator=(const scoped_category &) = delete;
+
+	/**
+	 * The category of the innermost scope on this thread, if any
+	 */
+	static nslog_category_t *current() noexcept
+	{
+		return s_current;
+	}
+
+private:
+	static inline thread_local nslog_category_t *s_current = nullptr;
+	nslog_category_t *m_prev;
+};
+
+namespace detail {
+
+/**
+ * The number of call sites' scoped contexts each thread keeps
+ */
+constexpr std::size_t scoped_contexts = 32;
+
+/* A call site's context, with the category replaced */
+struct scoped_context {
+	const nslog_entry_context_t *site;
+	nslog_entry_context_t ctx;
+};
+
+/* Log at a call site, but under the current scope's category, if any.
+ * The context for each call site and category is kept (per thread, in a
+ * small cache) so that its call-site data needn't be computed every time.
+ */
+template <typename... Args>
+inline void log_scoped(nslog_entry_context_t *ctx, const char *fmt,
+		       const Args &...args)
+{
+	static thread_local scoped_context cache[scoped_contexts];
+	nslog_category_t *category = scoped_category::current();
+	std::uintptr_t hash;
+
+	if (category == nullptr || category == ctx->category) {
+		log(ctx, fmt, args...);
+		return;
+	}
+
+	hash = (reinterpret_cast<std::uintptr_t>(ctx) ^
+		reinterpret_cast<std::uintptr_t>(category)) >> 4;
+	scoped_context &slot = cache[hash % scoped_contexts];
+	if (slot.site != ctx || slot.ctx.category != category) {
+		slot.site = ctx;
+		slot.ctx = {
+			category, ctx->level,
+			ctx->filename, ctx->filenamelen,
+			ctx->funcname, ctx->funcnamelen,
+			ctx->lineno, {}
+		};
+		/* So the slots share their call site's prefixes */
+		slot.ctx.site.origin = ctx;
+	}
+	log(&slot.ctx, fmt, args...);
+}
+
+} /* namespace detail */
+} /* namespace nslog */
+
+/**
+ * Declare a category, for C++
+ *
+ * As \ref NSLOG_DECLARE_CATEGORY, but the category's name is also known
+ * at compile time, so that subcategories' names can be built from it.
+ * Categories defined with \ref NSLOG_CXX_DEFINE_CATEGORY must be declared
+ * with this first.
+ *
+ * \param catname The category name (as a bareword)
+ */
+#define NSLOG_CXX_DECLARE_CATEGORY(catname)				\
+	NSLOG_CXX_DECLARE_CATEGORY_LEVEL(catname, DEEPDEBUG)
+
+/**
+ * Declare a category with its own compiled minimum level, for C++
+ *
+ * \param catname The category name (as a bareword)
+ * \param level The lowest level compiled in (see
+ *              \ref NSLOG_DECLARE_CATEGORY_LEVEL)
+ */
+#define NSLOG_CXX_DECLARE_CATEGORY_LEVEL(catname, level)		\
+	struct __nslog_cxx_category_##catname {				\
+		static constexpr auto name =				\
+			::nslog::detail::leaf(#catname);		\
+	};								\
+	extern "C" char __nslog_catmin_##catname[NSLOG_LEVEL_##level + 1]; \
+	extern "C" nslog_category_t __nslog_category_##catname
+
+/**
+ * Declare a subcategory, for C++
+ *
+ * \param parentcatname The parent category name, which must have been
+ *                      declared with one of the C++ declaration macros
+ * \param catname The category name (as a bareword)
+ */
+#define NSLOG_CXX_DECLARE_SUBCATEGORY(parentcatname, catname)		\
+	NSLOG_CXX_DECLARE_SUBCATEGORY_LEVEL(parentcatname, catname, DEEPDEBUG)
+
+/**
+ * Declare a subcategory with its own compiled minimum level, for C++
+ *
+ * \param parentcatname The parent category name
+ * \param catname The category name (as a bareword)
+ * \param level The lowest level compiled in
+ */
+#define NSLOG_CXX_DECLARE_SUBCATEGORY_LEVEL(parentcatname, catname, level) \
+	struct __nslog_cxx_category_##catname {				\
+		static constexpr auto name = ::nslog::detail::join(	\
+			__nslog_cxx_category_##parentcatname::name,	\
+			::nslog::detail::leaf(#catname));		\
+	};								\
+	extern "C" char __nslog_catmin_##catname[NSLOG_LEVEL_##level + 1]; \
+	extern "C" nslog_category_t __nslog_category_##catname
+
+/**
+ * Define a category, for C++
+ *
+ * The category can be logged to from C or C++, and its fully qualified
+ * name is built by the compiler rather than at runtime.
+ *
+ * \param catname The category name (as a bareword)
+ * \param description The description of the category
+ */
+#define NSLOG_CXX_DEFINE_CATEGORY(catname, description)			\
+	NSLOG_CXX_DEFINE_CATEGORY_LEVEL(catname, description, DEEPDEBUG)
+
+/**
+ * Define a category with its own compiled minimum level, for C++
+ *
+ * \param catname The category name (as a bareword)
+ * \param description The description of the category
+ * \param level The lowest level compiled in, as it was declared
+ */
+#define NSLOG_CXX_DEFINE_CATEGORY_LEVEL(catname, description, level)	\
+	extern "C" {							\
+	char __nslog_catmin_##catname[NSLOG_LEVEL_##level + 1];		\
+	nslog_category_t __nslog_category_##catname = {			\
+		#catname,						\
+		description,						\
+		nullptr,						\
+		nullptr,						\
+		0,							\
+		nullptr,						\
+		__nslog_cxx_category_##catname::name.data,		\
+		0,							\
+	};								\
+	}
+
+/**
+ * Define a subcategory, for C++
+ *
+ * \param parentcatname The parent category name
+ * \param catname The category name (as a bareword)
+ * \param description The description of the category
+ */
+#define NSLOG_CXX_DEFINE_SUBCATEGORY(parentcatname, catname, description) \
+	NSLOG_CXX_DEFINE_SUBCATEGORY_LEVEL(parentcatname, catname,	\
+					   description, DEEPDEBUG)
+
+/**
+ * Define a subcategory with its own compiled minimum level, for C++
+ *
+ * \param parentcatname The parent category name
+ * \param catname The category name (as a bareword)
+ * \param description The description of the category
+ * \param level The lowest level compiled in, as it was declared
+ */
+#define NSLOG_CXX_DEFINE_SUBCATEGORY_LEVEL(parentcatname, catname,	\
+					   description, level)		\
+	extern "C" {							\
+	char __nslog_catmin_##catname[NSLOG_LEVEL_##level + 1];		\
+	nslog_category_t __nslog_category_##catname = {			\
+		#catname,						\
+		description,						\
+		&__nslog_category_##parentcatname,			\
+		nullptr,						\
+		0,							\
+		nullptr,						\
+		__nslog_cxx_category_##catname::name.data,		\
+		0,							\
+	};								\
+	}
+
+/**
+ * Log something, from C++
+ *
+ * As \ref NSLOG, except that the format is checked against the types of
+ * the arguments when compiling, failing the build if they don't match,
+ * and a std::string may be given for %s.  The message is only rendered if
+ * it is to be delivered.
+ *
+ * \param catname The category name (as a bareword)
+ * \param level The level at which this is logged (as a bareword)
+ * \param logmsg The log message itself (a printf format string literal)
+ * \param args The arguments for the log message
+ */
+#define NSLOGXX(catname, level, logmsg, args...)			\
+	do {								\
+		static_assert(::nslog::detail::check_format(		\
+			logmsg,						\
+			decltype(::nslog::detail::arg_types(args)){}),	\
+			"log message format doesn't match its arguments"); \
+		if (NSLOG__COMPILED_IN(catname, level)) {		\
+			static nslog_entry_context_t _nslog_ctx =	\
+				NSLOG__ENTRY_CONTEXT(catname, level);	\
+			::nslog::detail::log(&_nslog_ctx, logmsg, ##args); \
+		}							\
+	} while(0)
+
+/**
+ * Log something under the current scope's category, from C++
+ *
+ * As \ref NSLOGXX, but if there is a \ref nslog::scoped_category on this
+ * thread the entry is made under its category instead of catname.
+ *
+ * \param catname The category name to use outside of any scope
+ * \param level The level at which this is logged (as a bareword)
+ * \param logmsg The log message itself (a printf format string literal)
+ * \param args The arguments for the log message
+ */
+#define NSLOG_SCOPED(catname, level, logmsg, args...)			\
+	do {								\
+		static_assert(::nslog::detail::check_format(		\
+			logmsg,						\
+			decltype(::nslog::detail::arg_types(args)){}),	\
+			"log message format doesn't match its arguments"); \
+		if (NSLOG__COMPILED_IN(catname, level)) {		\
+			static nslog_entry_context_t _nslog_ctx =	\
+				NSLOG__ENTRY_CONTEXT(catname, level);	\
+			::nslog::detail::log_scoped(&_nslog_ctx, logmsg, \
+						    ##args);		\
+		}							\
+	} while(0)
+
+#endif /* NSLOG_NSLOG_HPP_ */
@@ -0,0 +1,370 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Append Sinks
+ *
+ * An append sink writes each record, or a batch of whole records, with a
+ * single write to a file opened with O_APPEND, so that writers in several
+ * processes sharing the file never split each other's lines.  A write no
+ * bigger than NSLOG_APPEND_ATOMIC is taken to land in one piece.
+ *
+ * A record bigger than that is split into fragments, each written on its
+ * own and framed as:
+ *
+ * "\x1e" pid "." id " " part "/" count " " length ":" data "\n"
+ *
+ * where the id is unique to the record within the writing process, parts
+ * count from 1, and the data is the next length bytes of the record.
+ * Fragments of different records may be interleaved with each other and
+ * with whole records; \ref nslog_append_unframe puts them back together.
+ * A record any of whose lines starts with "\x1e" is framed however small it
+ * is, so it can't be mistaken for a fragment.
+ */
+
+#include "nslog_internal.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* The largest write taken to be atomic: PIPE_BUF on Linux */
+#define NSLOG_APPEND_ATOMIC 4096
+
+/* Room for a fragment's framing, with every number at its longest */
+#define NSLOG_APPEND_FRAME_MAX 96
+
+#define NSLOG_APPEND_FRAME_START '\x1e'
+
+struct nslog_append_sink_s {
+	int fd;
+	bool batch;
+	pthread_mutex_t lock;
+	nslog_error error; /**< The first write error, if any */
+	unsigned long frames; /**< The id of the next framed record */
+	char *rec; /**< Scratch space for one record */
+	size_t recalloc;
+	size_t outlen;
+	char out[NSLOG_APPEND_ATOMIC]; /**< Batched records */
+};
+
+static void nslog__append_error(nslog_append_sink_t *sink, nslog_error err)
+{
+	if (err != NSLOG_NO_ERROR && sink->error == NSLOG_NO_ERROR)
+		sink->error = err;
+}
+
+/* Write out an iovec with one writev, carrying on after a short write even
+ * though the rest of it can no longer be atomic.
+ */
+static nslog_error nslog__append_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return NSLOG_IO_ERROR;
+		}
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return NSLOG_NO_ERROR;
+}
+
+static nslog_error nslog__append_write(int fd, const char *data, size_t len)
+{
+	struct iovec iov = { (void *)data, len };
+	return nslog__append_writev(fd, &iov, 1);
+}
+
+/* Write out the batched records, with the sink locked */
+static void nslog__append_flush(nslog_append_sink_t *sink)
+{
+	if (sink->outlen == 0)
+		return;
+	nslog__append_error(sink, nslog__append_write(sink->fd, sink->out,
+						      sink->outlen));
+	sink->outlen = 0;
+}
+
+/* Write out a record too big to be written atomically, in fragments */
+static void nslog__append_framed(nslog_append_sink_t *sink,
+				 const char *rec, size_t len)
+{
+	const size_t payload = NSLOG_APPEND_ATOMIC - NSLOG_APPEND_FRAME_MAX;
+	unsigned long pid = (unsigned long)getpid();
+	unsigned long id = sink->frames++;
+	unsigned int count = (len + payload - 1) / payload;
+	unsigned int part;
+
+	for (part = 1; part <= count; part++) {
+		char frame[NSLOG_APPEND_FRAME_MAX];
+		size_t chunk = (len < payload) ? len : payload;
+		struct iovec iov[3];
+		nslog_error err;
+
+		iov[0].iov_base = frame;
+		iov[0].iov_len = snprintf(frame, sizeof(frame),
+					  "%c%lu.%lu %u/%u %zu:",
+					  NSLOG_APPEND_FRAME_START,
+					  pid, id, part, count, chunk);
+		iov[1].iov_base = (void *)rec;
+		iov[1].iov_len = chunk;
+		iov[2].iov_base = (void *)"\n";
+		iov[2].iov_len = 1;
+		err = nslog__append_writev(sink->fd, iov, 3);
+		if (err != NSLOG_NO_ERROR) {
+			nslog__append_error(sink, err);
+			return;
+		}
+		rec += chunk;
+		len -= chunk;
+	}
+}
+
+/* Build a record's text, the entry's timestamp and its call site's line
+ * prefix (see nslog_site_prefix()) followed by its message, in the sink's
+ * scratch space
+ */
+static bool nslog__append_record(nslog_append_sink_t *sink,
+				 nslog_entry_t *entry,
+				 const char *msg, size_t len,
+				 size_t *reclen)
+{
+	const char *prefix;
+	size_t prefixlen, need;
+	char stamp[48];
+	int stamplen;
+
+	if (nslog_site_prefix(entry->context, &prefix,
+			      &prefixlen) != NSLOG_NO_ERROR)
+		return false;
+	stamplen = snprintf(stamp, sizeof(stamp), "%llu.%09llu ",
+			    (unsigned long long)(entry->timestamp / 1000000000),
+			    (unsigned long long)(entry->timestamp % 1000000000));
+
+	need = stamplen + prefixlen + len + 1;
+	if (need > sink->recalloc) {
+		if (need < NSLOG_APPEND_ATOMIC)
+			need = NSLOG_APPEND_ATOMIC;
+		free(sink->rec);
+		sink->rec = malloc(need);
+		if (sink->rec == NULL) {
+			sink->recalloc = 0;
+			return false;
+		}
+		sink->recalloc = need;
+	}
+
+	memcpy(sink->rec, stamp, stamplen);
+	memcpy(sink->rec + stamplen, prefix, prefixlen);
+	memcpy(sink->rec + stamplen + prefixlen, msg, len);
+	*reclen = stamplen + prefixlen + len + 1;
+	sink->rec[*reclen - 1] = '\n';
+	return true;
+}
+
+/* Whether a record must be framed even though it could be written whole,
+ * as one of its lines starts like a fragment
+ */
+static bool nslog__append_needs_frame(const char *rec, size_t len)
+{
+	const char *p = rec;
+
+	while (p != NULL) {
+		if (*p == NSLOG_APPEND_FRAME_START)
+			return true;
+		p = memchr(p, '\n', len - (p - rec) - 1);
+		if (p != NULL)
+			p++;
+	}
+	return false;
+}
+
+nslog_error nslog_append_sink_open(const char *path, bool batch,
+				   nslog_append_sink_t **sink)
+{
+	nslog_append_sink_t *ret = calloc(sizeof(*ret), 1);
+
+	if (ret == NULL)
+		return NSLOG_NO_MEMORY;
+	ret->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (ret->fd < 0) {
+		free(ret);
+		return NSLOG_IO_ERROR;
+	}
+	ret->batch = batch;
+	pthread_mutex_init(&ret->lock, NULL);
+	*sink = ret;
+	return NSLOG_NO_ERROR;
+}
+
+void nslog_append_sink_render(void *context, nslog_entry_t *entry,
+			      const char *msg, size_t len)
+{
+	nslog_append_sink_t *sink = context;
+	size_t reclen;
+
+	pthread_mutex_lock(&sink->lock);
+	if (!nslog__append_record(sink, entry, msg, len, &reclen)) {
+		nslog__append_error(sink, NSLOG_NO_MEMORY);
+	} else if (reclen > NSLOG_APPEND_ATOMIC ||
+		   nslog__append_needs_frame(sink->rec, reclen)) {
+		/* Keep the batched records ahead of this one */
+		nslog__append_flush(sink);
+		nslog__append_framed(sink, sink->rec, reclen);
+	} else if (sink->batch) {
+		if (sink->outlen + reclen > sizeof(sink->out))
+			nslog__append_flush(sink);
+		memcpy(sink->out + sink->outlen, sink->rec, reclen);
+		sink->outlen += reclen;
+	} else {
+		nslog__append_error(sink, nslog__append_write(sink->fd,
+							      sink->rec,
+							      reclen));
+	}
+	pthread_mutex_unlock(&sink->lock);
+}
+
+nslog_error nslog_append_sink_flush(nslog_append_sink_t *sink)
+{
+	nslog_error err;
+
+	pthread_mutex_lock(&sink->lock);
+	nslog__append_flush(sink);
+	err = sink->error;
+	sink->error = NSLOG_NO_ERROR;
+	pthread_mutex_unlock(&sink->lock);
+	return err;
+}
+
+nslog_error nslog_append_sink_destroy(nslog_append_sink_t *sink)
+{
+	nslog_error err = nslog_append_sink_flush(sink);
+
+	if (close(sink->fd) != 0 && err == NSLOG_NO_ERROR)
+		err = NSLOG_IO_ERROR;
+	pthread_mutex_destroy(&sink->lock);
+	free(sink->rec);
+	free(sink);
+	return err;
+}
+
+/**** Unframing ****/
+
+struct nslog_append_pending {
+	struct nslog_append_pending *next;
+	unsigned long pid, id;
+	unsigned int parts; /**< The parts seen so far */
+	char *data;
+	size_t len;
+};
+
+static struct nslog_append_pending **
+nslog__append_pending(struct nslog_append_pending **list,
+		      unsigned long pid, unsigned long id)
+{
+	while (*list != NULL && ((*list)->pid != pid || (*list)->id != id))
+		list = &(*list)->next;
+	return list;
+}
+
+/* Read a fragment's framing and data, adding the data to its record */
+static nslog_error nslog__append_fragment(FILE *in, FILE *out,
+					  struct nslog_append_pending **list)
+{
+	struct nslog_append_pending **pos, *rec;
+	unsigned long pid, id;
+	unsigned int part, count;
+	size_t len;
+	char *data;
+
+	if (fscanf(in, "%lu.%lu %u/%u %zu:", &pid, &id, &part, &count,
+		   &len) != 5 || part == 0 || part > count ||
+	    len > NSLOG_APPEND_ATOMIC)
+		return NSLOG_PARSE_ERROR;
+
+	pos = nslog__append_pending(list, pid, id);
+	rec = *pos;
+	if (rec == NULL) {
+		if (part != 1)
+			return NSLOG_PARSE_ERROR;
+		rec = calloc(sizeof(*rec), 1);
+		if (rec == NULL)
+			return NSLOG_NO_MEMORY;
+		rec->pid = pid;
+		rec->id = id;
+		*pos = rec;
+	} else if (part != rec->parts + 1) {
+		return NSLOG_PARSE_ERROR;
+	}
+
+	data = realloc(rec->data, rec->len + len);
+	if (data == NULL)
+		return NSLOG_NO_MEMORY;
+	rec->data = data;
+	if (fread(rec->data + rec->len, 1, len, in) != len ||
+	    getc(in) != '\n')
+		return NSLOG_PARSE_ERROR;
+	rec->len += len;
+	rec->parts = part;
+
+	if (part == count) {
+		fwrite(rec->data, 1, rec->len, out);
+		*pos = rec->next;
+		free(rec->data);
+		free(rec);
+	}
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_append_unframe(FILE *in, FILE *out)
+{
+	struct nslog_append_pending *list = NULL, *rec;
+	nslog_error err = NSLOG_NO_ERROR;
+	int c;
+
+	while (err == NSLOG_NO_ERROR && (c = getc(in)) != EOF) {
+		if (c == NSLOG_APPEND_FRAME_START) {
+			err = nslog__append_fragment(in, out, &list);
+			continue;
+		}
+		/* A whole record, passed through as it is */
+		while (c != EOF) {
+			putc(c, out);
+			if (c == '\n')
+				break;
+			c = getc(in);
+		}
+	}
+
+	/* Records which never got all their parts are lost */
+	if (list != NULL && err == NSLOG_NO_ERROR)
+		err = NSLOG_PARSE_ERROR;
+	while ((rec = list) != NULL) {
+		list = rec->next;
+		free(rec->data);
+		free(rec);
+	}
+	if (ferror(in) || ferror(out))
+		err = NSLOG_IO_ERROR;
+	return err;
+}
@@ -0,0 +1,1119 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Binary Log Streams
+ *
+ * A binary log stream is a header followed by a sequence of records.  All
+ * integers are LEB128 varints (signed ones zigzag encoded first) and strings
+ * are a varint length followed by the bytes.
+ *
+ * header: "NSLB" version(u8) 0(u8) 0(u8) 0(u8)
+ * site record: 0x01 id level(u8) lineno category filename funcname format
+ * entry record: 0x02 id time-delta(signed, ns) args-length args
+ *
+ * The args are the printf arguments in the order the format string consumes
+ * them, each a tag byte ('i' signed, 'u' unsigned, 'd' double as eight
+ * little-endian bytes, 'p' pointer, 's' string) followed by its value.
+ */
+
+#include "nslog_internal.h"
+
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <wchar.h>
+
+#define NSLOG_BINLOG_VERSION 1
+#define NSLOG_BINLOG_SITE 0x01
+#define NSLOG_BINLOG_ENTRY 0x02
+#define NSLOG_BINLOG_BUFSZ 65536
+
+/* printf length modifiers we care about */
+typedef enum {
+	NSLBL_NONE = 0,
+	NSLBL_HH,
+	NSLBL_H,
+	NSLBL_L,
+	NSLBL_LL,
+	NSLBL_J,
+	NSLBL_Z,
+	NSLBL_T,
+	NSLBL_BIGL,
+} nslog_binlog_lenmod;
+
+struct nslog_binlog_spec {
+	const char *start; /**< The '%' which starts the spec */
+	size_t len; /**< The length of the spec, including conversion */
+	bool star_width; /**< Width is taken from an int argument */
+	bool star_prec; /**< Precision is taken from an int argument */
+	int prec; /**< Literal precision, or -1 if none */
+	nslog_binlog_lenmod lenmod;
+	char conv; /**< The conversion character */
+};
+
+/**
+ * Find the next conversion spec in a format string.
+ *
+ * \param fmt The format string to scan from
+ * \param spec The spec to fill out
+ * \return The format string after the spec, or NULL if there are no more
+ */
+static const char *nslog__binlog_next_spec(const char *fmt,
+					   struct nslog_binlog_spec *spec)
+{
+	const char *p = strchr(fmt, '%');
+
+	if (p == NULL)
+		return NULL;
+
+	memset(spec, 0, sizeof(*spec));
+	spec->start = p++;
+	spec->prec = -1;
+	while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+		p++;
+	if (*p == '*') {
+		spec->star_width = true;
+		p++;
+	} else {
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->star_prec = true;
+			p++;
+		} else {
+			spec->prec = 0;
+			while (*p >= '0' && *p <= '9')
+				spec->prec = (spec->prec * 10) + (*p++ - '0');
+		}
+	}
+	switch (*p) {
+	case 'h':
+		spec->lenmod = (p[1] == 'h') ? NSLBL_HH : NSLBL_H;
+		p += (p[1] == 'h') ? 2 : 1;
+		break;
+	case 'l':
+		spec->lenmod = (p[1] == 'l') ? NSLBL_LL : NSLBL_L;
+		p += (p[1] == 'l') ? 2 : 1;
+		break;
+	case 'q':
+		spec->lenmod = NSLBL_LL;
+		p++;
+		break;
+	case 'j':
+		spec->lenmod = NSLBL_J;
+		p++;
+		break;
+	case 'z':
+		spec->lenmod = NSLBL_Z;
+		p++;
+		break;
+	case 't':
+		spec->lenmod = NSLBL_T;
+		p++;
+		break;
+	case 'L':
+		spec->lenmod = NSLBL_BIGL;
+		p++;
+		break;
+	}
+	spec->conv = *p;
+	if (*p != '\0')
+		p++;
+	spec->len = p - spec->start;
+
+	return p;
+}
+
+/**
+ * Whether every conversion in a format string can be captured.
+ */
+static bool nslog__binlog_format_ok(const char *fmt)
+{
+	struct nslog_binlog_spec spec;
+
+	while ((fmt = nslog__binlog_next_spec(fmt, &spec)) != NULL) {
+		if (spec.conv == '\0' ||
+		    strchr("%diouxXcfFeEgGaAspnm", spec.conv) == NULL)
+			return false;
+	}
+	return true;
+}
+
+/**** Encoding ****/
+
+struct nslog_binlog_buf {
+	uint8_t *data;
+	size_t len;
+	size_t alloc;
+};
+
+static bool nslog__binlog_ensure(struct nslog_binlog_buf *buf, size_t extra)
+{
+	if (buf->len + extra > buf->alloc) {
+		size_t alloc = (buf->alloc == 0) ? 256 : buf->alloc;
+		uint8_t *data;
+		while (alloc < buf->len + extra)
+			alloc *= 2;
+		data = realloc(buf->data, alloc);
+		if (data == NULL)
+			return false;
+		buf->data = data;
+		buf->alloc = alloc;
+	}
+	return true;
+}
+
+static bool nslog__binlog_put_byte(struct nslog_binlog_buf *buf, uint8_t b)
+{
+	if (!nslog__binlog_ensure(buf, 1))
+		return false;
+	buf->data[buf->len++] = b;
+	return true;
+}
+
+static bool nslog__binlog_put_uint(struct nslog_binlog_buf *buf, uint64_t v)
+{
+	if (!nslog__binlog_ensure(buf, 10))
+		return false;
+	do {
+		uint8_t b = v & 0x7f;
+		v >>= 7;
+		buf->data[buf->len++] = b | ((v != 0) ? 0x80 : 0);
+	} while (v != 0);
+	return true;
+}
+
+static bool nslog__binlog_put_int(struct nslog_binlog_buf *buf, int64_t v)
+{
+	return nslog__binlog_put_uint(buf,
+				      ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static bool nslog__binlog_put_bytes(struct nslog_binlog_buf *buf,
+				    const void *bytes, size_t len)
+{
+	if (!nslog__binlog_put_uint(buf, len) ||
+	    !nslog__binlog_ensure(buf, len))
+		return false;
+	memcpy(buf->data + buf->len, bytes, len);
+	buf->len += len;
+	return true;
+}
+
+static bool nslog__binlog_put_string(struct nslog_binlog_buf *buf,
+				     const char *str)
+{
+	return nslog__binlog_put_bytes(buf, str, strlen(str));
+}
+
+static bool nslog__binlog_put_double(struct nslog_binlog_buf *buf, double d)
+{
+	uint64_t v;
+	int i;
+
+	memcpy(&v, &d, sizeof(v));
+	if (!nslog__binlog_ensure(buf, 8))
+		return false;
+	for (i = 0; i < 8; i++)
+		buf->data[buf->len++] = (v >> (i * 8)) & 0xff;
+	return true;
+}
+
+/**
+ * Capture the printf arguments for a format string.
+ *
+ * Conversions which are locale or errno dependent (wide characters and %m)
+ * are rendered at capture time and stored as strings.
+ */
+static bool nslog__binlog_put_args(struct nslog_binlog_buf *buf,
+				   const char *fmt, va_list args)
+{
+	struct nslog_binlog_spec spec;
+	bool ok = true;
+
+	while (ok && (fmt = nslog__binlog_next_spec(fmt, &spec)) != NULL) {
+		int prec = spec.prec;
+
+		if (spec.star_width) {
+			ok = nslog__binlog_put_byte(buf, 'i') &&
+				nslog__binlog_put_int(buf, va_arg(args, int));
+		}
+		if (ok && spec.star_prec) {
+			prec = va_arg(args, int);
+			ok = nslog__binlog_put_byte(buf, 'i') &&
+				nslog__binlog_put_int(buf, prec);
+		}
+		if (!ok)
+			break;
+
+		switch (spec.conv) {
+		case 'd':
+		case 'i': {
+			int64_t v;
+			switch (spec.lenmod) {
+			case NSLBL_L: v = va_arg(args, long); break;
+			case NSLBL_LL: v = va_arg(args, long long); break;
+			case NSLBL_J: v = va_arg(args, intmax_t); break;
+			case NSLBL_Z: v = (ssize_t)va_arg(args, size_t); break;
+			case NSLBL_T: v = va_arg(args, ptrdiff_t); break;
+			case NSLBL_HH: v = (signed char)va_arg(args, int); break;
+			case NSLBL_H: v = (short)va_arg(args, int); break;
+			default: v = va_arg(args, int); break;
+			}
+			ok = nslog__binlog_put_byte(buf, 'i') &&
+				nslog__binlog_put_int(buf, v);
+			break;
+		}
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X': {
+			uint64_t v;
+			switch (spec.lenmod) {
+			case NSLBL_L: v = va_arg(args, unsigned long); break;
+			case NSLBL_LL: v = va_arg(args, unsigned long long); break;
+			case NSLBL_J: v = va_arg(args, uintmax_t); break;
+			case NSLBL_Z: v = va_arg(args, size_t); break;
+			case NSLBL_T: v = (uint64_t)va_arg(args, ptrdiff_t); break;
+			case NSLBL_HH: v = (unsigned char)va_arg(args, unsigned int); break;
+			case NSLBL_H: v = (unsigned short)va_arg(args, unsigned int); break;
+			default: v = va_arg(args, unsigned int); break;
+			}
+			ok = nslog__binlog_put_byte(buf, 'u') &&
+				nslog__binlog_put_uint(buf, v);
+			break;
+		}
+		case 'c':
+			if (spec.lenmod == NSLBL_L) {
+				char tmp[MB_LEN_MAX + 1];
+				snprintf(tmp, sizeof(tmp), "%lc",
+					 va_arg(args, wint_t));
+				ok = nslog__binlog_put_byte(buf, 's') &&
+					nslog__binlog_put_string(buf, tmp);
+			} else {
+				ok = nslog__binlog_put_byte(buf, 'i') &&
+					nslog__binlog_put_int(buf, va_arg(args, int));
+			}
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A': {
+			double d;
+			if (spec.lenmod == NSLBL_BIGL)
+				d = va_arg(args, long double);
+			else
+				d = va_arg(args, double);
+			ok = nslog__binlog_put_byte(buf, 'd') &&
+				nslog__binlog_put_double(buf, d);
+			break;
+		}
+		case 's':
+			ok = nslog__binlog_put_byte(buf, 's');
+			if (!ok)
+				break;
+			if (spec.lenmod == NSLBL_L) {
+				const wchar_t *ws = va_arg(args, const wchar_t *);
+				int len = snprintf(NULL, 0, "%ls", ws);
+				char *tmp = malloc((len < 0 ? 0 : len) + 1);
+				if (tmp == NULL)
+					return false;
+				snprintf(tmp, len + 1, "%ls", ws);
+				ok = nslog__binlog_put_string(buf, tmp);
+				free(tmp);
+			} else {
+				const char *str = va_arg(args, const char *);
+				if (str == NULL)
+					str = "(null)";
+				/* With a precision, str need not be terminated */
+				ok = nslog__binlog_put_bytes(
+					buf, str,
+					(prec >= 0) ? strnlen(str, prec) : strlen(str));
+			}
+			break;
+		case 'p':
+			ok = nslog__binlog_put_byte(buf, 'p') &&
+				nslog__binlog_put_uint(buf,
+					(uintptr_t)va_arg(args, void *));
+			break;
+		case 'n':
+			/* Nothing is written back, the pointer is dropped */
+			(void)va_arg(args, void *);
+			break;
+		case 'm':
+			ok = nslog__binlog_put_byte(buf, 's') &&
+				nslog__binlog_put_string(buf, strerror(errno));
+			break;
+		default:
+			/* %% and friends consume no arguments */
+			break;
+		}
+	}
+
+	return ok;
+}
+
+struct nslog_binlog_site {
+	const char *filename;
+	const char *funcname;
+	const char *fmt;
+	nslog_category_t *category;
+	int lineno;
+	nslog_level level;
+	size_t hash;
+	uint64_t id;
+	bool rendered; /**< Format can't be captured, store rendered text */
+};
+
+struct nslog_binary_sink_s {
+	int fd;
+	pthread_mutex_t lock;
+	nslog_error error; /**< The first write error, if any */
+	uint8_t out[NSLOG_BINLOG_BUFSZ];
+	size_t outlen;
+	struct nslog_binlog_buf rec; /**< Scratch space for one record */
+	struct nslog_binlog_site *sites; /**< Open addressed site table */
+	size_t nsites;
+	size_t sitesalloc;
+	int64_t last_time;
+};
+
+static nslog_error nslog__binlog_write(int fd, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return NSLOG_IO_ERROR;
+		}
+		data += written;
+		len -= written;
+	}
+	return NSLOG_NO_ERROR;
+}
+
+static void nslog__binlog_error(nslog_binary_sink_t *sink, nslog_error err)
+{
+	if (err != NSLOG_NO_ERROR && sink->error == NSLOG_NO_ERROR)
+		sink->error = err;
+}
+
+/* Write out the buffered records, with the sink locked, keeping the first
+ * error for the caller's next flush
+ */
+static nslog_error nslog__binlog_flush(nslog_binary_sink_t *sink)
+{
+	nslog_error err = nslog__binlog_write(sink->fd, sink->out,
+					      sink->outlen);
+	sink->outlen = 0;
+	nslog__binlog_error(sink, err);
+	return err;
+}
+
+static void nslog__binlog_emit(nslog_binary_sink_t *sink,
+			       const uint8_t *data, size_t len)
+{
+	if (sink->outlen + len > sizeof(sink->out)) {
+		if (nslog__binlog_flush(sink) != NSLOG_NO_ERROR)
+			return;
+	}
+	if (len > sizeof(sink->out)) {
+		nslog__binlog_error(sink,
+				    nslog__binlog_write(sink->fd, data, len));
+		return;
+	}
+	memcpy(sink->out + sink->outlen, data, len);
+	sink->outlen += len;
+}
+
+static size_t nslog__binlog_site_hash(nslog_entry_context_t *ctx,
+				      const char *fmt)
+{
+	return ctx->site.filenamehash ^ ((size_t)ctx->lineno * 2654435761u) ^
+		((uintptr_t)fmt >> 3);
+}
+
+static bool nslog__binlog_site_grow(nslog_binary_sink_t *sink)
+{
+	size_t alloc = (sink->sitesalloc == 0) ? 64 : sink->sitesalloc * 2;
+	struct nslog_binlog_site *sites = calloc(alloc, sizeof(*sites));
+	size_t i;
+
+	if (sites == NULL)
+		return false;
+	for (i = 0; i < sink->sitesalloc; i++) {
+		struct nslog_binlog_site *old = &sink->sites[i];
+		size_t slot;
+		if (old->filename == NULL)
+			continue;
+		slot = old->hash & (alloc - 1);
+		while (sites[slot].filename != NULL)
+			slot = (slot + 1) & (alloc - 1);
+		sites[slot] = *old;
+	}
+	free(sink->sites);
+	sink->sites = sites;
+	sink->sitesalloc = alloc;
+	return true;
+}
+
+/**
+ * Find the site record for an entry, writing one out if it is new.
+ */
+static struct nslog_binlog_site *
+nslog__binlog_site(nslog_binary_sink_t *sink,
+		   nslog_entry_context_t *ctx,
+		   const char *fmt)
+{
+	struct nslog_binlog_site *site;
+	size_t hash = nslog__binlog_site_hash(ctx, fmt);
+	size_t slot;
+
+	if ((sink->nsites + 1) * 2 > sink->sitesalloc &&
+	    !nslog__binlog_site_grow(sink))
+		return NULL;
+
+	slot = hash & (sink->sitesalloc - 1);
+	while ((site = &sink->sites[slot])->filename != NULL) {
+		if (site->filename == ctx->filename &&
+		    site->lineno == ctx->lineno &&
+		    site->fmt == fmt &&
+		    site->funcname == ctx->funcname &&
+		    site->category == ctx->category &&
+		    site->level == ctx->level)
+			return site;
+		slot = (slot + 1) & (sink->sitesalloc - 1);
+	}
+
+	site->filename = ctx->filename;
+	site->funcname = ctx->funcname;
+	site->fmt = fmt;
+	site->category = ctx->category;
+	site->lineno = ctx->lineno;
+	site->level = ctx->level;
+	site->hash = hash;
+	site->id = sink->nsites++;
+	site->rendered = !nslog__binlog_format_ok(fmt);
+
+	sink->rec.len = 0;
+	if (!nslog__binlog_put_byte(&sink->rec, NSLOG_BINLOG_SITE) ||
+	    !nslog__binlog_put_uint(&sink->rec, site->id) ||
+	    !nslog__binlog_put_byte(&sink->rec, ctx->level) ||
+	    !nslog__binlog_put_uint(&sink->rec, ctx->lineno) ||
+	    !nslog__binlog_put_bytes(&sink->rec, ctx->category->name,
+				     ctx->category->namelen) ||
+	    !nslog__binlog_put_bytes(&sink->rec, ctx->filename,
+				     ctx->filenamelen) ||
+	    !nslog__binlog_put_bytes(&sink->rec, ctx->funcname,
+				     ctx->funcnamelen) ||
+	    !nslog__binlog_put_string(&sink->rec,
+				      site->rendered ? "%s" : fmt))
+		return NULL;
+	nslog__binlog_emit(sink, sink->rec.data, sink->rec.len);
+
+	return site;
+}
+
+nslog_error nslog_binary_sink_new(int fd, nslog_binary_sink_t **sink)
+{
+	static const uint8_t header[8] = {
+		'N', 'S', 'L', 'B', NSLOG_BINLOG_VERSION, 0, 0, 0
+	};
+	nslog_binary_sink_t *ret = calloc(sizeof(*ret), 1);
+
+	if (ret == NULL)
+		return NSLOG_NO_MEMORY;
+	ret->fd = fd;
+	pthread_mutex_init(&ret->lock, NULL);
+	nslog__binlog_emit(ret, header, sizeof(header));
+	*sink = ret;
+	return NSLOG_NO_ERROR;
+}
+
+void nslog_binary_sink_render(void *context, nslog_entry_t *entry,
+			      const char *fmt, va_list args)
+{
+	nslog_binary_sink_t *sink = context;
+	struct nslog_binlog_site *site;
+	int64_t now = entry->timestamp;
+	size_t hdrlen;
+	bool ok;
+
+	pthread_mutex_lock(&sink->lock);
+	site = nslog__binlog_site(sink, entry->context, fmt);
+	if (site == NULL) {
+		pthread_mutex_unlock(&sink->lock);
+		return;
+	}
+
+	/* Encode the arguments first, so their length can prefix them */
+	sink->rec.len = 0;
+	if (site->rendered) {
+		int len;
+		va_list ap;
+		va_copy(ap, args);
+		len = vsnprintf(NULL, 0, fmt, ap);
+		va_end(ap);
+		ok = (len >= 0) && nslog__binlog_put_byte(&sink->rec, 's') &&
+			nslog__binlog_put_uint(&sink->rec, len) &&
+			nslog__binlog_ensure(&sink->rec, len + 1);
+		if (ok) {
+			vsnprintf((char *)sink->rec.data + sink->rec.len,
+				  len + 1, fmt, args);
+			sink->rec.len += len;
+		}
+	} else {
+		ok = nslog__binlog_put_args(&sink->rec, fmt, args);
+	}
+	hdrlen = sink->rec.len;
+	ok = ok && nslog__binlog_put_byte(&sink->rec, NSLOG_BINLOG_ENTRY) &&
+		nslog__binlog_put_uint(&sink->rec, site->id) &&
+		nslog__binlog_put_int(&sink->rec, now - sink->last_time) &&
+		nslog__binlog_put_uint(&sink->rec, hdrlen);
+	if (ok) {
+		sink->last_time = now;
+
+		/* The record header was built after the arguments */
+		nslog__binlog_emit(sink, sink->rec.data + hdrlen,
+				   sink->rec.len - hdrlen);
+		nslog__binlog_emit(sink, sink->rec.data, hdrlen);
+	}
+	pthread_mutex_unlock(&sink->lock);
+}
+
+nslog_error nslog_binary_sink_flush(nslog_binary_sink_t *sink)
+{
+	nslog_error err;
+
+	pthread_mutex_lock(&sink->lock);
+	(void)nslog__binlog_flush(sink);
+	err = sink->error;
+	sink->error = NSLOG_NO_ERROR;
+	pthread_mutex_unlock(&sink->lock);
+	return err;
+}
+
+nslog_error nslog_binary_sink_destroy(nslog_binary_sink_t *sink)
+{
+	nslog_error err = nslog_binary_sink_flush(sink);
+	pthread_mutex_destroy(&sink->lock);
+	free(sink->rec.data);
+	free(sink->sites);
+	free(sink);
+	return err;
+}
+
+/**** Decoding ****/
+
+struct nslog_binlog_dsite {
+	nslog_level level;
+	int lineno;
+	char *category;
+	char *filename;
+	char *funcname;
+	char *fmt;
+};
+
+struct nslog_binlog_reader {
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+	bool bad;
+};
+
+static uint64_t nslog__binlog_get_uint(struct nslog_binlog_reader *rd)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	while (rd->pos < rd->len && shift < 64) {
+		uint8_t b = rd->data[rd->pos++];
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return v;
+		shift += 7;
+	}
+	rd->bad = true;
+	return 0;
+}
+
+static int64_t nslog__binlog_get_int(struct nslog_binlog_reader *rd)
+{
+	uint64_t v = nslog__binlog_get_uint(rd);
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int nslog__binlog_get_byte(struct nslog_binlog_reader *rd)
+{
+	if (rd->pos >= rd->len) {
+		rd->bad = true;
+		return -1;
+	}
+	return rd->data[rd->pos++];
+}
+
+static const char *nslog__binlog_get_bytes(struct nslog_binlog_reader *rd,
+					   size_t *len)
+{
+	const char *ret;
+	*len = nslog__binlog_get_uint(rd);
+	if (rd->bad || *len > rd->len - rd->pos) {
+		rd->bad = true;
+		return NULL;
+	}
+	ret = (const char *)rd->data + rd->pos;
+	rd->pos += *len;
+	return ret;
+}
+
+static char *nslog__binlog_get_string(struct nslog_binlog_reader *rd)
+{
+	size_t len;
+	const char *bytes = nslog__binlog_get_bytes(rd, &len);
+	char *ret;
+	if (bytes == NULL)
+		return NULL;
+	ret = malloc(len + 1);
+	if (ret == NULL) {
+		rd->bad = true;
+		return NULL;
+	}
+	memcpy(ret, bytes, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+static double nslog__binlog_get_double(struct nslog_binlog_reader *rd)
+{
+	uint64_t v = 0;
+	double d;
+	int i;
+
+	if (rd->len - rd->pos < 8) {
+		rd->bad = true;
+		return 0;
+	}
+	for (i = 0; i < 8; i++)
+		v |= (uint64_t)rd->data[rd->pos++] << (i * 8);
+	memcpy(&d, &v, sizeof(d));
+	return d;
+}
+
+/**
+ * Whether a captured argument's tag suits the conversion using it.
+ *
+ * The stream is not trusted, so a value must never be handed to fprintf()
+ * for a conversion expecting another type.
+ */
+static bool nslog__binlog_tag_ok(const struct nslog_binlog_spec *spec,
+				 int tag)
+{
+	switch (spec->conv) {
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		return tag == 'i' || tag == 'u';
+	case 'c':
+		/* %lc is rendered at capture time */
+		return tag == ((spec->lenmod == NSLBL_L) ? 's' : 'i');
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		return tag == 'd';
+	case 'p':
+		return tag == 'p';
+	case 's':
+	case 'm':
+		return tag == 's';
+	default:
+		return false;
+	}
+}
+
+/**
+ * Render one conversion spec with its captured value.
+ *
+ * The spec is rewritten so that star widths and precisions become literal
+ * and integer length modifiers become 'll', matching the captured types.
+ */
+static bool nslog__binlog_render_spec(FILE *out,
+				      const struct nslog_binlog_spec *spec,
+				      struct nslog_binlog_reader *rd)
+{
+	char tmpl[128];
+	size_t tlen = 0;
+	const char *p = spec->start;
+	const char *end = spec->start + spec->len;
+	int tag;
+
+	if (spec->len + 64 > sizeof(tmpl))
+		return false;
+
+	/* Flags and width */
+	tmpl[tlen++] = *p++;
+	while (p < end && strchr("-+ #0'", *p) != NULL)
+		tmpl[tlen++] = *p++;
+	if (spec->star_width) {
+		if (nslog__binlog_get_byte(rd) != 'i')
+			return false;
+		tlen += snprintf(tmpl + tlen, 16, "%d",
+				 (int)nslog__binlog_get_int(rd));
+		p++;
+	} else {
+		while (p < end && *p >= '0' && *p <= '9')
+			tmpl[tlen++] = *p++;
+	}
+	/* Precision */
+	if (p < end && *p == '.') {
+		p++;
+		if (spec->star_prec) {
+			int prec;
+			if (nslog__binlog_get_byte(rd) != 'i')
+				return false;
+			prec = nslog__binlog_get_int(rd);
+			if (prec >= 0)
+				tlen += snprintf(tmpl + tlen, 16, ".%d", prec);
+			p++;
+		} else {
+			tmpl[tlen++] = '.';
+			while (p < end && *p >= '0' && *p <= '9')
+				tmpl[tlen++] = *p++;
+		}
+	}
+
+	if (spec->conv == 'n')
+		return true;
+
+	tag = nslog__binlog_get_byte(rd);
+	if (!nslog__binlog_tag_ok(spec, tag))
+		return false;
+	switch (tag) {
+	case 'i':
+	case 'u': {
+		uint64_t v;
+		if (tag == 'i')
+			v = (uint64_t)nslog__binlog_get_int(rd);
+		else
+			v = nslog__binlog_get_uint(rd);
+		if (spec->conv == 'c') {
+			tmpl[tlen++] = 'c';
+			tmpl[tlen] = '\0';
+			fprintf(out, tmpl, (int)v);
+			break;
+		}
+		tmpl[tlen++] = 'l';
+		tmpl[tlen++] = 'l';
+		tmpl[tlen++] = spec->conv;
+		tmpl[tlen] = '\0';
+		/* The argument's signedness follows the conversion's */
+		if (spec->conv == 'd' || spec->conv == 'i')
+			fprintf(out, tmpl, (long long)v);
+		else
+			fprintf(out, tmpl, (unsigned long long)v);
+		break;
+	}
+	case 'd':
+		tmpl[tlen++] = spec->conv;
+		tmpl[tlen] = '\0';
+		fprintf(out, tmpl, nslog__binlog_get_double(rd));
+		break;
+	case 'p':
+		tmpl[tlen++] = 'p';
+		tmpl[tlen] = '\0';
+		fprintf(out, tmpl, (void *)(uintptr_t)nslog__binlog_get_uint(rd));
+		break;
+	case 's': {
+		size_t len;
+		const char *str = nslog__binlog_get_bytes(rd, &len);
+		const char *dot;
+		if (str == NULL)
+			return false;
+		if (spec->conv != 's') {
+			/* Rendered at capture time (%lc, %m) */
+			fwrite(str, 1, len, out);
+			break;
+		}
+		/* The captured string is not NUL terminated, so the
+		 * precision mustn't let fprintf() look beyond it
+		 */
+		tmpl[tlen] = '\0';
+		dot = memchr(tmpl, '.', tlen);
+		if (dot != NULL) {
+			size_t prec = strtoul(dot + 1, NULL, 10);
+			if (prec < len)
+				len = prec;
+			tlen = dot - tmpl;
+		}
+		tlen += snprintf(tmpl + tlen, 24, ".%zu", len);
+		tmpl[tlen++] = 's';
+		tmpl[tlen] = '\0';
+		fprintf(out, tmpl, str);
+		break;
+	}
+	default:
+		return false;
+	}
+
+	return !rd->bad;
+}
+
+static bool nslog__binlog_render(FILE *out, const char *fmt,
+				 struct nslog_binlog_reader *rd)
+{
+	struct nslog_binlog_spec spec;
+	const char *next;
+
+	while ((next = nslog__binlog_next_spec(fmt, &spec)) != NULL) {
+		fwrite(fmt, 1, spec.start - fmt, out);
+		if (spec.conv == '%')
+			fputc('%', out);
+		else if (!nslog__binlog_render_spec(out, &spec, rd))
+			return false;
+		fmt = next;
+	}
+	fputs(fmt, out);
+	return true;
+}
+
+static void nslog__binlog_free_sites(struct nslog_binlog_dsite *sites,
+				     size_t nsites)
+{
+	size_t i;
+	for (i = 0; i < nsites; i++) {
+		free(sites[i].category);
+		free(sites[i].filename);
+		free(sites[i].funcname);
+		free(sites[i].fmt);
+	}
+	free(sites);
+}
+
+/* The raw bytes of one record, read from the stream */
+struct nslog_binlog_record {
+	uint8_t *data;
+	size_t len;
+	size_t alloc;
+};
+
+/**
+ * Read bytes from a binary log stream onto the end of a record.
+ *
+ * The buffer only grows as bytes arrive, so a corrupt length can't claim
+ * more memory than the stream holds.
+ */
+static nslog_error nslog__binlog_fetch(FILE *in,
+				       struct nslog_binlog_record *rec,
+				       uint64_t n)
+{
+	while (n > 0) {
+		size_t chunk = (n < NSLOG_BINLOG_BUFSZ) ?
+			(size_t)n : NSLOG_BINLOG_BUFSZ;
+		size_t got;
+		if (rec->alloc - rec->len < chunk) {
+			size_t alloc = (rec->alloc == 0) ?
+				NSLOG_BINLOG_BUFSZ : rec->alloc * 2;
+			uint8_t *data;
+			if (alloc < rec->len + chunk)
+				alloc = rec->len + chunk;
+			data = realloc(rec->data, alloc);
+			if (data == NULL)
+				return NSLOG_NO_MEMORY;
+			rec->data = data;
+			rec->alloc = alloc;
+		}
+		got = fread(rec->data + rec->len, 1, chunk, in);
+		rec->len += got;
+		n -= got;
+		if (got < chunk)
+			return ferror(in) ? NSLOG_IO_ERROR : NSLOG_PARSE_ERROR;
+	}
+	return NSLOG_NO_ERROR;
+}
+
+static nslog_error nslog__binlog_fetch_uint(FILE *in,
+					    struct nslog_binlog_record *rec,
+					    uint64_t *v)
+{
+	nslog_error err;
+	int shift = 0;
+	uint8_t b;
+
+	*v = 0;
+	do {
+		if (shift >= 64)
+			return NSLOG_PARSE_ERROR;
+		err = nslog__binlog_fetch(in, rec, 1);
+		if (err != NSLOG_NO_ERROR)
+			return err;
+		b = rec->data[rec->len - 1];
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while ((b & 0x80) != 0);
+	return NSLOG_NO_ERROR;
+}
+
+/**
+ * Read the next record from a binary log stream.
+ *
+ * Exactly the record's bytes are read, so nothing waits on data beyond
+ * it.  The record is left empty at the end of the stream.
+ */
+static nslog_error nslog__binlog_fetch_record(FILE *in,
+					      struct nslog_binlog_record *rec)
+{
+	nslog_error err;
+	uint64_t v;
+	int c, i;
+
+	rec->len = 0;
+	c = getc(in);
+	if (c == EOF)
+		return ferror(in) ? NSLOG_IO_ERROR : NSLOG_NO_ERROR;
+	ungetc(c, in);
+
+	err = nslog__binlog_fetch(in, rec, 1);
+	if (err == NSLOG_NO_ERROR)
+		err = nslog__binlog_fetch_uint(in, rec, &v);
+	if (err != NSLOG_NO_ERROR)
+		return err;
+
+	switch (c) {
+	case NSLOG_BINLOG_SITE:
+		err = nslog__binlog_fetch(in, rec, 1);
+		if (err == NSLOG_NO_ERROR)
+			err = nslog__binlog_fetch_uint(in, rec, &v);
+		/* category, filename, funcname and format */
+		for (i = 0; i < 4 && err == NSLOG_NO_ERROR; i++) {
+			err = nslog__binlog_fetch_uint(in, rec, &v);
+			if (err == NSLOG_NO_ERROR)
+				err = nslog__binlog_fetch(in, rec, v);
+		}
+		return err;
+	case NSLOG_BINLOG_ENTRY:
+		err = nslog__binlog_fetch_uint(in, rec, &v);
+		if (err == NSLOG_NO_ERROR)
+			err = nslog__binlog_fetch_uint(in, rec, &v);
+		if (err == NSLOG_NO_ERROR)
+			err = nslog__binlog_fetch(in, rec, v);
+		return err;
+	default:
+		return NSLOG_PARSE_ERROR;
+	}
+}
+
+nslog_error nslog_binary_decode(FILE *in, FILE *out)
+{
+	struct nslog_binlog_dsite *sites = NULL;
+	size_t nsites = 0, salloc = 0;
+	struct nslog_binlog_record rec = { NULL, 0, 0 };
+	struct nslog_binlog_reader rd;
+	uint8_t header[8];
+	nslog_error err = NSLOG_NO_ERROR;
+	int64_t now = 0;
+
+	if (fread(header, 1, sizeof(header), in) != sizeof(header))
+		return ferror(in) ? NSLOG_IO_ERROR : NSLOG_PARSE_ERROR;
+	if (memcmp(header, "NSLB", 4) != 0 ||
+	    header[4] != NSLOG_BINLOG_VERSION)
+		return NSLOG_PARSE_ERROR;
+
+	/* A record at a time, so a stream still being written is followed */
+	while ((err = nslog__binlog_fetch_record(in, &rec)) == NSLOG_NO_ERROR &&
+	       rec.len > 0) {
+		int kind;
+		uint64_t id;
+
+		rd.data = rec.data;
+		rd.len = rec.len;
+		rd.pos = 0;
+		rd.bad = false;
+		kind = nslog__binlog_get_byte(&rd);
+		id = nslog__binlog_get_uint(&rd);
+
+		if (kind == NSLOG_BINLOG_SITE) {
+			struct nslog_binlog_dsite *site;
+			if (id != nsites) {
+				err = NSLOG_PARSE_ERROR;
+				break;
+			}
+			if (nsites == salloc) {
+				salloc = (salloc == 0) ? 64 : salloc * 2;
+				site = realloc(sites, salloc * sizeof(*sites));
+				if (site == NULL) {
+					err = NSLOG_NO_MEMORY;
+					break;
+				}
+				sites = site;
+			}
+			site = &sites[nsites++];
+			site->level = nslog__binlog_get_byte(&rd);
+			site->lineno = nslog__binlog_get_uint(&rd);
+			site->category = nslog__binlog_get_string(&rd);
+			site->filename = nslog__binlog_get_string(&rd);
+			site->funcname = nslog__binlog_get_string(&rd);
+			site->fmt = nslog__binlog_get_string(&rd);
+		} else {
+			struct nslog_binlog_dsite *site;
+			struct nslog_binlog_reader args;
+			size_t argslen;
+
+			now += nslog__binlog_get_int(&rd);
+			args.data = (const uint8_t *)
+				nslog__binlog_get_bytes(&rd, &argslen);
+			if (rd.bad || id >= nsites) {
+				err = NSLOG_PARSE_ERROR;
+				break;
+			}
+			args.len = argslen;
+			args.pos = 0;
+			args.bad = false;
+			site = &sites[id];
+			fprintf(out, "%lld.%09lld %s %s %s:%d %s: ",
+				(long long)(now / 1000000000),
+				(long long)(now % 1000000000),
+				nslog_short_level_name(site->level),
+				site->category, site->filename, site->lineno,
+				site->funcname);
+			if (!nslog__binlog_render(out, site->fmt, &args))
+				err = NSLOG_PARSE_ERROR;
+			fputc('\n', out);
+		}
+		if (rd.bad)
+			err = NSLOG_PARSE_ERROR;
+		if (err != NSLOG_NO_ERROR)
+			break;
+	}
+
+	if (err == NSLOG_NO_ERROR && ferror(out))
+		err = NSLOG_IO_ERROR;
+
+	nslog__binlog_free_sites(sites, nsites);
+	free(rec.data);
+	return err;
+}
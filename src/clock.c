@@ -0,0 +1,179 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Timestamps
+ */
+
+#include "nslog_internal.h"
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NSLOG_HAVE_TSC 1
+#include <cpuid.h>
+#endif
+
+#ifdef CLOCK_REALTIME_COARSE
+#define NSLOG_REALTIME_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define NSLOG_REALTIME_CLOCK CLOCK_REALTIME
+#endif
+
+static nslog_clock nslog__clock = NSLOG_CLOCK_REALTIME_COARSE;
+
+#ifdef NSLOG_HAVE_TSC
+/* A calibration is never changed once published, so a reader sees all of
+ * one.  Replaced ones are kept until nslog_cleanup(), as readers may still
+ * be using them.
+ */
+struct nslog_tsc_calibration {
+	struct nslog_tsc_calibration *next; /**< Next replaced calibration */
+	uint64_t base_tsc;
+	uint64_t base_ns;
+	double ns_per_tick;
+};
+
+static struct nslog_tsc_calibration *nslog__tsc = NULL;
+static struct nslog_tsc_calibration *nslog__tsc_replaced = NULL;
+#endif
+
+static uint64_t nslog__clock_read(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+uint64_t nslog__monotonic(void)
+{
+	return nslog__clock_read(CLOCK_MONOTONIC);
+}
+
+#ifdef NSLOG_HAVE_TSC
+/**
+ * Whether the TSC ticks at a constant rate through frequency changes and
+ * sleep states, without which it can't be trusted as a clock
+ */
+static bool nslog__tsc_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 ||
+	    eax < 0x80000007)
+		return false;
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx & (1u << 8)) != 0;
+}
+
+static nslog_error nslog__tsc_calibrate(void)
+{
+	struct timespec delay = { 0, 10000000 };
+	uint64_t start_ns, start_tsc, end_ns, end_tsc;
+	struct nslog_tsc_calibration *tsc, *old;
+
+	if (!nslog__tsc_invariant())
+		return NSLOG_NOT_SUPPORTED;
+
+	tsc = malloc(sizeof(*tsc));
+	if (tsc == NULL)
+		return NSLOG_NO_MEMORY;
+
+	start_ns = nslog__clock_read(CLOCK_MONOTONIC);
+	start_tsc = __builtin_ia32_rdtsc();
+	nanosleep(&delay, NULL);
+	end_ns = nslog__clock_read(CLOCK_MONOTONIC);
+	end_tsc = __builtin_ia32_rdtsc();
+
+	tsc->base_tsc = end_tsc;
+	tsc->base_ns = end_ns;
+	tsc->ns_per_tick = (double)(end_ns - start_ns) /
+		(double)(end_tsc - start_tsc);
+
+	old = __atomic_exchange_n(&nslog__tsc, tsc, __ATOMIC_ACQ_REL);
+	if (old != NULL) {
+		old->next = __atomic_load_n(&nslog__tsc_replaced,
+					    __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&nslog__tsc_replaced,
+						    &old->next, old, true,
+						    __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+	}
+	return NSLOG_NO_ERROR;
+}
+#endif
+
+void nslog__clock_cleanup(void)
+{
+#ifdef NSLOG_HAVE_TSC
+	/* The current calibration stays, as logging may carry on */
+	struct nslog_tsc_calibration *tsc =
+		__atomic_exchange_n(&nslog__tsc_replaced, NULL,
+				    __ATOMIC_ACQUIRE);
+	while (tsc != NULL) {
+		struct nslog_tsc_calibration *next = tsc->next;
+		free(tsc);
+		tsc = next;
+	}
+#endif
+}
+
+nslog_error nslog_set_clock(nslog_clock clock)
+{
+	switch (clock) {
+	case NSLOG_CLOCK_REALTIME_COARSE:
+	case NSLOG_CLOCK_MONOTONIC:
+		break;
+	case NSLOG_CLOCK_TSC: {
+#ifdef NSLOG_HAVE_TSC
+		nslog_error err = nslog__tsc_calibrate();
+		if (err != NSLOG_NO_ERROR)
+			return err;
+		break;
+#else
+		return NSLOG_NOT_SUPPORTED;
+#endif
+	}
+	default:
+		return NSLOG_NOT_SUPPORTED;
+	}
+
+	/* Published after the calibration it relies on */
+	__atomic_store_n(&nslog__clock, clock, __ATOMIC_RELEASE);
+	return NSLOG_NO_ERROR;
+}
+
+nslog_clock nslog__timestamp(uint64_t *timestamp)
+{
+	nslog_clock clock = __atomic_load_n(&nslog__clock, __ATOMIC_ACQUIRE);
+
+	switch (clock) {
+	case NSLOG_CLOCK_MONOTONIC:
+		*timestamp = nslog__clock_read(CLOCK_MONOTONIC);
+		break;
+#ifdef NSLOG_HAVE_TSC
+	case NSLOG_CLOCK_TSC: {
+		const struct nslog_tsc_calibration *tsc =
+			__atomic_load_n(&nslog__tsc, __ATOMIC_ACQUIRE);
+		*timestamp = tsc->base_ns + (uint64_t)
+			((double)(int64_t)(__builtin_ia32_rdtsc() -
+					   tsc->base_tsc) *
+			 tsc->ns_per_tick);
+		break;
+	}
+#endif
+	default:
+		*timestamp = nslog__clock_read(NSLOG_REALTIME_CLOCK);
+		break;
+	}
+
+	return clock;
+}
@@ -0,0 +1,402 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Control Socket
+ *
+ * One client is served at a time, which is plenty for an administrative
+ * interface.  Everything happens on the control thread, which only ever
+ * takes the locks the public API takes, so producers are never held up.
+ */
+
+#include "nslog_internal.h"
+
+#ifdef __unix__
+
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/**
+ * The longest command line accepted
+ */
+#define NSLOG_CONTROL_LINE 4096
+
+struct nslog_control_s {
+	char *path;
+	int listen_fd;
+	int wake_fd[2]; /* written to on stop */
+	pthread_t thread;
+	bool running; /* thread was started */
+};
+
+/**
+ * A connected control client
+ */
+struct nslog_control_client {
+	int fd;
+	char line[NSLOG_CONTROL_LINE];
+	size_t used;
+	bool overlong; /* discarding the rest of an overlong line */
+};
+
+static void nslog__control_write(struct nslog_control_client *client,
+				 const char *str, size_t len)
+{
+	while (len > 0 && client->fd != -1) {
+		ssize_t sent = send(client->fd, str, len, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+			/* The client has gone away */
+			close(client->fd);
+			client->fd = -1;
+			return;
+		}
+		str += sent;
+		len -= sent;
+	}
+}
+
+static void nslog__control_send(struct nslog_control_client *client,
+				const char *str)
+{
+	nslog__control_write(client, str, strlen(str));
+}
+
+static void nslog__control_sendf(struct nslog_control_client *client,
+				 const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void nslog__control_sendf(struct nslog_control_client *client,
+				 const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	nslog__control_send(client, buf);
+}
+
+static void nslog__control_category(void *context, nslog_category_t *cat)
+{
+	struct nslog_control_client *client = context;
+
+	nslog__control_send(client, cat->name);
+	nslog__control_send(client, "\n");
+}
+
+/* Entries are written to memory rather than straight to the client, so a
+ * slow client can't hold the history in use
+ */
+static void nslog__control_history(void *context, nslog_entry_t *entry,
+				   const char *msg, size_t len)
+{
+	FILE *out = context;
+	const char *prefix;
+	size_t prefixlen;
+
+	fprintf(out, "%llu.%09llu ",
+		(unsigned long long)(entry->timestamp / 1000000000),
+		(unsigned long long)(entry->timestamp % 1000000000));
+	if (nslog_site_prefix(entry->context, &prefix,
+			      &prefixlen) == NSLOG_NO_ERROR)
+		fwrite(prefix, 1, prefixlen, out);
+	fwrite(msg, 1, len, out);
+	fputc('\n', out);
+}
+
+static void nslog__control_command(struct nslog_control_client *client,
+				   char *line)
+{
+	char *args = line + strcspn(line, " \t");
+
+	if (*args != '\0')
+		*args++ = '\0';
+	args += strspn(args, " \t");
+
+	if (strcmp(line, "filter") == 0) {
+		nslog_filter_t *filter = NULL;
+		nslog_error err = NSLOG_NO_ERROR;
+		if (*args != '\0')
+			err = nslog_filter_from_text(args, &filter);
+		if (err != NSLOG_NO_ERROR) {
+			nslog__control_send(client, "ERR bad filter\n");
+			return;
+		}
+		nslog_filter_set_active(filter, NULL);
+		nslog_filter_unref(filter);
+	} else if (strcmp(line, "levelmap") == 0) {
+		if (nslog_set_level_map(args) != NSLOG_NO_ERROR) {
+			nslog__control_send(client, "ERR bad level map\n");
+			return;
+		}
+	} else if (strcmp(line, "history") == 0) {
+		nslog_filter_t *filter = NULL;
+		char *text = NULL;
+		size_t textlen;
+		FILE *out;
+		if (*args != '\0' &&
+		    nslog_filter_from_text(args, &filter) != NSLOG_NO_ERROR) {
+			nslog__control_send(client, "ERR bad filter\n");
+			return;
+		}
+		out = open_memstream(&text, &textlen);
+		if (out != NULL) {
+			nslog_history_query(filter, 0, 0,
+					    nslog__control_history, out);
+			if (fclose(out) != 0) {
+				free(text);
+				out = NULL;
+			}
+		}
+		nslog_filter_unref(filter);
+		if (out == NULL) {
+			nslog__control_send(client, "ERR no memory\n");
+			return;
+		}
+		nslog__control_write(client, text, textlen);
+		free(text);
+	} else if (strcmp(line, "categories") == 0 && *args == '\0') {
+		nslog_category_foreach(nslog__control_category, client);
+	} else if (strcmp(line, "stats") == 0 && *args == '\0') {
+		nslog_stats_t stats;
+		nslog_get_stats(&stats);
+		nslog__control_sendf(client,
+				     "entries %lu\ngated %lu\n"
+				     "filtered %lu\ndelivered %lu\n",
+				     stats.entries, stats.gated,
+				     stats.filtered, stats.delivered);
+	} else if (strcmp(line, "flush") == 0 && *args == '\0') {
+		nslog_flush();
+	} else if (strcmp(line, "level") == 0 && *args == '\0') {
+		int lvl;
+		for (lvl = NSLOG_LEVEL_DEEPDEBUG;
+		     lvl <= NSLOG_LEVEL_CRITICAL;
+		     lvl++)
+			nslog__control_sendf(client, "%s %s\n",
+					     nslog_level_name(lvl),
+					     nslog_level_enabled(lvl) ?
+					     "on" : "off");
+	} else if (strcmp(line, "level") == 0) {
+		char *state = args + strcspn(args, " \t");
+		nslog_level level;
+		if (*state != '\0')
+			*state++ = '\0';
+		state += strspn(state, " \t");
+		if (!nslog__level_from_name(args, strlen(args), &level)) {
+			nslog__control_send(client, "ERR unknown level\n");
+			return;
+		}
+		if (strcmp(state, "on") == 0) {
+			nslog_set_level_enabled(level, true);
+		} else if (strcmp(state, "off") == 0) {
+			nslog_set_level_enabled(level, false);
+		} else {
+			nslog__control_send(client, "ERR expected on or off\n");
+			return;
+		}
+	} else {
+		nslog__control_send(client, "ERR unknown command\n");
+		return;
+	}
+
+	nslog__control_send(client, "OK\n");
+}
+
+/* Read what the client has sent and run any complete commands */
+static void nslog__control_read(struct nslog_control_client *client)
+{
+	ssize_t got;
+	char *nl;
+
+	got = recv(client->fd, client->line + client->used,
+		   sizeof(client->line) - client->used - 1, 0);
+	if (got <= 0) {
+		if (got == -1 && (errno == EINTR || errno == EAGAIN))
+			return;
+		close(client->fd);
+		client->fd = -1;
+		return;
+	}
+	client->used += got;
+	client->line[client->used] = '\0';
+
+	while (client->fd != -1 &&
+	       (nl = strchr(client->line, '\n')) != NULL) {
+		size_t len = nl - client->line;
+		*nl = '\0';
+		if (len > 0 && client->line[len - 1] == '\r')
+			client->line[len - 1] = '\0';
+		if (client->overlong) {
+			client->overlong = false;
+			nslog__control_send(client, "ERR line too long\n");
+		} else if (client->line[0] != '\0') {
+			nslog__control_command(client, client->line);
+		}
+		client->used -= len + 1;
+		memmove(client->line, nl + 1, client->used + 1);
+	}
+
+	if (client->used == sizeof(client->line) - 1) {
+		/* No end of line in sight, so skip to the next one */
+		client->overlong = true;
+		client->used = 0;
+	}
+}
+
+static void *nslog__control_thread(void *pw)
+{
+	nslog_control_t *control = pw;
+	struct nslog_control_client client = { -1, "", 0, false };
+
+	for (;;) {
+		struct pollfd fds[2] = {
+			{ control->wake_fd[0], POLLIN, 0 },
+			{ -1, POLLIN, 0 },
+		};
+
+		fds[1].fd = (client.fd == -1) ? control->listen_fd : client.fd;
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].revents != 0)
+			break;
+		if (fds[1].revents == 0)
+			continue;
+
+		if (client.fd == -1) {
+			client.fd = accept4(control->listen_fd, NULL, NULL,
+					    SOCK_CLOEXEC);
+			client.used = 0;
+			client.overlong = false;
+		} else {
+			nslog__control_read(&client);
+		}
+	}
+
+	if (client.fd != -1)
+		close(client.fd);
+
+	return NULL;
+}
+
+nslog_error nslog_control_start(const char *path, nslog_control_t **control)
+{
+	struct sockaddr_un addr;
+	nslog_control_t *ret;
+	struct stat st;
+	mode_t mask;
+	int bound = -1;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return NSLOG_IO_ERROR;
+
+	ret = calloc(sizeof(*ret), 1);
+	if (ret == NULL)
+		return NSLOG_NO_MEMORY;
+	ret->listen_fd = ret->wake_fd[0] = ret->wake_fd[1] = -1;
+	ret->path = strdup(path);
+	if (ret->path == NULL) {
+		free(ret);
+		return NSLOG_NO_MEMORY;
+	}
+
+	/* Replace a socket left behind by a previous run, but nothing else */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	ret->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ret->listen_fd != -1) {
+		/* Only the owner may connect, from the moment the socket
+		 * exists
+		 */
+		mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+		bound = bind(ret->listen_fd, (struct sockaddr *)&addr,
+			     sizeof(addr));
+		umask(mask);
+	}
+	if (ret->listen_fd == -1 || bound == -1) {
+		/* Don't remove whatever is at the path */
+		free(ret->path);
+		ret->path = NULL;
+		nslog_control_stop(ret);
+		return NSLOG_IO_ERROR;
+	}
+	if (listen(ret->listen_fd, 4) == -1 ||
+	    pipe2(ret->wake_fd, O_CLOEXEC) == -1) {
+		nslog_control_stop(ret);
+		return NSLOG_IO_ERROR;
+	}
+
+	if (pthread_create(&ret->thread, NULL, nslog__control_thread, ret) != 0) {
+		nslog_control_stop(ret);
+		return NSLOG_NO_MEMORY;
+	}
+	ret->running = true;
+
+	*control = ret;
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_control_stop(nslog_control_t *control)
+{
+	if (control == NULL)
+		return NSLOG_NO_ERROR;
+
+	if (control->running) {
+		while (write(control->wake_fd[1], "", 1) == -1 &&
+		       errno == EINTR)
+			;
+		pthread_join(control->thread, NULL);
+	}
+	if (control->wake_fd[0] != -1)
+		close(control->wake_fd[0]);
+	if (control->wake_fd[1] != -1)
+		close(control->wake_fd[1]);
+	if (control->listen_fd != -1)
+		close(control->listen_fd);
+	if (control->path != NULL) {
+		unlink(control->path);
+		free(control->path);
+	}
+	free(control);
+
+	return NSLOG_NO_ERROR;
+}
+
+#else /* !__unix__ */
+
+nslog_error nslog_control_start(const char *path, nslog_control_t **control)
+{
+	(void)path;
+	(void)control;
+	return NSLOG_NOT_SUPPORTED;
+}
+
+nslog_error nslog_control_stop(nslog_control_t *control)
+{
+	(void)control;
+	return NSLOG_NOT_SUPPORTED;
+}
+
+#endif
@@ -14,19 +14,187 @@
 
 #include "nslog_internal.h"
 
+#include <sched.h>
+#include <pthread.h>
+
 static bool nslog__corked = true;
 
-static struct nslog_cork_chain {
+struct nslog_cork_chain {
 	struct nslog_cork_chain *next;
 	nslog_entry_context_t context;
+	nslog_entry_t entry; /* The entry details, as of being logged */
+	nslog_kv_field_t *fields; /* Structured fields, if kv is set */
+	int nfields;
+	bool kv; /* Whether this is a structured entry */
+	int len; /* The length of the message */
 	char message[0]; /* NUL terminated */
-} *nslog__cork_chain = NULL, *nslog__cork_chain_last = NULL;
+};
+
+/*
+ * A list of corked entries
+ */
+struct nslog_cork_lane {
+	struct nslog_cork_chain *head;
+	struct nslog_cork_chain *tail;
+	struct nslog_cork_chain *written; /* Last written by a signal flush */
+};
+
+/* Entries at or above the priority level are corked in the priority lane,
+ * which is drained first.
+ */
+#define NSLOG_CORK_LANE_PRIORITY 0
+#define NSLOG_CORK_LANE_NORMAL 1
+#define NSLOG_CORK_LANES 2
+
+/*
+ * While corked, each thread appends its entries to its own cork buffer, so
+ * threads logging during startup don't contend.  The buffers are merged by
+ * sequence number when uncorking.
+ */
+static struct nslog_cork_buffer {
+	struct nslog_cork_buffer *next; /* All the buffers, for uncorking */
+	struct nslog_cork_lane lane[NSLOG_CORK_LANES];
+	bool busy; /* The thread is appending an entry */
+} *nslog__cork_buffers = NULL;
+
+static __thread struct nslog_cork_buffer *nslog__cork_buffer = NULL;
+
+/*
+ * nslog_cleanup() frees every thread's buffers but can only forget the
+ * calling thread's pointers to them, so it also moves the generation on.
+ * Other threads' pointers are only trusted if tagged with the current
+ * generation.
+ */
+static unsigned int nslog__generation = 0;
+static __thread unsigned int nslog__cork_buffer_generation = 0;
+static __thread unsigned int nslog__backlog_generation = 0;
+
+/* This thread's cork buffer, if it has one which is still alive */
+static struct nslog_cork_buffer *nslog__thread_cork_buffer(void)
+{
+	if (nslog__cork_buffer_generation !=
+	    __atomic_load_n(&nslog__generation, __ATOMIC_ACQUIRE))
+		nslog__cork_buffer = NULL;
+	return nslog__cork_buffer;
+}
+
+/* The order of entries among all threads */
+static uint64_t nslog__seq = 0;
+
+static nslog_level nslog__priority_level = NSLOG_LEVEL_DEEPDEBUG;
+
+/*
+ * Once uncorked, entries below the backlog level are held back in their
+ * thread's backlog, a ring of the most recent such entries, until an entry
+ * at or above the trigger level is delivered on the same thread.
+ */
+static struct nslog_backlog {
+	struct nslog_backlog *next; /* All the backlogs, for cleanup */
+	struct nslog_cork_chain **ring;
+	unsigned int size; /* The number of slots in the ring */
+	unsigned int start; /* The oldest entry held */
+	unsigned int count; /* The number of entries held */
+	unsigned int config; /* The configuration the entries were held under */
+} *nslog__backlogs = NULL;
+
+static __thread struct nslog_backlog *nslog__backlog = NULL;
+
+/* Moved on by each nslog_set_backlog(), so entries held under an earlier
+ * configuration are discarded rather than delivered
+ */
+static unsigned int nslog__backlog_config = 0;
+
+/* This thread's backlog, if it has one which is still alive */
+static struct nslog_backlog *nslog__thread_backlog(void)
+{
+	if (nslog__backlog_generation !=
+	    __atomic_load_n(&nslog__generation, __ATOMIC_ACQUIRE))
+		nslog__backlog = NULL;
+	return nslog__backlog;
+}
+
+static void nslog__backlog_hold(struct nslog_cork_chain *ent);
+static void nslog__backlog_trigger_check(nslog_entry_context_t *ctx);
+
+static nslog_level nslog__backlog_level = NSLOG_LEVEL_DEEPDEBUG;
+static nslog_level nslog__backlog_trigger = NSLOG_LEVEL_CRITICAL;
+static unsigned int nslog__backlog_entries = 0;
 
 static nslog_callback nslog__cb = NULL;
 static void *nslog__cb_ctx = NULL;
 
+static nslog_kv_callback nslog__kv_cb = NULL;
+static void *nslog__kv_cb_ctx = NULL;
+
+static nslog_entry_callback nslog__entry_cb = NULL;
+static void *nslog__entry_cb_ctx = NULL;
+
+/**
+ * The most message callbacks which may be registered at once
+ */
+#define NSLOG_MESSAGE_CALLBACKS 8
+
+/* The message callbacks, never changed once published: adding or removing
+ * one publishes a new array, or NULL once there are none.
+ */
+struct nslog_message_cbs {
+	int count;
+	struct {
+		nslog_message_callback cb;
+		void *context;
+	} cbs[];
+};
+
+static struct nslog_message_cbs *nslog__message_cbs = NULL;
+
+/**
+ * The number of threads currently delivering to the message callbacks
+ */
+static unsigned int nslog__message_cb_readers = 0;
+
+/* Serialises adding and removing message callbacks */
+static pthread_mutex_t nslog__message_cb_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static nslog_category_t *nslog__all_categories = NULL;
 
+/* One bit per level, set if entries at that level are wanted */
+static unsigned int nslog__level_gates = ~0u;
+
+static nslog_flush_callback nslog__flush_cb = NULL;
+static void *nslog__flush_cb_ctx = NULL;
+
+/*
+ * Each thread counts its entries in statistics of its own, in a slot, and
+ * nslog_get_stats() sums them all, so counting needs neither locks nor
+ * shared writes.  The counts from before the last nslog_cleanup(), which
+ * frees the slots, are kept aside.
+ */
+struct nslog_thread_stats {
+	nslog_slot_t slot;
+	nslog_stats_t stats;
+};
+
+static nslog_stats_t nslog__stats_before_cleanup;
+
+/* Only the owning thread writes its counts, so no read-modify-write is
+ * needed; the store is atomic only so nslog_get_stats() can read it
+ */
+#define NSLOG__COUNT(stat)						\
+	do {								\
+		struct nslog_thread_stats *_ts =			\
+			(struct nslog_thread_stats *)nslog__slot(	\
+				NSLOG_SLOT_STATS,			\
+				sizeof(struct nslog_thread_stats));	\
+		if (_ts != NULL)					\
+			__atomic_store_n(&_ts->stats.stat,		\
+					 _ts->stats.stat + 1,		\
+					 __ATOMIC_RELAXED);		\
+	} while (0)
+
+/* Per-thread scratch space for rendering log messages into */
+static __thread char nslog__scratch[NSLOG_SCRATCH_SIZE];
+static __thread bool nslog__scratch_busy = false;
+
 const char *nslog_level_name(nslog_level level)
 {
 	switch (level) {
@@ -72,57 +240,360 @@ const char *nslog_short_level_name(nslog_level level)
 }
 
 
-static void nslog__normalise_category(nslog_category_t *cat)
+void nslog__normalise_category(nslog_category_t *cat)
 {
-	if (cat->name != NULL)
+	char *name, *expected = NULL;
+	int namelen;
+
+	if (__atomic_load_n(&cat->name, __ATOMIC_ACQUIRE) != NULL)
 		return;
-	if (cat->parent == NULL) {
-		cat->name = strdup(cat->cat_name);
-		cat->namelen = strlen(cat->name);
-	} else {
+	if (cat->parent != NULL)
 		nslog__normalise_category(cat->parent);
-		int bufsz = strlen(cat->parent->name) + strlen(cat->cat_name) + 2 /* a slash and a NUL */;
-		cat->name = malloc(bufsz);
-		snprintf(cat->name, bufsz, "%s/%s", cat->parent->name, cat->cat_name);
-		cat->namelen = bufsz - 1;
+	if (cat->static_name != NULL) {
+		/* Built by the compiler, so there's nothing to allocate */
+		name = (char *)cat->static_name;
+		namelen = strlen(name);
+	} else if (cat->parent == NULL) {
+		name = strdup(cat->cat_name);
+		if (name == NULL)
+			return;
+		namelen = strlen(name);
+	} else {
+		if (cat->parent->name == NULL)
+			return;
+		int bufsz = cat->parent->namelen + strlen(cat->cat_name) + 2 /* a slash and a NUL */;
+		name = malloc(bufsz);
+		if (name == NULL)
+			return;
+		snprintf(name, bufsz, "%s/%s", cat->parent->name, cat->cat_name);
+		namelen = bufsz - 1;
+	}
+
+	/* Several threads may be first to use the category at once; setting
+	 * the name is what makes one of them the one to link it into the
+	 * list, and every thread works out the same length.
+	 */
+	__atomic_store_n(&cat->namelen, namelen, __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&cat->name, &expected, name, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		if (name != cat->static_name)
+			free(name);
+		return;
+	}
+
+	/* Published so the category list can be read on other threads */
+	cat->next = __atomic_load_n(&nslog__all_categories, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&nslog__all_categories, &cat->next,
+					    cat, false, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+void nslog__compute_site(nslog_entry_context_t *ctx)
+{
+	const char *slash;
+	int computed = 0;
+
+	/* Only one thread computes the data, any others wait for it */
+	if (!__atomic_compare_exchange_n(&ctx->site.computed, &computed, 2,
+					 false, __ATOMIC_ACQUIRE,
+					 __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&ctx->site.computed,
+				       __ATOMIC_ACQUIRE) != 1)
+			sched_yield();
+		return;
+	}
+
+	slash = strrchr(ctx->filename, '/');
+
+	if (slash == NULL) {
+		ctx->site.leafoffset = 0;
+		ctx->site.dirnamelen = 0;
+	} else {
+		ctx->site.leafoffset = (slash - ctx->filename) + 1;
+		ctx->site.dirnamelen = slash - ctx->filename;
+	}
+	ctx->site.filenamehash = nslog__hash(ctx->filename, ctx->filenamelen);
+	ctx->site.leafhash = nslog__hash(ctx->filename + ctx->site.leafoffset,
+					 ctx->filenamelen - ctx->site.leafoffset);
+	ctx->site.dirnamehash = nslog__hash(ctx->filename,
+					    ctx->site.dirnamelen);
+	ctx->site.funcnamehash = nslog__hash(ctx->funcname, ctx->funcnamelen);
+	/* Copies of the context are made from here on, and share its prefix */
+	if (ctx->site.origin == NULL)
+		ctx->site.origin = ctx;
+	__atomic_store_n(&ctx->site.computed, 1, __ATOMIC_RELEASE);
+}
+
+/* Start corking an entry on this thread.  Returns false if nslog has been
+ * uncorked, and the entry should be delivered; otherwise the entry must be
+ * corked and then nslog__cork_end() called.
+ */
+static bool nslog__cork_begin(void)
+{
+	struct nslog_cork_buffer *buf = nslog__thread_cork_buffer();
+
+	if (buf == NULL) {
+		buf = calloc(sizeof(*buf), 1);
+		if (buf == NULL) {
+			/* The entry will be dropped */
+			return true;
+		}
+		buf->next = __atomic_load_n(&nslog__cork_buffers,
+					    __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&nslog__cork_buffers,
+						    &buf->next, buf, false,
+						    __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+		nslog__cork_buffer = buf;
+		nslog__cork_buffer_generation =
+			__atomic_load_n(&nslog__generation, __ATOMIC_RELAXED);
+	}
+
+	/* Pairs with nslog_uncork(), which clears nslog__corked and then
+	 * waits for each buffer not to be busy.
+	 */
+	__atomic_store_n(&buf->busy, true, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&nslog__corked, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&buf->busy, false, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	return true;
+}
+
+static void nslog__cork_end(void)
+{
+	struct nslog_cork_buffer *buf = nslog__thread_cork_buffer();
+
+	if (buf != NULL)
+		__atomic_store_n(&buf->busy, false, __ATOMIC_RELEASE);
+}
+
+static void nslog__chain_free(struct nslog_cork_chain *ent)
+{
+	free(ent->fields);
+	free(ent);
+}
+
+/* Give a stored entry its place in the order of entries, and its time */
+static void nslog__chain_stamp(struct nslog_cork_chain *ent)
+{
+	ent->entry.seq = __atomic_fetch_add(&nslog__seq, 1, __ATOMIC_RELAXED);
+	ent->entry.clock = nslog__timestamp(&ent->entry.timestamp);
+}
+
+static void nslog__cork_append(struct nslog_cork_chain *newcork)
+{
+	struct nslog_cork_buffer *buf = nslog__thread_cork_buffer();
+	struct nslog_cork_lane *lane;
+
+	if (buf == NULL) {
+		nslog__chain_free(newcork);
+		return;
+	}
+
+	nslog__chain_stamp(newcork);
+	if (newcork->context.level >=
+	    __atomic_load_n(&nslog__priority_level, __ATOMIC_RELAXED))
+		lane = &buf->lane[NSLOG_CORK_LANE_PRIORITY];
+	else
+		lane = &buf->lane[NSLOG_CORK_LANE_NORMAL];
+	if (lane->head == NULL) {
+		lane->head = lane->tail = newcork;
+	} else {
+		lane->tail->next = newcork;
+		lane->tail = newcork;
+	}
+}
+
+char *nslog__render(nslog_entry_context_t *ctx, int *len,
+		    const char *fmt, va_list args)
+{
+	char *ret;
+	va_list ap;
+	int slen;
+
+	va_copy(ap, args);
+	if (nslog__scratch_busy) {
+		/* Someone further up the stack is using the scratch space */
+		slen = nslog__vformat(ctx, NULL, 0, fmt, ap);
+	} else {
+		slen = nslog__vformat(ctx, nslog__scratch, NSLOG_SCRATCH_SIZE,
+				      fmt, ap);
+		if (slen >= 0 && slen < NSLOG_SCRATCH_SIZE) {
+			va_end(ap);
+			nslog__scratch_busy = true;
+			*len = slen;
+			return nslog__scratch;
+		}
+	}
+	va_end(ap);
+
+	/* Too big for the scratch space, so we have to render it again */
+	if (slen < 0 || (ret = malloc(slen + 1)) == NULL)
+		return NULL;
+	nslog__vformat(ctx, ret, slen + 1, fmt, args);
+	*len = slen;
+	return ret;
+}
+
+void nslog__render_release(char *rendered)
+{
+	if (rendered == nslog__scratch)
+		nslog__scratch_busy = false;
+	else
+		free(rendered);
+}
+
+/* Render an entry and copy it, to be delivered later */
+static struct nslog_cork_chain *nslog__chain_new(nslog_entry_context_t *ctx,
+						 const char *fmt,
+						 va_list args)
+{
+	struct nslog_cork_chain *newcork;
+	int len;
+	char *rendered = nslog__render(ctx, &len, fmt, args);
+
+	if (rendered == NULL)
+		return NULL;
+
+	newcork = calloc(sizeof(struct nslog_cork_chain) + len + 1, 1);
+	if (newcork != NULL) {
+		nslog__context_copy(&newcork->context, ctx);
+		newcork->len = len;
+		memcpy(newcork->message, rendered, len + 1);
 	}
-	cat->next = nslog__all_categories;
-	nslog__all_categories = cat;
+	nslog__render_release(rendered);
+	return newcork;
 }
 
 static void nslog__log_corked(nslog_entry_context_t *ctx,
-			      int measured_len,
 			      const char *fmt,
 			      va_list args)
 {
 	/* If corked, we need to store a copy */
-	struct nslog_cork_chain *newcork = calloc(sizeof(struct nslog_cork_chain) + measured_len + 1, 1);
-	if (newcork == NULL) {
-		/* Wow, something went wrong */
-		return;
+	struct nslog_cork_chain *newcork = nslog__chain_new(ctx, fmt, args);
+
+	if (newcork != NULL)
+		nslog__cork_append(newcork);
+}
+
+static inline bool nslog__have_message_cbs(void)
+{
+	return __atomic_load_n(&nslog__message_cbs, __ATOMIC_RELAXED) != NULL;
+}
+
+/* Whether there is anywhere for unstructured entries to go */
+static inline bool nslog__have_callbacks(void)
+{
+	return nslog__cb != NULL || nslog__entry_cb != NULL ||
+		nslog__have_message_cbs();
+}
+
+static void nslog__deliver_message(nslog_entry_t *entry,
+				   const char *msg,
+				   size_t len)
+{
+	const struct nslog_message_cbs *cbs;
+	int i;
+
+	__atomic_add_fetch(&nslog__message_cb_readers, 1, __ATOMIC_SEQ_CST);
+	cbs = __atomic_load_n(&nslog__message_cbs, __ATOMIC_SEQ_CST);
+	for (i = 0; cbs != NULL && i < cbs->count; i++) {
+		uint64_t start = nslog__sink_begin();
+		(*cbs->cbs[i].cb)(cbs->cbs[i].context, entry, msg, len);
+		NSLOG__SINK_END(NSLOG_SINK_MESSAGE, start, len);
 	}
-	newcork->context = *ctx;
-	vsnprintf(newcork->message, measured_len + 1, fmt, args);
-	if (nslog__cork_chain == NULL) {
-		nslog__cork_chain = nslog__cork_chain_last = newcork;
-	} else {
-		nslog__cork_chain_last->next = newcork;
-		nslog__cork_chain_last = newcork;
+	__atomic_sub_fetch(&nslog__message_cb_readers, 1, __ATOMIC_RELEASE);
+}
+
+/* Deliver an entry to the callbacks which are given the format.  The
+ * render callback is left out if render is false.
+ */
+static void nslog__deliver_printf(nslog_entry_t *entry,
+				  bool render,
+				  const char *fmt,
+				  va_list args)
+{
+	va_list ap;
+	uint64_t start;
+	/* These render the message themselves, so its size isn't known */
+	if (render && nslog__cb != NULL) {
+		start = nslog__sink_begin();
+		va_copy(ap, args);
+		(*nslog__cb)(nslog__cb_ctx, entry->context, fmt, ap);
+		va_end(ap);
+		NSLOG__SINK_END(NSLOG_SINK_RENDER, start, 0);
+	}
+	if (nslog__entry_cb != NULL) {
+		start = nslog__sink_begin();
+		va_copy(ap, args);
+		(*nslog__entry_cb)(nslog__entry_cb_ctx, entry, fmt, ap);
+		va_end(ap);
+		NSLOG__SINK_END(NSLOG_SINK_ENTRY, start, 0);
 	}
 }
 
+static void nslog__deliver(nslog_entry_t *entry,
+			   const char *fmt,
+			   va_list args)
+{
+	NSLOG__COUNT(delivered);
+	if (nslog__have_message_cbs()) {
+		/* Rendered once, however many message callbacks there are */
+		va_list ap;
+		char *rendered;
+		int len;
+		va_copy(ap, args);
+		rendered = nslog__render(entry->context, &len, fmt, ap);
+		va_end(ap);
+		if (rendered != NULL) {
+			nslog__deliver_message(entry, rendered, len);
+			nslog__render_release(rendered);
+		}
+	}
+	nslog__deliver_printf(entry, true, fmt, args);
+}
+
 static void nslog__log_uncorked(nslog_entry_context_t *ctx,
 				const char *fmt,
 				va_list args)
 {
-	/* TODO: Add filtering here */
-	if (nslog__cb != NULL) {
-		if (ctx->category->name == NULL) {
-			nslog__normalise_category(ctx->category);
-		}
-		if (nslog__filter_matches(ctx))
-			(*nslog__cb)(nslog__cb_ctx, ctx, fmt, args);
+	nslog_entry_t entry;
+
+	if (!nslog__have_callbacks())
+		return;
+	if (__atomic_load_n(&ctx->category->name,
+				    __ATOMIC_ACQUIRE) == NULL) {
+		nslog__normalise_category(ctx->category);
+	}
+	if (!nslog__filter_matches(ctx)) {
+		NSLOG__COUNT(filtered);
+		return;
 	}
+	if (ctx->level < __atomic_load_n(&nslog__backlog_level,
+					 __ATOMIC_RELAXED)) {
+		struct nslog_cork_chain *held =
+			nslog__chain_new(ctx, fmt, args);
+		if (held != NULL)
+			nslog__backlog_hold(held);
+		return;
+	}
+	nslog__backlog_trigger_check(ctx);
+
+	entry.context = ctx;
+	entry.timestamp = 0;
+	entry.seq = 0;
+	entry.clock = NSLOG_CLOCK_REALTIME_COARSE;
+	if (nslog__entry_cb != NULL || nslog__have_message_cbs()) {
+		/* Only callbacks given the entry get to see the time */
+		entry.clock = nslog__timestamp(&entry.timestamp);
+		entry.seq = __atomic_fetch_add(&nslog__seq, 1,
+					       __ATOMIC_RELAXED);
+	}
+	nslog__deliver(&entry, fmt, args);
 }
 
 void nslog__log(nslog_entry_context_t *ctx,
@@ -130,18 +601,25 @@ void nslog__log(nslog_entry_context_t *ctx,
 		...)
 {
 	va_list ap;
+	NSLOG__COUNT(entries);
+	if (!(__atomic_load_n(&nslog__level_gates, __ATOMIC_RELAXED) &
+	      (1u << ctx->level))) {
+		NSLOG__COUNT(gated);
+		return;
+	}
+	if (__atomic_load_n(&ctx->site.computed, __ATOMIC_ACQUIRE) != 1) {
+		nslog__compute_site(ctx);
+	}
 	va_start(ap, pattern);
-	if (nslog__corked) {
-		va_list ap2;
-		va_copy(ap2, ap);
-		int slen = vsnprintf(NULL, 0, pattern, ap);
-		va_end(ap);
-		nslog__log_corked(ctx, slen, pattern, ap2);
-		va_end(ap2);
+	nslog__history_record(ctx, pattern, ap);
+	if (__atomic_load_n(&nslog__corked, __ATOMIC_RELAXED) &&
+	    nslog__cork_begin()) {
+		nslog__log_corked(ctx, pattern, ap);
+		nslog__cork_end();
 	} else {
 		nslog__log_uncorked(ctx, pattern, ap);
-		va_end(ap);
 	}
+	va_end(ap);
 }
 
 nslog_error nslog_set_render_callback(nslog_callback cb, void *context)
@@ -152,38 +630,628 @@ nslog_error nslog_set_render_callback(nslog_callback cb, void *context)
 	return NSLOG_NO_ERROR;
 }
 
+nslog_error nslog_set_kv_callback(nslog_kv_callback cb, void *context)
+{
+	nslog__kv_cb = cb;
+	nslog__kv_cb_ctx = context;
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_set_entry_callback(nslog_entry_callback cb, void *context)
+{
+	nslog__entry_cb = cb;
+	nslog__entry_cb_ctx = context;
+
+	return NSLOG_NO_ERROR;
+}
+
+/* Publish a new set of message callbacks, and free the old one once no
+ * delivery can still be using it.  Called with the lock held.
+ */
+static void nslog__message_cbs_publish(struct nslog_message_cbs *cbs)
+{
+	struct nslog_message_cbs *old;
+
+	old = __atomic_exchange_n(&nslog__message_cbs, cbs, __ATOMIC_SEQ_CST);
 
-static void __nslog__deliver_corked_entry(nslog_entry_context_t *ctx,
-					  const char *fmt,
-					  ...)
+	/* Deliveries starting from here see the new set */
+	while (__atomic_load_n(&nslog__message_cb_readers,
+			       __ATOMIC_SEQ_CST) != 0)
+		sched_yield();
+	free(old);
+}
+
+nslog_error nslog_add_message_callback(nslog_message_callback cb,
+				       void *context)
+{
+	struct nslog_message_cbs *old, *cbs;
+	int count;
+
+	pthread_mutex_lock(&nslog__message_cb_lock);
+	old = nslog__message_cbs;
+	count = (old == NULL) ? 0 : old->count;
+	if (count == NSLOG_MESSAGE_CALLBACKS) {
+		pthread_mutex_unlock(&nslog__message_cb_lock);
+		return NSLOG_NO_MEMORY;
+	}
+
+	cbs = malloc(sizeof(*cbs) + (count + 1) * sizeof(cbs->cbs[0]));
+	if (cbs == NULL) {
+		pthread_mutex_unlock(&nslog__message_cb_lock);
+		return NSLOG_NO_MEMORY;
+	}
+	if (count > 0)
+		memcpy(cbs->cbs, old->cbs, count * sizeof(cbs->cbs[0]));
+	cbs->cbs[count].cb = cb;
+	cbs->cbs[count].context = context;
+	cbs->count = count + 1;
+
+	nslog__message_cbs_publish(cbs);
+	pthread_mutex_unlock(&nslog__message_cb_lock);
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_remove_message_callback(nslog_message_callback cb,
+					  void *context)
+{
+	struct nslog_message_cbs *old, *cbs = NULL;
+	int i;
+
+	pthread_mutex_lock(&nslog__message_cb_lock);
+	old = nslog__message_cbs;
+	for (i = 0; old != NULL && i < old->count; i++) {
+		if (old->cbs[i].cb == cb && old->cbs[i].context == context)
+			break;
+	}
+	if (old == NULL || i == old->count) {
+		pthread_mutex_unlock(&nslog__message_cb_lock);
+		return NSLOG_NO_ERROR;
+	}
+
+	if (old->count > 1) {
+		cbs = malloc(sizeof(*cbs) +
+			     (old->count - 1) * sizeof(cbs->cbs[0]));
+		if (cbs == NULL) {
+			pthread_mutex_unlock(&nslog__message_cb_lock);
+			return NSLOG_NO_MEMORY;
+		}
+		memcpy(cbs->cbs, old->cbs, i * sizeof(cbs->cbs[0]));
+		memcpy(&cbs->cbs[i], &old->cbs[i + 1],
+		       (old->count - i - 1) * sizeof(cbs->cbs[0]));
+		cbs->count = old->count - 1;
+	}
+
+	nslog__message_cbs_publish(cbs);
+	pthread_mutex_unlock(&nslog__message_cb_lock);
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_set_level_enabled(nslog_level level, bool enabled)
+{
+	if ((unsigned int)level > NSLOG_LEVEL_CRITICAL)
+		return NSLOG_NOT_SUPPORTED;
+
+	if (enabled)
+		__atomic_or_fetch(&nslog__level_gates, 1u << level,
+				  __ATOMIC_RELAXED);
+	else
+		__atomic_and_fetch(&nslog__level_gates, ~(1u << level),
+				   __ATOMIC_RELAXED);
+
+	return NSLOG_NO_ERROR;
+}
+
+bool nslog_level_enabled(nslog_level level)
+{
+	if ((unsigned int)level > NSLOG_LEVEL_CRITICAL)
+		return false;
+
+	return (__atomic_load_n(&nslog__level_gates, __ATOMIC_RELAXED) &
+		(1u << level)) != 0;
+}
+
+nslog_error nslog_set_flush_callback(nslog_flush_callback cb, void *context)
+{
+	nslog__flush_cb = cb;
+	nslog__flush_cb_ctx = context;
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_flush(void)
+{
+	nslog_flush_callback cb = nslog__flush_cb;
+
+	if (cb != NULL)
+		(*cb)(nslog__flush_cb_ctx);
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_get_stats(nslog_stats_t *stats)
+{
+	nslog_slot_t *slot;
+
+	*stats = nslog__stats_before_cleanup;
+	for (slot = nslog__slots(NSLOG_SLOT_STATS); slot != NULL;
+	     slot = slot->next) {
+		struct nslog_thread_stats *ts =
+			(struct nslog_thread_stats *)slot;
+		stats->entries += __atomic_load_n(&ts->stats.entries,
+						  __ATOMIC_RELAXED);
+		stats->gated += __atomic_load_n(&ts->stats.gated,
+						__ATOMIC_RELAXED);
+		stats->filtered += __atomic_load_n(&ts->stats.filtered,
+						   __ATOMIC_RELAXED);
+		stats->delivered += __atomic_load_n(&ts->stats.delivered,
+						    __ATOMIC_RELAXED);
+	}
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_category_foreach(nslog_category_callback cb, void *context)
+{
+	nslog_category_t *cat;
+
+	for (cat = __atomic_load_n(&nslog__all_categories, __ATOMIC_ACQUIRE);
+	     cat != NULL;
+	     cat = cat->next)
+		(*cb)(context, cat);
+
+	return NSLOG_NO_ERROR;
+}
+
+static void __nslog__deliver_rendered_entry(nslog_entry_t *entry,
+					    bool render,
+					    const char *fmt,
+					    ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	if (nslog__cb != NULL) {
-		(*nslog__cb)(nslog__cb_ctx, ctx, fmt, args);
-	}
+	nslog__deliver_printf(entry, render, fmt, args);
 	va_end(args);
 }
 
-nslog_error nslog_uncork()
+/* Deliver an entry which has already been rendered */
+static void nslog__deliver_rendered(nslog_entry_t *entry,
+				    const char *msg,
+				    size_t len)
+{
+	NSLOG__COUNT(delivered);
+	nslog__deliver_message(entry, msg, len);
+	if (nslog__cb != NULL || nslog__entry_cb != NULL)
+		__nslog__deliver_rendered_entry(entry, true, "%s", msg);
+}
+
+static void nslog__deliver_kv(nslog_entry_t *entry,
+			      const char *msg,
+			      const nslog_kv_field_t *fields,
+			      int nfields)
+{
+	/* The render callback only gets structured entries which have no
+	 * structured callback to go to
+	 */
+	bool render = (nslog__kv_cb == NULL && nslog__cb != NULL);
+	char *rendered;
+	int len;
+
+	if (nslog__kv_cb == NULL && !nslog__have_callbacks())
+		return;
+	NSLOG__COUNT(delivered);
+
+	if (nslog__kv_cb != NULL) {
+		uint64_t start = nslog__sink_begin();
+		(*nslog__kv_cb)(nslog__kv_cb_ctx, entry->context,
+				msg, fields, nfields);
+		NSLOG__SINK_END(NSLOG_SINK_KV, start, 0);
+	}
+	if (!render && nslog__entry_cb == NULL && !nslog__have_message_cbs())
+		return;
+
+	/* Rendered in logfmt once, for all the unstructured callbacks */
+	if (nslog__scratch_busy) {
+		rendered = NULL;
+		len = nslog_kv_render(NULL, 0, NSLOG_KV_FORMAT_LOGFMT,
+				      msg, fields, nfields);
+	} else {
+		rendered = nslog__scratch;
+		len = nslog_kv_render(rendered, NSLOG_SCRATCH_SIZE,
+				      NSLOG_KV_FORMAT_LOGFMT,
+				      msg, fields, nfields);
+	}
+	if (rendered == NULL || len >= NSLOG_SCRATCH_SIZE) {
+		rendered = malloc(len + 1);
+		if (rendered == NULL)
+			return;
+		nslog_kv_render(rendered, len + 1, NSLOG_KV_FORMAT_LOGFMT,
+				msg, fields, nfields);
+	} else {
+		nslog__scratch_busy = true;
+	}
+	nslog__deliver_message(entry, rendered, len);
+	if (render || nslog__entry_cb != NULL)
+		__nslog__deliver_rendered_entry(entry, render, "%s", rendered);
+	nslog__render_release(rendered);
+}
+
+/* Deliver a stored entry */
+static void nslog__chain_deliver(struct nslog_cork_chain *ent)
+{
+	ent->entry.context = &ent->context;
+	if (ent->kv)
+		nslog__deliver_kv(&ent->entry,
+				  ent->message,
+				  ent->fields,
+				  ent->nfields);
+	else
+		nslog__deliver_rendered(&ent->entry,
+					ent->message,
+					ent->len);
+}
+
+/* Drop everything in a backlog */
+static void nslog__backlog_clear(struct nslog_backlog *backlog)
 {
-	if (nslog__corked) {
-		while (nslog__cork_chain != NULL) {
-			struct nslog_cork_chain *ent = nslog__cork_chain;
-			nslog__cork_chain = ent->next;
-			if (ent->context.category->name == NULL) {
-				nslog__normalise_category(ent->context.category);
+	while (backlog->count > 0) {
+		nslog__chain_free(backlog->ring[backlog->start]);
+		backlog->start = (backlog->start + 1) % backlog->size;
+		backlog->count--;
+	}
+	backlog->start = 0;
+}
+
+static void nslog__backlog_hold(struct nslog_cork_chain *ent)
+{
+	struct nslog_backlog *backlog = nslog__thread_backlog();
+	unsigned int config = __atomic_load_n(&nslog__backlog_config,
+					      __ATOMIC_ACQUIRE);
+	unsigned int size = __atomic_load_n(&nslog__backlog_entries,
+					    __ATOMIC_RELAXED);
+
+	if (backlog == NULL) {
+		backlog = calloc(sizeof(*backlog), 1);
+		if (backlog == NULL) {
+			nslog__chain_free(ent);
+			return;
+		}
+		backlog->next = __atomic_load_n(&nslog__backlogs,
+						__ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&nslog__backlogs,
+						    &backlog->next, backlog,
+						    false, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+		nslog__backlog = backlog;
+		nslog__backlog_generation =
+			__atomic_load_n(&nslog__generation, __ATOMIC_RELAXED);
+	}
+	if (backlog->config != config) {
+		/* The backlog has been reconfigured since this thread last
+		 * used it, so start again.
+		 */
+		nslog__backlog_clear(backlog);
+		backlog->config = config;
+	}
+	if (backlog->size != size) {
+		free(backlog->ring);
+		backlog->ring = (size == 0) ? NULL :
+			malloc(size * sizeof(*backlog->ring));
+		backlog->size = (backlog->ring == NULL) ? 0 : size;
+	}
+	if (backlog->size == 0) {
+		nslog__chain_free(ent);
+		return;
+	}
+
+	nslog__chain_stamp(ent);
+	if (backlog->count == backlog->size) {
+		/* Full, so the oldest entry makes way */
+		nslog__chain_free(backlog->ring[backlog->start]);
+		backlog->start = (backlog->start + 1) % backlog->size;
+		backlog->count--;
+	}
+	backlog->ring[(backlog->start + backlog->count) % backlog->size] = ent;
+	backlog->count++;
+}
+
+/* Deliver this thread's backlog, if the entry about to be delivered is at
+ * or above the trigger level
+ */
+static void nslog__backlog_trigger_check(nslog_entry_context_t *ctx)
+{
+	struct nslog_backlog *backlog = nslog__thread_backlog();
+
+	if (backlog == NULL || backlog->count == 0)
+		return;
+	if (backlog->config != __atomic_load_n(&nslog__backlog_config,
+					       __ATOMIC_ACQUIRE)) {
+		/* Held under an earlier configuration, so not wanted */
+		nslog__backlog_clear(backlog);
+		return;
+	}
+	if (ctx->level < __atomic_load_n(&nslog__backlog_trigger,
+					 __ATOMIC_RELAXED))
+		return;
+
+	/* Each entry is taken out before it is delivered, in case a
+	 * callback logs something
+	 */
+	while (backlog->count > 0) {
+		struct nslog_cork_chain *ent = backlog->ring[backlog->start];
+		backlog->start = (backlog->start + 1) % backlog->size;
+		backlog->count--;
+		nslog__chain_deliver(ent);
+		nslog__chain_free(ent);
+	}
+}
+
+nslog_error nslog_set_backlog(nslog_level level, nslog_level trigger,
+			      unsigned int entries)
+{
+	if ((unsigned int)level > NSLOG_LEVEL_CRITICAL ||
+	    (unsigned int)trigger > NSLOG_LEVEL_CRITICAL ||
+	    trigger < level)
+		return NSLOG_NOT_SUPPORTED;
+
+	if (entries == 0)
+		level = NSLOG_LEVEL_DEEPDEBUG;
+	__atomic_store_n(&nslog__backlog_level, NSLOG_LEVEL_DEEPDEBUG,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&nslog__backlog_entries, entries, __ATOMIC_RELAXED);
+	__atomic_store_n(&nslog__backlog_trigger, trigger, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&nslog__backlog_config, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&nslog__backlog_level, level, __ATOMIC_RELEASE);
+
+	/* Other threads discard what they held the next time they log */
+	if (nslog__thread_backlog() != NULL)
+		nslog__backlog_clear(nslog__backlog);
+
+	return NSLOG_NO_ERROR;
+}
+
+/* Copy a structured entry, to be delivered later */
+static struct nslog_cork_chain *
+nslog__kv_chain_new(nslog_entry_context_t *ctx,
+		    const char *msg,
+		    const nslog_kv_field_t *fields,
+		    int nfields)
+{
+	size_t msglen = strlen(msg);
+	size_t fieldsz = nfields * sizeof(nslog_kv_field_t);
+	size_t strsz = 0;
+	struct nslog_cork_chain *newcork;
+	char *strs;
+	int i;
+
+	/* The fields and their strings are copied into one block */
+	for (i = 0; i < nfields; i++) {
+		strsz += strlen(fields[i].key) + 1;
+		if (fields[i].type == NSLOG_KV_TYPE_STRING &&
+		    fields[i].value.s != NULL)
+			strsz += strlen(fields[i].value.s) + 1;
+	}
+
+	newcork = calloc(sizeof(struct nslog_cork_chain) + msglen + 1, 1);
+	if (newcork == NULL)
+		return NULL;
+	if (nfields > 0) {
+		newcork->fields = malloc(fieldsz + strsz);
+		if (newcork->fields == NULL) {
+			free(newcork);
+			return NULL;
+		}
+	}
+	nslog__context_copy(&newcork->context, ctx);
+	newcork->kv = true;
+	newcork->nfields = nfields;
+	memcpy(newcork->message, msg, msglen + 1);
+
+	strs = (char *)newcork->fields + fieldsz;
+	for (i = 0; i < nfields; i++) {
+		size_t len = strlen(fields[i].key) + 1;
+		newcork->fields[i] = fields[i];
+		memcpy(strs, fields[i].key, len);
+		newcork->fields[i].key = strs;
+		strs += len;
+		if (fields[i].type == NSLOG_KV_TYPE_STRING &&
+		    fields[i].value.s != NULL) {
+			len = strlen(fields[i].value.s) + 1;
+			memcpy(strs, fields[i].value.s, len);
+			newcork->fields[i].value.s = strs;
+			strs += len;
+		}
+	}
+
+	return newcork;
+}
+
+void nslog__log_kv(nslog_entry_context_t *ctx,
+		   const char *msg,
+		   const nslog_kv_field_t *fields,
+		   int nfields)
+{
+	nslog_entry_t entry;
+
+	NSLOG__COUNT(entries);
+	if (!(__atomic_load_n(&nslog__level_gates, __ATOMIC_RELAXED) &
+	      (1u << ctx->level))) {
+		NSLOG__COUNT(gated);
+		return;
+	}
+	if (__atomic_load_n(&ctx->site.computed, __ATOMIC_ACQUIRE) != 1) {
+		nslog__compute_site(ctx);
+	}
+	nslog__history_record_kv(ctx, msg, fields, nfields);
+	if (__atomic_load_n(&nslog__corked, __ATOMIC_RELAXED) &&
+	    nslog__cork_begin()) {
+		struct nslog_cork_chain *newcork =
+			nslog__kv_chain_new(ctx, msg, fields, nfields);
+		if (newcork != NULL)
+			nslog__cork_append(newcork);
+		nslog__cork_end();
+		return;
+	}
+	if (nslog__kv_cb == NULL && !nslog__have_callbacks())
+		return;
+	if (__atomic_load_n(&ctx->category->name,
+				    __ATOMIC_ACQUIRE) == NULL) {
+		nslog__normalise_category(ctx->category);
+	}
+	if (!nslog__filter_matches(ctx)) {
+		NSLOG__COUNT(filtered);
+		return;
+	}
+	if (ctx->level < __atomic_load_n(&nslog__backlog_level,
+					 __ATOMIC_RELAXED)) {
+		struct nslog_cork_chain *held =
+			nslog__kv_chain_new(ctx, msg, fields, nfields);
+		if (held != NULL)
+			nslog__backlog_hold(held);
+		return;
+	}
+	nslog__backlog_trigger_check(ctx);
+
+	entry.context = ctx;
+	entry.timestamp = 0;
+	entry.seq = 0;
+	entry.clock = NSLOG_CLOCK_REALTIME_COARSE;
+	if (nslog__entry_cb != NULL || nslog__have_message_cbs()) {
+		entry.clock = nslog__timestamp(&entry.timestamp);
+		entry.seq = __atomic_fetch_add(&nslog__seq, 1,
+					       __ATOMIC_RELAXED);
+	}
+	nslog__deliver_kv(&entry, msg, fields, nfields);
+}
+
+/* Take the earliest corked entry in a lane from all the threads' cork
+ * buffers
+ */
+static struct nslog_cork_chain *nslog__cork_next(int lane)
+{
+	struct nslog_cork_buffer *buf;
+	struct nslog_cork_lane *first = NULL;
+	struct nslog_cork_chain *ent;
+
+	for (buf = nslog__cork_buffers; buf != NULL; buf = buf->next) {
+		struct nslog_cork_lane *l = &buf->lane[lane];
+		if (l->head != NULL &&
+		    (first == NULL || l->head->entry.seq < first->head->entry.seq))
+			first = l;
+	}
+	if (first == NULL)
+		return NULL;
+
+	ent = first->head;
+	first->head = ent->next;
+	if (first->head == NULL)
+		first->tail = NULL;
+	return ent;
+}
+
+/* The next corked entry in a lane not yet written by a signal flush */
+static struct nslog_cork_chain *
+nslog__cork_unwritten(struct nslog_cork_lane *lane)
+{
+	return (lane->written == NULL) ? lane->head : lane->written->next;
+}
+
+bool nslog__cork_write(int fd)
+{
+	struct nslog_cork_buffer *buf;
+	struct nslog_cork_lane *first;
+	struct nslog_cork_chain *ent;
+	bool ok = true;
+	int lane;
+
+	/* Once uncorking has begun the entries belong to nslog_uncork() */
+	if (!__atomic_load_n(&nslog__corked, __ATOMIC_SEQ_CST))
+		return true;
+
+	/* The same merge as nslog__cork_next(), but leaving the entries be */
+	for (lane = 0; lane < NSLOG_CORK_LANES; lane++) {
+		for (;;) {
+			first = NULL;
+			for (buf = __atomic_load_n(&nslog__cork_buffers,
+						   __ATOMIC_ACQUIRE);
+			     buf != NULL;
+			     buf = buf->next) {
+				struct nslog_cork_lane *l = &buf->lane[lane];
+				ent = nslog__cork_unwritten(l);
+				if (ent != NULL &&
+				    (first == NULL ||
+				     ent->entry.seq <
+				     nslog__cork_unwritten(first)->entry.seq))
+					first = l;
 			}
-			if (nslog__filter_matches(&ent->context))
-				__nslog__deliver_corked_entry(&ent->context,
-							      "%s", ent->message);
-			free(ent);
+			if (first == NULL)
+				break;
+
+			ent = nslog__cork_unwritten(first);
+			first->written = ent;
+			if (ok && !nslog__signal_write(fd, &ent->context,
+						       ent->entry.timestamp,
+						       ent->message, NULL))
+				ok = false;
 		}
-		nslog__corked = false;
-		return NSLOG_NO_ERROR;
+	}
+
+	return ok;
+}
+
+nslog_error nslog_set_priority_level(nslog_level level)
+{
+	if ((unsigned int)level > NSLOG_LEVEL_CRITICAL)
+		return NSLOG_NOT_SUPPORTED;
+
+	__atomic_store_n(&nslog__priority_level, level, __ATOMIC_RELAXED);
+
+	return NSLOG_NO_ERROR;
+}
+
+/* Deliver, and then free, an entry from a cork buffer */
+static void nslog__uncork_entry(struct nslog_cork_chain *ent)
+{
+	if (__atomic_load_n(&ent->context.category->name,
+				    __ATOMIC_ACQUIRE) == NULL) {
+		nslog__normalise_category(ent->context.category);
+	}
+	if (!nslog__filter_matches(&ent->context)) {
+		NSLOG__COUNT(filtered);
 	} else {
+		nslog__chain_deliver(ent);
+	}
+	nslog__chain_free(ent);
+}
+
+nslog_error nslog_uncork()
+{
+	struct nslog_cork_buffer *buf;
+	struct nslog_cork_chain *ent;
+	int lane;
+
+	if (!__atomic_exchange_n(&nslog__corked, false, __ATOMIC_SEQ_CST))
 		return NSLOG_UNCORKED;
+
+	/* Let any thread part way through corking an entry finish */
+	for (buf = __atomic_load_n(&nslog__cork_buffers, __ATOMIC_ACQUIRE);
+	     buf != NULL;
+	     buf = buf->next) {
+		while (__atomic_load_n(&buf->busy, __ATOMIC_SEQ_CST))
+			sched_yield();
+	}
+
+	/* The priority lanes are drained first, then the rest */
+	for (lane = 0; lane < NSLOG_CORK_LANES; lane++) {
+		while ((ent = nslog__cork_next(lane)) != NULL) {
+			nslog__uncork_entry(ent);
+		}
 	}
+
+	return NSLOG_NO_ERROR;
 }
 
 void nslog_cleanup()
@@ -191,11 +1259,40 @@ void nslog_cleanup()
 	nslog_category_t *cat = nslog__all_categories;
 	(void)nslog_uncork();
 	(void)nslog_filter_set_active(NULL, NULL);
+	(void)nslog_set_level_map(NULL);
+	(void)nslog_history_stop();
+	(void)nslog_sink_stats_disable();
+	nslog__count_cleanup();
+	nslog__filter_cache_flush();
+	nslog__filter_nodes_release();
+	nslog__prefix_cleanup();
+	nslog__clock_cleanup();
+	/* Uncorked, so the cork buffers are empty and no longer used */
+	while (nslog__cork_buffers != NULL) {
+		struct nslog_cork_buffer *buf = nslog__cork_buffers;
+		nslog__cork_buffers = buf->next;
+		free(buf);
+	}
+	nslog__cork_buffer = NULL;
+	while (nslog__backlogs != NULL) {
+		struct nslog_backlog *backlog = nslog__backlogs;
+		nslog__backlogs = backlog->next;
+		nslog__backlog_clear(backlog);
+		free(backlog->ring);
+		free(backlog);
+	}
+	nslog__backlog = NULL;
+	__atomic_add_fetch(&nslog__generation, 1, __ATOMIC_RELEASE);
+	(void)nslog_get_stats(&nslog__stats_before_cleanup);
+	nslog__slot_cleanup();
+	nslog__all_categories = NULL;
 	while (cat != NULL) {
 		nslog_category_t *nextcat = cat->next;
-		free(cat->name);
+		if (cat->name != cat->static_name)
+			free(cat->name);
 		cat->name = NULL;
 		cat->namelen = 0;
+		cat->levelmap = 0;
 		cat->next = NULL;
 		cat = nextcat;
 	}
@@ -0,0 +1,290 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Event Counting
+ *
+ * Each thread counts events at a site in a counter of its own, which only
+ * it writes, so counting needs neither locks nor atomic read-modify-writes.
+ * The counters are only ever added to, so a summary is the sum of a site's
+ * counters less the sum as of the last summary.
+ *
+ * A thread's counters belong to its counting slot, so when the thread
+ * exits and the slot is taken over, so are the counters, counts and all.
+ * Threads find their counters through a thread-local pointer at each site,
+ * which nslog_cleanup() can't clear, so a site's state while counting
+ * carries the generation of its counters, and a thread only trusts its
+ * pointer while the state it was found in is current.
+ */
+
+#include "nslog_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * A thread's count of events at a site
+ */
+struct nslog_counter_s {
+	struct nslog_counter_s *next; /* The site's next counter */
+	nslog_slot_t *owner; /* The counting slot of the thread counting */
+	uint64_t count;
+};
+
+/* Guards the list of sites and their lists of counters */
+static pthread_mutex_t nslog__count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held while summarising, which mustn't hold the lock above as it logs */
+static pthread_mutex_t nslog__count_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static nslog_count_site_t *nslog__count_sites = NULL;
+static bool nslog__counting = false;
+
+/* When the counts were last summarised */
+static uint64_t nslog__count_last = 0;
+
+/* Moved on as the counters are freed, so threads' pointers to them lapse */
+static unsigned int nslog__count_generation = 0;
+
+/* The thread which summarises the counts periodically */
+static pthread_mutex_t nslog__count_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nslog__count_thread_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t nslog__count_thread;
+static bool nslog__count_thread_running = false;
+static bool nslog__count_thread_stopping = false;
+static uint64_t nslog__count_interval = 0;
+
+/* Work out whether a site's events should be counted */
+static int nslog__count_state(nslog_count_site_t *site)
+{
+	nslog_entry_context_t *ctx = site->context;
+
+	if (!__atomic_load_n(&nslog__counting, __ATOMIC_RELAXED) ||
+	    !nslog_level_enabled(ctx->level))
+		return NSLOG__COUNT_OFF;
+	if (__atomic_load_n(&ctx->site.computed, __ATOMIC_ACQUIRE) != 1)
+		nslog__compute_site(ctx);
+	if (__atomic_load_n(&ctx->category->name,
+				    __ATOMIC_ACQUIRE) == NULL)
+		nslog__normalise_category(ctx->category);
+	if (!nslog__filter_matches(ctx))
+		return NSLOG__COUNT_OFF;
+	return NSLOG__COUNT_ON + (nslog__count_generation & 0xffffff);
+}
+
+/* Work out afresh whether every site's events should be counted */
+static void nslog__count_restate(void)
+{
+	nslog_count_site_t *site;
+
+	pthread_mutex_lock(&nslog__count_lock);
+	for (site = nslog__count_sites; site != NULL; site = site->next)
+		__atomic_store_n(&site->state, nslog__count_state(site),
+				 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&nslog__count_lock);
+}
+
+uint64_t *nslog__count(nslog_count_site_t *site, int *state)
+{
+	struct nslog_counter_s *counter;
+	nslog_slot_t *owner = nslog__slot(NSLOG_SLOT_COUNT, sizeof(*owner));
+
+	*state = NSLOG__COUNT_NEW;
+	if (owner == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&nslog__count_lock);
+	if (site->state == NSLOG__COUNT_NEW) {
+		site->next = nslog__count_sites;
+		nslog__count_sites = site;
+		__atomic_store_n(&site->state, nslog__count_state(site),
+				 __ATOMIC_RELAXED);
+	}
+	if (site->state < NSLOG__COUNT_ON) {
+		pthread_mutex_unlock(&nslog__count_lock);
+		return NULL;
+	}
+
+	for (counter = site->counters; counter != NULL; counter = counter->next)
+		if (counter->owner == owner)
+			break;
+	if (counter == NULL) {
+		counter = calloc(1, sizeof(*counter));
+		if (counter == NULL) {
+			pthread_mutex_unlock(&nslog__count_lock);
+			return NULL;
+		}
+		counter->owner = owner;
+		counter->next = site->counters;
+		site->counters = counter;
+	}
+	__atomic_store_n(&counter->count, counter->count + 1,
+			 __ATOMIC_RELAXED);
+	*state = site->state;
+	pthread_mutex_unlock(&nslog__count_lock);
+
+	return &counter->count;
+}
+
+nslog_error nslog_count_flush(void)
+{
+	nslog_count_site_t *site;
+	uint64_t now, elapsed;
+
+	pthread_mutex_lock(&nslog__count_flush_lock);
+	now = nslog__monotonic();
+	elapsed = now - nslog__count_last;
+	nslog__count_last = now;
+
+	/* Sites are only ever added at the head of the list, so it can be
+	 * walked from the head as it was without the lock.
+	 */
+	pthread_mutex_lock(&nslog__count_lock);
+	site = nslog__count_sites;
+	pthread_mutex_unlock(&nslog__count_lock);
+
+	for (; site != NULL; site = site->next) {
+		struct nslog_counter_s *counter;
+		uint64_t total = 0;
+
+		pthread_mutex_lock(&nslog__count_lock);
+		for (counter = site->counters; counter != NULL;
+		     counter = counter->next)
+			total += __atomic_load_n(&counter->count,
+						 __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&nslog__count_lock);
+
+		if (total == site->reported)
+			continue;
+		nslog__log(site->context, "%s x%llu in the last %llu.%03llus",
+			   site->msg,
+			   (unsigned long long)(total - site->reported),
+			   (unsigned long long)(elapsed / 1000000000),
+			   (unsigned long long)(elapsed / 1000000 % 1000));
+		site->reported = total;
+	}
+
+	nslog__count_restate();
+	pthread_mutex_unlock(&nslog__count_flush_lock);
+
+	return NSLOG_NO_ERROR;
+}
+
+static void *nslog__count_thread_main(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&nslog__count_thread_lock);
+	while (!nslog__count_thread_stopping) {
+		struct timespec deadline;
+		uint64_t ns;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		ns = deadline.tv_nsec + nslog__count_interval;
+		deadline.tv_sec += ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+		while (!nslog__count_thread_stopping &&
+		       pthread_cond_timedwait(&nslog__count_thread_cond,
+					      &nslog__count_thread_lock,
+					      &deadline) != ETIMEDOUT)
+			;
+		if (nslog__count_thread_stopping)
+			break;
+		pthread_mutex_unlock(&nslog__count_thread_lock);
+		nslog_count_flush();
+		pthread_mutex_lock(&nslog__count_thread_lock);
+	}
+	pthread_mutex_unlock(&nslog__count_thread_lock);
+
+	return NULL;
+}
+
+static void nslog__count_thread_stop(void)
+{
+	pthread_mutex_lock(&nslog__count_thread_lock);
+	if (!nslog__count_thread_running) {
+		pthread_mutex_unlock(&nslog__count_thread_lock);
+		return;
+	}
+	nslog__count_thread_stopping = true;
+	pthread_cond_signal(&nslog__count_thread_cond);
+	pthread_mutex_unlock(&nslog__count_thread_lock);
+
+	pthread_join(nslog__count_thread, NULL);
+	nslog__count_thread_running = false;
+	nslog__count_thread_stopping = false;
+}
+
+nslog_error nslog_count_start(uint64_t interval)
+{
+	nslog__count_thread_stop();
+
+	pthread_mutex_lock(&nslog__count_flush_lock);
+	if (!nslog__counting) {
+		nslog__count_last = nslog__monotonic();
+		__atomic_store_n(&nslog__counting, true, __ATOMIC_RELAXED);
+	}
+	nslog__count_restate();
+	pthread_mutex_unlock(&nslog__count_flush_lock);
+
+	if (interval == 0)
+		return NSLOG_NO_ERROR;
+	nslog__count_interval = interval;
+	if (pthread_create(&nslog__count_thread, NULL,
+			   nslog__count_thread_main, NULL) != 0)
+		return NSLOG_NO_MEMORY;
+	nslog__count_thread_running = true;
+
+	return NSLOG_NO_ERROR;
+}
+
+/* Stop counting events, without summarising them */
+static void nslog__count_off(void)
+{
+	nslog__count_thread_stop();
+	pthread_mutex_lock(&nslog__count_flush_lock);
+	__atomic_store_n(&nslog__counting, false, __ATOMIC_RELAXED);
+	nslog__count_restate();
+	pthread_mutex_unlock(&nslog__count_flush_lock);
+}
+
+void nslog__count_cleanup(void)
+{
+	nslog_count_site_t *site;
+
+	nslog__count_off();
+
+	pthread_mutex_lock(&nslog__count_lock);
+	while (nslog__count_sites != NULL) {
+		site = nslog__count_sites;
+		nslog__count_sites = site->next;
+		while (site->counters != NULL) {
+			struct nslog_counter_s *counter = site->counters;
+			site->counters = counter->next;
+			free(counter);
+		}
+		site->reported = 0;
+		site->next = NULL;
+		__atomic_store_n(&site->state, NSLOG__COUNT_NEW,
+				 __ATOMIC_RELAXED);
+	}
+	nslog__count_generation++;
+	pthread_mutex_unlock(&nslog__count_lock);
+}
+
+nslog_error nslog_count_stop(void)
+{
+	nslog__count_thread_stop();
+	nslog_count_flush();
+	nslog__count_off();
+
+	return NSLOG_NO_ERROR;
+}
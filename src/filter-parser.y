@@ -8,23 +8,34 @@
  *
  */
 
-#include "nslog/nslog.h"
+#include "nslog_internal.h"
 #include <assert.h>
 
 #include "filter-parser.h"
 #include "filter-lexer.h"
 
-static void filter_error(YYLTYPE *loc, nslog_filter_t **output, const char *msg)
+static void filter_error(YYLTYPE *loc, yyscan_t scanner,
+			 nslog_filter_t **output, const char *msg)
 {
 	(void)loc;
+	(void)scanner;
 	(void)output;
 	(void)msg;
 }
 
 %}
 
+%code requires {
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+}
+
 %locations
 %pure-parser
+%lex-param { yyscan_t scanner }
+%parse-param { yyscan_t scanner }
 %parse-param { nslog_filter_t **output }
 
 %union {
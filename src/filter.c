@@ -14,6 +14,9 @@
 
 #include "nslog_internal.h"
 
+#include <pthread.h>
+#include <sched.h>
+
 #include "filter-parser.h"
 
 /* Ensure compatability with bison 2.6 and later */
@@ -27,6 +30,9 @@
 
 #include "filter-lexer.h"
 
+/* These values are also the node kinds in the binary form of filters, so
+ * must not be changed.
+ */
 typedef enum {
 	/* Fundamentals */
 	NSLFK_CATEGORY = 0,
@@ -44,10 +50,14 @@ typedef enum {
 struct nslog_filter_s {
 	nslog_filter_kind kind;
 	int refcount;
+	unsigned int intern_hash; /* nslog__filter_node_hash() of this node */
+	nslog_filter_t *intern_next; /* intern chain, or pool free list */
 	union {
 		struct {
 			char *ptr;
 			int len;
+			unsigned int hash; /* nslog__hash() of ptr */
+			bool leaf; /* ptr contains no slashes */
 		} str;
 		nslog_level level;
 		nslog_filter_t *unary_input;
@@ -58,91 +68,390 @@ struct nslog_filter_s {
 	} params;
 };
 
-static nslog_filter_t *nslog__active_filter = NULL;
+/**
+ * The number of filter nodes allocated at a time
+ */
+#define NSLOG_FILTER_SLAB_NODES 64
 
-nslog_error nslog_filter_category_new(const char *catname,
-				      nslog_filter_t **filter)
+/**
+ * A slab of filter nodes
+ */
+struct nslog_filter_slab {
+	struct nslog_filter_slab *next;
+	nslog_filter_t nodes[NSLOG_FILTER_SLAB_NODES];
+};
+
+/**
+ * The filter node pool and intern table
+ *
+ * Every live filter node is interned, so structurally identical filters
+ * are always the same node.  Nodes whose reference count drops to zero
+ * are removed from the table and returned to the pool's free list.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct nslog_filter_slab *slabs;
+	nslog_filter_t *free;
+	nslog_filter_t **buckets;
+	unsigned int nbuckets;
+	unsigned int count;
+} nslog__filter_nodes = {
+	PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL, 0, 0
+};
+
+static unsigned int nslog__filter_node_hash(const nslog_filter_t *filter)
 {
-	nslog_filter_t *ret = calloc(sizeof(*ret), 1);
-	if (ret == NULL)
-		return NSLOG_NO_MEMORY;
-	ret->kind = NSLFK_CATEGORY;
-	ret->refcount = 1;
-	ret->params.str.ptr = strdup(catname);
-	ret->params.str.len = strlen(catname);
-	if (ret->params.str.ptr == NULL) {
-		free(ret);
+	uintptr_t key[3] = { filter->kind, 0, 0 };
+
+	switch (filter->kind) {
+	case NSLFK_CATEGORY:
+	case NSLFK_FILENAME:
+	case NSLFK_DIRNAME:
+	case NSLFK_FUNCNAME:
+		return (filter->params.str.hash ^ filter->kind) * 16777619u;
+	case NSLFK_LEVEL:
+		key[1] = filter->params.level;
+		break;
+	case NSLFK_AND:
+	case NSLFK_OR:
+	case NSLFK_XOR:
+		/* Inputs are interned, so their identity is their structure */
+		key[1] = (uintptr_t)filter->params.binary.input1;
+		key[2] = (uintptr_t)filter->params.binary.input2;
+		break;
+	case NSLFK_NOT:
+		key[1] = (uintptr_t)filter->params.unary_input;
+		break;
+	}
+
+	return nslog__hash((const char *)key, sizeof(key));
+}
+
+static bool nslog__filter_node_equal(const nslog_filter_t *a,
+				     const nslog_filter_t *b)
+{
+	if (a->kind != b->kind)
+		return false;
+
+	switch (a->kind) {
+	case NSLFK_CATEGORY:
+	case NSLFK_FILENAME:
+	case NSLFK_DIRNAME:
+	case NSLFK_FUNCNAME:
+		return (a->params.str.len == b->params.str.len &&
+			memcmp(a->params.str.ptr, b->params.str.ptr,
+			       a->params.str.len) == 0);
+	case NSLFK_LEVEL:
+		return a->params.level == b->params.level;
+	case NSLFK_AND:
+	case NSLFK_OR:
+	case NSLFK_XOR:
+		return (a->params.binary.input1 == b->params.binary.input1 &&
+			a->params.binary.input2 == b->params.binary.input2);
+	case NSLFK_NOT:
+		return a->params.unary_input == b->params.unary_input;
+	}
+
+	return false;
+}
+
+/* Double the intern table.  Must be called with the lock held. */
+static bool nslog__filter_nodes_grow(void)
+{
+	unsigned int nbuckets = (nslog__filter_nodes.nbuckets == 0) ?
+		64 : nslog__filter_nodes.nbuckets * 2;
+	nslog_filter_t **buckets = calloc(nbuckets, sizeof(*buckets));
+	unsigned int i;
+
+	if (buckets == NULL)
+		return false;
+
+	for (i = 0; i < nslog__filter_nodes.nbuckets; i++) {
+		nslog_filter_t *node = nslog__filter_nodes.buckets[i];
+		while (node != NULL) {
+			nslog_filter_t *next = node->intern_next;
+			unsigned int b = node->intern_hash & (nbuckets - 1);
+			node->intern_next = buckets[b];
+			buckets[b] = node;
+			node = next;
+		}
+	}
+
+	free(nslog__filter_nodes.buckets);
+	nslog__filter_nodes.buckets = buckets;
+	nslog__filter_nodes.nbuckets = nbuckets;
+	return true;
+}
+
+/* Take a node from the pool.  Must be called with the lock held. */
+static nslog_filter_t *nslog__filter_node_alloc(void)
+{
+	nslog_filter_t *node;
+
+	if (nslog__filter_nodes.free == NULL) {
+		struct nslog_filter_slab *slab = malloc(sizeof(*slab));
+		int i;
+		if (slab == NULL)
+			return NULL;
+		slab->next = nslog__filter_nodes.slabs;
+		nslog__filter_nodes.slabs = slab;
+		/* Thread the free list so nodes are handed out in order */
+		for (i = NSLOG_FILTER_SLAB_NODES - 1; i >= 0; i--) {
+			slab->nodes[i].intern_next = nslog__filter_nodes.free;
+			nslog__filter_nodes.free = &slab->nodes[i];
+		}
+	}
+
+	node = nslog__filter_nodes.free;
+	nslog__filter_nodes.free = node->intern_next;
+	return node;
+}
+
+/**
+ * Find or create the interned filter node matching a prototype
+ *
+ * If an identical node already exists, a new reference to it is returned.
+ * Otherwise a node is taken from the pool and filled out from the prototype,
+ * copying its string and taking references to its inputs.
+ */
+static nslog_error nslog__filter_intern(const nslog_filter_t *proto,
+					nslog_filter_t **filter)
+{
+	unsigned int hash = nslog__filter_node_hash(proto);
+	nslog_filter_t *node;
+	char *str = NULL;
+
+	switch (proto->kind) {
+	case NSLFK_CATEGORY:
+	case NSLFK_FILENAME:
+	case NSLFK_DIRNAME:
+	case NSLFK_FUNCNAME:
+		/* Copied up front so that no allocation is done locked */
+		str = strndup(proto->params.str.ptr, proto->params.str.len);
+		if (str == NULL)
+			return NSLOG_NO_MEMORY;
+		break;
+	default:
+		break;
+	}
+
+	pthread_mutex_lock(&nslog__filter_nodes.lock);
+
+	if (nslog__filter_nodes.nbuckets > 0) {
+		node = nslog__filter_nodes.buckets[
+			hash & (nslog__filter_nodes.nbuckets - 1)];
+		for (; node != NULL; node = node->intern_next) {
+			if (node->intern_hash == hash &&
+			    nslog__filter_node_equal(node, proto)) {
+				nslog_filter_ref(node);
+				pthread_mutex_unlock(&nslog__filter_nodes.lock);
+				free(str);
+				*filter = node;
+				return NSLOG_NO_ERROR;
+			}
+		}
+	}
+
+	if ((nslog__filter_nodes.count >= nslog__filter_nodes.nbuckets &&
+	     !nslog__filter_nodes_grow()) ||
+	    (node = nslog__filter_node_alloc()) == NULL) {
+		pthread_mutex_unlock(&nslog__filter_nodes.lock);
+		free(str);
 		return NSLOG_NO_MEMORY;
 	}
-	*filter = ret;
+
+	*node = *proto;
+	node->refcount = 1;
+	node->intern_hash = hash;
+	switch (node->kind) {
+	case NSLFK_CATEGORY:
+	case NSLFK_FILENAME:
+	case NSLFK_DIRNAME:
+	case NSLFK_FUNCNAME:
+		node->params.str.ptr = str;
+		break;
+	case NSLFK_AND:
+	case NSLFK_OR:
+	case NSLFK_XOR:
+		nslog_filter_ref(node->params.binary.input1);
+		nslog_filter_ref(node->params.binary.input2);
+		break;
+	case NSLFK_NOT:
+		nslog_filter_ref(node->params.unary_input);
+		break;
+	default:
+		break;
+	}
+	node->intern_next = nslog__filter_nodes.buckets[
+		hash & (nslog__filter_nodes.nbuckets - 1)];
+	nslog__filter_nodes.buckets[hash & (nslog__filter_nodes.nbuckets - 1)] =
+		node;
+	nslog__filter_nodes.count++;
+
+	pthread_mutex_unlock(&nslog__filter_nodes.lock);
+
+	*filter = node;
 	return NSLOG_NO_ERROR;
 }
 
+void nslog__filter_nodes_release(void)
+{
+	pthread_mutex_lock(&nslog__filter_nodes.lock);
+	if (nslog__filter_nodes.count == 0) {
+		while (nslog__filter_nodes.slabs != NULL) {
+			struct nslog_filter_slab *slab =
+				nslog__filter_nodes.slabs;
+			nslog__filter_nodes.slabs = slab->next;
+			free(slab);
+		}
+		free(nslog__filter_nodes.buckets);
+		nslog__filter_nodes.buckets = NULL;
+		nslog__filter_nodes.nbuckets = 0;
+		nslog__filter_nodes.free = NULL;
+	}
+	pthread_mutex_unlock(&nslog__filter_nodes.lock);
+}
+
+static nslog_error nslog__filter_str_new(nslog_filter_kind kind,
+					 const char *str,
+					 size_t len,
+					 nslog_filter_t **filter)
+{
+	nslog_filter_t proto;
+
+	proto.kind = kind;
+	proto.params.str.ptr = (char *)str;
+	proto.params.str.len = len;
+	proto.params.str.hash = nslog__hash(str, len);
+	proto.params.str.leaf = (memchr(str, '/', len) == NULL);
+
+	return nslog__filter_intern(&proto, filter);
+}
+
+static nslog_error nslog__filter_binary_new(nslog_filter_kind kind,
+					    nslog_filter_t *left,
+					    nslog_filter_t *right,
+					    nslog_filter_t **filter)
+{
+	nslog_filter_t proto;
+
+	proto.kind = kind;
+	proto.params.binary.input1 = left;
+	proto.params.binary.input2 = right;
+
+	return nslog__filter_intern(&proto, filter);
+}
+
+static nslog_filter_t *nslog__active_filter = NULL;
+
+/**
+ * A thread which matches against the active filter
+ *
+ * While matching, a thread notes in its matcher (a slot) the filter epoch
+ * it began in, so matching writes nothing shared with other threads.  A
+ * filter retired in epoch E is released once every matcher is either idle
+ * or matching from epoch E onwards, and so can no longer be using it.
+ */
+struct nslog_filter_matcher {
+	nslog_slot_t slot;
+	uint64_t epoch; /* The epoch matching began in, or 0 if idle */
+};
+
+/* The current filter epoch, advanced each time the active filter changes */
+static uint64_t nslog__filter_epoch = 1;
+
+/**
+ * A filter replaced as the active filter, and the epoch it was replaced in
+ */
+struct nslog_retired_filter {
+	nslog_filter_t *filter;
+	uint64_t epoch;
+};
+
+/**
+ * Filters replaced as the active filter, which are released once no
+ * thread can still be matching against them.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct nslog_retired_filter *filters;
+	unsigned int count;
+	unsigned int alloc;
+} nslog__retired_filters = {
+	PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0
+};
+
+/**
+ * An entry in the filter parse cache, holding a reference to the filter
+ * parsed from its text.
+ */
+struct nslog_filter_cache_entry {
+	struct nslog_filter_cache_entry *prev;
+	struct nslog_filter_cache_entry *next;
+	struct nslog_filter_cache_entry *chain; /* hash bucket chain */
+	unsigned int hash; /* nslog__hash() of text */
+	size_t len;
+	nslog_filter_t *filter;
+	char text[0];
+};
+
+/**
+ * The filter parse cache
+ *
+ * Entries are listed most recently used first, for eviction, and are
+ * found by their text through a hash table.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct nslog_filter_cache_entry *head;
+	struct nslog_filter_cache_entry *tail;
+	struct nslog_filter_cache_entry **buckets;
+	unsigned int nbuckets;
+	unsigned int count;
+	unsigned int size;
+	unsigned long hits;
+	unsigned long misses;
+} nslog__filter_cache = {
+	PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL, 0, 0, 0, 0, 0
+};
+
+nslog_error nslog_filter_category_new(const char *catname,
+				      nslog_filter_t **filter)
+{
+	return nslog__filter_str_new(NSLFK_CATEGORY, catname, strlen(catname),
+				     filter);
+}
+
 nslog_error nslog_filter_level_new(nslog_level level,
 				   nslog_filter_t **filter)
 {
-	nslog_filter_t *ret = calloc(sizeof(*ret), 1);
-	if (ret == NULL)
-		return NSLOG_NO_MEMORY;
-	ret->kind = NSLFK_LEVEL;
-	ret->refcount = 1;
-	ret->params.level = level;
-	*filter = ret;
-	return NSLOG_NO_ERROR;
+	nslog_filter_t proto;
+
+	proto.kind = NSLFK_LEVEL;
+	proto.params.level = level;
+
+	return nslog__filter_intern(&proto, filter);
 }
 
 nslog_error nslog_filter_filename_new(const char *filename,
 				      nslog_filter_t **filter)
 {
-	nslog_filter_t *ret = calloc(sizeof(*ret), 1);
-	if (ret == NULL)
-		return NSLOG_NO_MEMORY;
-	ret->kind = NSLFK_FILENAME;
-	ret->refcount = 1;
-	ret->params.str.ptr = strdup(filename);
-	ret->params.str.len = strlen(filename);
-	if (ret->params.str.ptr == NULL) {
-		free(ret);
-		return NSLOG_NO_MEMORY;
-	}
-	*filter = ret;
-	return NSLOG_NO_ERROR;
+	return nslog__filter_str_new(NSLFK_FILENAME, filename, strlen(filename),
+				     filter);
 }
 
 nslog_error nslog_filter_dirname_new(const char *dirname,
 				     nslog_filter_t **filter)
 {
-	nslog_filter_t *ret = calloc(sizeof(*ret), 1);
-	if (ret == NULL)
-		return NSLOG_NO_MEMORY;
-	ret->kind = NSLFK_DIRNAME;
-	ret->refcount = 1;
-	ret->params.str.ptr = strdup(dirname);
-	ret->params.str.len = strlen(dirname);
-	if (ret->params.str.ptr == NULL) {
-		free(ret);
-		return NSLOG_NO_MEMORY;
-	}
-	*filter = ret;
-	return NSLOG_NO_ERROR;
+	return nslog__filter_str_new(NSLFK_DIRNAME, dirname, strlen(dirname),
+				     filter);
 }
 
 nslog_error nslog_filter_funcname_new(const char *funcname,
 				      nslog_filter_t **filter)
 {
-	nslog_filter_t *ret = calloc(sizeof(*ret), 1);
-	if (ret == NULL)
-		return NSLOG_NO_MEMORY;
-	ret->kind = NSLFK_FUNCNAME;
-	ret->refcount = 1;
-	ret->params.str.ptr = strdup(funcname);
-	ret->params.str.len = strlen(funcname);
-	if (ret->params.str.ptr == NULL) {
-		free(ret);
-		return NSLOG_NO_MEMORY;
-	}
-	*filter = ret;
-	return NSLOG_NO_ERROR;
+	return nslog__filter_str_new(NSLFK_FUNCNAME, funcname, strlen(funcname),
+				     filter);
 }
 
 
@@ -150,107 +459,199 @@ nslog_error nslog_filter_and_new(nslog_filter_t *left,
 				 nslog_filter_t *right,
 				 nslog_filter_t **filter)
 {
-	nslog_filter_t *ret = calloc(sizeof(*ret), 1);
-	if (ret == NULL)
-		return NSLOG_NO_MEMORY;
-	ret->kind = NSLFK_AND;
-	ret->refcount = 1;
-	ret->params.binary.input1 = nslog_filter_ref(left);
-	ret->params.binary.input2 = nslog_filter_ref(right);
-	*filter = ret;
-	return NSLOG_NO_ERROR;
+	return nslog__filter_binary_new(NSLFK_AND, left, right, filter);
 }
 
 nslog_error nslog_filter_or_new(nslog_filter_t *left,
 				nslog_filter_t *right,
 				nslog_filter_t **filter)
 {
-	nslog_filter_t *ret = calloc(sizeof(*ret), 1);
-	if (ret == NULL)
-		return NSLOG_NO_MEMORY;
-	ret->kind = NSLFK_OR;
-	ret->refcount = 1;
-	ret->params.binary.input1 = nslog_filter_ref(left);
-	ret->params.binary.input2 = nslog_filter_ref(right);
-	*filter = ret;
-	return NSLOG_NO_ERROR;
+	return nslog__filter_binary_new(NSLFK_OR, left, right, filter);
 }
 
 nslog_error nslog_filter_xor_new(nslog_filter_t *left,
 				 nslog_filter_t *right,
 				 nslog_filter_t **filter)
 {
-	nslog_filter_t *ret = calloc(sizeof(*ret), 1);
-	if (ret == NULL)
-		return NSLOG_NO_MEMORY;
-	ret->kind = NSLFK_XOR;
-	ret->refcount = 1;
-	ret->params.binary.input1 = nslog_filter_ref(left);
-	ret->params.binary.input2 = nslog_filter_ref(right);
-	*filter = ret;
-	return NSLOG_NO_ERROR;
+	return nslog__filter_binary_new(NSLFK_XOR, left, right, filter);
 }
 
 nslog_error nslog_filter_not_new(nslog_filter_t *input,
 				 nslog_filter_t **filter)
 {
-	nslog_filter_t *ret = calloc(sizeof(*ret), 1);
-	if (ret == NULL)
-		return NSLOG_NO_MEMORY;
-	ret->kind = NSLFK_NOT;
-	ret->refcount = 1;
-	ret->params.unary_input = nslog_filter_ref(input);
-	*filter = ret;
-	return NSLOG_NO_ERROR;
+	nslog_filter_t proto;
+
+	proto.kind = NSLFK_NOT;
+	proto.params.unary_input = input;
+
+	return nslog__filter_intern(&proto, filter);
 }
 
 
 nslog_filter_t *nslog_filter_ref(nslog_filter_t *filter)
 {
 	if (filter != NULL)
-		filter->refcount++;
+		__atomic_add_fetch(&filter->refcount, 1, __ATOMIC_RELAXED);
 
 	return filter;
 }
 
 nslog_filter_t *nslog_filter_unref(nslog_filter_t *filter)
 {
-	if (filter != NULL && filter->refcount-- == 1) {
-		switch(filter->kind) {
-		case NSLFK_CATEGORY:
-		case NSLFK_FILENAME:
-		case NSLFK_DIRNAME:
-		case NSLFK_FUNCNAME:
-			free(filter->params.str.ptr);
-			break;
-		case NSLFK_AND:
-		case NSLFK_OR:
-		case NSLFK_XOR:
-			nslog_filter_unref(filter->params.binary.input1);
-			nslog_filter_unref(filter->params.binary.input2);
-			break;
-		case NSLFK_NOT:
-			nslog_filter_unref(filter->params.unary_input);
-			break;
-		default:
-			/* Nothing to do for the other kind(s) */
-			break;
-		}
-		free(filter);
+	nslog_filter_t **pnode;
+	nslog_filter_t dead;
+	int refcount;
+
+	if (filter == NULL)
+		return NULL;
+
+	/* Only the last reference need be dropped with the lock held, so
+	 * that a dying node can't be found in the intern table.
+	 */
+	refcount = __atomic_load_n(&filter->refcount, __ATOMIC_RELAXED);
+	while (refcount > 1) {
+		if (__atomic_compare_exchange_n(&filter->refcount, &refcount,
+						refcount - 1, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			return NULL;
+	}
+
+	pthread_mutex_lock(&nslog__filter_nodes.lock);
+	if (__atomic_sub_fetch(&filter->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+		pthread_mutex_unlock(&nslog__filter_nodes.lock);
+		return NULL;
+	}
+	pnode = &nslog__filter_nodes.buckets[
+		filter->intern_hash & (nslog__filter_nodes.nbuckets - 1)];
+	while (*pnode != filter)
+		pnode = &(*pnode)->intern_next;
+	*pnode = filter->intern_next;
+	nslog__filter_nodes.count--;
+	dead = *filter;
+	filter->intern_next = nslog__filter_nodes.free;
+	nslog__filter_nodes.free = filter;
+	pthread_mutex_unlock(&nslog__filter_nodes.lock);
+
+	switch(dead.kind) {
+	case NSLFK_CATEGORY:
+	case NSLFK_FILENAME:
+	case NSLFK_DIRNAME:
+	case NSLFK_FUNCNAME:
+		free(dead.params.str.ptr);
+		break;
+	case NSLFK_AND:
+	case NSLFK_OR:
+	case NSLFK_XOR:
+		nslog_filter_unref(dead.params.binary.input1);
+		nslog_filter_unref(dead.params.binary.input2);
+		break;
+	case NSLFK_NOT:
+		nslog_filter_unref(dead.params.unary_input);
+		break;
+	default:
+		/* Nothing to do for the other kind(s) */
+		break;
 	}
 
 	return NULL;
 }
 
+/* The epoch the longest-running match began in, or UINT64_MAX if no
+ * thread is matching
+ */
+static uint64_t nslog__filter_oldest_epoch(void)
+{
+	nslog_slot_t *slot;
+	uint64_t oldest = UINT64_MAX;
+
+	for (slot = nslog__slots(NSLOG_SLOT_FILTER); slot != NULL;
+	     slot = slot->next) {
+		struct nslog_filter_matcher *matcher =
+			(struct nslog_filter_matcher *)slot;
+		uint64_t epoch = __atomic_load_n(&matcher->epoch,
+						 __ATOMIC_SEQ_CST);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+
+	return oldest;
+}
+
+/* Free the retired filters which no thread could still be matching
+ * against.  Must be called with the retired filter lock held.
+ */
+static void nslog__filter_reclaim(void)
+{
+	uint64_t oldest = nslog__filter_oldest_epoch();
+	unsigned int i, kept = 0;
+
+	for (i = 0; i < nslog__retired_filters.count; i++) {
+		struct nslog_retired_filter *retired =
+			&nslog__retired_filters.filters[i];
+		if (retired->epoch <= oldest)
+			nslog_filter_unref(retired->filter);
+		else
+			nslog__retired_filters.filters[kept++] = *retired;
+	}
+	nslog__retired_filters.count = kept;
+
+	if (kept == 0) {
+		free(nslog__retired_filters.filters);
+		nslog__retired_filters.filters = NULL;
+		nslog__retired_filters.alloc = 0;
+	}
+}
+
 nslog_error nslog_filter_set_active(nslog_filter_t *filter,
 				    nslog_filter_t **prev)
 {
+	nslog_filter_t *old;
+	uint64_t epoch;
+
+	pthread_mutex_lock(&nslog__retired_filters.lock);
+
+	old = __atomic_exchange_n(&nslog__active_filter,
+				  nslog_filter_ref(filter),
+				  __ATOMIC_SEQ_CST);
+	/* Matching which began from here on can't see the old filter */
+	epoch = __atomic_add_fetch(&nslog__filter_epoch, 1, __ATOMIC_SEQ_CST);
 	if (prev != NULL)
-		*prev = nslog__active_filter;
-	else
-		nslog_filter_unref(nslog__active_filter);
+		*prev = nslog_filter_ref(old);
+
+	if (old != NULL) {
+		/* Other threads may be matching against the old filter, so
+		 * it is only released once they have all moved on.
+		 */
+		if (nslog__retired_filters.count ==
+		    nslog__retired_filters.alloc) {
+			unsigned int alloc = (nslog__retired_filters.alloc == 0)
+				? 4 : nslog__retired_filters.alloc * 2;
+			struct nslog_retired_filter *filters = realloc(
+				nslog__retired_filters.filters,
+				alloc * sizeof(*filters));
+			if (filters == NULL) {
+				/* Nowhere to put it, so wait it out */
+				while (nslog__filter_oldest_epoch() < epoch)
+					sched_yield();
+				nslog_filter_unref(old);
+				old = NULL;
+			} else {
+				nslog__retired_filters.filters = filters;
+				nslog__retired_filters.alloc = alloc;
+			}
+		}
+		if (old != NULL) {
+			struct nslog_retired_filter *retired =
+				&nslog__retired_filters.filters[
+					nslog__retired_filters.count++];
+			retired->filter = old;
+			retired->epoch = epoch;
+		}
+	}
+	nslog__filter_reclaim();
 
-	nslog__active_filter = nslog_filter_ref(filter);
+	pthread_mutex_unlock(&nslog__retired_filters.lock);
 
 	return NSLOG_NO_ERROR;
 }
@@ -274,17 +675,31 @@ static bool _nslog__filter_matches(nslog_entry_context_t *ctx,
 	case NSLFK_FILENAME:
 		if (filter->params.str.len > ctx->filenamelen)
 			return false;
-		if ((filter->params.str.len == ctx->filenamelen) &&
-		    (strcmp(filter->params.str.ptr, ctx->filename) == 0))
-			return true;
+		if (filter->params.str.len == ctx->filenamelen)
+			return ((filter->params.str.hash == ctx->site.filenamehash) &&
+				(strcmp(filter->params.str.ptr, ctx->filename) == 0));
+		if (filter->params.str.leaf) {
+			/* Without slashes, only the leafname can match */
+			if (filter->params.str.len !=
+			    ctx->filenamelen - ctx->site.leafoffset)
+				return false;
+			return ((filter->params.str.hash == ctx->site.leafhash) &&
+				(strcmp(filter->params.str.ptr,
+					ctx->filename + ctx->site.leafoffset) == 0));
+		}
 		if ((ctx->filename[ctx->filenamelen - filter->params.str.len - 1] == '/')
 		    && (strcmp(filter->params.str.ptr,
 			       ctx->filename + ctx->filenamelen - filter->params.str.len) == 0))
 			return true;
 		return false;
 	case NSLFK_DIRNAME:
-		if (filter->params.str.len >= ctx->filenamelen)
+		if (filter->params.str.len > ctx->site.dirnamelen)
 			return false;
+		if (filter->params.str.len == ctx->site.dirnamelen)
+			return ((filter->params.str.hash == ctx->site.dirnamehash) &&
+				(strncmp(filter->params.str.ptr,
+					 ctx->filename,
+					 filter->params.str.len) == 0));
 		if ((ctx->filename[filter->params.str.len] == '/')
 		    && (strncmp(filter->params.str.ptr,
 				ctx->filename,
@@ -293,6 +708,7 @@ static bool _nslog__filter_matches(nslog_entry_context_t *ctx,
 		return false;
 	case NSLFK_FUNCNAME:
 		return (filter->params.str.len == ctx->funcnamelen &&
+			filter->params.str.hash == ctx->site.funcnamehash &&
 			strcmp(ctx->funcname, filter->params.str.ptr) == 0);
 	case NSLFK_AND:
 		return (_nslog__filter_matches(ctx, filter->params.binary.input1)
@@ -315,75 +731,640 @@ static bool _nslog__filter_matches(nslog_entry_context_t *ctx,
 	}
 }
 
+bool nslog__filter_test(nslog_entry_context_t *ctx, nslog_filter_t *filter)
+{
+	return _nslog__filter_matches(ctx, filter);
+}
+
 bool nslog__filter_matches(nslog_entry_context_t *ctx)
 {
-	if (nslog__active_filter == NULL)
+	struct nslog_filter_matcher *matcher;
+	nslog_filter_t *filter;
+	uint64_t epoch;
+	bool ret = true;
+
+	if (!nslog__levelmap_passes(ctx))
+		return false;
+
+	if (__atomic_load_n(&nslog__active_filter, __ATOMIC_RELAXED) == NULL)
+		return true;
+
+	matcher = (struct nslog_filter_matcher *)nslog__slot(
+		NSLOG_SLOT_FILTER, sizeof(*matcher));
+	if (matcher == NULL) {
+		/* Without a matcher the filter can't safely be read */
 		return true;
-	return _nslog__filter_matches(ctx, nslog__active_filter);
+	}
+
+	/* Matching may be nested (from a signal handler, say), in which case
+	 * the outer match's epoch covers it
+	 */
+	epoch = matcher->epoch;
+	if (epoch == 0)
+		__atomic_store_n(&matcher->epoch,
+				 __atomic_load_n(&nslog__filter_epoch,
+						 __ATOMIC_SEQ_CST),
+				 __ATOMIC_SEQ_CST);
+	filter = __atomic_load_n(&nslog__active_filter, __ATOMIC_SEQ_CST);
+	if (filter != NULL)
+		ret = _nslog__filter_matches(ctx, filter);
+	if (epoch == 0)
+		__atomic_store_n(&matcher->epoch, 0, __ATOMIC_RELEASE);
+
+	return ret;
 }
 
-char *nslog_filter_sprintf(nslog_filter_t *filter)
+/**
+ * A growing output buffer for rendering filters
+ */
+struct nslog_filter_buf {
+	char *data;
+	size_t len;
+	size_t alloc;
+	bool failed; /* an allocation failed, the content is incomplete */
+};
+
+static bool nslog__filter_buf_ensure(struct nslog_filter_buf *buf,
+				     size_t extra)
+{
+	if (buf->failed)
+		return false;
+	if (buf->len + extra > buf->alloc) {
+		size_t alloc = (buf->alloc == 0) ? 64 : buf->alloc;
+		char *data;
+		while (alloc < buf->len + extra)
+			alloc *= 2;
+		data = realloc(buf->data, alloc);
+		if (data == NULL) {
+			buf->failed = true;
+			return false;
+		}
+		buf->data = data;
+		buf->alloc = alloc;
+	}
+	return true;
+}
+
+static void nslog__filter_buf_put(struct nslog_filter_buf *buf,
+				  const void *bytes, size_t len)
+{
+	if (nslog__filter_buf_ensure(buf, len)) {
+		memcpy(buf->data + buf->len, bytes, len);
+		buf->len += len;
+	}
+}
+
+static void nslog__filter_buf_puts(struct nslog_filter_buf *buf,
+				   const char *str)
+{
+	nslog__filter_buf_put(buf, str, strlen(str));
+}
+
+static void nslog__filter_buf_put_uint(struct nslog_filter_buf *buf,
+				       uint64_t v)
+{
+	if (!nslog__filter_buf_ensure(buf, 10))
+		return;
+	do {
+		uint8_t b = v & 0x7f;
+		v >>= 7;
+		buf->data[buf->len++] = b | ((v != 0) ? 0x80 : 0);
+	} while (v != 0);
+}
+
+static void nslog__filter_print(struct nslog_filter_buf *out,
+				nslog_filter_t *filter)
 {
-	char *ret = NULL;
 	switch (filter->kind) {
 	case NSLFK_CATEGORY:
-		ret = calloc(filter->params.str.len + 5, 1);
-		sprintf(ret, "cat:%s", filter->params.str.ptr);
+		nslog__filter_buf_puts(out, "cat:");
+		nslog__filter_buf_put(out, filter->params.str.ptr,
+				      filter->params.str.len);
 		break;
-	case NSLFK_LEVEL: {
-		const char *lvl = nslog_level_name(filter->params.level);
-		ret = calloc(strlen(lvl) + 5, 1);
-		sprintf(ret, "lvl:%s", lvl);
+	case NSLFK_LEVEL:
+		nslog__filter_buf_puts(out, "lvl:");
+		nslog__filter_buf_puts(out,
+				       nslog_level_name(filter->params.level));
 		break;
-	}
 	case NSLFK_FILENAME:
-		ret = calloc(filter->params.str.len + 6, 1);
-		sprintf(ret, "file:%s", filter->params.str.ptr);
+		nslog__filter_buf_puts(out, "file:");
+		nslog__filter_buf_put(out, filter->params.str.ptr,
+				      filter->params.str.len);
 		break;
 	case NSLFK_DIRNAME:
-		ret = calloc(filter->params.str.len + 5, 1);
-		sprintf(ret, "dir:%s", filter->params.str.ptr);
+		nslog__filter_buf_puts(out, "dir:");
+		nslog__filter_buf_put(out, filter->params.str.ptr,
+				      filter->params.str.len);
 		break;
 	case NSLFK_FUNCNAME:
-		ret = calloc(filter->params.str.len + 6, 1);
-		sprintf(ret, "func:%s", filter->params.str.ptr);
+		nslog__filter_buf_puts(out, "func:");
+		nslog__filter_buf_put(out, filter->params.str.ptr,
+				      filter->params.str.len);
 		break;
 	case NSLFK_AND:
 	case NSLFK_OR:
-	case NSLFK_XOR: {
-		char *left = nslog_filter_sprintf(filter->params.binary.input1);
-		char *right = nslog_filter_sprintf(filter->params.binary.input2);
-		const char *op =
-			(filter->kind == NSLFK_AND) ? "&&" :
-			(filter->kind == NSLFK_OR) ? "||" : "^";
-		ret = calloc(strlen(left) + strlen(right) + 7, 1);
-		sprintf(ret, "(%s %s %s)", left, op, right);
-		free(left);
-		free(right);
+	case NSLFK_XOR:
+		nslog__filter_buf_puts(out, "(");
+		nslog__filter_print(out, filter->params.binary.input1);
+		nslog__filter_buf_puts(out,
+				       (filter->kind == NSLFK_AND) ? " && " :
+				       (filter->kind == NSLFK_OR) ? " || " :
+				       " ^ ");
+		nslog__filter_print(out, filter->params.binary.input2);
+		nslog__filter_buf_puts(out, ")");
 		break;
-	}
-	case NSLFK_NOT: {
-		char *input = nslog_filter_sprintf(filter->params.unary_input);
-		ret = calloc(strlen(input) + 2, 1);
-		sprintf(ret, "!%s", input);
-		free(input);
+	case NSLFK_NOT:
+		nslog__filter_buf_puts(out, "!");
+		nslog__filter_print(out, filter->params.unary_input);
 		break;
-	}
 	default:
 		assert("Unexpected kind" == NULL);
-		return strdup("***ERROR***");
+		nslog__filter_buf_puts(out, "***ERROR***");
 	}
+}
+
+char *nslog_filter_sprintf(nslog_filter_t *filter)
+{
+	struct nslog_filter_buf out = { NULL, 0, 0, false };
+
+	nslog__filter_print(&out, filter);
+	nslog__filter_buf_put(&out, "", 1);
+	if (out.failed) {
+		free(out.data);
+		return NULL;
+	}
+
+	return out.data;
+}
+
+/*
+ * The binary form of a filter is:
+ *
+ *   "NSLF" version(byte) count(varint) node...
+ *
+ * with the nodes in an order where every node comes after its inputs and
+ * the last node being the filter itself.  Each node is a kind byte then:
+ *
+ *   category, filename, dirname, funcname: length(varint) bytes
+ *   level: level(varint)
+ *   and, or, xor: input1(varint) input2(varint)
+ *   not: input(varint)
+ *
+ * where inputs are given as the distance back from the node to the input,
+ * so one is the node immediately before.  Shared inputs are written once.
+ * Integers are little-endian base-128 varints, as in the binary log.
+ */
+
+#define NSLOG_FILTER_BINARY_VERSION 1
+
+/**
+ * The node indices already written while serialising a filter
+ */
+struct nslog_filter_index {
+	nslog_filter_t **nodes;
+	uint64_t *index;
+	size_t size;
+	size_t count;
+};
+
+static size_t nslog__filter_index_slot(struct nslog_filter_index *idx,
+				       nslog_filter_t *node)
+{
+	size_t slot = ((uintptr_t)node >> 4) * 2654435761u;
+
+	for (slot &= idx->size - 1;
+	     idx->nodes[slot] != NULL && idx->nodes[slot] != node;
+	     slot = (slot + 1) & (idx->size - 1))
+		;
+	return slot;
+}
+
+static bool nslog__filter_index_grow(struct nslog_filter_index *idx)
+{
+	struct nslog_filter_index bigger;
+	size_t i;
+
+	bigger.size = (idx->size == 0) ? 64 : idx->size * 2;
+	bigger.count = idx->count;
+	bigger.nodes = calloc(bigger.size, sizeof(*bigger.nodes));
+	bigger.index = calloc(bigger.size, sizeof(*bigger.index));
+	if (bigger.nodes == NULL || bigger.index == NULL) {
+		free(bigger.nodes);
+		free(bigger.index);
+		return false;
+	}
+	for (i = 0; i < idx->size; i++) {
+		if (idx->nodes[i] != NULL) {
+			size_t slot = nslog__filter_index_slot(&bigger,
+							       idx->nodes[i]);
+			bigger.nodes[slot] = idx->nodes[i];
+			bigger.index[slot] = idx->index[i];
+		}
+	}
+	free(idx->nodes);
+	free(idx->index);
+	*idx = bigger;
+	return true;
+}
+
+/* Write the given node, and any of its inputs not yet written, returning
+ * the node's index.
+ */
+static uint64_t nslog__filter_serialise_node(struct nslog_filter_buf *out,
+					     struct nslog_filter_index *idx,
+					     nslog_filter_t *filter)
+{
+	uint64_t in1 = 0, in2 = 0, ret;
+	size_t slot;
+
+	if (idx->size > 0) {
+		slot = nslog__filter_index_slot(idx, filter);
+		if (idx->nodes[slot] != NULL)
+			return idx->index[slot];
+	}
+
+	switch (filter->kind) {
+	case NSLFK_AND:
+	case NSLFK_OR:
+	case NSLFK_XOR:
+		in1 = nslog__filter_serialise_node(out, idx,
+						   filter->params.binary.input1);
+		in2 = nslog__filter_serialise_node(out, idx,
+						   filter->params.binary.input2);
+		break;
+	case NSLFK_NOT:
+		in1 = nslog__filter_serialise_node(out, idx,
+						   filter->params.unary_input);
+		break;
+	default:
+		break;
+	}
+
+	ret = idx->count;
+	nslog__filter_buf_put(out, (uint8_t[]){ filter->kind }, 1);
+	switch (filter->kind) {
+	case NSLFK_CATEGORY:
+	case NSLFK_FILENAME:
+	case NSLFK_DIRNAME:
+	case NSLFK_FUNCNAME:
+		nslog__filter_buf_put_uint(out, filter->params.str.len);
+		nslog__filter_buf_put(out, filter->params.str.ptr,
+				      filter->params.str.len);
+		break;
+	case NSLFK_LEVEL:
+		nslog__filter_buf_put_uint(out, filter->params.level);
+		break;
+	case NSLFK_AND:
+	case NSLFK_OR:
+	case NSLFK_XOR:
+		nslog__filter_buf_put_uint(out, ret - in1);
+		nslog__filter_buf_put_uint(out, ret - in2);
+		break;
+	case NSLFK_NOT:
+		nslog__filter_buf_put_uint(out, ret - in1);
+		break;
+	}
+
+	if (idx->count >= idx->size / 2 && !nslog__filter_index_grow(idx)) {
+		out->failed = true;
+		return ret;
+	}
+	slot = nslog__filter_index_slot(idx, filter);
+	idx->nodes[slot] = filter;
+	idx->index[slot] = ret;
+	idx->count++;
+
 	return ret;
 }
 
+nslog_error nslog_filter_serialise(nslog_filter_t *filter,
+				   void **data, size_t *len)
+{
+	struct nslog_filter_buf nodes = { NULL, 0, 0, false };
+	struct nslog_filter_buf out = { NULL, 0, 0, false };
+	struct nslog_filter_index idx = { NULL, NULL, 0, 0 };
+
+	nslog__filter_serialise_node(&nodes, &idx, filter);
+	free(idx.nodes);
+	free(idx.index);
+
+	/* The header needs the node count, so is written after the nodes */
+	nslog__filter_buf_puts(&out, "NSLF");
+	nslog__filter_buf_put(&out,
+			      (uint8_t[]){ NSLOG_FILTER_BINARY_VERSION }, 1);
+	nslog__filter_buf_put_uint(&out, idx.count);
+	if (!nodes.failed)
+		nslog__filter_buf_put(&out, nodes.data, nodes.len);
+	free(nodes.data);
+	if (nodes.failed || out.failed) {
+		free(out.data);
+		return NSLOG_NO_MEMORY;
+	}
+
+	*data = out.data;
+	*len = out.len;
+	return NSLOG_NO_ERROR;
+}
+
+/**
+ * A cursor over a filter's binary form
+ */
+struct nslog_filter_reader {
+	const uint8_t *ptr;
+	const uint8_t *end;
+	bool bad; /* ran off the end or read a malformed value */
+};
+
+static uint64_t nslog__filter_get_uint(struct nslog_filter_reader *rd)
+{
+	uint64_t v = 0;
+	int shift;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		uint8_t b;
+		if (rd->ptr >= rd->end)
+			break;
+		b = *rd->ptr++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return v;
+	}
+	rd->bad = true;
+	return 0;
+}
+
+nslog_error nslog_filter_deserialise(const void *data, size_t len,
+				     nslog_filter_t **filter)
+{
+	struct nslog_filter_reader rd = {
+		data, (const uint8_t *)data + len, false
+	};
+	nslog_filter_t **nodes;
+	nslog_error err = NSLOG_NO_ERROR;
+	uint64_t count, i;
+
+	if (len < 5 || memcmp(data, "NSLF", 4) != 0)
+		return NSLOG_PARSE_ERROR;
+	rd.ptr += 4;
+	if (*rd.ptr++ != NSLOG_FILTER_BINARY_VERSION)
+		return NSLOG_NOT_SUPPORTED;
+	count = nslog__filter_get_uint(&rd);
+	/* Every node is at least two bytes */
+	if (rd.bad || count == 0 || count > (uint64_t)(rd.end - rd.ptr) / 2)
+		return NSLOG_PARSE_ERROR;
+
+	nodes = calloc(count, sizeof(*nodes));
+	if (nodes == NULL)
+		return NSLOG_NO_MEMORY;
+
+	for (i = 0; i < count && err == NSLOG_NO_ERROR; i++) {
+		nslog_filter_kind kind;
+		uint64_t in1, in2, n;
+
+		if (rd.ptr >= rd.end) {
+			err = NSLOG_PARSE_ERROR;
+			break;
+		}
+		kind = *rd.ptr++;
+		switch (kind) {
+		case NSLFK_CATEGORY:
+		case NSLFK_FILENAME:
+		case NSLFK_DIRNAME:
+		case NSLFK_FUNCNAME:
+			n = nslog__filter_get_uint(&rd);
+			if (rd.bad || n > (uint64_t)(rd.end - rd.ptr) ||
+			    memchr(rd.ptr, '\0', n) != NULL) {
+				err = NSLOG_PARSE_ERROR;
+				break;
+			}
+			err = nslog__filter_str_new(kind, (const char *)rd.ptr,
+						    n, &nodes[i]);
+			rd.ptr += n;
+			break;
+		case NSLFK_LEVEL:
+			n = nslog__filter_get_uint(&rd);
+			if (rd.bad || n > NSLOG_LEVEL_CRITICAL)
+				err = NSLOG_PARSE_ERROR;
+			else
+				err = nslog_filter_level_new(n, &nodes[i]);
+			break;
+		case NSLFK_AND:
+		case NSLFK_OR:
+		case NSLFK_XOR:
+			in1 = nslog__filter_get_uint(&rd);
+			in2 = nslog__filter_get_uint(&rd);
+			if (rd.bad || in1 == 0 || in1 > i || in2 == 0 || in2 > i)
+				err = NSLOG_PARSE_ERROR;
+			else
+				err = nslog__filter_binary_new(kind,
+							       nodes[i - in1],
+							       nodes[i - in2],
+							       &nodes[i]);
+			break;
+		case NSLFK_NOT:
+			in1 = nslog__filter_get_uint(&rd);
+			if (rd.bad || in1 == 0 || in1 > i)
+				err = NSLOG_PARSE_ERROR;
+			else
+				err = nslog_filter_not_new(nodes[i - in1],
+							   &nodes[i]);
+			break;
+		default:
+			err = NSLOG_PARSE_ERROR;
+		}
+	}
+
+	if (err == NSLOG_NO_ERROR && rd.ptr != rd.end)
+		err = NSLOG_PARSE_ERROR;
+	if (err == NSLOG_NO_ERROR)
+		*filter = nslog_filter_ref(nodes[count - 1]);
+	for (i = 0; i < count; i++)
+		nslog_filter_unref(nodes[i]);
+	free(nodes);
+
+	return err;
+}
+
 nslog_error nslog_filter_from_text(const char *input,
 				   nslog_filter_t **output)
 {
+	return nslog_filter_from_buffer(input, strlen(input), output);
+}
+
+static void nslog__filter_cache_unlink(struct nslog_filter_cache_entry *ent)
+{
+	if (ent->prev != NULL)
+		ent->prev->next = ent->next;
+	else
+		nslog__filter_cache.head = ent->next;
+	if (ent->next != NULL)
+		ent->next->prev = ent->prev;
+	else
+		nslog__filter_cache.tail = ent->prev;
+	nslog__filter_cache.count--;
+}
+
+static void nslog__filter_cache_push(struct nslog_filter_cache_entry *ent)
+{
+	ent->prev = NULL;
+	ent->next = nslog__filter_cache.head;
+	if (ent->next != NULL)
+		ent->next->prev = ent;
+	else
+		nslog__filter_cache.tail = ent;
+	nslog__filter_cache.head = ent;
+	nslog__filter_cache.count++;
+}
+
+/* Double the cache's hash table.  Must be called with the cache lock
+ * held.
+ */
+static bool nslog__filter_cache_grow(void)
+{
+	unsigned int nbuckets = (nslog__filter_cache.nbuckets == 0) ?
+		16 : nslog__filter_cache.nbuckets * 2;
+	struct nslog_filter_cache_entry **buckets;
+	struct nslog_filter_cache_entry *ent;
+
+	buckets = calloc(nbuckets, sizeof(*buckets));
+	if (buckets == NULL)
+		return false;
+
+	for (ent = nslog__filter_cache.head; ent != NULL; ent = ent->next) {
+		unsigned int b = ent->hash & (nbuckets - 1);
+		ent->chain = buckets[b];
+		buckets[b] = ent;
+	}
+
+	free(nslog__filter_cache.buckets);
+	nslog__filter_cache.buckets = buckets;
+	nslog__filter_cache.nbuckets = nbuckets;
+	return true;
+}
+
+/* Add an entry to the cache, as the most recently used.  Must be called
+ * with the cache lock held.
+ */
+static bool nslog__filter_cache_add(struct nslog_filter_cache_entry *ent)
+{
+	struct nslog_filter_cache_entry **bucket;
+
+	if (nslog__filter_cache.count >= nslog__filter_cache.nbuckets &&
+	    !nslog__filter_cache_grow() && nslog__filter_cache.nbuckets == 0)
+		return false;
+
+	bucket = &nslog__filter_cache.buckets[
+		ent->hash & (nslog__filter_cache.nbuckets - 1)];
+	ent->chain = *bucket;
+	*bucket = ent;
+	nslog__filter_cache_push(ent);
+	return true;
+}
+
+/* Remove an entry from the cache.  Must be called with the cache lock
+ * held.
+ */
+static void nslog__filter_cache_remove(struct nslog_filter_cache_entry *ent)
+{
+	struct nslog_filter_cache_entry **pent;
+
+	pent = &nslog__filter_cache.buckets[
+		ent->hash & (nslog__filter_cache.nbuckets - 1)];
+	while (*pent != ent)
+		pent = &(*pent)->chain;
+	*pent = ent->chain;
+	nslog__filter_cache_unlink(ent);
+}
+
+/* Evict least recently used entries until at most size remain.
+ * Must be called with the cache lock held.
+ */
+static void nslog__filter_cache_trim(unsigned int size)
+{
+	while (nslog__filter_cache.count > size) {
+		struct nslog_filter_cache_entry *ent = nslog__filter_cache.tail;
+		nslog__filter_cache_remove(ent);
+		nslog_filter_unref(ent->filter);
+		free(ent);
+	}
+
+	if (size == 0) {
+		free(nslog__filter_cache.buckets);
+		nslog__filter_cache.buckets = NULL;
+		nslog__filter_cache.nbuckets = 0;
+	}
+}
+
+/* Find the cached filter for the given text, if any, and return a new
+ * reference to it.  Must be called with the cache lock held.
+ */
+static nslog_filter_t *nslog__filter_cache_find(const char *input,
+						size_t len,
+						unsigned int hash)
+{
+	struct nslog_filter_cache_entry *ent;
+
+	if (nslog__filter_cache.nbuckets == 0)
+		return NULL;
+
+	for (ent = nslog__filter_cache.buckets[
+		     hash & (nslog__filter_cache.nbuckets - 1)];
+	     ent != NULL; ent = ent->chain) {
+		if (ent->hash == hash && ent->len == len &&
+		    memcmp(ent->text, input, len) == 0) {
+			if (ent != nslog__filter_cache.head) {
+				nslog__filter_cache_unlink(ent);
+				nslog__filter_cache_push(ent);
+			}
+			return nslog_filter_ref(ent->filter);
+		}
+	}
+
+	return NULL;
+}
+
+nslog_error nslog_filter_cache_set_size(unsigned int entries)
+{
+	pthread_mutex_lock(&nslog__filter_cache.lock);
+	nslog__filter_cache.size = entries;
+	nslog__filter_cache_trim(entries);
+	pthread_mutex_unlock(&nslog__filter_cache.lock);
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_filter_cache_stats(unsigned long *hits,
+				     unsigned long *misses)
+{
+	pthread_mutex_lock(&nslog__filter_cache.lock);
+	if (hits != NULL)
+		*hits = nslog__filter_cache.hits;
+	if (misses != NULL)
+		*misses = nslog__filter_cache.misses;
+	pthread_mutex_unlock(&nslog__filter_cache.lock);
+
+	return NSLOG_NO_ERROR;
+}
+
+void nslog__filter_cache_flush(void)
+{
+	pthread_mutex_lock(&nslog__filter_cache.lock);
+	nslog__filter_cache_trim(0);
+	pthread_mutex_unlock(&nslog__filter_cache.lock);
+}
+
+static nslog_error nslog__filter_parse(const char *input,
+				       size_t len,
+				       nslog_filter_t **output)
+{
+	struct nslog_filter_input in = { input, len };
+	yyscan_t scanner;
 	int ret;
-	YY_BUFFER_STATE buffer = filter__scan_string((char *)input);
-	filter_push_buffer_state(buffer);
-	ret = filter_parse(output);
-	filter_lex_destroy();
+
+	if (filter_lex_init_extra(&in, &scanner) != 0)
+		return NSLOG_NO_MEMORY;
+	ret = filter_parse(scanner, output);
+	filter_lex_destroy(scanner);
 	switch (ret) {
 	case 0:
 		return NSLOG_NO_ERROR;
@@ -392,3 +1373,62 @@ nslog_error nslog_filter_from_text(const char *input,
 	}
 	return NSLOG_PARSE_ERROR;
 }
+
+nslog_error nslog_filter_from_buffer(const char *input,
+				     size_t len,
+				     nslog_filter_t **output)
+{
+	struct nslog_filter_cache_entry *ent;
+	nslog_filter_t *filter;
+	unsigned int hash;
+	nslog_error err;
+
+	if (__atomic_load_n(&nslog__filter_cache.size, __ATOMIC_RELAXED) == 0)
+		return nslog__filter_parse(input, len, output);
+
+	hash = nslog__hash(input, len);
+	pthread_mutex_lock(&nslog__filter_cache.lock);
+	filter = nslog__filter_cache_find(input, len, hash);
+	if (filter != NULL)
+		nslog__filter_cache.hits++;
+	else
+		nslog__filter_cache.misses++;
+	pthread_mutex_unlock(&nslog__filter_cache.lock);
+	if (filter != NULL) {
+		*output = filter;
+		return NSLOG_NO_ERROR;
+	}
+
+	/* Parse without the lock held so other threads aren't held up */
+	err = nslog__filter_parse(input, len, &filter);
+	if (err != NSLOG_NO_ERROR)
+		return err;
+
+	ent = malloc(sizeof(*ent) + len);
+	if (ent != NULL) {
+		ent->hash = hash;
+		ent->len = len;
+		memcpy(ent->text, input, len);
+		pthread_mutex_lock(&nslog__filter_cache.lock);
+		/* Another thread may have cached this text while we parsed */
+		*output = nslog__filter_cache_find(input, len, hash);
+		if (*output == NULL && nslog__filter_cache.size > 0) {
+			ent->filter = filter;
+			if (nslog__filter_cache_add(ent)) {
+				nslog_filter_ref(filter);
+				nslog__filter_cache_trim(
+					nslog__filter_cache.size);
+				ent = NULL;
+			}
+		}
+		pthread_mutex_unlock(&nslog__filter_cache.lock);
+		free(ent);
+		if (*output != NULL) {
+			nslog_filter_unref(filter);
+			return NSLOG_NO_ERROR;
+		}
+	}
+
+	*output = filter;
+	return NSLOG_NO_ERROR;
+}
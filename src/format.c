@@ -0,0 +1,218 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Message Formatting
+ *
+ * Most log messages use only a handful of conversions, with no flags or
+ * field widths, and for those the C library's vsnprintf() spends more time
+ * working out what to do than doing it.  This formats those directly, and
+ * hands anything else back to the C library.
+ */
+
+#include "nslog_internal.h"
+
+#include <limits.h>
+#include <sys/types.h>
+
+/**
+ * A buffer being formatted into, which counts what doesn't fit
+ */
+struct nslog_format_out {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static inline void nslog__format_put(struct nslog_format_out *out,
+				     const char *str, size_t len)
+{
+	if (out->len < out->size) {
+		size_t room = out->size - out->len;
+		memcpy(out->buf + out->len, str, (len < room) ? len : room);
+	}
+	out->len += len;
+}
+
+static void nslog__format_unsigned(struct nslog_format_out *out,
+				   unsigned long long value, bool negative,
+				   unsigned int base, const char *digits)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = digits[value % base];
+		value /= base;
+	} while (value != 0);
+	if (negative)
+		*--p = '-';
+	nslog__format_put(out, p, tmp + sizeof(tmp) - p);
+}
+
+static void nslog__format_signed(struct nslog_format_out *out,
+				 long long value)
+{
+	unsigned long long mag = (unsigned long long)value;
+
+	if (value < 0)
+		mag = -mag;
+	nslog__format_unsigned(out, mag, value < 0, 10, "0123456789");
+}
+
+/**
+ * Format a message, if it can be done without the C library
+ *
+ * \return NSLOG_FORMAT_FAST if the message was formatted,
+ *         NSLOG_FORMAT_LIBC if the format string needs the C library, or
+ *         NSLOG_FORMAT_UNKNOWN if only these arguments do (a NULL string,
+ *         whose rendering is up to the C library)
+ */
+static int nslog__format(char *buf, size_t size, int *len,
+			 const char *fmt, va_list args)
+{
+	struct nslog_format_out out = { buf, size, 0 };
+	const char *p;
+
+	while ((p = strchr(fmt, '%')) != NULL) {
+		enum { MOD_NONE, MOD_L, MOD_LL, MOD_Z } mod = MOD_NONE;
+		bool star_prec = false;
+
+		nslog__format_put(&out, fmt, p - fmt);
+		p++;
+
+		if (p[0] == '.' && p[1] == '*' && p[2] == 's') {
+			star_prec = true;
+			p += 2;
+		} else if (p[0] == 'l' && p[1] == 'l') {
+			mod = MOD_LL;
+			p += 2;
+		} else if (p[0] == 'l') {
+			mod = MOD_L;
+			p++;
+		} else if (p[0] == 'z') {
+			mod = MOD_Z;
+			p++;
+		}
+
+		switch (*p) {
+		case 'd':
+		case 'i': {
+			long long value;
+			if (mod == MOD_LL)
+				value = va_arg(args, long long);
+			else if (mod == MOD_L)
+				value = va_arg(args, long);
+			else if (mod == MOD_Z)
+				value = va_arg(args, ssize_t);
+			else
+				value = va_arg(args, int);
+			nslog__format_signed(&out, value);
+			break;
+		}
+		case 'u':
+		case 'x':
+		case 'X': {
+			unsigned long long value;
+			if (mod == MOD_LL)
+				value = va_arg(args, unsigned long long);
+			else if (mod == MOD_L)
+				value = va_arg(args, unsigned long);
+			else if (mod == MOD_Z)
+				value = va_arg(args, size_t);
+			else
+				value = va_arg(args, unsigned int);
+			if (*p == 'u')
+				nslog__format_unsigned(&out, value, false, 10,
+						       "0123456789");
+			else
+				nslog__format_unsigned(&out, value, false, 16,
+						       (*p == 'x') ?
+						       "0123456789abcdef" :
+						       "0123456789ABCDEF");
+			break;
+		}
+		case 'c': {
+			char c;
+			if (mod != MOD_NONE)
+				return NSLOG_FORMAT_LIBC;
+			c = (char)va_arg(args, int);
+			nslog__format_put(&out, &c, 1);
+			break;
+		}
+		case 's': {
+			int prec = star_prec ? va_arg(args, int) : -1;
+			const char *str;
+			if (mod != MOD_NONE)
+				return NSLOG_FORMAT_LIBC;
+			str = va_arg(args, const char *);
+			if (str == NULL) {
+				/* The C library decides how to show this */
+				return NSLOG_FORMAT_UNKNOWN;
+			}
+			nslog__format_put(&out, str,
+					  (prec < 0) ? strlen(str) :
+					  strnlen(str, prec));
+			break;
+		}
+		case 'p': {
+			void *ptr;
+			if (mod != MOD_NONE)
+				return NSLOG_FORMAT_LIBC;
+			ptr = va_arg(args, void *);
+			if (ptr == NULL)
+				return NSLOG_FORMAT_UNKNOWN;
+			nslog__format_put(&out, "0x", 2);
+			nslog__format_unsigned(&out, (uintptr_t)ptr, false, 16,
+					       "0123456789abcdef");
+			break;
+		}
+		case '%':
+			if (mod != MOD_NONE)
+				return NSLOG_FORMAT_LIBC;
+			nslog__format_put(&out, "%", 1);
+			break;
+		default:
+			/* Flags, widths, floating point, and so on */
+			return NSLOG_FORMAT_LIBC;
+		}
+		fmt = p + 1;
+	}
+	nslog__format_put(&out, fmt, strlen(fmt));
+
+	if (out.len > INT_MAX)
+		return NSLOG_FORMAT_UNKNOWN;
+	if (size > 0)
+		buf[(out.len < size) ? out.len : size - 1] = '\0';
+	*len = out.len;
+	return NSLOG_FORMAT_FAST;
+}
+
+int nslog__vformat(nslog_entry_context_t *ctx, char *buf, size_t size,
+		   const char *fmt, va_list args)
+{
+	int state = __atomic_load_n(&ctx->site.format, __ATOMIC_RELAXED);
+	int len;
+
+	if (state != NSLOG_FORMAT_LIBC) {
+		va_list ap;
+		int result;
+		va_copy(ap, args);
+		result = nslog__format(buf, size, &len, fmt, ap);
+		va_end(ap);
+		if (result != state && result != NSLOG_FORMAT_UNKNOWN)
+			__atomic_store_n(&ctx->site.format, result,
+					 __ATOMIC_RELAXED);
+		if (result == NSLOG_FORMAT_FAST)
+			return len;
+	}
+
+	return vsnprintf(buf, size, fmt, args);
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Recent History
+ *
+ * The history is a ring of fixed size slots, each holding an entry's
+ * context and its message rendered (and truncated if need be) straight into
+ * the slot.  Writers claim slots with a single atomic add and never wait
+ * for queries; a query copies each slot out and checks that it wasn't
+ * rewritten while it was being copied.  A writer only waits when the ring
+ * has come round to a slot whose writer from the last lap hasn't finished
+ * with it, so no slot ever has two writers.
+ */
+
+#include "nslog_internal.h"
+
+#include <sched.h>
+
+/**
+ * A slot in the history ring
+ */
+struct nslog_history_slot {
+	uint64_t seq; /* One more than the entry's sequence, once written */
+	nslog_entry_context_t context;
+	uint64_t timestamp;
+	nslog_clock clock;
+	size_t len;
+	char msg[0]; /* msgsize + 1 bytes, NUL terminated */
+};
+
+struct nslog_history {
+	unsigned int entries;
+	size_t msgsize;
+	size_t stride; /* The size of each slot */
+	uint64_t head; /* Next sequence to claim */
+	char slots[0];
+};
+
+static struct nslog_history *nslog__history = NULL;
+
+/**
+ * The number of threads currently writing to or querying the history
+ */
+static unsigned int nslog__history_users = 0;
+
+static inline struct nslog_history_slot *
+nslog__history_slot(struct nslog_history *history, uint64_t seq)
+{
+	return (struct nslog_history_slot *)
+		(history->slots + (seq % history->entries) * history->stride);
+}
+
+/* Start using the history, returning NULL if there isn't one */
+static struct nslog_history *nslog__history_get(void)
+{
+	struct nslog_history *history;
+
+	if (__atomic_load_n(&nslog__history, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+	__atomic_add_fetch(&nslog__history_users, 1, __ATOMIC_SEQ_CST);
+	history = __atomic_load_n(&nslog__history, __ATOMIC_SEQ_CST);
+	if (history == NULL)
+		__atomic_sub_fetch(&nslog__history_users, 1, __ATOMIC_RELEASE);
+	return history;
+}
+
+static void nslog__history_put(void)
+{
+	__atomic_sub_fetch(&nslog__history_users, 1, __ATOMIC_RELEASE);
+}
+
+/* Claim the next slot, ready for its message to be written */
+static struct nslog_history_slot *
+nslog__history_claim(struct nslog_history *history,
+		     nslog_entry_context_t *ctx, uint64_t *seq)
+{
+	struct nslog_history_slot *slot;
+	uint64_t last;
+
+	*seq = __atomic_fetch_add(&history->head, 1, __ATOMIC_RELAXED);
+	slot = nslog__history_slot(history, *seq);
+
+	/* With more writers than slots, the last lap's may still be busy */
+	last = (*seq >= history->entries) ? *seq - history->entries + 1 : 0;
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != last)
+		sched_yield();
+
+	/* Invalidate the slot while it is rewritten, in case a query is
+	 * copying it out.
+	 */
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	nslog__context_copy(&slot->context, ctx);
+	slot->clock = nslog__timestamp(&slot->timestamp);
+	return slot;
+}
+
+static void nslog__history_publish(struct nslog_history_slot *slot,
+				   uint64_t seq, int len, size_t msgsize)
+{
+	if (len < 0)
+		len = 0;
+	slot->len = ((size_t)len < msgsize) ? (size_t)len : msgsize;
+	slot->msg[slot->len] = '\0';
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void nslog__history_record(nslog_entry_context_t *ctx,
+			   const char *fmt,
+			   va_list args)
+{
+	struct nslog_history *history = nslog__history_get();
+	struct nslog_history_slot *slot;
+	uint64_t seq;
+	va_list ap;
+	int len;
+
+	if (history == NULL)
+		return;
+	slot = nslog__history_claim(history, ctx, &seq);
+	va_copy(ap, args);
+	len = nslog__vformat(ctx, slot->msg, history->msgsize + 1, fmt, ap);
+	va_end(ap);
+	nslog__history_publish(slot, seq, len, history->msgsize);
+	nslog__history_put();
+}
+
+void nslog__history_record_kv(nslog_entry_context_t *ctx,
+			      const char *msg,
+			      const nslog_kv_field_t *fields,
+			      int nfields)
+{
+	struct nslog_history *history = nslog__history_get();
+	struct nslog_history_slot *slot;
+	uint64_t seq;
+	int len;
+
+	if (history == NULL)
+		return;
+	slot = nslog__history_claim(history, ctx, &seq);
+	len = nslog_kv_render(slot->msg, history->msgsize + 1,
+			      NSLOG_KV_FORMAT_LOGFMT, msg, fields, nfields);
+	nslog__history_publish(slot, seq, len, history->msgsize);
+	nslog__history_put();
+}
+
+nslog_error nslog_history_start(unsigned int entries, size_t msgsize)
+{
+	struct nslog_history *history, *old;
+	size_t stride;
+
+	if (entries == 0)
+		return nslog_history_stop();
+
+	if (msgsize > SIZE_MAX / 2)
+		return NSLOG_NO_MEMORY;
+	/* Slots are aligned for the context's pointers and the sequence */
+	stride = sizeof(struct nslog_history_slot) + msgsize + 1;
+	stride = (stride + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+	if (entries > (SIZE_MAX - sizeof(*history)) / stride)
+		return NSLOG_NO_MEMORY;
+
+	history = calloc(1, sizeof(*history) + stride * entries);
+	if (history == NULL)
+		return NSLOG_NO_MEMORY;
+	history->entries = entries;
+	history->msgsize = msgsize;
+	history->stride = stride;
+
+	old = __atomic_exchange_n(&nslog__history, history, __ATOMIC_SEQ_CST);
+	if (old != NULL) {
+		while (__atomic_load_n(&nslog__history_users,
+				       __ATOMIC_SEQ_CST) != 0)
+			sched_yield();
+		free(old);
+	}
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_history_stop(void)
+{
+	struct nslog_history *old;
+
+	old = __atomic_exchange_n(&nslog__history, NULL, __ATOMIC_SEQ_CST);
+	if (old != NULL) {
+		/* Entries being written (or queried) finish quickly */
+		while (__atomic_load_n(&nslog__history_users,
+				       __ATOMIC_SEQ_CST) != 0)
+			sched_yield();
+		free(old);
+	}
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_history_query(nslog_filter_t *filter,
+				uint64_t since,
+				uint64_t until,
+				nslog_message_callback cb,
+				void *context)
+{
+	struct nslog_history *history = nslog__history_get();
+	struct nslog_history_slot *copy;
+	uint64_t seq, head;
+
+	if (history == NULL)
+		return NSLOG_NO_ERROR;
+
+	copy = malloc(history->stride);
+	if (copy == NULL) {
+		nslog__history_put();
+		return NSLOG_NO_MEMORY;
+	}
+
+	head = __atomic_load_n(&history->head, __ATOMIC_ACQUIRE);
+	seq = (head > history->entries) ? head - history->entries : 0;
+	for (; seq != head; seq++) {
+		struct nslog_history_slot *slot =
+			nslog__history_slot(history, seq);
+		nslog_entry_t entry;
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+			continue; /* Still being written, or overwritten */
+		memcpy(copy, slot, history->stride);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1)
+			continue;
+
+		if (copy->timestamp < since ||
+		    (until != 0 && copy->timestamp >= until))
+			continue;
+		if (__atomic_load_n(&copy->context.category->name,
+					    __ATOMIC_ACQUIRE) == NULL)
+			nslog__normalise_category(copy->context.category);
+		if (filter != NULL && !nslog__filter_test(&copy->context, filter))
+			continue;
+
+		entry.context = &copy->context;
+		entry.timestamp = copy->timestamp;
+		entry.clock = copy->clock;
+		entry.seq = seq;
+		(*cb)(context, &entry, copy->msg, copy->len);
+	}
+
+	free(copy);
+	nslog__history_put();
+
+	return NSLOG_NO_ERROR;
+}
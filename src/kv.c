@@ -0,0 +1,168 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Structured Entry Rendering
+ */
+
+#include "nslog_internal.h"
+
+#include <math.h>
+
+struct nslog_kv_out {
+	char *buf;
+	size_t len;
+	size_t pos;
+};
+
+static void nslog__kv_putc(struct nslog_kv_out *out, char c)
+{
+	if (out->pos + 1 < out->len)
+		out->buf[out->pos] = c;
+	out->pos++;
+}
+
+static void nslog__kv_puts(struct nslog_kv_out *out, const char *str)
+{
+	while (*str != '\0')
+		nslog__kv_putc(out, *str++);
+}
+
+static void nslog__kv_printf(struct nslog_kv_out *out, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void nslog__kv_printf(struct nslog_kv_out *out, const char *fmt, ...)
+{
+	char tmp[64];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	nslog__kv_puts(out, tmp);
+}
+
+static void nslog__kv_json_string(struct nslog_kv_out *out, const char *str)
+{
+	nslog__kv_putc(out, '"');
+	for (; *str != '\0'; str++) {
+		unsigned char c = (unsigned char)*str;
+		switch (c) {
+		case '"':
+			nslog__kv_puts(out, "\\\"");
+			break;
+		case '\\':
+			nslog__kv_puts(out, "\\\\");
+			break;
+		case '\n':
+			nslog__kv_puts(out, "\\n");
+			break;
+		case '\r':
+			nslog__kv_puts(out, "\\r");
+			break;
+		case '\t':
+			nslog__kv_puts(out, "\\t");
+			break;
+		default:
+			if (c < 0x20)
+				nslog__kv_printf(out, "\\u%04x", c);
+			else
+				nslog__kv_putc(out, c);
+		}
+	}
+	nslog__kv_putc(out, '"');
+}
+
+static void nslog__kv_logfmt_string(struct nslog_kv_out *out, const char *str)
+{
+	const char *p;
+	bool quote = (*str == '\0');
+
+	for (p = str; *p != '\0' && !quote; p++) {
+		if (*p == ' ' || *p == '=' || *p == '"' ||
+		    (unsigned char)*p < 0x20)
+			quote = true;
+	}
+	if (!quote) {
+		nslog__kv_puts(out, str);
+		return;
+	}
+	/* logfmt quoting is close enough to JSON's to share */
+	nslog__kv_json_string(out, str);
+}
+
+static void nslog__kv_value(struct nslog_kv_out *out,
+			    nslog_kv_format format,
+			    const nslog_kv_field_t *field)
+{
+	switch (field->type) {
+	case NSLOG_KV_TYPE_INT:
+		nslog__kv_printf(out, "%lld", field->value.i);
+		break;
+	case NSLOG_KV_TYPE_DOUBLE:
+		if (format == NSLOG_KV_FORMAT_JSON && !isfinite(field->value.d))
+			nslog__kv_puts(out, "null");
+		else
+			nslog__kv_printf(out, "%.17g", field->value.d);
+		break;
+	case NSLOG_KV_TYPE_STRING: {
+		const char *str = (field->value.s == NULL) ?
+			"(null)" : field->value.s;
+		if (format == NSLOG_KV_FORMAT_JSON)
+			nslog__kv_json_string(out, str);
+		else
+			nslog__kv_logfmt_string(out, str);
+		break;
+	}
+	case NSLOG_KV_TYPE_POINTER:
+		if (format == NSLOG_KV_FORMAT_JSON)
+			nslog__kv_putc(out, '"');
+		nslog__kv_printf(out, "%p", field->value.p);
+		if (format == NSLOG_KV_FORMAT_JSON)
+			nslog__kv_putc(out, '"');
+		break;
+	default:
+		nslog__kv_puts(out, (format == NSLOG_KV_FORMAT_JSON) ?
+			       "null" : "?");
+	}
+}
+
+int nslog_kv_render(char *buf, size_t len, nslog_kv_format format,
+		    const char *msg,
+		    const nslog_kv_field_t *fields,
+		    int nfields)
+{
+	struct nslog_kv_out out = { buf, len, 0 };
+	int i;
+
+	if (format == NSLOG_KV_FORMAT_JSON) {
+		nslog__kv_puts(&out, "{\"msg\":");
+		nslog__kv_json_string(&out, msg);
+		for (i = 0; i < nfields; i++) {
+			nslog__kv_putc(&out, ',');
+			nslog__kv_json_string(&out, fields[i].key);
+			nslog__kv_putc(&out, ':');
+			nslog__kv_value(&out, format, &fields[i]);
+		}
+		nslog__kv_putc(&out, '}');
+	} else {
+		nslog__kv_puts(&out, msg);
+		for (i = 0; i < nfields; i++) {
+			nslog__kv_putc(&out, ' ');
+			nslog__kv_puts(&out, fields[i].key);
+			nslog__kv_putc(&out, '=');
+			nslog__kv_value(&out, format, &fields[i]);
+		}
+	}
+
+	if (len > 0)
+		buf[(out.pos < len) ? out.pos : len - 1] = '\0';
+
+	return out.pos;
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Level Maps
+ *
+ * A level map gives categories (and their subcategories) a minimum level.
+ * Rather than searching the map for every entry, each category looks its
+ * level up once and keeps it, tagged with the map's generation, so an entry
+ * only costs a compare however big the map is.
+ */
+
+#include "nslog_internal.h"
+
+#include <sched.h>
+#include <strings.h>
+
+/**
+ * An entry in a level map
+ */
+struct nslog_levelmap_entry {
+	char *prefix; /* NULL for the default */
+	size_t len;
+	nslog_level level;
+};
+
+/**
+ * A level map, which is never changed once made active
+ */
+struct nslog_levelmap {
+	unsigned int count;
+	struct nslog_levelmap_entry entries[0];
+};
+
+static struct nslog_levelmap *nslog__levelmap = NULL;
+
+/* A category's levelmap field holds its level in the low bits and the
+ * generation it was looked up in above them.  Zero is never a generation,
+ * so categories start out needing a lookup.
+ */
+#define NSLOG_LEVELMAP_SHIFT 3
+#define NSLOG_LEVELMAP_LEVEL ((1u << NSLOG_LEVELMAP_SHIFT) - 1)
+
+static unsigned int nslog__levelmap_gen = 1;
+
+/**
+ * The number of threads currently looking a category up in the map
+ */
+static unsigned int nslog__levelmap_readers = 0;
+
+bool nslog__level_from_name(const char *name, size_t len, nslog_level *level)
+{
+	int lvl;
+
+	for (lvl = NSLOG_LEVEL_DEEPDEBUG; lvl <= NSLOG_LEVEL_CRITICAL; lvl++) {
+		const char *fullname = nslog_level_name(lvl);
+		const char *shortname = nslog_short_level_name(lvl);
+		size_t shortlen = strcspn(shortname, " ");
+		if ((strlen(fullname) == len &&
+		     strncasecmp(name, fullname, len) == 0) ||
+		    (shortlen == len &&
+		     strncasecmp(name, shortname, len) == 0)) {
+			*level = lvl;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void nslog__levelmap_free(struct nslog_levelmap *map)
+{
+	unsigned int i;
+
+	if (map == NULL)
+		return;
+	for (i = 0; i < map->count; i++)
+		free(map->entries[i].prefix);
+	free(map);
+}
+
+/**
+ * Parse a level map
+ *
+ * \param text The map's text
+ * \param map Filled out with the map, or NULL if it was empty
+ * \return Whether or not this succeeded
+ */
+static nslog_error nslog__levelmap_parse(const char *text,
+					 struct nslog_levelmap **map)
+{
+	const char *p;
+	unsigned int count = 1;
+	struct nslog_levelmap *ret;
+
+	for (p = text; *p != '\0'; p++)
+		if (*p == ',')
+			count++;
+	ret = malloc(sizeof(*ret) + count * sizeof(ret->entries[0]));
+	if (ret == NULL)
+		return NSLOG_NO_MEMORY;
+	ret->count = 0;
+
+	for (p = text; ; p++) {
+		struct nslog_levelmap_entry *ent = &ret->entries[ret->count];
+		const char *cat, *lvl;
+		size_t catlen, lvllen;
+
+		p += strspn(p, " \t\n");
+		if (*p == '\0' && ret->count == 0)
+			break; /* An empty map */
+		cat = p;
+		catlen = strcspn(p, ":, \t\n");
+		p += catlen;
+		p += strspn(p, " \t\n");
+		if (catlen == 0 || *p != ':')
+			goto parse_error;
+		p++;
+		p += strspn(p, " \t\n");
+		lvl = p;
+		lvllen = strcspn(p, ", \t\n");
+		p += lvllen;
+		p += strspn(p, " \t\n");
+		if (!nslog__level_from_name(lvl, lvllen, &ent->level))
+			goto parse_error;
+
+		if (catlen == 1 && *cat == '*') {
+			ent->prefix = NULL;
+			ent->len = 0;
+		} else {
+			/* "foo/" means the same as "foo" */
+			while (catlen > 1 && cat[catlen - 1] == '/')
+				catlen--;
+			ent->prefix = strndup(cat, catlen);
+			if (ent->prefix == NULL) {
+				nslog__levelmap_free(ret);
+				return NSLOG_NO_MEMORY;
+			}
+			ent->len = catlen;
+		}
+		ret->count++;
+
+		if (*p == '\0')
+			break;
+		if (*p != ',')
+			goto parse_error;
+	}
+
+	if (ret->count == 0) {
+		free(ret);
+		ret = NULL;
+	}
+	*map = ret;
+	return NSLOG_NO_ERROR;
+
+parse_error:
+	nslog__levelmap_free(ret);
+	return NSLOG_PARSE_ERROR;
+}
+
+nslog_error nslog_set_level_map(const char *text)
+{
+	struct nslog_levelmap *map = NULL, *old;
+	nslog_error err;
+	unsigned int gen;
+
+	if (text != NULL) {
+		err = nslog__levelmap_parse(text, &map);
+		if (err != NSLOG_NO_ERROR)
+			return err;
+	}
+
+	/* Lookups read the generation before the map, so one which sees
+	 * the new generation also sees the new map.
+	 */
+	old = __atomic_exchange_n(&nslog__levelmap, map, __ATOMIC_SEQ_CST);
+	do {
+		gen = __atomic_add_fetch(&nslog__levelmap_gen, 1,
+					 __ATOMIC_SEQ_CST);
+		gen &= ~0u >> NSLOG_LEVELMAP_SHIFT;
+	} while (gen == 0);
+
+	/* Lookups are short, so wait out any using the old map */
+	while (__atomic_load_n(&nslog__levelmap_readers, __ATOMIC_SEQ_CST) != 0)
+		sched_yield();
+	nslog__levelmap_free(old);
+
+	return NSLOG_NO_ERROR;
+}
+
+/* Find the level for a category: that of the longest prefix of its name
+ * which ends at a slash, or the default.
+ */
+static nslog_level nslog__levelmap_lookup(const struct nslog_levelmap *map,
+					  const nslog_category_t *cat)
+{
+	nslog_level level = NSLOG_LEVEL_DEEPDEBUG;
+	size_t best = 0;
+	bool found = false;
+	unsigned int i;
+
+	for (i = 0; i < map->count; i++) {
+		const struct nslog_levelmap_entry *ent = &map->entries[i];
+		if (ent->prefix == NULL) {
+			if (!found)
+				level = ent->level;
+			continue;
+		}
+		if (ent->len > (size_t)cat->namelen ||
+		    (found && ent->len <= best) ||
+		    memcmp(cat->name, ent->prefix, ent->len) != 0 ||
+		    (cat->name[ent->len] != '\0' &&
+		     cat->name[ent->len] != '/'))
+			continue;
+		level = ent->level;
+		best = ent->len;
+		found = true;
+	}
+
+	return level;
+}
+
+bool nslog__levelmap_passes(nslog_entry_context_t *ctx)
+{
+	nslog_category_t *cat = ctx->category;
+	unsigned int gen, cached;
+	struct nslog_levelmap *map;
+	nslog_level level;
+
+	if (__atomic_load_n(&nslog__levelmap, __ATOMIC_RELAXED) == NULL)
+		return true;
+
+	gen = __atomic_load_n(&nslog__levelmap_gen, __ATOMIC_ACQUIRE) &
+		(~0u >> NSLOG_LEVELMAP_SHIFT);
+	cached = __atomic_load_n(&cat->levelmap, __ATOMIC_RELAXED);
+	if ((cached >> NSLOG_LEVELMAP_SHIFT) == gen)
+		return ctx->level >= (nslog_level)(cached &
+						   NSLOG_LEVELMAP_LEVEL);
+
+	__atomic_add_fetch(&nslog__levelmap_readers, 1, __ATOMIC_SEQ_CST);
+	map = __atomic_load_n(&nslog__levelmap, __ATOMIC_SEQ_CST);
+	level = (map == NULL) ? NSLOG_LEVEL_DEEPDEBUG :
+		nslog__levelmap_lookup(map, cat);
+	__atomic_sub_fetch(&nslog__levelmap_readers, 1, __ATOMIC_RELEASE);
+
+	/* If the map changed since gen was read, this is simply looked up
+	 * again next time.
+	 */
+	__atomic_store_n(&cat->levelmap,
+			 (gen << NSLOG_LEVELMAP_SHIFT) | level,
+			 __ATOMIC_RELAXED);
+
+	return ctx->level >= level;
+}
@@ -24,6 +24,329 @@
 
 #include "nslog/nslog.h"
 
+/**
+ * Hash a string for the call-site and filter caches (FNV-1a)
+ */
+static inline unsigned int nslog__hash(const char *str, int len)
+{
+	unsigned int hash = 2166136261u;
+	while (len-- > 0) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * The size of each thread's scratch space for rendering log messages
+ */
+#define NSLOG_SCRATCH_SIZE 1024
+
+/**
+ * Render a log message
+ *
+ * The message is rendered, in a single pass, into the calling thread's
+ * scratch space.  Only if it doesn't fit (or the scratch space is already
+ * in use further up the stack) is a buffer allocated and the message
+ * rendered again into that.  The result must be passed to
+ * \ref nslog__render_release when no longer needed.
+ *
+ * \param ctx The context of the entry being rendered
+ * \param len Filled out with the length of the rendered message
+ * \param fmt The printf format string
+ * \param args The printf arguments
+ * \return The NUL terminated message, or NULL on failure
+ */
+char *nslog__render(nslog_entry_context_t *ctx, int *len,
+		    const char *fmt, va_list args);
+
+/**
+ * Release a message rendered by \ref nslog__render
+ */
+void nslog__render_release(char *rendered);
+
+/**
+ * How a call site's messages are formatted (its site.format)
+ */
+#define NSLOG_FORMAT_UNKNOWN 0 /* Not yet known */
+#define NSLOG_FORMAT_FAST 1 /* By nslog itself */
+#define NSLOG_FORMAT_LIBC 2 /* By the C library */
+
+/**
+ * Format a log message, as vsnprintf() would
+ *
+ * Messages using only the common conversions (%d, %i, %u and %x with no
+ * length modifier or with l, ll or z; %c, %s, %.*s, %p and %%) without
+ * flags or widths are formatted by nslog itself; anything else falls back
+ * to the C library.  The call site remembers which was needed, so sites
+ * whose formats need the C library don't try nslog's formatter first.
+ *
+ * Only that verdict is kept, not the parsed conversions: the format is
+ * scanned afresh as it is formatted, which costs little beside the
+ * formatting itself and needs no per-site allocation (nor any way to free
+ * it from static call sites).  This is only used where nslog renders
+ * messages itself (corked and held entries, message callbacks and the
+ * history); the render callback is handed the format and arguments as
+ * they were logged.
+ *
+ * \param ctx The context of the entry being formatted
+ * \param buf The buffer to format into
+ * \param size The size of the buffer
+ * \param fmt The printf format string
+ * \param args The printf arguments
+ * \return The length of the formatted message, as vsnprintf()
+ */
+int nslog__vformat(nslog_entry_context_t *ctx, char *buf, size_t size,
+		   const char *fmt, va_list args);
+
+void nslog__compute_site(nslog_entry_context_t *ctx);
+
+/**
+ * Copy a computed call site's context, to keep with a stored entry
+ *
+ * Other threads may be updating the site's caches as it is copied, so they
+ * are read atomically (the format verdict) or not copied at all (the line
+ * prefix, which copies look up through their origin).
+ */
+static inline void nslog__context_copy(nslog_entry_context_t *dst,
+				       const nslog_entry_context_t *src)
+{
+	dst->category = src->category;
+	dst->level = src->level;
+	dst->filename = src->filename;
+	dst->filenamelen = src->filenamelen;
+	dst->funcname = src->funcname;
+	dst->funcnamelen = src->funcnamelen;
+	dst->lineno = src->lineno;
+	dst->site.computed = src->site.computed;
+	dst->site.leafoffset = src->site.leafoffset;
+	dst->site.dirnamelen = src->site.dirnamelen;
+	dst->site.filenamehash = src->site.filenamehash;
+	dst->site.leafhash = src->site.leafhash;
+	dst->site.dirnamehash = src->site.dirnamehash;
+	dst->site.funcnamehash = src->site.funcnamehash;
+	dst->site.format = __atomic_load_n(&src->site.format,
+					   __ATOMIC_RELAXED);
+	dst->site.prefixgen = 0;
+	dst->site.prefix = NULL;
+	dst->site.origin = src->site.origin;
+}
+
+/**
+ * Fill out a category's fully qualified name, if it hasn't been already
+ */
+void nslog__normalise_category(nslog_category_t *cat);
+
+nslog_clock nslog__timestamp(uint64_t *timestamp);
+
+/**
+ * Free the TSC calibrations replaced by later ones
+ */
+void nslog__clock_cleanup(void);
+
 bool nslog__filter_matches(nslog_entry_context_t *ctx);
 
+/**
+ * Match an entry against a filter other than the active one
+ *
+ * The entry's category must have been normalised.
+ */
+bool nslog__filter_test(nslog_entry_context_t *ctx, nslog_filter_t *filter);
+
+/**
+ * Check an entry against the level map
+ *
+ * The entry's category must have been normalised.
+ *
+ * \return true if the entry's level is at least its category's level in
+ *         the map (or there is no map)
+ */
+bool nslog__levelmap_passes(nslog_entry_context_t *ctx);
+
+/**
+ * Look a level up by its name or short name, in either case
+ *
+ * \param name The name, which needn't be NUL terminated
+ * \param len The length of the name
+ * \param level Filled out with the level
+ * \return Whether the name was recognised
+ */
+bool nslog__level_from_name(const char *name, size_t len, nslog_level *level);
+
+/**
+ * Release every filter held by the filter parse cache
+ */
+void nslog__filter_cache_flush(void);
+
+/**
+ * Release the filter node pool, if no filters remain alive
+ */
+void nslog__filter_nodes_release(void);
+
+/**
+ * Record an entry in the recent history, if it is being kept
+ *
+ * \param ctx The entry's context
+ * \param fmt The printf format string
+ * \param args The printf arguments, which are left to be used again
+ */
+void nslog__history_record(nslog_entry_context_t *ctx,
+			   const char *fmt,
+			   va_list args);
+
+/**
+ * Record a structured entry in the recent history, if it is being kept
+ */
+void nslog__history_record_kv(nslog_entry_context_t *ctx,
+			      const char *msg,
+			      const nslog_kv_field_t *fields,
+			      int nfields);
+
+/**
+ * The category of the library's own entries
+ */
+NSLOG_DECLARE_CATEGORY(nslog);
+
+/**
+ * Read the monotonic clock, in nanoseconds
+ */
+uint64_t nslog__monotonic(void);
+
+extern bool nslog__sink_stats_enabled;
+
+/**
+ * Start timing a call to a sink
+ *
+ * \return The time the call started, or 0 if sinks aren't being measured
+ */
+static inline uint64_t nslog__sink_begin(void)
+{
+	if (!__atomic_load_n(&nslog__sink_stats_enabled, __ATOMIC_RELAXED))
+		return 0;
+	return nslog__monotonic();
+}
+
+/**
+ * Finish timing a call to a sink, begun with \ref nslog__sink_begin
+ */
+void nslog__sink_end(nslog_sink sink, uint64_t start, size_t bytes);
+
+#define NSLOG__SINK_END(sink, start, bytes)				\
+	do {								\
+		if ((start) != 0)					\
+			nslog__sink_end(sink, start, bytes);		\
+	} while (0)
+
+/**
+ * The kinds of per-thread slot
+ */
+typedef enum {
+	NSLOG_SLOT_STATS = 0, /* The logging statistics */
+	NSLOG_SLOT_FILTER = 1, /* Matching against the active filter */
+	NSLOG_SLOT_COUNT = 2, /* Owning event counters */
+	NSLOG_SLOT_KINDS = 3
+} nslog_slot_kind;
+
+/**
+ * A thread's slot, of some kind
+ *
+ * Each thread has at most one slot of each kind, holding data only it
+ * writes, so threads needn't contend over it.  Slots are the first member
+ * of the structures holding that data.  When a thread exits its slots are
+ * given up, to be taken over, contents and all, by the next threads to
+ * need slots of their kinds.  nslog_cleanup() frees every slot.
+ */
+typedef struct nslog_slot_s {
+	struct nslog_slot_s *next; /* The next slot of the same kind */
+	bool owned; /* Whether a live thread is using this */
+} nslog_slot_t;
+
+/**
+ * A thread's pointer to its slot of some kind, trusted only while the
+ * generation is current
+ */
+struct nslog_thread_slot {
+	nslog_slot_t *slot;
+	unsigned int generation;
+};
+
+extern __thread struct nslog_thread_slot nslog__thread_slots[NSLOG_SLOT_KINDS];
+extern unsigned int nslog__slot_generation;
+
+/**
+ * Claim a slot for the calling thread, taking over one given up by an
+ * exited thread or making a new (zeroed) one
+ *
+ * \param kind The kind of slot
+ * \param size The size of the structure the slot starts
+ * 
+eturn The slot, or NULL on failure
+ */
+nslog_slot_t *nslog__slot_claim(nslog_slot_kind kind, size_t size);
+
+/**
+ * Find the calling thread's slot of a kind, claiming one if need be
+ */
+static inline nslog_slot_t *nslog__slot(nslog_slot_kind kind, size_t size)
+{
+	struct nslog_thread_slot *ts = &nslog__thread_slots[kind];
+
+	if (ts->slot != NULL && ts->generation ==
+	    __atomic_load_n(&nslog__slot_generation, __ATOMIC_ACQUIRE))
+		return ts->slot;
+	return nslog__slot_claim(kind, size);
+}
+
+/**
+ * The most recently made slot of a kind, from which the rest can be
+ * walked, whoever owns them
+ */
+nslog_slot_t *nslog__slots(nslog_slot_kind kind);
+
+/**
+ * Free every slot of every kind, which nothing may be using
+ */
+void nslog__slot_cleanup(void);
+
+/**
+ * Stop counting events, without summarising them
+ */
+void nslog__count_cleanup(void);
+
+/**
+ * Release every call site's line prefix
+ */
+void nslog__prefix_cleanup(void);
+
+/**
+ * Write a log entry out as a line of text, using only async-signal-safe
+ * calls
+ *
+ * \param fd The file descriptor to write to
+ * \param ctx The entry's context
+ * \param timestamp The entry's timestamp, in nanoseconds
+ * \param msg The entry's message
+ * \param value A value to follow the message, or NULL for none
+ * \return true on success, false if writing failed
+ */
+bool nslog__signal_write(int fd, const nslog_entry_context_t *ctx,
+			 uint64_t timestamp, const char *msg,
+			 const uint64_t *value);
+
+/**
+ * Write out any corked entries not yet written by a signal flush
+ *
+ * \param fd The file descriptor to write to
+ * \return true on success, false if writing failed
+ */
+bool nslog__cork_write(int fd);
+
+/**
+ * The input to the filter lexer, consumed as the lexer reads it
+ */
+struct nslog_filter_input {
+	const char *ptr;
+	size_t len;
+};
+
 #endif /* NSLOG_INTERNAL_H_ */
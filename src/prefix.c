@@ -0,0 +1,363 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Line Prefixes
+ *
+ * Everything in a line prefix is constant for a call site, so each site
+ * renders its prefix once and keeps it.  The prefixes (and the templates)
+ * are never freed before nslog_cleanup(), so that a thread part way through
+ * writing one out isn't disturbed by the template changing under it.
+ *
+ * Copies of a call site's context (as kept by corked and held entries and
+ * the history) share the site's prefix.  Copies in a category other than
+ * the site's (as the C++ scoped categories make) share one prefix per site
+ * and category, kept in a small table.  Either way the number of prefixes
+ * is bounded by the number of call sites, not the number of entries.
+ */
+
+#include "nslog_internal.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+struct nslog_prefix_s {
+	struct nslog_prefix_s *next; /* All the prefixes and templates */
+	/* For prefixes in the table of copies in other categories */
+	struct nslog_prefix_s *chain; /* The next in the same bucket */
+	const nslog_entry_context_t *origin;
+	const nslog_category_t *category;
+	unsigned int gen;
+	size_t len;
+	char text[0]; /* NUL terminated */
+};
+
+static const char nslog__default_prefix_template[] = "%l %c %f:%n %F: ";
+
+static struct nslog_prefix_s *nslog__prefixes = NULL;
+
+/* The template, or NULL for the default */
+static struct nslog_prefix_s *nslog__prefix_template = NULL;
+
+/* Bumped whenever the template changes; a site's prefix is valid only if
+ * it was rendered in the current generation.  Zero (a site which has never
+ * had a prefix) and NSLOG_PREFIX_BUSY are never generations.
+ */
+static unsigned int nslog__prefix_gen = 1;
+
+/* A site's prefixgen while its prefix is being replaced */
+#define NSLOG_PREFIX_BUSY (~0u)
+
+/* Prefixes of copied contexts in categories other than their site's */
+#define NSLOG_PREFIX_BUCKETS 64
+static pthread_mutex_t nslog__prefix_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nslog_prefix_s *nslog__prefix_table[NSLOG_PREFIX_BUCKETS];
+
+/* Make every site's cached prefix out of date */
+static void nslog__prefix_invalidate(void)
+{
+	unsigned int gen;
+
+	do {
+		gen = __atomic_add_fetch(&nslog__prefix_gen, 1,
+					 __ATOMIC_RELEASE);
+	} while (gen == 0 || gen == NSLOG_PREFIX_BUSY);
+}
+
+static struct nslog_prefix_s *nslog__prefix_new(size_t len)
+{
+	struct nslog_prefix_s *prefix = malloc(sizeof(*prefix) + len + 1);
+
+	if (prefix == NULL)
+		return NULL;
+	prefix->chain = NULL;
+	prefix->origin = NULL;
+	prefix->category = NULL;
+	prefix->gen = 0;
+	prefix->len = len;
+	return prefix;
+}
+
+/* Keep a prefix until nslog_cleanup() */
+static void nslog__prefix_keep(struct nslog_prefix_s *prefix)
+{
+	prefix->next = __atomic_load_n(&nslog__prefixes, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&nslog__prefixes, &prefix->next,
+					    prefix, false, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+/* Write out a category's name, normalised or not, returning its length */
+static size_t nslog__prefix_category(char *out, const nslog_category_t *cat)
+{
+	size_t len = 0, catlen;
+
+	if (cat->name != NULL) {
+		catlen = cat->namelen;
+		if (out != NULL)
+			memcpy(out, cat->name, catlen);
+		return catlen;
+	}
+	if (cat->parent != NULL) {
+		len = nslog__prefix_category(out, cat->parent);
+		if (out != NULL)
+			out[len] = '/';
+		len++;
+	}
+	catlen = strlen(cat->cat_name);
+	if (out != NULL)
+		memcpy(out + len, cat->cat_name, catlen);
+	return len + catlen;
+}
+
+/**
+ * Render a prefix from a template
+ *
+ * \param out The buffer to render into, or NULL to just measure
+ * \param tmpl The template, already validated
+ * \param ctx The call site
+ * \return The length of the prefix
+ */
+static size_t nslog__prefix_render(char *out, const char *tmpl,
+				   nslog_entry_context_t *ctx)
+{
+	size_t len = 0;
+
+	for (; *tmpl != '\0'; tmpl++) {
+		const char *str = NULL;
+		size_t slen = 0;
+		char num[16];
+
+		if (*tmpl != '%') {
+			if (out != NULL)
+				out[len] = *tmpl;
+			len++;
+			continue;
+		}
+		switch (*++tmpl) {
+		case 'l':
+			str = nslog_short_level_name(ctx->level);
+			break;
+		case 'L':
+			str = nslog_level_name(ctx->level);
+			break;
+		case 'c':
+			len += nslog__prefix_category(
+				(out != NULL) ? out + len : NULL,
+				ctx->category);
+			continue;
+		case 'f':
+			str = ctx->filename;
+			slen = ctx->filenamelen;
+			break;
+		case 'b':
+			str = strrchr(ctx->filename, '/');
+			str = (str == NULL) ? ctx->filename : str + 1;
+			break;
+		case 'n':
+			snprintf(num, sizeof(num), "%d", ctx->lineno);
+			str = num;
+			break;
+		case 'F':
+			str = ctx->funcname;
+			slen = ctx->funcnamelen;
+			break;
+		default: /* '%' */
+			str = "%";
+			break;
+		}
+		if (slen == 0)
+			slen = strlen(str);
+		if (out != NULL)
+			memcpy(out + len, str, slen);
+		len += slen;
+	}
+
+	return len;
+}
+
+nslog_error nslog_set_prefix_template(const char *tmpl)
+{
+	struct nslog_prefix_s *prefix = NULL;
+	const char *p;
+
+	if (tmpl != NULL) {
+		for (p = strchr(tmpl, '%'); p != NULL; p = strchr(p + 2, '%')) {
+			if (p[1] == '\0' || strchr("lLcfbnF%", p[1]) == NULL)
+				return NSLOG_PARSE_ERROR;
+		}
+		prefix = nslog__prefix_new(strlen(tmpl));
+		if (prefix == NULL)
+			return NSLOG_NO_MEMORY;
+		memcpy(prefix->text, tmpl, prefix->len + 1);
+		nslog__prefix_keep(prefix);
+	}
+
+	/* Renderers read the generation before the template, so one which
+	 * sees the new generation also sees the new template.
+	 */
+	__atomic_store_n(&nslog__prefix_template, prefix, __ATOMIC_RELEASE);
+	nslog__prefix_invalidate();
+
+	return NSLOG_NO_ERROR;
+}
+
+/* Render a context's prefix from the current template */
+static struct nslog_prefix_s *nslog__prefix_make(nslog_entry_context_t *ctx)
+{
+	struct nslog_prefix_s *tmpl, *ret;
+	const char *text;
+
+	tmpl = __atomic_load_n(&nslog__prefix_template, __ATOMIC_ACQUIRE);
+	text = (tmpl == NULL) ? nslog__default_prefix_template : tmpl->text;
+	ret = nslog__prefix_new(nslog__prefix_render(NULL, text, ctx));
+	if (ret == NULL)
+		return NULL;
+	nslog__prefix_render(ret->text, text, ctx);
+	ret->text[ret->len] = '\0';
+	return ret;
+}
+
+/**
+ * Find (or make) the prefix shared by copies of a call site's context in
+ * a category other than the site's
+ */
+static struct nslog_prefix_s *nslog__prefix_other(nslog_entry_context_t *ctx,
+						  unsigned int gen)
+{
+	const nslog_entry_context_t *origin = ctx->site.origin;
+	struct nslog_prefix_s **bucket, **pp, *ret;
+
+	bucket = &nslog__prefix_table[(((uintptr_t)origin >> 4) ^
+				       ((uintptr_t)ctx->category >> 4)) %
+				      NSLOG_PREFIX_BUCKETS];
+	pthread_mutex_lock(&nslog__prefix_table_lock);
+	for (pp = bucket; (ret = *pp) != NULL; ) {
+		if (ret->gen != gen) {
+			/* Rendered from an old template; it stays kept */
+			*pp = ret->chain;
+			continue;
+		}
+		if (ret->origin == origin && ret->category == ctx->category)
+			break;
+		pp = &ret->chain;
+	}
+	if (ret == NULL) {
+		ret = nslog__prefix_make(ctx);
+		if (ret != NULL) {
+			ret->origin = origin;
+			ret->category = ctx->category;
+			ret->gen = gen;
+			ret->chain = *bucket;
+			*bucket = ret;
+			nslog__prefix_keep(ret);
+		}
+	}
+	pthread_mutex_unlock(&nslog__prefix_table_lock);
+
+	return ret;
+}
+
+/* Cache a prefix in a context, unless another thread is already doing so
+ * or has done so since sitegen was read
+ */
+static bool nslog__prefix_cache(nslog_entry_context_t *ctx,
+				unsigned int sitegen, unsigned int gen,
+				struct nslog_prefix_s *prefix)
+{
+	if (sitegen == NSLOG_PREFIX_BUSY ||
+	    !__atomic_compare_exchange_n(&ctx->site.prefixgen, &sitegen,
+					 NSLOG_PREFIX_BUSY,
+					 false, __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED))
+		return false;
+	__atomic_store_n(&ctx->site.prefix, prefix, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->site.prefixgen, gen, __ATOMIC_RELEASE);
+	return true;
+}
+
+nslog_error nslog_site_prefix(nslog_entry_context_t *ctx,
+			      const char **prefix,
+			      size_t *len)
+{
+	nslog_entry_context_t *origin = ctx->site.origin;
+	struct nslog_prefix_s *ret;
+	unsigned int gen, sitegen;
+	bool copy = (origin != NULL && origin != ctx);
+
+	if (copy && origin->category == ctx->category)
+		return nslog_site_prefix(origin, prefix, len);
+
+	for (;;) {
+		gen = __atomic_load_n(&nslog__prefix_gen, __ATOMIC_ACQUIRE);
+		sitegen = __atomic_load_n(&ctx->site.prefixgen,
+					  __ATOMIC_ACQUIRE);
+		if (sitegen == gen) {
+			ret = __atomic_load_n(&ctx->site.prefix,
+					      __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			/* Unless it was being replaced as we read it, or was
+			 * copied along with a context since recategorised
+			 */
+			if (__atomic_load_n(&ctx->site.prefixgen,
+					    __ATOMIC_RELAXED) == gen &&
+			    (!copy || ret->category == ctx->category))
+				break;
+		}
+
+		if (copy) {
+			/* Kept in the table, so it needn't be cached */
+			ret = nslog__prefix_other(ctx, gen);
+			if (ret == NULL)
+				return NSLOG_NO_MEMORY;
+			(void)nslog__prefix_cache(ctx, sitegen, gen, ret);
+			break;
+		}
+
+		ret = nslog__prefix_make(ctx);
+		if (ret == NULL)
+			return NSLOG_NO_MEMORY;
+		if (nslog__prefix_cache(ctx, sitegen, gen, ret)) {
+			nslog__prefix_keep(ret);
+			break;
+		}
+		/* Another thread got there first, so use its prefix */
+		free(ret);
+		if (sitegen == NSLOG_PREFIX_BUSY)
+			sched_yield();
+	}
+
+	*prefix = ret->text;
+	*len = ret->len;
+	return NSLOG_NO_ERROR;
+}
+
+void nslog__prefix_cleanup(void)
+{
+	struct nslog_prefix_s *prefix = nslog__prefixes;
+
+	/* The template is kept, like the callbacks */
+	nslog__prefixes = nslog__prefix_template;
+	nslog__prefix_invalidate();
+	pthread_mutex_lock(&nslog__prefix_table_lock);
+	memset(nslog__prefix_table, 0, sizeof(nslog__prefix_table));
+	pthread_mutex_unlock(&nslog__prefix_table_lock);
+
+	while (prefix != NULL) {
+		struct nslog_prefix_s *next = prefix->next;
+		if (prefix != nslog__prefix_template)
+			free(prefix);
+		else
+			prefix->next = NULL;
+		prefix = next;
+	}
+}
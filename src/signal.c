@@ -0,0 +1,210 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging from Signal Handlers
+ *
+ * Nothing in here allocates, takes a lock, or calls anything which isn't
+ * async-signal-safe, so it can be used from a handler for SIGSEGV and
+ * friends, where the heap or stdio may be in an inconsistent state.
+ */
+
+#include "nslog_internal.h"
+
+#include <unistd.h>
+#include <errno.h>
+
+/**
+ * The number of records held for \ref nslog_signal_flush (a power of two)
+ */
+#define NSLOG_SIGNAL_RING 256
+
+/**
+ * A record made by \ref NSLOG_SIGNAL
+ */
+struct nslog_signal_record {
+	unsigned int seq; /* One more than the slot's sequence, once written */
+	nslog_entry_context_t *ctx;
+	const char *msg;
+	uint64_t timestamp;
+	uint64_t value;
+	bool has_value;
+};
+
+static struct nslog_signal_record nslog__signal_ring[NSLOG_SIGNAL_RING];
+
+static unsigned int nslog__signal_head = 0; /* Next sequence to claim */
+static unsigned int nslog__signal_tail = 0; /* Next sequence to flush */
+
+/**
+ * A line being built up on the stack for writing out
+ */
+struct nslog_signal_line {
+	char buf[256];
+	size_t len;
+};
+
+static void nslog__signal_puts(struct nslog_signal_line *line,
+			       const char *str)
+{
+	while (*str != '\0' && line->len < sizeof(line->buf))
+		line->buf[line->len++] = *str++;
+}
+
+static void nslog__signal_putu(struct nslog_signal_line *line,
+			       uint64_t value, unsigned int base, int width)
+{
+	char digits[24];
+	int n = 0;
+
+	do {
+		digits[n++] = "0123456789abcdef"[value % base];
+		value /= base;
+	} while (value != 0);
+	while (n < width)
+		digits[n++] = '0';
+	while (n > 0 && line->len < sizeof(line->buf))
+		line->buf[line->len++] = digits[--n];
+}
+
+/* Categories may not have been normalised, so build the name up here */
+static void nslog__signal_putcat(struct nslog_signal_line *line,
+				 const nslog_category_t *cat)
+{
+	if (cat->parent != NULL) {
+		nslog__signal_putcat(line, cat->parent);
+		nslog__signal_puts(line, "/");
+	}
+	nslog__signal_puts(line, cat->cat_name);
+}
+
+static bool nslog__signal_write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t done = write(fd, buf, len);
+		if (done == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += done;
+		len -= done;
+	}
+	return true;
+}
+
+bool nslog__signal_write(int fd, const nslog_entry_context_t *ctx,
+			 uint64_t timestamp, const char *msg,
+			 const uint64_t *value)
+{
+	struct nslog_signal_line line;
+	int saved_errno = errno;
+	bool ok;
+
+	/* The same layout as nslog_binary_decode() produces */
+	line.len = 0;
+	nslog__signal_putu(&line, timestamp / 1000000000, 10, 1);
+	nslog__signal_puts(&line, ".");
+	nslog__signal_putu(&line, timestamp % 1000000000, 10, 9);
+	nslog__signal_puts(&line, " ");
+	nslog__signal_puts(&line, nslog_short_level_name(ctx->level));
+	nslog__signal_puts(&line, " ");
+	nslog__signal_putcat(&line, ctx->category);
+	nslog__signal_puts(&line, " ");
+	nslog__signal_puts(&line, ctx->filename);
+	nslog__signal_puts(&line, ":");
+	nslog__signal_putu(&line, ctx->lineno, 10, 1);
+	nslog__signal_puts(&line, " ");
+	nslog__signal_puts(&line, ctx->funcname);
+	nslog__signal_puts(&line, ": ");
+	ok = nslog__signal_write_all(fd, line.buf, line.len) &&
+		nslog__signal_write_all(fd, msg, strlen(msg));
+
+	line.len = 0;
+	if (value != NULL) {
+		nslog__signal_puts(&line, " 0x");
+		nslog__signal_putu(&line, *value, 16, 1);
+	}
+	nslog__signal_puts(&line, "\n");
+	ok = ok && nslog__signal_write_all(fd, line.buf, line.len);
+
+	/* A signal handler mustn't disturb the interrupted code's errno */
+	errno = saved_errno;
+	return ok;
+}
+
+void nslog__log_signal(nslog_entry_context_t *ctx,
+		       const char *msg,
+		       uint64_t value,
+		       bool has_value)
+{
+	struct nslog_signal_record *rec;
+	unsigned int seq;
+
+	if (!nslog_level_enabled(ctx->level))
+		return;
+
+	seq = __atomic_fetch_add(&nslog__signal_head, 1, __ATOMIC_RELAXED);
+	rec = &nslog__signal_ring[seq % NSLOG_SIGNAL_RING];
+
+	/* Invalidate the slot while it is rewritten, since the ring may
+	 * have wrapped around onto a record which is being flushed.
+	 */
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec->ctx = ctx;
+	rec->msg = msg;
+	nslog__timestamp(&rec->timestamp);
+	rec->value = value;
+	rec->has_value = has_value;
+	__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+nslog_error nslog_signal_flush(int fd)
+{
+	unsigned int start, tail, head, seq;
+	bool ok = true;
+
+	/* Anything corked hasn't been seen anywhere else yet either */
+	if (!nslog__cork_write(fd))
+		ok = false;
+
+	start = tail = __atomic_load_n(&nslog__signal_tail, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&nslog__signal_head, __ATOMIC_ACQUIRE);
+	if (head - tail > NSLOG_SIGNAL_RING) {
+		/* The oldest records have been overwritten */
+		tail = head - NSLOG_SIGNAL_RING;
+	}
+
+	for (seq = tail; seq != head; seq++) {
+		struct nslog_signal_record *rec =
+			&nslog__signal_ring[seq % NSLOG_SIGNAL_RING];
+		struct nslog_signal_record copy;
+
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq + 1)
+			continue; /* Still being written, or overwritten */
+		copy = *rec;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq + 1)
+			continue;
+
+		if (ok && !nslog__signal_write(fd, copy.ctx, copy.timestamp,
+					       copy.msg,
+					       copy.has_value ?
+					       &copy.value : NULL))
+			ok = false;
+	}
+
+	/* Unless another flush got there first, these are done with */
+	__atomic_compare_exchange_n(&nslog__signal_tail, &start, head, false,
+				    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+	return ok ? NSLOG_NO_ERROR : NSLOG_IO_ERROR;
+}
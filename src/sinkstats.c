@@ -0,0 +1,197 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Sink Statistics
+ *
+ * Every figure is a counter updated with a relaxed atomic add (or, for the
+ * maxima, a compare and swap), so timing the callbacks takes no locks and
+ * threads delivering entries at the same time don't wait for each other.
+ */
+
+#include "nslog_internal.h"
+
+NSLOG_DEFINE_CATEGORY(nslog, "Lib NSLOG's own entries");
+
+bool nslog__sink_stats_enabled = false;
+
+static nslog_sink_stats_t nslog__sink_stats[NSLOG_SINKS];
+
+/* When the statistics were last reset */
+static uint64_t nslog__sink_stats_start = 0;
+
+/* How often to report, and when the next report is due (0 for never) */
+static uint64_t nslog__sink_stats_interval = 0;
+static uint64_t nslog__sink_stats_due = 0;
+
+/* The statistics as of the last report, for working out rates */
+static struct {
+	uint64_t at;
+	uint64_t entries[NSLOG_SINKS];
+	uint64_t bytes[NSLOG_SINKS];
+} nslog__sink_stats_last;
+
+/* Set while this thread reports, so the report doesn't report itself */
+static __thread bool nslog__sink_stats_reporting = false;
+
+static const char *nslog__sink_names[NSLOG_SINKS] = {
+	"render", "entry", "kv", "message"
+};
+
+static unsigned int nslog__sink_bucket(uint64_t ns)
+{
+	unsigned int msb, bucket;
+
+	if (ns < 4)
+		return ns;
+	/* Four buckets for each power of two */
+	msb = 63 - __builtin_clzll(ns);
+	bucket = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+	return (bucket < NSLOG_SINK_BUCKETS) ? bucket : NSLOG_SINK_BUCKETS - 1;
+}
+
+uint64_t nslog_sink_bucket_floor(unsigned int bucket)
+{
+	if (bucket < 4)
+		return bucket;
+	if (bucket >= NSLOG_SINK_BUCKETS)
+		bucket = NSLOG_SINK_BUCKETS - 1;
+	return (uint64_t)(4 + (bucket % 4)) << (bucket / 4 - 1);
+}
+
+static void nslog__sink_stats_max(uint64_t *max, uint64_t value)
+{
+	uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while (value > cur &&
+	       !__atomic_compare_exchange_n(max, &cur, value, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Log the rates since the last report, and the latencies, of each sink
+ * which has been used
+ */
+static void nslog__sink_stats_report(uint64_t now)
+{
+	uint64_t elapsed = now - nslog__sink_stats_last.at;
+	int sink;
+
+	if (elapsed == 0)
+		return;
+
+	for (sink = 0; sink < NSLOG_SINKS; sink++) {
+		nslog_sink_stats_t stats;
+		uint64_t entries, bytes;
+
+		nslog_get_sink_stats(sink, &stats);
+		if (stats.entries == 0)
+			continue;
+		entries = stats.entries - nslog__sink_stats_last.entries[sink];
+		bytes = stats.bytes - nslog__sink_stats_last.bytes[sink];
+		nslog__sink_stats_last.entries[sink] = stats.entries;
+		nslog__sink_stats_last.bytes[sink] = stats.bytes;
+
+		NSLOG_KV(nslog, INFO, "sink statistics",
+			 NSLOG_KV_STR("sink", nslog__sink_names[sink]),
+			 NSLOG_KV_INT("entries", stats.entries),
+			 NSLOG_KV_DOUBLE("entries_per_sec",
+					 entries * 1e9 / elapsed),
+			 NSLOG_KV_DOUBLE("bytes_per_sec",
+					 bytes * 1e9 / elapsed),
+			 NSLOG_KV_INT("mean_ns",
+				      stats.total_ns / stats.entries),
+			 NSLOG_KV_INT("max_ns", stats.max_ns));
+	}
+	nslog__sink_stats_last.at = now;
+}
+
+void nslog__sink_end(nslog_sink sink, uint64_t start, size_t bytes)
+{
+	nslog_sink_stats_t *stats = &nslog__sink_stats[sink];
+	uint64_t now = nslog__monotonic();
+	uint64_t ns = now - start;
+	uint64_t due;
+
+	__atomic_add_fetch(&stats->entries, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->buckets[nslog__sink_bucket(ns)], 1,
+			   __ATOMIC_RELAXED);
+	nslog__sink_stats_max(&stats->max_ns, ns);
+
+	due = __atomic_load_n(&nslog__sink_stats_due, __ATOMIC_RELAXED);
+	if (due == 0 || now < due || nslog__sink_stats_reporting)
+		return;
+	/* Only the thread which moves the due time on reports */
+	if (!__atomic_compare_exchange_n(&nslog__sink_stats_due, &due,
+					 now + __atomic_load_n(
+						 &nslog__sink_stats_interval,
+						 __ATOMIC_RELAXED),
+					 false, __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED))
+		return;
+	nslog__sink_stats_reporting = true;
+	nslog__sink_stats_report(now);
+	nslog__sink_stats_reporting = false;
+}
+
+nslog_error nslog_sink_stats_enable(uint64_t interval)
+{
+	uint64_t now = nslog__monotonic();
+	int sink;
+
+	__atomic_store_n(&nslog__sink_stats_enabled, false, __ATOMIC_RELAXED);
+	memset(nslog__sink_stats, 0, sizeof(nslog__sink_stats));
+	memset(&nslog__sink_stats_last, 0, sizeof(nslog__sink_stats_last));
+	for (sink = 0; sink < NSLOG_SINKS; sink++)
+		nslog__sink_stats[sink].sink = sink;
+	nslog__sink_stats_last.at = now;
+	__atomic_store_n(&nslog__sink_stats_start, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&nslog__sink_stats_interval, interval,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&nslog__sink_stats_due,
+			 (interval == 0) ? 0 : now + interval,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&nslog__sink_stats_enabled, true, __ATOMIC_RELEASE);
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_sink_stats_disable(void)
+{
+	__atomic_store_n(&nslog__sink_stats_enabled, false, __ATOMIC_RELAXED);
+	__atomic_store_n(&nslog__sink_stats_due, 0, __ATOMIC_RELAXED);
+
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_get_sink_stats(nslog_sink sink, nslog_sink_stats_t *stats)
+{
+	const nslog_sink_stats_t *src;
+	unsigned int bucket;
+
+	if ((unsigned int)sink >= NSLOG_SINKS)
+		return NSLOG_NOT_SUPPORTED;
+
+	src = &nslog__sink_stats[sink];
+	stats->sink = sink;
+	stats->entries = __atomic_load_n(&src->entries, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+	stats->total_ns = __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+	stats->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+	for (bucket = 0; bucket < NSLOG_SINK_BUCKETS; bucket++)
+		stats->buckets[bucket] = __atomic_load_n(&src->buckets[bucket],
+							 __ATOMIC_RELAXED);
+	stats->elapsed_ns = nslog__monotonic() -
+		__atomic_load_n(&nslog__sink_stats_start, __ATOMIC_RELAXED);
+
+	return NSLOG_NO_ERROR;
+}
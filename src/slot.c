@@ -0,0 +1,124 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Per-Thread Slots
+ *
+ * Threads find their slots through thread-local pointers, which
+ * nslog_cleanup() can't clear on other threads, so each pointer is tagged
+ * with the generation it was claimed in and trusted only while that is
+ * current.  nslog_cleanup() frees every slot and moves the generation on.
+ */
+
+#include "nslog_internal.h"
+
+#include <pthread.h>
+
+/* Slots are given a cache line each, so no two threads' slots share one */
+#define NSLOG_SLOT_ALIGN 64
+
+__thread struct nslog_thread_slot nslog__thread_slots[NSLOG_SLOT_KINDS];
+unsigned int nslog__slot_generation = 0;
+
+/* Every slot of each kind, most recently made first */
+static nslog_slot_t *nslog__all_slots[NSLOG_SLOT_KINDS];
+
+/* Guards who owns each slot, and the lists' heads against cleanup */
+static pthread_mutex_t nslog__slot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set on each thread with slots, so they are given up when it exits */
+static pthread_once_t nslog__slot_once = PTHREAD_ONCE_INIT;
+static pthread_key_t nslog__slot_key;
+
+static void nslog__slot_thread_exit(void *value)
+{
+	unsigned int generation;
+	int kind;
+
+	(void)value;
+
+	pthread_mutex_lock(&nslog__slot_lock);
+	generation = __atomic_load_n(&nslog__slot_generation, __ATOMIC_RELAXED);
+	for (kind = 0; kind < NSLOG_SLOT_KINDS; kind++) {
+		struct nslog_thread_slot *ts = &nslog__thread_slots[kind];
+		if (ts->slot != NULL && ts->generation == generation)
+			ts->slot->owned = false;
+		ts->slot = NULL;
+	}
+	pthread_mutex_unlock(&nslog__slot_lock);
+}
+
+static void nslog__slot_init(void)
+{
+	pthread_key_create(&nslog__slot_key, nslog__slot_thread_exit);
+}
+
+nslog_slot_t *nslog__slot_claim(nslog_slot_kind kind, size_t size)
+{
+	struct nslog_thread_slot *ts = &nslog__thread_slots[kind];
+	nslog_slot_t *slot;
+	void *mem;
+
+	pthread_once(&nslog__slot_once, nslog__slot_init);
+
+	pthread_mutex_lock(&nslog__slot_lock);
+
+	/* Take over a slot given up by an exited thread, if there is one */
+	for (slot = nslog__all_slots[kind]; slot != NULL; slot = slot->next)
+		if (!slot->owned)
+			break;
+
+	if (slot == NULL) {
+		size = (size + NSLOG_SLOT_ALIGN - 1) &
+			~(size_t)(NSLOG_SLOT_ALIGN - 1);
+		if (posix_memalign(&mem, NSLOG_SLOT_ALIGN, size) != 0) {
+			pthread_mutex_unlock(&nslog__slot_lock);
+			return NULL;
+		}
+		slot = memset(mem, 0, size);
+		slot->next = nslog__all_slots[kind];
+		/* Walked without the lock, so only listed once filled out */
+		__atomic_store_n(&nslog__all_slots[kind], slot,
+				 __ATOMIC_RELEASE);
+	}
+	slot->owned = true;
+
+	ts->slot = slot;
+	ts->generation = __atomic_load_n(&nslog__slot_generation,
+					 __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&nslog__slot_lock);
+
+	pthread_setspecific(nslog__slot_key, nslog__thread_slots);
+
+	return slot;
+}
+
+nslog_slot_t *nslog__slots(nslog_slot_kind kind)
+{
+	return __atomic_load_n(&nslog__all_slots[kind], __ATOMIC_ACQUIRE);
+}
+
+void nslog__slot_cleanup(void)
+{
+	int kind;
+
+	pthread_mutex_lock(&nslog__slot_lock);
+	for (kind = 0; kind < NSLOG_SLOT_KINDS; kind++) {
+		while (nslog__all_slots[kind] != NULL) {
+			nslog_slot_t *slot = nslog__all_slots[kind];
+			nslog__all_slots[kind] = slot->next;
+			free(slot);
+		}
+		nslog__thread_slots[kind].slot = NULL;
+	}
+	__atomic_add_fetch(&nslog__slot_generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&nslog__slot_lock);
+}
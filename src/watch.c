@@ -0,0 +1,276 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * NetSurf Logging Filter File Watching
+ *
+ * The directory holding the filter file is watched, rather than the file
+ * itself, so that the file being replaced (as most editors and
+ * configuration management tools do) is noticed as readily as the file
+ * being rewritten in place.
+ */
+
+#include "nslog_internal.h"
+
+#ifdef __linux__
+
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/inotify.h>
+
+struct nslog_filter_watch_s {
+	char *path;
+	const char *leafname; /* within path */
+	int inotify_fd;
+	int wake_fd[2]; /* written to on stop */
+	pthread_t thread;
+	bool running; /* thread was started */
+	unsigned int loads;
+	unsigned int errors;
+};
+
+/* Read the whole of the filter file into a newly allocated buffer */
+static nslog_error nslog__watch_read(const char *path, char **text,
+				     size_t *len)
+{
+	size_t alloc = 4096, used = 0;
+	char *buf = malloc(alloc);
+	int fd;
+
+	if (buf == NULL)
+		return NSLOG_NO_MEMORY;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		free(buf);
+		return NSLOG_IO_ERROR;
+	}
+
+	for (;;) {
+		ssize_t got;
+		if (used == alloc) {
+			char *bigger = realloc(buf, alloc * 2);
+			if (bigger == NULL) {
+				close(fd);
+				free(buf);
+				return NSLOG_NO_MEMORY;
+			}
+			buf = bigger;
+			alloc *= 2;
+		}
+		got = read(fd, buf + used, alloc - used);
+		if (got == 0)
+			break;
+		if (got == -1) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			free(buf);
+			return NSLOG_IO_ERROR;
+		}
+		used += got;
+	}
+
+	close(fd);
+	*text = buf;
+	*len = used;
+	return NSLOG_NO_ERROR;
+}
+
+/* Load the filter file and make it the active filter.  If the file can't
+ * be read or parsed, the active filter is left alone.
+ */
+static void nslog__watch_load(nslog_filter_watch_t *watch)
+{
+	nslog_filter_t *filter = NULL;
+	nslog_error err;
+	char *text;
+	size_t len, i;
+
+	err = nslog__watch_read(watch->path, &text, &len);
+	if (err == NSLOG_NO_ERROR) {
+		for (i = 0; i < len && isspace((unsigned char)text[i]); i++)
+			;
+		/* An empty file means no filtering */
+		if (i < len)
+			err = nslog_filter_from_buffer(text, len, &filter);
+		free(text);
+	}
+	if (err == NSLOG_NO_ERROR) {
+		nslog_filter_set_active(filter, NULL);
+		nslog_filter_unref(filter);
+		__atomic_add_fetch(&watch->loads, 1, __ATOMIC_RELEASE);
+	} else {
+		__atomic_add_fetch(&watch->errors, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void *nslog__watch_thread(void *pw)
+{
+	nslog_filter_watch_t *watch = pw;
+	struct pollfd fds[2] = {
+		{ watch->inotify_fd, POLLIN, 0 },
+		{ watch->wake_fd[0], POLLIN, 0 },
+	};
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		bool changed = false;
+		ssize_t got, pos;
+
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents != 0)
+			break;
+
+		got = read(watch->inotify_fd, buf, sizeof(buf));
+		if (got <= 0)
+			continue;
+		/* Several events for the file are often queued at once (an
+		 * editor's write, then its rename) so load just once for
+		 * them all.
+		 */
+		for (pos = 0; pos < got; ) {
+			struct inotify_event *ev =
+				(struct inotify_event *)(buf + pos);
+			if (ev->len > 0 &&
+			    strcmp(ev->name, watch->leafname) == 0)
+				changed = true;
+			pos += sizeof(*ev) + ev->len;
+		}
+		if (changed)
+			nslog__watch_load(watch);
+	}
+
+	return NULL;
+}
+
+nslog_error nslog_filter_watch_start(const char *path,
+				     nslog_filter_watch_t **watch)
+{
+	nslog_filter_watch_t *ret = calloc(sizeof(*ret), 1);
+	char *dirname;
+	int wd;
+
+	if (ret == NULL)
+		return NSLOG_NO_MEMORY;
+	ret->inotify_fd = ret->wake_fd[0] = ret->wake_fd[1] = -1;
+
+	ret->path = strdup(path);
+	if (ret->path == NULL)
+		goto nomem;
+	ret->leafname = strrchr(ret->path, '/');
+	if (ret->leafname == NULL) {
+		ret->leafname = ret->path;
+		dirname = strdup(".");
+	} else {
+		ret->leafname++;
+		dirname = strndup(ret->path, ret->leafname - ret->path);
+	}
+	if (dirname == NULL)
+		goto nomem;
+
+	ret->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ret->inotify_fd == -1) {
+		free(dirname);
+		goto ioerror;
+	}
+	wd = inotify_add_watch(ret->inotify_fd, dirname,
+			       IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+	free(dirname);
+	if (wd == -1 || pipe2(ret->wake_fd, O_CLOEXEC) == -1)
+		goto ioerror;
+
+	/* Watch before loading so that no change can be missed */
+	nslog__watch_load(ret);
+
+	if (pthread_create(&ret->thread, NULL, nslog__watch_thread, ret) != 0)
+		goto nomem;
+	ret->running = true;
+
+	*watch = ret;
+	return NSLOG_NO_ERROR;
+
+nomem:
+	nslog_filter_watch_stop(ret);
+	return NSLOG_NO_MEMORY;
+ioerror:
+	nslog_filter_watch_stop(ret);
+	return NSLOG_IO_ERROR;
+}
+
+nslog_error nslog_filter_watch_status(nslog_filter_watch_t *watch,
+				      unsigned int *loads,
+				      unsigned int *errors)
+{
+	if (loads != NULL)
+		*loads = __atomic_load_n(&watch->loads, __ATOMIC_ACQUIRE);
+	if (errors != NULL)
+		*errors = __atomic_load_n(&watch->errors, __ATOMIC_ACQUIRE);
+	return NSLOG_NO_ERROR;
+}
+
+nslog_error nslog_filter_watch_stop(nslog_filter_watch_t *watch)
+{
+	if (watch == NULL)
+		return NSLOG_NO_ERROR;
+
+	if (watch->running) {
+		while (write(watch->wake_fd[1], "", 1) == -1 && errno == EINTR)
+			;
+		pthread_join(watch->thread, NULL);
+	}
+	if (watch->wake_fd[0] != -1)
+		close(watch->wake_fd[0]);
+	if (watch->wake_fd[1] != -1)
+		close(watch->wake_fd[1]);
+	if (watch->inotify_fd != -1)
+		close(watch->inotify_fd);
+	free(watch->path);
+	free(watch);
+
+	return NSLOG_NO_ERROR;
+}
+
+#else /* !__linux__ */
+
+nslog_error nslog_filter_watch_start(const char *path,
+				     nslog_filter_watch_t **watch)
+{
+	(void)path;
+	(void)watch;
+	return NSLOG_NOT_SUPPORTED;
+}
+
+nslog_error nslog_filter_watch_status(nslog_filter_watch_t *watch,
+				      unsigned int *loads,
+				      unsigned int *errors)
+{
+	(void)watch;
+	(void)loads;
+	(void)errors;
+	return NSLOG_NOT_SUPPORTED;
+}
+
+nslog_error nslog_filter_watch_stop(nslog_filter_watch_t *watch)
+{
+	(void)watch;
+	return NSLOG_NOT_SUPPORTED;
+}
+
+#endif
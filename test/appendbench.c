@@ -0,0 +1,148 @@
+/* test/appendbench.c
+ *
+ * Append sink benchmark for libnslog
+ *
+ * Copyright 2017 The NetSurf Browser Project
+ *                Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This is not run as part of the test suite.  Run it by hand as:
+ *
+ *     appendbench [processes] [records]
+ *
+ * It starts the given number of processes, each of which logs the given
+ * number of records to an append sink, first all sharing one file and then
+ * each with a file of its own as a baseline, both with and without
+ * batching.  The shared files are then checked for torn records.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "nslog/nslog.h"
+
+NSLOG_DEFINE_CATEGORY(bench, "Append sink benchmark");
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void writer(const char *path, bool batch, int records)
+{
+	nslog_append_sink_t *sink;
+	int i;
+
+	if (nslog_append_sink_open(path, batch, &sink) != NSLOG_NO_ERROR)
+		_exit(EXIT_FAILURE);
+	nslog_add_message_callback(nslog_append_sink_render, sink);
+	nslog_uncork();
+	for (i = 0; i < records; i++)
+		NSLOG(bench, INFO, "worker %d record %d of %d: %s",
+		      (int)getpid(), i, records,
+		      "fetch http://www.netsurf-browser.org/ finished");
+	nslog_remove_message_callback(nslog_append_sink_render, sink);
+	if (nslog_append_sink_destroy(sink) != NSLOG_NO_ERROR)
+		_exit(EXIT_FAILURE);
+	nslog_cleanup();
+	_exit(EXIT_SUCCESS);
+}
+
+/* Count the records in a file, and those which aren't whole */
+static int check(const char *path, int *torn)
+{
+	FILE *f = fopen(path, "r");
+	char line[1024];
+	int lines = 0;
+
+	*torn = 0;
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		size_t len = strlen(line);
+		if (len == 0 || line[len - 1] != '\n' ||
+		    strstr(line, " bench ") == NULL ||
+		    strstr(line, " finished\n") == NULL)
+			(*torn)++;
+		lines++;
+	}
+	fclose(f);
+	return lines;
+}
+
+static double run(const char *dir, bool shared, bool batch,
+		  int processes, int records)
+{
+	char path[256];
+	double start, secs;
+	int i, failed = 0, lines = 0, torn = 0;
+
+	start = now();
+	for (i = 0; i < processes; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		if (pid == 0) {
+			snprintf(path, sizeof(path), "%s/%d.log", dir,
+				 shared ? 0 : i);
+			writer(path, batch, records);
+		}
+	}
+	for (i = 0; i < processes; i++) {
+		int status;
+		if (wait(&status) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != EXIT_SUCCESS)
+			failed++;
+	}
+	secs = now() - start;
+
+	for (i = 0; i < (shared ? 1 : processes); i++) {
+		int t;
+		snprintf(path, sizeof(path), "%s/%d.log", dir, i);
+		lines += check(path, &t);
+		torn += t;
+		unlink(path);
+	}
+	if (failed != 0 || lines != processes * records || torn != 0)
+		printf("  %d writers failed, %d of %d records, %d torn\n",
+		       failed, lines, processes * records, torn);
+
+	return (processes * records) / secs;
+}
+
+int main(int argc, char **argv)
+{
+	int processes = (argc > 1) ? atoi(argv[1]) : 4;
+	int records = (argc > 2) ? atoi(argv[2]) : 100000;
+	char dir[] = "/tmp/appendbench-XXXXXX";
+
+	if (processes < 1 || records < 1) {
+		fprintf(stderr, "usage: %s [processes] [records]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	printf("%d processes, %d records each\n", processes, records);
+	printf("shared file:             %.1f records/s\n",
+	       run(dir, true, false, processes, records));
+	printf("shared file, batched:    %.1f records/s\n",
+	       run(dir, true, true, processes, records));
+	printf("file per process:        %.1f records/s\n",
+	       run(dir, false, false, processes, records));
+	printf("file per process, batch: %.1f records/s\n",
+	       run(dir, false, true, processes, records));
+
+	rmdir(dir);
+
+	return EXIT_SUCCESS;
+}
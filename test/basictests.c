@@ -11,6 +11,17 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include "tests.h"
 
@@ -20,6 +31,12 @@
 
 NSLOG_DEFINE_CATEGORY(test, "Top level test category");
 NSLOG_DEFINE_SUBCATEGORY(test, sub, "Lower level test category");
+NSLOG_DECLARE_CATEGORY_LEVEL(hot, WARNING);
+NSLOG_DEFINE_SUBCATEGORY_LEVEL(test, hot, "Test category built without debug",
+			       WARNING);
+
+/* The library's own category, in which sink statistics are reported */
+NSLOG_DECLARE_CATEGORY(nslog);
 
 static void *captured_render_context = NULL;
 static nslog_entry_context_t captured_context = { 0 };
@@ -130,6 +147,82 @@ START_TEST (test_nslog_subcategory_name)
 }
 END_TEST
 
+static int compiled_out_calls = 0;
+
+static int compiled_out_call(void)
+{
+	return ++compiled_out_calls;
+}
+
+START_TEST (test_nslog_category_compiled_level)
+{
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	compiled_out_calls = 0;
+	NSLOG(hot, DEBUG, "Compiled out %d", compiled_out_call());
+	NSLOG(hot, INFO, "Compiled out %d", compiled_out_call());
+	fail_unless(compiled_out_calls == 0,
+		    "Compiled out entry's arguments were evaluated");
+	fail_unless(captured_message_count == 0,
+		    "Compiled out entry was delivered");
+	NSLOG(hot, WARNING, "Compiled in %d", compiled_out_call());
+	fail_unless(captured_message_count == 1,
+		    "Compiled in entry wasn't delivered");
+	fail_unless(strcmp(captured_rendered_message, "Compiled in 1") == 0,
+		    "Captured message wasn't correct");
+	fail_unless(strcmp(captured_context.category->name, "test/hot") == 0,
+		    "Captured context category wasn't normalised");
+	/* The parent's level is its own */
+	NSLOG(test, DEBUG, "Still here");
+	fail_unless(captured_message_count == 2,
+		    "Parent category's entry wasn't delivered");
+}
+END_TEST
+
+START_TEST (test_nslog_level_map)
+{
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_set_level_map("test:WARN, test/sub : debug,te:CRIT")
+		    == NSLOG_NO_ERROR,
+		    "Unable to set level map");
+	NSLOG(test, INFO, "Dropped");
+	NSLOG(sub, DEEPDEBUG, "Dropped");
+	fail_unless(captured_message_count == 0,
+		    "Entries below the map's level were delivered");
+	NSLOG(test, WARNING, "Kept");
+	NSLOG(sub, DEBUG, "Kept");
+	fail_unless(captured_message_count == 2,
+		    "Entries at the map's level were dropped");
+
+	/* A bad map leaves the current one in place */
+	fail_unless(nslog_set_level_map("test:LOUD") == NSLOG_PARSE_ERROR,
+		    "Bad level name wasn't rejected");
+	fail_unless(nslog_set_level_map("test WARN") == NSLOG_PARSE_ERROR,
+		    "Missing colon wasn't rejected");
+	NSLOG(test, INFO, "Dropped");
+	fail_unless(captured_message_count == 2,
+		    "Level map was lost");
+
+	/* Replacing the map makes categories look their level up again */
+	fail_unless(nslog_set_level_map("*:ERR, test/sub:INFO")
+		    == NSLOG_NO_ERROR,
+		    "Unable to set level map");
+	NSLOG(test, WARNING, "Dropped");
+	NSLOG(sub, INFO, "Kept");
+	fail_unless(captured_message_count == 3,
+		    "Replacement map wasn't used");
+	fail_unless(strcmp(captured_rendered_message, "Kept") == 0,
+		    "Captured message wasn't correct");
+
+	fail_unless(nslog_set_level_map(NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear level map");
+	NSLOG(test, DEBUG, "Kept");
+	fail_unless(captured_message_count == 4,
+		    "Cleared map still applied");
+}
+END_TEST
+
 START_TEST (test_nslog_two_corked_messages)
 {
 	NSLOG(test, INFO, "First");
@@ -155,6 +248,265 @@ START_TEST (test_nslog_two_corked_messages)
 }
 END_TEST
 
+START_TEST (test_nslog_long_corked_message)
+{
+	char longstr[3000];
+	memset(longstr, 'x', sizeof(longstr) - 1);
+	longstr[sizeof(longstr) - 1] = '\0';
+	NSLOG(test, INFO, "Short %d", 1);
+	NSLOG(test, INFO, "Long %s!", longstr);
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(captured_message_count == 2,
+		    "Captured message count was wrong");
+	fail_unless(captured_rendered_message_length == 3005,
+		    "Captured message wasn't correct length");
+	fail_unless(strncmp(captured_rendered_message, "Long xxx", 8) == 0 &&
+		    captured_rendered_message[3004] == '!',
+		    "Captured message wasn't correct");
+}
+END_TEST
+
+#define CORK_THREADS 4
+#define CORK_MESSAGES 200
+
+static int cork_next[CORK_THREADS + 1];
+static bool cork_in_order;
+
+static void
+nslog__test__cork_order_function(void *_ctx, nslog_entry_context_t *ctx,
+				 const char *fmt, va_list args)
+{
+	char msg[32];
+	int thread = -1, n = -1;
+	UNUSED(_ctx);
+	UNUSED(ctx);
+	/* Corked messages arrive pre-rendered, so render them all */
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	sscanf(msg, "%d %d", &thread, &n);
+	/* Each thread's messages must come out in the order it logged them,
+	 * and the main thread's last message must come out last of all.
+	 */
+	if (thread < 0 || thread > CORK_THREADS || n != cork_next[thread]++)
+		cork_in_order = false;
+	if (thread != CORK_THREADS && cork_next[CORK_THREADS] != 0)
+		cork_in_order = false;
+	captured_message_count++;
+}
+
+static void *
+cork_thread(void *pw)
+{
+	int thread = (int)(intptr_t)pw;
+	int n;
+	for (n = 0; n < CORK_MESSAGES; n++)
+		NSLOG(test, INFO, "%d %d", thread, n);
+	return NULL;
+}
+
+START_TEST (test_nslog_threaded_corked_messages)
+{
+	pthread_t threads[CORK_THREADS];
+	int i;
+	memset(cork_next, 0, sizeof(cork_next));
+	cork_in_order = true;
+	fail_unless(nslog_set_render_callback(
+			    nslog__test__cork_order_function,
+			    NULL) == NSLOG_NO_ERROR,
+		    "Unable to set up render callback");
+	for (i = 0; i < CORK_THREADS; i++)
+		fail_unless(pthread_create(&threads[i], NULL, cork_thread,
+					   (void *)(intptr_t)i) == 0,
+			    "Unable to start thread");
+	for (i = 0; i < CORK_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	NSLOG(test, INFO, "%d %d", CORK_THREADS, 0);
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(captured_message_count == CORK_THREADS * CORK_MESSAGES + 1,
+		    "Corked messages lost");
+	fail_unless(cork_in_order,
+		    "Corked messages delivered out of order");
+}
+END_TEST
+
+static pthread_barrier_t cleanup_barrier;
+
+static void *
+cleanup_thread(void *arg)
+{
+	UNUSED(arg);
+	NSLOG(test, INFO, "Before cleanup");
+	pthread_barrier_wait(&cleanup_barrier);
+	/* The main thread cleans up, freeing this thread's cork buffer */
+	pthread_barrier_wait(&cleanup_barrier);
+	NSLOG(test, INFO, "After cleanup");
+	return NULL;
+}
+
+START_TEST (test_nslog_log_after_cleanup)
+{
+	pthread_t thread;
+	pthread_barrier_init(&cleanup_barrier, NULL, 2);
+	fail_unless(pthread_create(&thread, NULL, cleanup_thread, NULL) == 0,
+		    "Unable to start thread");
+	pthread_barrier_wait(&cleanup_barrier);
+	fail_unless(captured_message_count == 0,
+		    "Corked message delivered early");
+	nslog_cleanup();
+	fail_unless(captured_message_count == 1,
+		    "Corked message not delivered by cleanup");
+	pthread_barrier_wait(&cleanup_barrier);
+	pthread_join(thread, NULL);
+	pthread_barrier_destroy(&cleanup_barrier);
+	fail_unless(captured_message_count == 2,
+		    "Message logged after cleanup was lost");
+	fail_unless(strcmp(captured_rendered_message, "After cleanup") == 0,
+		    "Message logged after cleanup was wrong");
+}
+END_TEST
+
+#define RACE_CATEGORIES 64
+#define RACE_THREADS 4
+
+static nslog_category_t race_categories[RACE_CATEGORIES];
+static char race_names[RACE_CATEGORIES][8];
+static pthread_barrier_t race_barrier;
+
+static void
+nslog__test__discard_function(void *_ctx, nslog_entry_context_t *ctx,
+			      const char *fmt, va_list args)
+{
+	UNUSED(_ctx);
+	UNUSED(ctx);
+	UNUSED(fmt);
+	UNUSED(args);
+}
+
+static void *
+race_thread(void *arg)
+{
+	nslog_entry_context_t ctx;
+	int i;
+	UNUSED(arg);
+	pthread_barrier_wait(&race_barrier);
+	for (i = 0; i < RACE_CATEGORIES; i++) {
+		memset(&ctx, 0, sizeof(ctx));
+		ctx.category = &race_categories[i];
+		ctx.level = NSLOG_LEVEL_INFO;
+		ctx.filename = __FILE__;
+		ctx.filenamelen = strlen(__FILE__);
+		ctx.funcname = __func__;
+		ctx.funcnamelen = strlen(__func__);
+		ctx.lineno = __LINE__;
+		nslog__log(&ctx, "First use");
+	}
+	return NULL;
+}
+
+static void
+nslog__test__race_category_function(void *context, nslog_category_t *cat)
+{
+	int *seen = context;
+	if (cat >= race_categories && cat < race_categories + RACE_CATEGORIES)
+		seen[cat - race_categories]++;
+}
+
+START_TEST (test_nslog_category_first_use_race)
+{
+	pthread_t threads[RACE_THREADS];
+	int seen[RACE_CATEGORIES];
+	int i;
+	memset(race_categories, 0, sizeof(race_categories));
+	for (i = 0; i < RACE_CATEGORIES; i++) {
+		snprintf(race_names[i], sizeof(race_names[i]), "race%d", i);
+		race_categories[i].cat_name = race_names[i];
+	}
+	fail_unless(nslog_set_render_callback(
+			    nslog__test__discard_function,
+			    NULL) == NSLOG_NO_ERROR,
+		    "Unable to set up render callback");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	pthread_barrier_init(&race_barrier, NULL, RACE_THREADS);
+	for (i = 0; i < RACE_THREADS; i++)
+		fail_unless(pthread_create(&threads[i], NULL, race_thread,
+					   NULL) == 0,
+			    "Unable to start thread");
+	for (i = 0; i < RACE_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&race_barrier);
+
+	/* Each category is listed exactly once, however many threads
+	 * raced to use it first
+	 */
+	memset(seen, 0, sizeof(seen));
+	fail_unless(nslog_category_foreach(nslog__test__race_category_function,
+					   seen) == NSLOG_NO_ERROR,
+		    "Unable to list categories");
+	for (i = 0; i < RACE_CATEGORIES; i++)
+		fail_unless(seen[i] == 1 &&
+			    strcmp(race_categories[i].name, race_names[i]) == 0,
+			    "Category %d listed %d times", i, seen[i]);
+}
+END_TEST
+
+#define STATS_ENTRIES 100
+
+static void *
+stats_thread(void *arg)
+{
+	int i;
+	UNUSED(arg);
+	for (i = 0; i < STATS_ENTRIES; i++) {
+		NSLOG(test, INFO, "Counted %d", i);
+		NSLOG(test, DEBUG, "Gated %d", i);
+	}
+	return NULL;
+}
+
+START_TEST (test_nslog_threaded_stats)
+{
+	pthread_t threads[RACE_THREADS];
+	nslog_stats_t before, after;
+	int round, i;
+	fail_unless(nslog_set_render_callback(
+			    nslog__test__discard_function,
+			    NULL) == NSLOG_NO_ERROR,
+		    "Unable to set up render callback");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_set_level_enabled(NSLOG_LEVEL_DEBUG, false) ==
+		    NSLOG_NO_ERROR,
+		    "Unable to disable a level");
+	fail_unless(nslog_get_stats(&before) == NSLOG_NO_ERROR,
+		    "Unable to read statistics");
+	/* The second round's threads take over the first round's counts */
+	for (round = 1; round <= 2; round++) {
+		for (i = 0; i < RACE_THREADS; i++)
+			fail_unless(pthread_create(&threads[i], NULL,
+						   stats_thread, NULL) == 0,
+				    "Unable to start thread");
+		for (i = 0; i < RACE_THREADS; i++)
+			pthread_join(threads[i], NULL);
+		fail_unless(nslog_get_stats(&after) == NSLOG_NO_ERROR,
+			    "Unable to read statistics");
+		fail_unless(after.entries - before.entries ==
+			    (unsigned long)round * RACE_THREADS *
+			    STATS_ENTRIES * 2 &&
+			    after.gated - before.gated ==
+			    (unsigned long)round * RACE_THREADS *
+			    STATS_ENTRIES &&
+			    after.delivered - before.delivered ==
+			    (unsigned long)round * RACE_THREADS *
+			    STATS_ENTRIES &&
+			    after.filtered == before.filtered,
+			    "Statistics miscounted in round %d", round);
+	}
+	nslog_set_level_enabled(NSLOG_LEVEL_DEBUG, true);
+}
+END_TEST
+
 START_TEST (test_nslog_check_bad_level)
 {
 	fail_unless(strcmp(nslog_level_name((nslog_level)-1),
@@ -163,6 +515,64 @@ START_TEST (test_nslog_check_bad_level)
 }
 END_TEST
 
+static void
+nslog__test__signal_handler(int sig)
+{
+	NSLOG_SIGNAL_VALUE(sub, ERROR, "Caught signal", sig);
+}
+
+START_TEST (test_nslog_signal_flush)
+{
+	char buf[4096], expect[64];
+	char *corked, *caught, *after;
+	int fds[2];
+	ssize_t got;
+
+	NSLOG(test, INFO, "Corked %s", "earlier");
+	signal(SIGUSR1, nslog__test__signal_handler);
+	raise(SIGUSR1);
+	signal(SIGUSR1, SIG_DFL);
+	NSLOG_SIGNAL(test, DEBUG, "Not in a handler");
+
+	fail_unless(pipe(fds) == 0, "Unable to make a pipe");
+	fail_unless(nslog_signal_flush(fds[1]) == NSLOG_NO_ERROR,
+		    "Unable to flush");
+	/* Nothing is written twice */
+	fail_unless(nslog_signal_flush(fds[1]) == NSLOG_NO_ERROR,
+		    "Unable to flush again");
+	close(fds[1]);
+	got = read(fds[0], buf, sizeof(buf) - 1);
+	close(fds[0]);
+	fail_unless(got > 0, "Nothing was flushed");
+	buf[got] = '\0';
+
+	corked = strstr(buf, " INFO test test/basictests.c:");
+	fail_unless(corked != NULL, "Corked entry wasn't flushed");
+	fail_unless(strstr(corked, ": Corked earlier\n") != NULL,
+		    "Corked entry wasn't rendered");
+	caught = strstr(buf, " ERR  test/sub test/basictests.c:");
+	fail_unless(caught != NULL, "Signal entry wasn't flushed");
+	snprintf(expect, sizeof(expect),
+		 " nslog__test__signal_handler: Caught signal 0x%x\n",
+		 SIGUSR1);
+	fail_unless(strstr(caught, expect) != NULL,
+		    "Signal entry wasn't rendered");
+	after = strstr(buf, " DBG  test ");
+	fail_unless(after != NULL, "Second signal entry wasn't flushed");
+	fail_unless(corked < caught && caught < after,
+		    "Entries were flushed out of order");
+	fail_unless(strstr(after, "Not in a handler\n") != NULL &&
+		    strchr(after, '\n')[1] == '\0',
+		    "Entries were flushed more than once");
+
+	/* The corked entry is still delivered as normal */
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(captured_message_count == 1,
+		    "Captured message count was wrong");
+}
+END_TEST
+
 /**** The next set of tests need a fixture set for filters ****/
 
 static nslog_filter_t *cat_test = NULL;
@@ -295,6 +705,53 @@ START_TEST (test_nslog_simple_filter_out_subcategory_message)
 }
 END_TEST
 
+static bool swap_stop;
+
+static void *
+swap_thread(void *arg)
+{
+	UNUSED(arg);
+	while (!__atomic_load_n(&swap_stop, __ATOMIC_RELAXED))
+		NSLOG(test, INFO, "Matching while the filter changes");
+	return NULL;
+}
+
+START_TEST (test_nslog_filter_swap_while_logging)
+{
+	pthread_t threads[RACE_THREADS];
+	nslog_filter_t *filter;
+	char name[16];
+	int i;
+	fail_unless(nslog_set_render_callback(
+			    nslog__test__discard_function,
+			    NULL) == NSLOG_NO_ERROR,
+		    "Unable to set up render callback");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	swap_stop = false;
+	for (i = 0; i < RACE_THREADS; i++)
+		fail_unless(pthread_create(&threads[i], NULL, swap_thread,
+					   NULL) == 0,
+			    "Unable to start thread");
+	/* Each filter is only held active, so is freed once retired, while
+	 * the other threads may still be matching against it
+	 */
+	for (i = 0; i < 20000; i++) {
+		snprintf(name, sizeof(name), "s%d", i % 1000);
+		fail_unless(nslog_filter_category_new(name, &filter) ==
+			    NSLOG_NO_ERROR,
+			    "Unable to create a category filter");
+		fail_unless(nslog_filter_set_active(filter, NULL) ==
+			    NSLOG_NO_ERROR,
+			    "Unable to set active filter");
+		nslog_filter_unref(filter);
+	}
+	__atomic_store_n(&swap_stop, true, __ATOMIC_RELAXED);
+	for (i = 0; i < RACE_THREADS; i++)
+		pthread_join(threads[i], NULL);
+}
+END_TEST
+
 START_TEST (test_nslog_basic_filter_sprintf)
 {
 	char *ct = nslog_filter_sprintf(cat_test);
@@ -359,6 +816,212 @@ START_TEST (test_nslog_parse_and_sprintf_all_kinds)
 }
 END_TEST
 
+START_TEST (test_nslog_parse_from_buffer)
+{
+	nslog_filter_t *filt = NULL;
+	const char input[] = "(cat:test &&\n\tlvl:WARN)(garbage";
+	fail_unless(nslog_filter_from_buffer(input, 23, &filt) == NSLOG_NO_ERROR,
+		    "Unable to parse length-delimited filter");
+	fail_unless(filt != NULL,
+		    "Strange, despite parsing okay, filt was NULL");
+	char *ct = nslog_filter_sprintf(filt);
+	nslog_filter_unref(filt);
+	fail_unless(strcmp(ct, "(cat:test && lvl:WARNING)") == 0,
+		    "Printed parsed buffer not right");
+	free(ct);
+	fail_unless(nslog_filter_from_buffer(input, 12, &filt) == NSLOG_PARSE_ERROR,
+		    "Truncated filter parsed");
+}
+END_TEST
+
+START_TEST (test_nslog_parse_cache)
+{
+	nslog_filter_t *a, *b;
+	unsigned long hits, misses, hits0, misses0;
+	char text[16];
+	int i;
+	fail_unless(nslog_filter_cache_stats(&hits0, &misses0) == NSLOG_NO_ERROR,
+		    "Unable to read parse cache statistics");
+	fail_unless(nslog_filter_from_text("cat:test", &a) == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	nslog_filter_unref(a);
+	nslog_filter_cache_stats(&hits, &misses);
+	fail_unless(hits == hits0 && misses == misses0,
+		    "Parse cache used while disabled");
+	fail_unless(nslog_filter_cache_set_size(2) == NSLOG_NO_ERROR,
+		    "Unable to enable the parse cache");
+	fail_unless(nslog_filter_from_text("cat:test", &a) == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	fail_unless(nslog_filter_from_buffer("cat:test)", 8, &b) == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	fail_unless(a == b,
+		    "Repeated parse returned a different filter");
+	nslog_filter_cache_stats(&hits, &misses);
+	fail_unless(hits == hits0 + 1 && misses == misses0 + 1,
+		    "Repeated parse not satisfied from the cache");
+	b = nslog_filter_unref(b);
+	fail_unless(nslog_filter_from_text("lvl:INFO", &b) == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	b = nslog_filter_unref(b);
+	fail_unless(nslog_filter_from_text("cat:test", &b) == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	b = nslog_filter_unref(b);
+	nslog_filter_cache_stats(&hits, &misses);
+	fail_unless(hits == hits0 + 2 && misses == misses0 + 2,
+		    "Recently used filter evicted from the cache");
+	fail_unless(nslog_filter_from_text("lvl:WARN", &b) == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	b = nslog_filter_unref(b);
+	fail_unless(nslog_filter_from_text("lvl:INFO", &b) == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	b = nslog_filter_unref(b);
+	nslog_filter_cache_stats(&hits, &misses);
+	fail_unless(hits == hits0 + 2 && misses == misses0 + 4,
+		    "Least recently used filter not evicted from the cache");
+	fail_unless(nslog_filter_from_text("cat:test &&", &b) == NSLOG_PARSE_ERROR,
+		    "Bad filter parsed with the cache enabled");
+	/* Many entries, found through the cache's table as it grows */
+	fail_unless(nslog_filter_cache_set_size(100) == NSLOG_NO_ERROR,
+		    "Unable to resize the parse cache");
+	nslog_filter_cache_stats(&hits, &misses);
+	for (i = 0; i < 200; i++) {
+		snprintf(text, sizeof(text), "cat:c%d", i % 100);
+		fail_unless(nslog_filter_from_text(text, &b) == NSLOG_NO_ERROR,
+			    "Unable to parse filter");
+		b = nslog_filter_unref(b);
+	}
+	nslog_filter_cache_stats(&hits0, &misses0);
+	fail_unless(hits0 == hits + 100 && misses0 == misses + 100,
+		    "Parse cache didn't keep every entry");
+	fail_unless(nslog_filter_cache_set_size(50) == NSLOG_NO_ERROR,
+		    "Unable to shrink the parse cache");
+	for (i = 99; i >= 49; i--) {
+		snprintf(text, sizeof(text), "cat:c%d", i);
+		fail_unless(nslog_filter_from_text(text, &b) == NSLOG_NO_ERROR,
+			    "Unable to parse filter");
+		b = nslog_filter_unref(b);
+	}
+	nslog_filter_cache_stats(&hits, &misses);
+	fail_unless(hits == hits0 + 50 && misses == misses0 + 1,
+		    "Shrinking the parse cache kept the wrong entries");
+	fail_unless(nslog_filter_cache_set_size(0) == NSLOG_NO_ERROR,
+		    "Unable to disable the parse cache");
+	/* The cache's references are gone, ours is still good */
+	char *ct = nslog_filter_sprintf(a);
+	fail_unless(strcmp(ct, "cat:test") == 0,
+		    "Cached filter damaged by disabling the cache");
+	free(ct);
+	nslog_filter_unref(a);
+}
+END_TEST
+
+START_TEST (test_nslog_filter_interning)
+{
+	nslog_filter_t *a, *b, *c, *d;
+	fail_unless(nslog_filter_from_text("(cat:foo && !lvl:INFO)", &a) ==
+		    NSLOG_NO_ERROR, "Unable to parse filter");
+	fail_unless(nslog_filter_from_text("(cat:foo&&!lvl:INFO)", &b) ==
+		    NSLOG_NO_ERROR, "Unable to parse filter");
+	fail_unless(a == b,
+		    "Identical filters not shared");
+	b = nslog_filter_unref(b);
+	fail_unless(nslog_filter_from_text("(cat:foo || !lvl:INFO)", &b) ==
+		    NSLOG_NO_ERROR, "Unable to parse filter");
+	fail_unless(a != b,
+		    "Different filters shared");
+	fail_unless(nslog_filter_category_new("foo", &c) == NSLOG_NO_ERROR,
+		    "Unable to make category filter");
+	fail_unless(nslog_filter_filename_new("foo", &d) == NSLOG_NO_ERROR,
+		    "Unable to make filename filter");
+	fail_unless(c != d,
+		    "Filters of different kinds shared");
+	nslog_filter_unref(d);
+	nslog_filter_unref(a);
+	/* Dropping a must not release the subtree b still shares */
+	char *ct = nslog_filter_sprintf(b);
+	fail_unless(strcmp(ct, "(cat:foo || !lvl:INFO)") == 0,
+		    "Shared subtree damaged by unref");
+	free(ct);
+	nslog_filter_unref(b);
+	nslog_filter_unref(c);
+}
+END_TEST
+
+
+START_TEST (test_nslog_filter_serialise)
+{
+	const char *sub =
+		"((cat:foo/bar && !file:baz.c) ^ (dir:src && !func:main))";
+	const char *text =
+		"((cat:foo/bar && !file:baz.c) || "
+		"((cat:foo/bar && !file:baz.c) ^ (dir:src && !func:main)))";
+	nslog_filter_t *filt, *copy;
+	void *data;
+	size_t len, sublen;
+	fail_unless(nslog_filter_from_text(sub, &filt) == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	fail_unless(nslog_filter_serialise(filt, &data, &sublen) ==
+		    NSLOG_NO_ERROR,
+		    "Unable to serialise filter");
+	free(data);
+	nslog_filter_unref(filt);
+	fail_unless(nslog_filter_from_text(text, &filt) == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	fail_unless(nslog_filter_serialise(filt, &data, &len) == NSLOG_NO_ERROR,
+		    "Unable to serialise filter");
+	/* The left of the 'or' is shared with the right, so only the 'or'
+	 * itself should add to the length: a kind and two input references
+	 */
+	fail_unless(len == sublen + 3,
+		    "Shared subtree serialised more than once");
+	fail_unless(nslog_filter_deserialise(data, len, &copy) == NSLOG_NO_ERROR,
+		    "Unable to deserialise filter");
+	fail_unless(copy == filt,
+		    "Deserialised filter differs");
+	nslog_filter_unref(copy);
+	fail_unless(nslog_filter_deserialise(data, len - 1, &copy) ==
+		    NSLOG_PARSE_ERROR,
+		    "Truncated binary filter accepted");
+	((unsigned char *)data)[4]++;
+	fail_unless(nslog_filter_deserialise(data, len, &copy) ==
+		    NSLOG_NOT_SUPPORTED,
+		    "Binary filter from a future version accepted");
+	free(data);
+	nslog_filter_unref(filt);
+}
+END_TEST
+
+START_TEST (test_nslog_filter_deserialise_garbage)
+{
+	/* A 'not' whose input refers beyond the start of the filter */
+	const unsigned char bad_ref[] = { 'N', 'S', 'L', 'F', 1, 2,
+					  1, 4, 2, 8, 2 };
+	/* A level out of range */
+	const unsigned char bad_level[] = { 'N', 'S', 'L', 'F', 1, 1, 1, 99 };
+	/* A string which runs off the end */
+	const unsigned char bad_str[] = { 'N', 'S', 'L', 'F', 1, 1,
+					  0, 9, 'f', 'o', 'o' };
+	const unsigned char good[] = { 'N', 'S', 'L', 'F', 1, 2,
+				       1, 4, 8, 1 };
+	nslog_filter_t *filt;
+	fail_unless(nslog_filter_deserialise(bad_ref, sizeof(bad_ref), &filt) ==
+		    NSLOG_PARSE_ERROR, "Bad input reference accepted");
+	fail_unless(nslog_filter_deserialise(bad_level, sizeof(bad_level), &filt)
+		    == NSLOG_PARSE_ERROR, "Bad level accepted");
+	fail_unless(nslog_filter_deserialise(bad_str, sizeof(bad_str), &filt) ==
+		    NSLOG_PARSE_ERROR, "Overlong string accepted");
+	fail_unless(nslog_filter_deserialise("NSLX", 4, &filt) ==
+		    NSLOG_PARSE_ERROR, "Bad magic accepted");
+	fail_unless(nslog_filter_deserialise(good, sizeof(good), &filt) ==
+		    NSLOG_NO_ERROR, "Hand-made binary filter rejected");
+	char *ct = nslog_filter_sprintf(filt);
+	fail_unless(strcmp(ct, "!lvl:WARNING") == 0,
+		    "Hand-made binary filter decoded wrongly");
+	free(ct);
+	nslog_filter_unref(filt);
+}
+END_TEST
+
 /**** The next set of tests need a fixture set for a variety of filters ****/
 
 static const char *anchor_context_3 = "3";
@@ -445,6 +1108,299 @@ START_TEST (test_nslog_filter_out_filename)
 }
 END_TEST
 
+START_TEST (test_nslog_filter_out_same_length_filename)
+{
+	nslog_filter_t *filter;
+	fail_unless(nslog_filter_filename_new("basictestz.c", &filter) == NSLOG_NO_ERROR,
+		    "Unable to create filename filter");
+	fail_unless(nslog_filter_set_active(filter, NULL) == NSLOG_NO_ERROR,
+		    "Unable to set active filter to file:basictestz.c");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	NSLOG(test, WARN, "Hello");
+	fail_unless(captured_message_count == 0,
+		    "Captured message count was wrong");
+	filter = nslog_filter_unref(filter);
+}
+END_TEST
+
+START_TEST (test_nslog_site_data)
+{
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	NSLOG(test, WARN, "Hello");
+	fail_unless(captured_message_count == 1,
+		    "Captured message count was wrong");
+	fail_unless(captured_context.site.computed,
+		    "Site data was not computed");
+	fail_unless(captured_context.site.leafoffset == 5,
+		    "Leafname offset was wrong");
+	fail_unless(captured_context.site.dirnamelen == 4,
+		    "Dirname length was wrong");
+}
+END_TEST
+
+static void
+write_filter_file(const char *path, const char *text)
+{
+	FILE *f = fopen(path, "w");
+	fail_unless(f != NULL, "Unable to write filter file");
+	fputs(text, f);
+	fclose(f);
+}
+
+static void
+wait_for_watch(nslog_filter_watch_t *watch, unsigned int loads,
+	       unsigned int errors)
+{
+	struct timespec delay = { 0, 10000000 };
+	unsigned int l, e;
+	int tries;
+	for (tries = 0; tries < 200; tries++) {
+		nslog_filter_watch_status(watch, &l, &e);
+		if (l == loads && e == errors)
+			break;
+		nanosleep(&delay, NULL);
+	}
+	fail_unless(l == loads && e == errors,
+		    "Filter file watch didn't reload (%u loads, %u errors)",
+		    l, e);
+}
+
+START_TEST (test_nslog_filter_watch)
+{
+	char dir[] = "/tmp/nslogtestXXXXXX";
+	char path[64], tmppath[64];
+	nslog_filter_watch_t *watch;
+	fail_unless(mkdtemp(dir) != NULL,
+		    "Unable to make temporary directory");
+	snprintf(path, sizeof(path), "%s/filter", dir);
+	snprintf(tmppath, sizeof(tmppath), "%s/filter.new", dir);
+	write_filter_file(path, "cat:nothere\n");
+	fail_unless(nslog_filter_watch_start(path, &watch) == NSLOG_NO_ERROR,
+		    "Unable to watch filter file");
+	wait_for_watch(watch, 1, 0);
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	NSLOG(test, WARN, "Hello");
+	fail_unless(captured_message_count == 0,
+		    "Initial filter file not loaded");
+	/* Rewritten in place */
+	write_filter_file(path, "(cat:test &&\n  lvl:WARN)\n");
+	wait_for_watch(watch, 2, 0);
+	NSLOG(test, WARN, "Hello");
+	NSLOG(test, INFO, "Hello");
+	fail_unless(captured_message_count == 1,
+		    "Rewritten filter file not loaded");
+	/* A broken filter leaves the last good one active */
+	write_filter_file(path, "(cat:test &&");
+	wait_for_watch(watch, 2, 1);
+	NSLOG(test, WARN, "Hello");
+	NSLOG(test, INFO, "Hello");
+	fail_unless(captured_message_count == 2,
+		    "Broken filter file replaced the active filter");
+	/* Replaced, as an editor would */
+	write_filter_file(tmppath, "lvl:INFO");
+	fail_unless(rename(tmppath, path) == 0,
+		    "Unable to replace filter file");
+	wait_for_watch(watch, 3, 1);
+	NSLOG(test, INFO, "Hello");
+	fail_unless(captured_message_count == 3,
+		    "Replaced filter file not loaded");
+	/* Other files in the directory are ignored */
+	write_filter_file(tmppath, "cat:nothere");
+	fail_unless(nslog_filter_watch_stop(watch) == NSLOG_NO_ERROR,
+		    "Unable to stop watching filter file");
+	unlink(tmppath);
+	unlink(path);
+	rmdir(dir);
+	NSLOG(test, INFO, "Hello");
+	fail_unless(captured_message_count == 4,
+		    "Filter changed by an unrelated file");
+}
+END_TEST
+
+static void
+control_command(int fd, const char *cmd, char *reply, size_t len)
+{
+	size_t used = 0;
+	fail_unless(write(fd, cmd, strlen(cmd)) == (ssize_t)strlen(cmd),
+		    "Unable to send control command");
+	reply[0] = '\0';
+	while (used < len - 1) {
+		char *last;
+		ssize_t got = read(fd, reply + used, len - used - 1);
+		fail_unless(got > 0, "Control socket closed early");
+		used += got;
+		reply[used] = '\0';
+		if (used == 0 || reply[used - 1] != '\n')
+			continue;
+		/* Find the start of the last line */
+		reply[used - 1] = '\0';
+		last = strrchr(reply, '\n');
+		last = (last == NULL) ? reply : last + 1;
+		reply[used - 1] = '\n';
+		if (strcmp(last, "OK\n") == 0 || strncmp(last, "ERR ", 4) == 0)
+			return;
+	}
+	fail_unless(false, "Control reply too long");
+}
+
+static unsigned int flush_count;
+
+static void
+nslog__test__flush_function(void *context)
+{
+	fail_unless(context == anchor_context_3,
+		    "Flush context wasn't passed through");
+	flush_count++;
+}
+
+START_TEST (test_nslog_control_socket)
+{
+	char dir[] = "/tmp/nslogtestXXXXXX";
+	struct sockaddr_un addr;
+	char reply[1024];
+	struct timespec pause = { 0, 200000000 };
+	nslog_control_t *control;
+	nslog_stats_t stats;
+	struct stat st;
+	size_t used;
+	int fd, i;
+	fail_unless(mkdtemp(dir) != NULL,
+		    "Unable to make temporary directory");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/control", dir);
+	fail_unless(nslog_control_start(addr.sun_path, &control) ==
+		    NSLOG_NO_ERROR,
+		    "Unable to start control socket");
+	fail_unless(stat(addr.sun_path, &st) == 0 &&
+		    (st.st_mode & 0777) == 0600,
+		    "Control socket is open to other users");
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fail_unless(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0,
+		    "Unable to connect to control socket");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+
+	NSLOG(test, INFO, "Hello");
+	fail_unless(captured_message_count == 1,
+		    "Captured message count was wrong");
+	control_command(fd, "categories\n", reply, sizeof(reply));
+	fail_unless(strcmp(reply, "test\nOK\n") == 0,
+		    "Categories listed wrongly: %s", reply);
+
+	control_command(fd, "level info off\n", reply, sizeof(reply));
+	fail_unless(strcmp(reply, "OK\n") == 0,
+		    "Unable to disable level: %s", reply);
+	fail_unless(!nslog_level_enabled(NSLOG_LEVEL_INFO),
+		    "Level not disabled");
+	NSLOG(test, INFO, "Hello");
+	NSLOG(test, WARN, "Hello");
+	fail_unless(captured_message_count == 2,
+		    "Disabled level still logged");
+	control_command(fd, "level\n", reply, sizeof(reply));
+	fail_unless(strstr(reply, "\nINFO off\nWARNING on\n") != NULL,
+		    "Levels listed wrongly: %s", reply);
+	control_command(fd, "level INFO on\r\n", reply, sizeof(reply));
+	fail_unless(strcmp(reply, "OK\n") == 0 &&
+		    nslog_level_enabled(NSLOG_LEVEL_INFO),
+		    "Unable to enable level: %s", reply);
+	control_command(fd, "level LOUD on\n", reply, sizeof(reply));
+	fail_unless(strncmp(reply, "ERR ", 4) == 0,
+		    "Unknown level accepted");
+
+	control_command(fd, "filter lvl:WARN\n", reply, sizeof(reply));
+	fail_unless(strcmp(reply, "OK\n") == 0,
+		    "Unable to set filter: %s", reply);
+	NSLOG(test, INFO, "Hello");
+	fail_unless(captured_message_count == 2,
+		    "Filter not set");
+	control_command(fd, "filter (lvl:WARN\n", reply, sizeof(reply));
+	fail_unless(strncmp(reply, "ERR ", 4) == 0,
+		    "Bad filter accepted");
+	control_command(fd, "filter\n", reply, sizeof(reply));
+	NSLOG(test, INFO, "Hello");
+	fail_unless(captured_message_count == 3,
+		    "Filter not cleared");
+
+	control_command(fd, "levelmap test:ERR\n", reply, sizeof(reply));
+	fail_unless(strcmp(reply, "OK\n") == 0,
+		    "Unable to set level map: %s", reply);
+	NSLOG(test, WARN, "Hello");
+	fail_unless(captured_message_count == 3,
+		    "Level map not set");
+	control_command(fd, "levelmap test\n", reply, sizeof(reply));
+	fail_unless(strncmp(reply, "ERR ", 4) == 0,
+		    "Bad level map accepted");
+	control_command(fd, "levelmap\n", reply, sizeof(reply));
+	NSLOG(test, WARN, "Hello");
+	fail_unless(captured_message_count == 4,
+		    "Level map not cleared");
+
+	nslog_history_start(8, 64);
+	NSLOG(test, DEBUG, "Remembered");
+	NSLOG(sub, DEBUG, "Forgotten");
+	control_command(fd, "history (cat:test && !cat:test/sub)\n",
+			reply, sizeof(reply));
+	fail_unless(strstr(reply, " DBG  test test/basictests.c:") != NULL &&
+		    strstr(reply, ": Remembered\nOK\n") != NULL &&
+		    strstr(reply, "Forgotten") == NULL,
+		    "History listed wrongly: %s", reply);
+	nslog_history_stop();
+
+	/* A client which stops reading mustn't keep the history in use */
+	nslog_history_start(4096, 256);
+	for (i = 0; i < 4096; i++)
+		NSLOG(test, DEBUG, "%200d", i);
+	fail_unless(write(fd, "history\n", 8) == 8,
+		    "Unable to send control command");
+	nanosleep(&pause, NULL);
+	nslog_history_stop();
+	used = 0;
+	do {
+		ssize_t got = read(fd, reply + used, sizeof(reply) - used);
+		fail_unless(got > 0, "Control socket closed early");
+		used += got;
+		/* Keep the tail, to spot the end of the reply */
+		if (used > 4) {
+			memmove(reply, reply + used - 4, 4);
+			used = 4;
+		}
+	} while (used < 4 || memcmp(reply, "\nOK\n", 4) != 0);
+
+	nslog_get_stats(&stats);
+	control_command(fd, "stats\n", reply, sizeof(reply));
+	snprintf(captured_rendered_message, sizeof(captured_rendered_message),
+		 "entries %lu\ngated %lu\nfiltered %lu\ndelivered %lu\nOK\n",
+		 stats.entries, stats.gated, stats.filtered, stats.delivered);
+	fail_unless(strcmp(reply, captured_rendered_message) == 0,
+		    "Statistics reported wrongly: %s", reply);
+	fail_unless(stats.gated >= 1 && stats.filtered >= 1,
+		    "Statistics not counted");
+
+	nslog_set_flush_callback(nslog__test__flush_function,
+				 (void *)anchor_context_3);
+	flush_count = 0;
+	control_command(fd, "flush\n", reply, sizeof(reply));
+	fail_unless(flush_count == 1,
+		    "Flush callback not called");
+	nslog_set_flush_callback(NULL, NULL);
+
+	control_command(fd, "frobnicate\n", reply, sizeof(reply));
+	fail_unless(strcmp(reply, "ERR unknown command\n") == 0,
+		    "Unknown command accepted");
+
+	close(fd);
+	fail_unless(nslog_control_stop(control) == NSLOG_NO_ERROR,
+		    "Unable to stop control socket");
+	fail_unless(access(addr.sun_path, F_OK) != 0,
+		    "Control socket not removed");
+	rmdir(dir);
+}
+END_TEST
+
 START_TEST (test_nslog_filter_level)
 {
 	nslog_filter_t *filter;
@@ -603,23 +1559,1638 @@ START_TEST (test_nslog_complex_filter2)
 }
 END_TEST
 
-/**** And the suites are set up here ****/
+/**** The next set of tests need a fixture set for structured logging ****/
 
-void
-nslog_basic_suite(SRunner *sr)
+static nslog_kv_field_t captured_fields[8];
+static char captured_field_strings[8][64];
+static char captured_field_keys[8][64];
+static int captured_nfields = 0;
+
+static void
+nslog__test__kv_function(void *_ctx, nslog_entry_context_t *ctx,
+			 const char *msg, const nslog_kv_field_t *fields,
+			 int nfields)
 {
-        Suite *s = suite_create("libnslog: Basic tests");
-        TCase *tc_basic = NULL;
+	int i;
+	captured_context = *ctx;
+	captured_render_context = _ctx;
+	captured_rendered_message_length =
+		snprintf(captured_rendered_message,
+			 sizeof(captured_rendered_message), "%s", msg);
+	captured_nfields = nfields;
+	for (i = 0; i < nfields && i < 8; i++) {
+		captured_fields[i] = fields[i];
+		snprintf(captured_field_keys[i], 64, "%s", fields[i].key);
+		captured_fields[i].key = captured_field_keys[i];
+		if (fields[i].type == NSLOG_KV_TYPE_STRING) {
+			snprintf(captured_field_strings[i], 64, "%s",
+				 fields[i].value.s);
+			captured_fields[i].value.s = captured_field_strings[i];
+		}
+	}
+	captured_message_count++;
+}
 
-	tc_basic = tcase_create("Simple log checks, no filters");
+static const char *anchor_context_4 = "4";
 
-        tcase_add_checked_fixture(tc_basic, with_simple_context_setup,
-                                  with_simple_context_teardown);
+static void
+with_kv_context_setup(void)
+{
+	with_trivial_filter_context_setup();
+	captured_nfields = 0;
+	memset(captured_fields, 0, sizeof(captured_fields));
+}
+
+static void
+with_kv_context_teardown(void)
+{
+	fail_unless(nslog_set_kv_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear structured callback");
+	with_trivial_filter_context_teardown();
+}
+
+START_TEST (test_nslog_kv_uncorked_message)
+{
+	fail_unless(nslog_set_kv_callback(nslog__test__kv_function,
+					  (void *)anchor_context_4) == NSLOG_NO_ERROR,
+		    "Unable to set structured callback");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	NSLOG_KV(test, INFO, "fetched",
+		 NSLOG_KV_STR("url", "http://x/"),
+		 NSLOG_KV_INT("status", 200),
+		 NSLOG_KV_DOUBLE("secs", 0.5));
+	fail_unless(captured_message_count == 1,
+		    "Captured message count was wrong");
+	fail_unless(captured_render_context == anchor_context_4,
+		    "Captured context wasn't passed through");
+	fail_unless(strcmp(captured_rendered_message, "fetched") == 0,
+		    "Captured message wasn't correct");
+	fail_unless(captured_nfields == 3,
+		    "Captured field count was wrong");
+	fail_unless(strcmp(captured_fields[0].key, "url") == 0 &&
+		    captured_fields[0].type == NSLOG_KV_TYPE_STRING &&
+		    strcmp(captured_fields[0].value.s, "http://x/") == 0,
+		    "Captured string field was wrong");
+	fail_unless(captured_fields[1].type == NSLOG_KV_TYPE_INT &&
+		    captured_fields[1].value.i == 200,
+		    "Captured integer field was wrong");
+	fail_unless(captured_fields[2].type == NSLOG_KV_TYPE_DOUBLE &&
+		    captured_fields[2].value.d == 0.5,
+		    "Captured double field was wrong");
+}
+END_TEST
+
+START_TEST (test_nslog_kv_no_fields)
+{
+	fail_unless(nslog_set_kv_callback(nslog__test__kv_function,
+					  (void *)anchor_context_4) == NSLOG_NO_ERROR,
+		    "Unable to set structured callback");
+	NSLOG_KV(test, INFO, "corked");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(captured_message_count == 1 && captured_nfields == 0,
+		    "Corked entry without fields wasn't delivered");
+	NSLOG_KV(test, INFO, "bare");
+	fail_unless(captured_message_count == 2,
+		    "Captured message count was wrong");
+	fail_unless(strcmp(captured_rendered_message, "bare") == 0,
+		    "Captured message wasn't correct");
+	fail_unless(captured_nfields == 0,
+		    "Captured field count was wrong");
+}
+END_TEST
+
+START_TEST (test_nslog_kv_corked_message)
+{
+	char key[] = "who";
+	char value[] = "world";
+	fail_unless(nslog_set_kv_callback(nslog__test__kv_function,
+					  (void *)anchor_context_4) == NSLOG_NO_ERROR,
+		    "Unable to set structured callback");
+	NSLOG_KV(test, INFO, "hello", NSLOG_KV_STR(key, value));
+	/* The corked entry must not refer to our buffers */
+	memset(key, 0, sizeof(key));
+	memset(value, 0, sizeof(value));
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(captured_message_count == 1,
+		    "Captured message count was wrong");
+	fail_unless(captured_nfields == 1,
+		    "Captured field count was wrong");
+	fail_unless(strcmp(captured_fields[0].key, "who") == 0 &&
+		    strcmp(captured_fields[0].value.s, "world") == 0,
+		    "Captured corked field was wrong");
+}
+END_TEST
+
+START_TEST (test_nslog_kv_fallback_render)
+{
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	NSLOG_KV(test, INFO, "hello",
+		 NSLOG_KV_STR("who", "big world"),
+		 NSLOG_KV_INT("n", -3));
+	fail_unless(captured_message_count == 1,
+		    "Captured message count was wrong");
+	fail_unless(captured_render_context == anchor_context_3,
+		    "Captured context wasn't passed through");
+	fail_unless(strcmp(captured_rendered_message,
+			   "hello who=\"big world\" n=-3") == 0,
+		    "Fallback rendering wasn't correct");
+}
+END_TEST
+
+START_TEST (test_nslog_kv_render_json)
+{
+	char buf[128];
+	const nslog_kv_field_t fields[] = {
+		NSLOG_KV_STR("s", "a\"b"),
+		NSLOG_KV_INT("i", 42),
+		NSLOG_KV_DOUBLE("d", 1.5),
+		NSLOG_KV_PTR("p", NULL),
+	};
+	const char *expected =
+		"{\"msg\":\"m\",\"s\":\"a\\\"b\",\"i\":42,\"d\":1.5,\"p\":\"(nil)\"}";
+	int len = nslog_kv_render(buf, sizeof(buf), NSLOG_KV_FORMAT_JSON,
+				  "m", fields, 4);
+	fail_unless(len == (int)strlen(expected),
+		    "JSON rendering length was wrong");
+	fail_unless(strcmp(buf, expected) == 0,
+		    "JSON rendering was wrong");
+	fail_unless(nslog_kv_render(buf, 4, NSLOG_KV_FORMAT_JSON,
+				    "m", fields, 4) == len,
+		    "Truncated rendering length was wrong");
+	fail_unless(strcmp(buf, "{\"m") == 0,
+		    "Truncated rendering was wrong");
+}
+END_TEST
+
+/**** The next set of tests are for entry callbacks and timestamps ****/
+
+static nslog_entry_t captured_entry;
+
+static void
+nslog__test__entry_function(void *_ctx, nslog_entry_t *entry,
+			    const char *fmt, va_list args)
+{
+	captured_entry = *entry;
+	nslog__test__render_function(_ctx, entry->context, fmt, args);
+}
+
+static uint64_t
+nslog__test__monotonic_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void
+with_entry_context_setup(void)
+{
+	with_trivial_filter_context_setup();
+	memset(&captured_entry, 0, sizeof(captured_entry));
+	fail_unless(nslog_set_render_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear render callback");
+	fail_unless(nslog_set_entry_callback(nslog__test__entry_function,
+					     (void *)anchor_context_3) == NSLOG_NO_ERROR,
+		    "Unable to set entry callback");
+}
+
+static void
+with_entry_context_teardown(void)
+{
+	fail_unless(nslog_set_entry_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear entry callback");
+	with_trivial_filter_context_teardown();
+}
+
+START_TEST (test_nslog_entry_uncorked_timestamp)
+{
+	uint64_t before, after;
+	fail_unless(nslog_set_clock(NSLOG_CLOCK_MONOTONIC) == NSLOG_NO_ERROR,
+		    "Unable to select monotonic clock");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	before = nslog__test__monotonic_now();
+	NSLOG(test, INFO, "Hello %s", "world");
+	after = nslog__test__monotonic_now();
+	fail_unless(captured_message_count == 1,
+		    "Captured message count was wrong");
+	fail_unless(strcmp(captured_rendered_message, "Hello world") == 0,
+		    "Captured message wasn't correct");
+	fail_unless(captured_entry.clock == NSLOG_CLOCK_MONOTONIC,
+		    "Entry clock was wrong");
+	fail_unless(captured_entry.timestamp >= before &&
+		    captured_entry.timestamp <= after,
+		    "Entry timestamp was out of range");
+}
+END_TEST
+
+START_TEST (test_nslog_entry_corked_timestamp)
+{
+	struct timespec delay = { 0, 50000000 };
+	uint64_t before, logged;
+	fail_unless(nslog_set_clock(NSLOG_CLOCK_MONOTONIC) == NSLOG_NO_ERROR,
+		    "Unable to select monotonic clock");
+	before = nslog__test__monotonic_now();
+	NSLOG(test, INFO, "Early");
+	logged = nslog__test__monotonic_now();
+	nanosleep(&delay, NULL);
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(captured_message_count == 1,
+		    "Captured message count was wrong");
+	fail_unless(captured_entry.timestamp >= before &&
+		    captured_entry.timestamp <= logged,
+		    "Corked entry didn't keep its original time");
+}
+END_TEST
+
+START_TEST (test_nslog_entry_tsc_clock)
+{
+	uint64_t before, after;
+	nslog_error err = nslog_set_clock(NSLOG_CLOCK_TSC);
+	if (err == NSLOG_NOT_SUPPORTED)
+		return;
+	fail_unless(err == NSLOG_NO_ERROR,
+		    "Unable to select TSC clock");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	before = nslog__test__monotonic_now();
+	NSLOG(test, INFO, "Tick");
+	after = nslog__test__monotonic_now();
+	fail_unless(captured_entry.clock == NSLOG_CLOCK_TSC,
+		    "Entry clock was wrong");
+	/* Calibration is approximate, so allow a millisecond either way */
+	fail_unless(captured_entry.timestamp + 1000000 >= before &&
+		    captured_entry.timestamp <= after + 1000000,
+		    "TSC timestamp was out of range");
+}
+END_TEST
+
+static bool clock_race_done;
+
+static void *clock_race_thread(void *arg)
+{
+	(void)arg;
+	while (!__atomic_load_n(&clock_race_done, __ATOMIC_RELAXED))
+		NSLOG(test, INFO, "Tick");
+	return NULL;
+}
+
+START_TEST (test_nslog_entry_tsc_recalibrate)
+{
+	pthread_t thread;
+	uint64_t before, after;
+	int i;
+	nslog_error err = nslog_set_clock(NSLOG_CLOCK_TSC);
+	if (err == NSLOG_NOT_SUPPORTED)
+		return;
+	fail_unless(err == NSLOG_NO_ERROR,
+		    "Unable to select TSC clock");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	/* Calibrations are replaced while another thread is using them */
+	fail_unless(pthread_create(&thread, NULL, clock_race_thread,
+				   NULL) == 0,
+		    "Unable to start thread");
+	for (i = 0; i < 5; i++) {
+		fail_unless(nslog_set_clock(i % 2 == 0 ?
+					    NSLOG_CLOCK_MONOTONIC :
+					    NSLOG_CLOCK_TSC) == NSLOG_NO_ERROR,
+			    "Unable to change clock");
+		fail_unless(nslog_set_clock(NSLOG_CLOCK_TSC) == NSLOG_NO_ERROR,
+			    "Unable to recalibrate TSC clock");
+	}
+	__atomic_store_n(&clock_race_done, true, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	before = nslog__test__monotonic_now();
+	NSLOG(test, INFO, "Tock");
+	after = nslog__test__monotonic_now();
+	fail_unless(captured_entry.clock == NSLOG_CLOCK_TSC &&
+		    captured_entry.timestamp + 1000000 >= before &&
+		    captured_entry.timestamp <= after + 1000000,
+		    "TSC timestamp was out of range after recalibrating");
+}
+END_TEST
+
+static nslog_level captured_levels[8];
+static uint64_t captured_seqs[8];
+
+static void
+nslog__test__order_function(void *_ctx, nslog_entry_t *entry,
+			    const char *fmt, va_list args)
+{
+	if (captured_message_count < 8) {
+		captured_levels[captured_message_count] = entry->context->level;
+		captured_seqs[captured_message_count] = entry->seq;
+	}
+	nslog__test__render_function(_ctx, entry->context, fmt, args);
+}
+
+START_TEST (test_nslog_entry_priority_lane)
+{
+	fail_unless(nslog_set_entry_callback(nslog__test__order_function,
+					     NULL) == NSLOG_NO_ERROR,
+		    "Unable to set entry callback");
+	fail_unless(nslog_set_priority_level((nslog_level)-1) ==
+		    NSLOG_NOT_SUPPORTED,
+		    "Bad priority level was accepted");
+	fail_unless(nslog_set_priority_level(NSLOG_LEVEL_ERROR) ==
+		    NSLOG_NO_ERROR,
+		    "Unable to set priority level");
+	NSLOG(test, DEBUG, "First");
+	NSLOG(test, INFO, "Second");
+	NSLOG(test, ERROR, "Third");
+	NSLOG(test, DEBUG, "Fourth");
+	NSLOG(test, CRITICAL, "Fifth");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(captured_message_count == 5,
+		    "Captured message count was wrong");
+	fail_unless(captured_levels[0] == NSLOG_LEVEL_ERROR &&
+		    captured_levels[1] == NSLOG_LEVEL_CRITICAL &&
+		    captured_levels[2] == NSLOG_LEVEL_DEBUG &&
+		    captured_levels[3] == NSLOG_LEVEL_INFO &&
+		    captured_levels[4] == NSLOG_LEVEL_DEBUG,
+		    "Priority entries weren't delivered first");
+	fail_unless(captured_seqs[2] < captured_seqs[3] &&
+		    captured_seqs[3] < captured_seqs[0] &&
+		    captured_seqs[0] < captured_seqs[4] &&
+		    captured_seqs[4] < captured_seqs[1],
+		    "Sequence numbers don't give the logged order");
+	NSLOG(test, INFO, "Sixth");
+	fail_unless(captured_seqs[5] > captured_seqs[1],
+		    "Uncorked entry wasn't given a later sequence number");
+}
+END_TEST
+
+START_TEST (test_nslog_entry_priority_lane_off)
+{
+	fail_unless(nslog_set_entry_callback(nslog__test__order_function,
+					     NULL) == NSLOG_NO_ERROR,
+		    "Unable to set entry callback");
+	NSLOG(test, DEBUG, "First");
+	NSLOG(test, ERROR, "Second");
+	NSLOG(test, INFO, "Third");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(captured_message_count == 3,
+		    "Captured message count was wrong");
+	fail_unless(captured_levels[0] == NSLOG_LEVEL_DEBUG &&
+		    captured_levels[1] == NSLOG_LEVEL_ERROR &&
+		    captured_levels[2] == NSLOG_LEVEL_INFO,
+		    "Entries weren't delivered in order");
+}
+END_TEST
+
+struct test_message_sink {
+	int count;
+	char msg[256];
+	size_t len;
+	uint64_t seq;
+};
+
+static void
+nslog__test__message_function(void *_ctx, nslog_entry_t *entry,
+			      const char *msg, size_t len)
+{
+	struct test_message_sink *sink = _ctx;
+	sink->count++;
+	snprintf(sink->msg, sizeof(sink->msg), "%s", msg);
+	sink->len = len;
+	sink->seq = entry->seq;
+}
+
+/* Counts messages without copying them, which racing threads would tear */
+static void
+nslog__test__discard_message(void *_ctx, nslog_entry_t *entry,
+			     const char *msg, size_t len)
+{
+	struct test_message_sink *sink = _ctx;
+	(void)entry;
+	(void)msg;
+	__atomic_add_fetch(&sink->count, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&sink->len, len, __ATOMIC_RELAXED);
+}
+
+START_TEST (test_nslog_message_callbacks)
+{
+	struct test_message_sink one = { 0 }, two = { 0 };
+	struct test_message_sink spare[8];
+	int i;
+
+	fail_unless(nslog_add_message_callback(nslog__test__message_function,
+					       &one) == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+	fail_unless(nslog_add_message_callback(nslog__test__message_function,
+					       &two) == NSLOG_NO_ERROR,
+		    "Unable to add second message callback");
+	NSLOG(test, INFO, "Corked %d", 1);
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(one.count == 1 && two.count == 1,
+		    "Corked message wasn't delivered to both callbacks");
+	fail_unless(strcmp(one.msg, "Corked 1") == 0 && one.len == 8,
+		    "Corked message wasn't correct");
+	fail_unless(captured_message_count == 1,
+		    "Corked message wasn't delivered to the entry callback");
+
+	NSLOG(test, INFO, "Hello %s", "world");
+	fail_unless(one.count == 2 && two.count == 2,
+		    "Message wasn't delivered to both callbacks");
+	fail_unless(strcmp(two.msg, "Hello world") == 0 && two.len == 11,
+		    "Message wasn't correct");
+	fail_unless(one.seq == two.seq && one.seq == captured_entry.seq,
+		    "Callbacks were given different entries");
+	fail_unless(strcmp(captured_rendered_message, "Hello world") == 0,
+		    "Entry callback didn't see the message");
+
+	fail_unless(nslog_remove_message_callback(nslog__test__message_function,
+						  &one) == NSLOG_NO_ERROR,
+		    "Unable to remove message callback");
+	NSLOG(test, INFO, "Goodbye");
+	fail_unless(one.count == 2 && two.count == 3,
+		    "Removed callback was still called");
+
+	for (i = 0; i < 7; i++)
+		fail_unless(nslog_add_message_callback(
+				    nslog__test__message_function,
+				    &spare[i]) == NSLOG_NO_ERROR,
+			    "Unable to add message callback");
+	fail_unless(nslog_add_message_callback(nslog__test__message_function,
+					       &spare[7]) == NSLOG_NO_MEMORY,
+		    "Too many message callbacks were allowed");
+
+	nslog_remove_message_callback(nslog__test__message_function, &two);
+	for (i = 0; i < 7; i++)
+		nslog_remove_message_callback(nslog__test__message_function,
+					      &spare[i]);
+}
+END_TEST
+
+static bool message_race_done;
+
+static void *message_race_thread(void *arg)
+{
+	(void)arg;
+	while (!__atomic_load_n(&message_race_done, __ATOMIC_RELAXED))
+		NSLOG(test, INFO, "Racing");
+	return NULL;
+}
+
+START_TEST (test_nslog_message_callbacks_while_logging)
+{
+	struct test_message_sink keep = { 0 };
+	pthread_t threads[RACE_THREADS];
+	int i;
+
+	fail_unless(nslog_set_entry_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear entry callback");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_add_message_callback(nslog__test__discard_message,
+					       &keep) == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+	for (i = 0; i < RACE_THREADS; i++)
+		fail_unless(pthread_create(&threads[i], NULL,
+					   message_race_thread, NULL) == 0,
+			    "Unable to start thread");
+	while (__atomic_load_n(&keep.count, __ATOMIC_RELAXED) == 0)
+		sched_yield();
+	/* Once removed, a callback's context can be freed at once */
+	for (i = 0; i < 2000; i++) {
+		struct test_message_sink *sink = calloc(1, sizeof(*sink));
+		fail_unless(sink != NULL, "Unable to allocate sink");
+		fail_unless(nslog_add_message_callback(
+				    nslog__test__discard_message,
+				    sink) == NSLOG_NO_ERROR,
+			    "Unable to add message callback");
+		fail_unless(nslog_remove_message_callback(
+				    nslog__test__discard_message,
+				    sink) == NSLOG_NO_ERROR,
+			    "Unable to remove message callback");
+		free(sink);
+	}
+	__atomic_store_n(&message_race_done, true, __ATOMIC_RELAXED);
+	for (i = 0; i < RACE_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	nslog_remove_message_callback(nslog__test__discard_message, &keep);
+}
+END_TEST
+
+START_TEST (test_nslog_message_callbacks_with_kv)
+{
+	struct test_message_sink one = { 0 };
+
+	fail_unless(nslog_set_kv_callback(nslog__test__kv_function,
+					  (void *)anchor_context_4) == NSLOG_NO_ERROR,
+		    "Unable to set structured callback");
+	fail_unless(nslog_add_message_callback(nslog__test__message_function,
+					       &one) == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	captured_nfields = 0;
+	NSLOG_KV(test, INFO, "fetched", NSLOG_KV_INT("status", 200));
+	fail_unless(captured_nfields == 1 &&
+		    captured_fields[0].value.i == 200,
+		    "Structured callback didn't see the fields");
+	fail_unless(one.count == 1 &&
+		    strcmp(one.msg, "fetched status=200") == 0,
+		    "Message callback didn't see the structured entry");
+	fail_unless(strcmp(captured_rendered_message,
+			   "fetched status=200") == 0 &&
+		    captured_entry.seq == one.seq,
+		    "Entry callback didn't see the structured entry");
+	fail_unless(nslog_set_kv_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear structured callback");
+}
+END_TEST
+
+static char captured_format[4096];
+static size_t captured_format_len;
+
+static void
+nslog__test__format_function(void *_ctx, nslog_entry_t *entry,
+			     const char *msg, size_t len)
+{
+	UNUSED(_ctx);
+	UNUSED(entry);
+	snprintf(captured_format, sizeof(captured_format), "%s", msg);
+	captured_format_len = len;
+}
+
+/* Log the same thing twice (so the second time the site knows how it is
+ * formatted) and check each time that it matches snprintf().
+ */
+#define CHECK_FORMAT(fmt, args...)					\
+	do {								\
+		char expect[4096];					\
+		int _i, _len = snprintf(expect, sizeof(expect),		\
+					fmt, ##args);			\
+		for (_i = 0; _i < 2; _i++) {				\
+			NSLOG(test, INFO, fmt, ##args);			\
+			fail_unless(captured_format_len == (size_t)_len && \
+				    strcmp(captured_format, expect) == 0, \
+				    "Format differed from snprintf");	\
+		}							\
+	} while (0)
+
+START_TEST (test_nslog_format_matches_snprintf)
+{
+	char big[2000];
+	const char *volatile nullstr = NULL;
+	int local;
+
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_add_message_callback(nslog__test__format_function,
+					       NULL) == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+
+	CHECK_FORMAT("Plain text");
+	CHECK_FORMAT("%d %d %d %d", 0, -1, INT_MIN, INT_MAX);
+	CHECK_FORMAT("%i|%u|%u", 42, 0u, UINT_MAX);
+	CHECK_FORMAT("%ld %lu %li", LONG_MIN, ULONG_MAX, LONG_MAX);
+	CHECK_FORMAT("%lld %llu", LLONG_MIN, ULLONG_MAX);
+	CHECK_FORMAT("%zu %zd %zx", SIZE_MAX, (ssize_t)-5, (size_t)4096);
+	CHECK_FORMAT("%x %X %lx %llx", 0xdeadbeefu, 0xcafeu, 0x0ul, ~0ull);
+	CHECK_FORMAT("%p and %p", (void *)&local, (void *)nullstr);
+	CHECK_FORMAT("[%s] [%s]", "string", nullstr);
+	CHECK_FORMAT("%.*s|%.*s|%.*s|%.*s", 3, "abcdef", -1, "abc",
+		     10, "ab", 0, "abc");
+	CHECK_FORMAT("%c%c%c", 'a', '%', 0x80 + 'b');
+	CHECK_FORMAT("100%% of %s%%", "tests");
+	CHECK_FORMAT("%s", big);
+	CHECK_FORMAT("%s then %d", big, 7);
+	/* Anything else is left to the C library */
+	CHECK_FORMAT("%5d|%-4s|%08x|%+d", 12, "ab", 0xbeefu, 3);
+	CHECK_FORMAT("%f %.3e %g", 1.5, 12345.678, 0.25);
+	CHECK_FORMAT("%hhd %hu %jd %o", 300, 70000, (intmax_t)-9, 8u);
+	CHECK_FORMAT("%#x %.3s %5.2s", 255u, "abcdef", "xyz");
+}
+END_TEST
+
+static nslog_entry_context_t *captured_site;
+
+static void
+nslog__test__site_function(void *_ctx, nslog_entry_t *entry,
+			   const char *msg, size_t len)
+{
+	UNUSED(_ctx);
+	UNUSED(msg);
+	UNUSED(len);
+	captured_site = entry->context;
+}
+
+START_TEST (test_nslog_site_prefix)
+{
+	nslog_entry_context_t copy;
+	const char *prefix, *again, *other;
+	size_t len;
+	char expect[256];
+	int line;
+
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_add_message_callback(nslog__test__site_function,
+					       NULL) == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+	line = __LINE__ + 1;
+	NSLOG(sub, WARNING, "Prefixed");
+	fail_unless(captured_site != NULL, "Entry wasn't delivered");
+
+	fail_unless(nslog_site_prefix(captured_site, &prefix, &len) ==
+		    NSLOG_NO_ERROR,
+		    "Unable to get site prefix");
+	snprintf(expect, sizeof(expect), "WARN test/sub test/basictests.c:%d %s: ",
+		 line, __func__);
+	fail_unless(strcmp(prefix, expect) == 0 && len == strlen(expect),
+		    "Default prefix was wrong");
+	fail_unless(nslog_site_prefix(captured_site, &again, &len) ==
+		    NSLOG_NO_ERROR && again == prefix,
+		    "Prefix wasn't cached");
+
+	/* Copies of the site, as corked and held entries keep, share its
+	 * prefix, and copies in another category share one of their own
+	 */
+	copy = *captured_site;
+	fail_unless(nslog_site_prefix(&copy, &again, &len) ==
+		    NSLOG_NO_ERROR && again == prefix,
+		    "Copy of the site didn't share its prefix");
+	copy = *captured_site;
+	copy.category = &__nslog_category_test;
+	fail_unless(nslog_site_prefix(&copy, &again, &len) ==
+		    NSLOG_NO_ERROR &&
+		    strncmp(again, "WARN test test/basictests.c:", 28) == 0,
+		    "Copy in another category had the wrong prefix");
+	other = again;
+	copy = *captured_site;
+	copy.category = &__nslog_category_test;
+	fail_unless(nslog_site_prefix(&copy, &again, &len) ==
+		    NSLOG_NO_ERROR && again == other,
+		    "Copies in another category didn't share a prefix");
+
+	fail_unless(nslog_set_prefix_template("[%q] ") == NSLOG_PARSE_ERROR,
+		    "Bad directive was accepted");
+	fail_unless(nslog_set_prefix_template("trailing %") ==
+		    NSLOG_PARSE_ERROR,
+		    "Trailing percent was accepted");
+	fail_unless(nslog_set_prefix_template("[%L] %b:%n %%%c| ") ==
+		    NSLOG_NO_ERROR,
+		    "Unable to set prefix template");
+	fail_unless(nslog_site_prefix(captured_site, &prefix, &len) ==
+		    NSLOG_NO_ERROR,
+		    "Unable to get site prefix");
+	snprintf(expect, sizeof(expect), "[WARNING] basictests.c:%d %%test/sub| ",
+		 line);
+	fail_unless(strcmp(prefix, expect) == 0 && len == strlen(expect),
+		    "Prefix wasn't rendered from the new template");
+
+	fail_unless(nslog_set_prefix_template(NULL) == NSLOG_NO_ERROR,
+		    "Unable to restore default prefix template");
+	fail_unless(nslog_site_prefix(captured_site, &prefix, &len) ==
+		    NSLOG_NO_ERROR &&
+		    strncmp(prefix, "WARN test/sub ", 14) == 0,
+		    "Default prefix wasn't restored");
+}
+END_TEST
+
+struct test_history {
+	int count;
+	char msgs[8][32];
+	nslog_level levels[8];
+	uint64_t timestamps[8];
+};
+
+static void
+nslog__test__history_function(void *_ctx, nslog_entry_t *entry,
+			      const char *msg, size_t len)
+{
+	struct test_history *history = _ctx;
+	UNUSED(len);
+	if (history->count < 8) {
+		snprintf(history->msgs[history->count],
+			 sizeof(history->msgs[0]), "%s", msg);
+		history->levels[history->count] = entry->context->level;
+		history->timestamps[history->count] = entry->timestamp;
+	}
+	history->count++;
+}
+
+START_TEST (test_nslog_history)
+{
+	struct test_history history;
+	nslog_filter_t *filter;
+
+	fail_unless(nslog_history_start(4, 10) == NSLOG_NO_ERROR,
+		    "Unable to start the history");
+	fail_unless(nslog_filter_from_text("lvl:ERROR", &filter)
+		    == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	fail_unless(nslog_filter_set_active(filter, NULL) == NSLOG_NO_ERROR,
+		    "Unable to set active filter");
+	filter = nslog_filter_unref(filter);
+
+	/* Recorded whether corked or filtered out, or not */
+	NSLOG(test, DEBUG, "Corked %d", 1);
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	NSLOG(sub, DEBUG, "Filtered %d", 2);
+	NSLOG(test, ERROR, "Shown %d", 3);
+	NSLOG(sub, INFO, "A long message, truncated");
+	fail_unless(captured_message_count == 1,
+		    "Filter wasn't applied to delivery");
+
+	memset(&history, 0, sizeof(history));
+	fail_unless(nslog_history_query(NULL, 0, 0,
+					nslog__test__history_function,
+					&history) == NSLOG_NO_ERROR,
+		    "Unable to query history");
+	fail_unless(history.count == 4,
+		    "History held the wrong number of entries");
+	fail_unless(strcmp(history.msgs[0], "Corked 1") == 0 &&
+		    strcmp(history.msgs[1], "Filtered 2") == 0 &&
+		    strcmp(history.msgs[2], "Shown 3") == 0 &&
+		    strcmp(history.msgs[3], "A long mes") == 0,
+		    "History held the wrong messages");
+
+	/* Only the most recent entries are kept */
+	NSLOG(test, WARNING, "Newest");
+	fail_unless(nslog_filter_from_text("cat:test/sub", &filter)
+		    == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	memset(&history, 0, sizeof(history));
+	fail_unless(nslog_history_query(filter, 0, 0,
+					nslog__test__history_function,
+					&history) == NSLOG_NO_ERROR,
+		    "Unable to query history");
+	filter = nslog_filter_unref(filter);
+	fail_unless(history.count == 2 &&
+		    history.levels[0] == NSLOG_LEVEL_DEBUG &&
+		    history.levels[1] == NSLOG_LEVEL_INFO,
+		    "History query didn't filter entries");
+
+	memset(&history, 0, sizeof(history));
+	nslog_history_query(NULL, 0, 0, nslog__test__history_function,
+			    &history);
+	fail_unless(history.count == 4 &&
+		    strcmp(history.msgs[3], "Newest") == 0 &&
+		    strcmp(history.msgs[0], "Filtered 2") == 0,
+		    "Oldest entry wasn't dropped");
+
+	/* Time ranges include since but not until */
+	{
+		uint64_t newest = history.timestamps[3];
+		memset(&history, 0, sizeof(history));
+		nslog_history_query(NULL, newest, 0,
+				    nslog__test__history_function, &history);
+		fail_unless(history.count >= 1 &&
+			    strcmp(history.msgs[history.count - 1],
+				   "Newest") == 0,
+			    "Time range excluded its start");
+		memset(&history, 0, sizeof(history));
+		nslog_history_query(NULL, 0, newest,
+				    nslog__test__history_function, &history);
+		fail_unless(history.count <= 3,
+			    "Time range included its end");
+	}
+
+	fail_unless(nslog_history_stop() == NSLOG_NO_ERROR,
+		    "Unable to stop the history");
+	memset(&history, 0, sizeof(history));
+	nslog_history_query(NULL, 0, 0, nslog__test__history_function,
+			    &history);
+	fail_unless(history.count == 0,
+		    "Stopped history still held entries");
+}
+END_TEST
+
+static bool history_race_done;
+
+static void *history_race_thread(void *arg)
+{
+	char msg[1001];
+	memset(msg, 'a' + *(int *)arg, sizeof(msg) - 1);
+	msg[sizeof(msg) - 1] = '\0';
+	while (!__atomic_load_n(&history_race_done, __ATOMIC_RELAXED))
+		NSLOG(test, INFO, "%s", msg);
+	return NULL;
+}
+
+static void
+nslog__test__history_check(void *_ctx, nslog_entry_t *entry,
+			   const char *msg, size_t len)
+{
+	int *torn = _ctx;
+	UNUSED(entry);
+	if (len != 1000 || strspn(msg, (char[]){ msg[0], '\0' }) != len)
+		(*torn)++;
+}
+
+START_TEST (test_nslog_history_more_writers_than_slots)
+{
+	pthread_t threads[RACE_THREADS];
+	int ids[RACE_THREADS];
+	int torn = 0;
+	int i;
+
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_set_entry_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear entry callback");
+	fail_unless(nslog_set_render_callback(nslog__test__discard_function,
+					      NULL) == NSLOG_NO_ERROR,
+		    "Unable to set up render callback");
+	fail_unless(nslog_history_start(1, 1000) == NSLOG_NO_ERROR,
+		    "Unable to start the history");
+	for (i = 0; i < RACE_THREADS; i++) {
+		ids[i] = i;
+		fail_unless(pthread_create(&threads[i], NULL,
+					   history_race_thread,
+					   &ids[i]) == 0,
+			    "Unable to start thread");
+	}
+	/* No slot is written by two threads at once, so none is torn */
+	for (i = 0; i < 20000; i++)
+		nslog_history_query(NULL, 0, 0, nslog__test__history_check,
+				    &torn);
+	__atomic_store_n(&history_race_done, true, __ATOMIC_RELAXED);
+	for (i = 0; i < RACE_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	fail_unless(torn == 0, "%d torn entries were seen", torn);
+	nslog_history_stop();
+}
+END_TEST
+
+static void *backlog_thread(void *arg)
+{
+	UNUSED(arg);
+	NSLOG(test, DEBUG, "Other thread");
+	return NULL;
+}
+
+START_TEST (test_nslog_backlog)
+{
+	struct test_history seen;
+	pthread_t thread;
+
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_set_backlog(NSLOG_LEVEL_ERROR,
+				      NSLOG_LEVEL_INFO, 3)
+		    == NSLOG_NOT_SUPPORTED,
+		    "Trigger below the level was accepted");
+	fail_unless(nslog_set_backlog(NSLOG_LEVEL_INFO,
+				      NSLOG_LEVEL_ERROR, 3)
+		    == NSLOG_NO_ERROR,
+		    "Unable to set backlog");
+	memset(&seen, 0, sizeof(seen));
+	fail_unless(nslog_add_message_callback(nslog__test__history_function,
+					       &seen) == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+
+	fail_unless(pthread_create(&thread, NULL, backlog_thread, NULL) == 0,
+		    "Unable to start thread");
+	pthread_join(thread, NULL);
+	NSLOG(test, DEBUG, "Held %d", 1);
+	NSLOG(test, DEBUG, "Held %d", 2);
+	NSLOG(sub, DEBUG, "Held %d", 3);
+	NSLOG(test, DEBUG, "Held %d", 4);
+	fail_unless(seen.count == 0,
+		    "Entries below the backlog level were delivered");
+	NSLOG(test, WARNING, "Not a trigger");
+	fail_unless(seen.count == 1,
+		    "Entry above the backlog level wasn't delivered");
+
+	/* Only this thread's most recent entries come out with a trigger */
+	NSLOG(sub, ERROR, "Trigger");
+	fail_unless(seen.count == 5,
+		    "Backlog wasn't delivered with the trigger");
+	fail_unless(strcmp(seen.msgs[1], "Held 2") == 0 &&
+		    strcmp(seen.msgs[2], "Held 3") == 0 &&
+		    strcmp(seen.msgs[3], "Held 4") == 0 &&
+		    strcmp(seen.msgs[4], "Trigger") == 0,
+		    "Backlog was delivered wrongly");
+	fail_unless(seen.timestamps[1] <= seen.timestamps[3] &&
+		    seen.timestamps[3] <= seen.timestamps[4],
+		    "Backlog entries lost their timestamps");
+	NSLOG(test, CRITICAL, "Trigger again");
+	fail_unless(seen.count == 6,
+		    "Backlog was delivered twice");
+
+	/* Stopping the backlog discards what it held */
+	NSLOG(test, DEBUG, "Discarded");
+	fail_unless(nslog_set_backlog(NSLOG_LEVEL_INFO,
+				      NSLOG_LEVEL_ERROR, 0)
+		    == NSLOG_NO_ERROR,
+		    "Unable to stop backlog");
+	NSLOG(test, DEBUG, "Not held");
+	fail_unless(seen.count == 7,
+		    "Entry held after backlog was stopped");
+	fail_unless(nslog_set_backlog(NSLOG_LEVEL_INFO,
+				      NSLOG_LEVEL_ERROR, 3)
+		    == NSLOG_NO_ERROR,
+		    "Unable to restart backlog");
+	NSLOG(test, ERROR, "Trigger after restart");
+	fail_unless(seen.count == 8 &&
+		    strcmp(seen.msgs[7], "Trigger after restart") == 0,
+		    "Entry held before backlog was stopped was delivered");
+	nslog_remove_message_callback(nslog__test__history_function, &seen);
+}
+END_TEST
+
+static pthread_barrier_t backlog_barrier;
+
+static void *backlog_cleanup_thread(void *arg)
+{
+	UNUSED(arg);
+	NSLOG(test, DEBUG, "Held before cleanup");
+	pthread_barrier_wait(&backlog_barrier);
+	/* The main thread cleans up, freeing this thread's backlog */
+	pthread_barrier_wait(&backlog_barrier);
+	NSLOG(test, DEBUG, "Held after cleanup");
+	NSLOG(test, ERROR, "Trigger after cleanup");
+	return NULL;
+}
+
+START_TEST (test_nslog_backlog_after_cleanup)
+{
+	struct test_history seen;
+	pthread_t thread;
+
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_set_backlog(NSLOG_LEVEL_INFO,
+				      NSLOG_LEVEL_ERROR, 3)
+		    == NSLOG_NO_ERROR,
+		    "Unable to set backlog");
+	memset(&seen, 0, sizeof(seen));
+	fail_unless(nslog_add_message_callback(nslog__test__history_function,
+					       &seen) == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+
+	pthread_barrier_init(&backlog_barrier, NULL, 2);
+	fail_unless(pthread_create(&thread, NULL, backlog_cleanup_thread,
+				   NULL) == 0,
+		    "Unable to start thread");
+	pthread_barrier_wait(&backlog_barrier);
+	nslog_cleanup();
+	pthread_barrier_wait(&backlog_barrier);
+	pthread_join(thread, NULL);
+	pthread_barrier_destroy(&backlog_barrier);
+
+	fail_unless(seen.count == 2 &&
+		    strcmp(seen.msgs[0], "Held after cleanup") == 0 &&
+		    strcmp(seen.msgs[1], "Trigger after cleanup") == 0,
+		    "Backlog after cleanup was delivered wrongly");
+	nslog_remove_message_callback(nslog__test__history_function, &seen);
+}
+END_TEST
+
+START_TEST (test_nslog_sink_stats)
+{
+	nslog_sink_stats_t stats;
+	struct test_history seen;
+	uint64_t counted = 0;
+	unsigned int bucket;
+
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_sink_stats_enable(0) == NSLOG_NO_ERROR,
+		    "Unable to enable sink statistics");
+	memset(&seen, 0, sizeof(seen));
+	fail_unless(nslog_add_message_callback(nslog__test__history_function,
+					       &seen) == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+	NSLOG(test, INFO, "Hello");
+	NSLOG(test, INFO, "Hello %s", "world");
+	NSLOG(sub, INFO, "Hi");
+	fail_unless(captured_message_count == 3,
+		    "Captured message count was wrong");
+
+	fail_unless(nslog_get_sink_stats(NSLOG_SINK_ENTRY, &stats)
+		    == NSLOG_NO_ERROR,
+		    "Unable to get entry sink statistics");
+	fail_unless(stats.sink == NSLOG_SINK_ENTRY && stats.entries == 3,
+		    "Entry sink was called %llu times",
+		    (unsigned long long)stats.entries);
+	for (bucket = 0; bucket < NSLOG_SINK_BUCKETS; bucket++)
+		counted += stats.buckets[bucket];
+	fail_unless(counted == 3,
+		    "Histogram counted %llu calls", (unsigned long long)counted);
+	fail_unless(stats.max_ns <= stats.total_ns &&
+		    stats.total_ns <= stats.elapsed_ns,
+		    "Entry sink timings were inconsistent");
+	fail_unless(nslog_get_sink_stats(NSLOG_SINK_MESSAGE, &stats)
+		    == NSLOG_NO_ERROR,
+		    "Unable to get message sink statistics");
+	fail_unless(stats.entries == 3 && stats.bytes == 5 + 11 + 2,
+		    "Message sink counts were wrong");
+	fail_unless(nslog_get_sink_stats(NSLOG_SINK_KV, &stats)
+		    == NSLOG_NO_ERROR && stats.entries == 0,
+		    "Unused sink was counted");
+	fail_unless(nslog_get_sink_stats(NSLOG_SINKS, &stats)
+		    == NSLOG_NOT_SUPPORTED,
+		    "Statistics for a bad sink were returned");
+
+	fail_unless(nslog_sink_bucket_floor(0) == 0 &&
+		    nslog_sink_bucket_floor(4) == 4 &&
+		    nslog_sink_bucket_floor(7) == 7 &&
+		    nslog_sink_bucket_floor(8) == 8 &&
+		    nslog_sink_bucket_floor(12) == 16 &&
+		    nslog_sink_bucket_floor(13) == 20,
+		    "Bucket floors were wrong");
+	for (bucket = 1; bucket < NSLOG_SINK_BUCKETS; bucket++)
+		fail_unless(nslog_sink_bucket_floor(bucket) >
+			    nslog_sink_bucket_floor(bucket - 1),
+			    "Bucket %u's floor isn't above the last", bucket);
+
+	/* With a report due at once, the next sink call is followed by one */
+	fail_unless(nslog_sink_stats_enable(1) == NSLOG_NO_ERROR,
+		    "Unable to enable sink statistics");
+	NSLOG(test, INFO, "Reported");
+	fail_unless(seen.count > 4,
+		    "Report wasn't logged");
+	fail_unless(strncmp(seen.msgs[4], "sink statistics sink=message",
+			    28) == 0,
+		    "Report was wrong: %s", seen.msgs[4]);
+	fail_unless(captured_context.category == &__nslog_category_nslog &&
+		    captured_context.level == NSLOG_LEVEL_INFO,
+		    "Report was logged wrongly");
+
+	fail_unless(nslog_sink_stats_disable() == NSLOG_NO_ERROR,
+		    "Unable to disable sink statistics");
+	nslog_get_sink_stats(NSLOG_SINK_ENTRY, &stats);
+	counted = stats.entries;
+	NSLOG(test, INFO, "Unmeasured");
+	fail_unless(nslog_get_sink_stats(NSLOG_SINK_ENTRY, &stats)
+		    == NSLOG_NO_ERROR && stats.entries == counted,
+		    "Sink was measured while disabled");
+	nslog_remove_message_callback(nslog__test__history_function, &seen);
+}
+END_TEST
+
+static void count_ticks(int n)
+{
+	while (n-- > 0)
+		NSLOG_COUNT(test, INFO, "tick");
+}
+
+static void *count_thread(void *arg)
+{
+	count_ticks(*(int *)arg);
+	return NULL;
+}
+
+START_TEST (test_nslog_count)
+{
+	struct timespec delay = { 0, 50000000 };
+	nslog_filter_t *filter;
+	pthread_t threads[2];
+	int per_thread = 500;
+	int i;
+
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	count_ticks(100);
+	fail_unless(nslog_count_flush() == NSLOG_NO_ERROR &&
+		    captured_message_count == 0,
+		    "Events were counted before counting started");
+
+	fail_unless(nslog_count_start(0) == NSLOG_NO_ERROR,
+		    "Unable to start counting");
+	count_ticks(1000);
+	for (i = 0; i < 2; i++)
+		fail_unless(pthread_create(&threads[i], NULL, count_thread,
+					   &per_thread) == 0,
+			    "Unable to start thread");
+	for (i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+	fail_unless(captured_message_count == 0,
+		    "Counted events were logged");
+	fail_unless(nslog_count_flush() == NSLOG_NO_ERROR,
+		    "Unable to summarise counts");
+	fail_unless(captured_message_count == 1,
+		    "Summary count was wrong");
+	fail_unless(strncmp(captured_rendered_message,
+			    "tick x2000 in the last ", 23) == 0,
+		    "Summary was wrong: %s", captured_rendered_message);
+	fail_unless(captured_context.category == &__nslog_category_test &&
+		    captured_context.level == NSLOG_LEVEL_INFO,
+		    "Summary was logged wrongly");
+	nslog_count_flush();
+	fail_unless(captured_message_count == 1,
+		    "Empty summary was logged");
+
+	/* A thread taking over an exited thread's counter */
+	fail_unless(pthread_create(&threads[0], NULL, count_thread,
+				   &per_thread) == 0,
+		    "Unable to start thread");
+	pthread_join(threads[0], NULL);
+	nslog_count_flush();
+	fail_unless(captured_message_count == 2 &&
+		    strncmp(captured_rendered_message, "tick x500 ", 10) == 0,
+		    "Summary was wrong: %s", captured_rendered_message);
+
+	/* Filtered out sites stop counting once summarised */
+	fail_unless(nslog_filter_from_text("cat:test/sub", &filter)
+		    == NSLOG_NO_ERROR,
+		    "Unable to parse filter");
+	fail_unless(nslog_filter_set_active(filter, NULL) == NSLOG_NO_ERROR,
+		    "Unable to set active filter");
+	nslog_filter_unref(filter);
+	nslog_count_flush();
+	count_ticks(100);
+	fail_unless(nslog_filter_set_active(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear active filter");
+	nslog_count_flush();
+	fail_unless(captured_message_count == 2,
+		    "Filtered out events were counted");
+	count_ticks(5);
+	nslog_count_flush();
+	fail_unless(captured_message_count == 3 &&
+		    strncmp(captured_rendered_message, "tick x5 ", 8) == 0,
+		    "Summary was wrong: %s", captured_rendered_message);
+
+	/* Periodic summaries, and one more on stopping */
+	fail_unless(nslog_count_start(10000000) == NSLOG_NO_ERROR,
+		    "Unable to start periodic summaries");
+	count_ticks(7);
+	nanosleep(&delay, NULL);
+	fail_unless(nslog_count_stop() == NSLOG_NO_ERROR,
+		    "Unable to stop counting");
+	fail_unless(captured_message_count == 4 &&
+		    strncmp(captured_rendered_message, "tick x7 ", 8) == 0,
+		    "Periodic summary was wrong: %s",
+		    captured_rendered_message);
+	count_ticks(3);
+	fail_unless(nslog_count_stop() == NSLOG_NO_ERROR &&
+		    captured_message_count == 4,
+		    "Events were counted after counting stopped");
+}
+END_TEST
+
+START_TEST (test_nslog_count_after_cleanup)
+{
+	nslog_stats_t before, after;
+	pthread_t thread;
+	int per_thread = 10;
+
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_count_start(0) == NSLOG_NO_ERROR,
+		    "Unable to start counting");
+	count_ticks(10);
+	fail_unless(pthread_create(&thread, NULL, count_thread,
+				   &per_thread) == 0,
+		    "Unable to start thread");
+	pthread_join(thread, NULL);
+	fail_unless(nslog_get_stats(&before) == NSLOG_NO_ERROR,
+		    "Unable to read statistics");
+
+	/* Cleanup frees the counters, summarising nothing */
+	nslog_cleanup();
+	fail_unless(captured_message_count == 0,
+		    "Counts were summarised by cleanup");
+	fail_unless(nslog_get_stats(&after) == NSLOG_NO_ERROR &&
+		    memcmp(&before, &after, sizeof(before)) == 0,
+		    "Statistics were lost by cleanup");
+
+	/* The sites count afresh, with counters of their own */
+	fail_unless(nslog_count_start(0) == NSLOG_NO_ERROR,
+		    "Unable to restart counting");
+	count_ticks(5);
+	fail_unless(pthread_create(&thread, NULL, count_thread,
+				   &per_thread) == 0,
+		    "Unable to start thread");
+	pthread_join(thread, NULL);
+	fail_unless(nslog_count_flush() == NSLOG_NO_ERROR,
+		    "Unable to summarise counts");
+	fail_unless(captured_message_count == 1 &&
+		    strncmp(captured_rendered_message, "tick x15 ", 9) == 0,
+		    "Summary was wrong: %s", captured_rendered_message);
+	fail_unless(nslog_count_stop() == NSLOG_NO_ERROR,
+		    "Unable to stop counting");
+}
+END_TEST
+
+/**** The next set of tests are for the binary log sink ****/
+
+START_TEST (test_nslog_binary_sink_roundtrip)
+{
+	nslog_binary_sink_t *sink;
+	FILE *bin = tmpfile();
+	FILE *text = tmpfile();
+	char line[4096];
+	char expected[256];
+	const char partial[] = "abcdefgh";
+	int lineno;
+
+	fail_unless(bin != NULL && text != NULL,
+		    "Unable to create temporary files");
+	fail_unless(nslog_binary_sink_new(fileno(bin), &sink) == NSLOG_NO_ERROR,
+		    "Unable to create binary sink");
+	fail_unless(nslog_set_render_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear render callback");
+	fail_unless(nslog_set_entry_callback(nslog_binary_sink_render,
+					     sink) == NSLOG_NO_ERROR,
+		    "Unable to set binary sink as entry callback");
+	NSLOG(sub, INFO, "Corked %s", "entry");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	lineno = __LINE__; NSLOG(test, WARN, "%d %u %ld %zu %x %-4.*s| %c %5.2f %% %p",
+				 -7, 7u, 123456789012L, (size_t)42, 255u,
+				 3, partial, 'q', 1.5, (void *)NULL);
+	fail_unless(nslog_set_entry_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear entry callback");
+	fail_unless(nslog_binary_sink_destroy(sink) == NSLOG_NO_ERROR,
+		    "Unable to flush binary sink");
+
+	rewind(bin);
+	fail_unless(nslog_binary_decode(bin, text) == NSLOG_NO_ERROR,
+		    "Unable to decode binary log");
+	rewind(text);
+
+	fail_unless(fgets(line, sizeof(line), text) != NULL,
+		    "Missing first decoded entry");
+	fail_unless(strstr(line, " INFO test/sub test/basictests.c:") != NULL,
+		    "First decoded entry had the wrong site");
+	fail_unless(strstr(line, ": Corked entry\n") != NULL,
+		    "First decoded entry had the wrong message");
+
+	fail_unless(fgets(line, sizeof(line), text) != NULL,
+		    "Missing second decoded entry");
+	snprintf(expected, sizeof(expected),
+		 " WARN test test/basictests.c:%d %s: "
+		 "-7 7 123456789012 42 ff abc | q  1.50 %% (nil)\n",
+		 lineno, __func__);
+	fail_unless(strstr(line, expected) != NULL,
+		    "Second decoded entry was wrong");
+	fail_unless(fgets(line, sizeof(line), text) == NULL,
+		    "Unexpected extra decoded entries");
+
+	fclose(bin);
+	fclose(text);
+}
+END_TEST
+
+struct live_decode {
+	FILE *in;
+	FILE *out;
+	nslog_error err;
+};
+
+static void *live_decode_thread(void *arg)
+{
+	struct live_decode *live = arg;
+	live->err = nslog_binary_decode(live->in, live->out);
+	return NULL;
+}
+
+START_TEST (test_nslog_binary_decode_live)
+{
+	struct timespec delay = { 0, 1000000 };
+	struct live_decode live;
+	nslog_binary_sink_t *sink;
+	pthread_t thread;
+	struct stat st;
+	int fds[2];
+	int waited;
+
+	fail_unless(pipe(fds) == 0, "Unable to create pipe");
+	live.in = fdopen(fds[0], "rb");
+	live.out = tmpfile();
+	fail_unless(live.in != NULL && live.out != NULL,
+		    "Unable to open decoder streams");
+	setvbuf(live.out, NULL, _IONBF, 0);
+	fail_unless(nslog_binary_sink_new(fds[1], &sink) == NSLOG_NO_ERROR,
+		    "Unable to create binary sink");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_set_entry_callback(nslog_binary_sink_render,
+					     sink) == NSLOG_NO_ERROR,
+		    "Unable to set binary sink as entry callback");
+	NSLOG(test, INFO, "Live");
+	fail_unless(nslog_binary_sink_flush(sink) == NSLOG_NO_ERROR,
+		    "Unable to flush binary sink");
+	fail_unless(pthread_create(&thread, NULL, live_decode_thread,
+				   &live) == 0,
+		    "Unable to start thread");
+
+	/* The entry is decoded while the stream is still open */
+	for (waited = 0; waited < 5000; waited++) {
+		fail_unless(fstat(fileno(live.out), &st) == 0,
+			    "Unable to examine decoded text");
+		if (st.st_size > 0)
+			break;
+		nanosleep(&delay, NULL);
+	}
+	fail_unless(st.st_size > 0,
+		    "Entry not decoded until the stream ended");
+
+	fail_unless(nslog_set_entry_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear entry callback");
+	fail_unless(nslog_binary_sink_destroy(sink) == NSLOG_NO_ERROR,
+		    "Unable to destroy binary sink");
+	close(fds[1]);
+	pthread_join(thread, NULL);
+	fail_unless(live.err == NSLOG_NO_ERROR,
+		    "Unable to decode live binary log");
+	fclose(live.in);
+	fclose(live.out);
+}
+END_TEST
+
+START_TEST (test_nslog_binary_sink_write_error)
+{
+	nslog_binary_sink_t *sink;
+	FILE *spare = tmpfile();
+	char big[1024];
+	int fds[2];
+	int i;
+
+	/* Writing to the read end of a pipe fails */
+	fail_unless(spare != NULL && pipe(fds) == 0,
+		    "Unable to create pipe");
+	fail_unless(nslog_binary_sink_new(fds[0], &sink) == NSLOG_NO_ERROR,
+		    "Unable to create binary sink");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	fail_unless(nslog_set_entry_callback(nslog_binary_sink_render,
+					     sink) == NSLOG_NO_ERROR,
+		    "Unable to set binary sink as entry callback");
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	/* Enough to fill the sink's buffer, so it writes out as it goes */
+	for (i = 0; i < 100; i++)
+		NSLOG(test, INFO, "%s", big);
+	fail_unless(nslog_set_entry_callback(NULL, NULL) == NSLOG_NO_ERROR,
+		    "Unable to clear entry callback");
+	/* The rest can be written, but the error must still be reported */
+	fail_unless(dup2(fileno(spare), fds[0]) == fds[0],
+		    "Unable to replace the sink's file descriptor");
+	fail_unless(nslog_binary_sink_flush(sink) == NSLOG_IO_ERROR,
+		    "Write error while logging was lost");
+	fail_unless(nslog_binary_sink_destroy(sink) == NSLOG_NO_ERROR,
+		    "Write error was reported twice");
+	close(fds[0]);
+	close(fds[1]);
+	fclose(spare);
+}
+END_TEST
+
+/* Decode a stream made of a header, a site with the given format and one
+ * entry with the given arguments, twice over
+ */
+static nslog_error decode_binary_entry(const char *fmt, const char *args,
+				       size_t argslen, char *text,
+				       size_t textlen)
+{
+	FILE *bin = tmpfile();
+	FILE *out = tmpfile();
+	nslog_error err;
+	size_t len;
+	fail_unless(bin != NULL && out != NULL,
+		    "Unable to create temporary files");
+	fwrite("NSLB\001\000\000\000", 1, 8, bin);
+	fwrite("\001\000\002\001\001c\001f\001g", 1, 10, bin);
+	fputc((int)strlen(fmt), bin);
+	fputs(fmt, bin);
+	for (len = 0; len < 2; len++) {
+		fwrite("\002\000\000", 1, 3, bin);
+		fputc((int)argslen, bin);
+		fwrite(args, 1, argslen, bin);
+	}
+	rewind(bin);
+	err = nslog_binary_decode(bin, out);
+	rewind(out);
+	len = fread(text, 1, textlen - 1, out);
+	text[len] = '\0';
+	fclose(bin);
+	fclose(out);
+	return err;
+}
+
+START_TEST (test_nslog_binary_decode_garbage)
+{
+	FILE *bin = tmpfile();
+	FILE *text = tmpfile();
+	char out[256];
+	fail_unless(bin != NULL && text != NULL,
+		    "Unable to create temporary files");
+	fputs("NSLB\001\000\000\000\002\005", bin);
+	rewind(bin);
+	fail_unless(nslog_binary_decode(bin, text) == NSLOG_PARSE_ERROR,
+		    "Decoding garbage didn't fail");
+	fclose(bin);
+	fclose(text);
+
+	/* Arguments must have been captured for the conversion using them */
+	fail_unless(decode_binary_entry("%s", "d\0\0\0\0\0\0\0\0", 9,
+					out, sizeof(out)) ==
+		    NSLOG_PARSE_ERROR,
+		    "Double decoded for %%s");
+	fail_unless(decode_binary_entry("%s", "i\002", 2, out, sizeof(out)) ==
+		    NSLOG_PARSE_ERROR,
+		    "Integer decoded for %%s");
+	fail_unless(decode_binary_entry("%p", "i\002", 2, out, sizeof(out)) ==
+		    NSLOG_PARSE_ERROR,
+		    "Integer decoded for %%p");
+	fail_unless(decode_binary_entry("%d", "s\001x", 3, out, sizeof(out)) ==
+		    NSLOG_PARSE_ERROR,
+		    "String decoded for %%d");
+	fail_unless(decode_binary_entry("%d", "p\001", 2, out, sizeof(out)) ==
+		    NSLOG_PARSE_ERROR,
+		    "Pointer decoded for %%d");
+	fail_unless(decode_binary_entry("%f", "u\001", 2, out, sizeof(out)) ==
+		    NSLOG_PARSE_ERROR,
+		    "Integer decoded for %%f");
+	fail_unless(decode_binary_entry("%k", "u\001", 2, out, sizeof(out)) ==
+		    NSLOG_PARSE_ERROR,
+		    "Unknown conversion decoded");
+
+	/* A precision longer than the string mustn't read past it */
+	fail_unless(decode_binary_entry("%.9s|", "s\001x", 3, out,
+					sizeof(out)) == NSLOG_NO_ERROR,
+		    "Unable to decode a short string");
+	fail_unless(strstr(out, "g: x|\n") != NULL &&
+		    strstr(strstr(out, "g: x|\n") + 1, "g: x|\n") != NULL,
+		    "Short string decoded wrongly: %s", out);
+}
+END_TEST
+
+/**** The next set of tests are for the append sink ****/
+
+#define APPEND_WRITERS 4
+#define APPEND_RECORDS 100
+
+static char append_big[10000];
+
+/* Count the lines of a file, checking that every line is an entry */
+static int
+append_count_lines(FILE *f, size_t *longest)
+{
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	int lines = 0;
+
+	*longest = 0;
+	rewind(f);
+	while ((len = getline(&line, &alloc, f)) > 0) {
+		fail_unless(line[len - 1] == '\n' &&
+			    strstr(line, " test ") != NULL,
+			    "Line %d was corrupt", lines);
+		if ((size_t)len > *longest)
+			*longest = len;
+		lines++;
+	}
+	free(line);
+	return lines;
+}
+
+START_TEST (test_nslog_append_sink)
+{
+	char path[] = "/tmp/nslog-append-XXXXXX";
+	nslog_append_sink_t *sink;
+	FILE *raw, *text;
+	size_t longest;
+	long before;
+	int fd, i;
+
+	fd = mkstemp(path);
+	fail_unless(fd >= 0, "Unable to create temporary file");
+	close(fd);
+	memset(append_big, 'x', sizeof(append_big) - 1);
+
+	fail_unless(nslog_append_sink_open(path, false, &sink)
+		    == NSLOG_NO_ERROR,
+		    "Unable to open append sink");
+	fail_unless(nslog_add_message_callback(nslog_append_sink_render, sink)
+		    == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+	fail_unless(nslog_uncork() == NSLOG_NO_ERROR,
+		    "Unable to uncork");
+	NSLOG(test, INFO, "Hello %s", "world");
+	/* A line starting like a fragment mustn't be taken for one */
+	NSLOG(test, INFO, "Two\n%cline test log", 0x1e);
+	NSLOG(test, WARNING, "%s", append_big);
+
+	/* Writers in other processes mustn't split each other's records */
+	for (i = 0; i < APPEND_WRITERS; i++) {
+		pid_t pid = fork();
+		fail_unless(pid >= 0, "Unable to fork");
+		if (pid == 0) {
+			int n;
+			for (n = 0; n < APPEND_RECORDS; n++)
+				NSLOG(test, INFO, "%d %.1000s", n, append_big);
+			_exit(0);
+		}
+	}
+	for (i = 0; i < APPEND_WRITERS; i++)
+		wait(NULL);
+	nslog_remove_message_callback(nslog_append_sink_render, sink);
+	fail_unless(nslog_append_sink_destroy(sink) == NSLOG_NO_ERROR,
+		    "Unable to destroy append sink");
+
+	raw = fopen(path, "r");
+	text = tmpfile();
+	fail_unless(raw != NULL && text != NULL,
+		    "Unable to open files");
+	fail_unless(nslog_append_unframe(raw, text) == NSLOG_NO_ERROR,
+		    "Unable to unframe the log");
+	fail_unless(append_count_lines(text, &longest)
+		    == 4 + APPEND_WRITERS * APPEND_RECORDS,
+		    "Wrong number of records");
+	fail_unless(longest > sizeof(append_big),
+		    "Big record wasn't reassembled");
+	rewind(text);
+	fail_unless(fgets(append_big, sizeof(append_big), text) != NULL &&
+		    strstr(append_big, ": Hello world\n") != NULL,
+		    "First record was wrong: %s", append_big);
+	fail_unless(fgets(append_big, sizeof(append_big), text) != NULL &&
+		    strstr(append_big, ": Two\n") != NULL &&
+		    fgets(append_big, sizeof(append_big), text) != NULL &&
+		    strcmp(append_big, "\x1eline test log\n") == 0,
+		    "Second record was wrong: %s", append_big);
+	fclose(text);
+	fclose(raw);
+
+	/* Batched records wait for a flush */
+	fail_unless(nslog_append_sink_open(path, true, &sink)
+		    == NSLOG_NO_ERROR,
+		    "Unable to open batching append sink");
+	fail_unless(nslog_add_message_callback(nslog_append_sink_render, sink)
+		    == NSLOG_NO_ERROR,
+		    "Unable to add message callback");
+	raw = fopen(path, "r");
+	fail_unless(raw != NULL, "Unable to open log");
+	fseek(raw, 0, SEEK_END);
+	before = ftell(raw);
+	NSLOG(test, INFO, "Batched %d", 1);
+	NSLOG(test, INFO, "Batched %d", 2);
+	fseek(raw, 0, SEEK_END);
+	fail_unless(ftell(raw) == before,
+		    "Batched records were written early");
+	fail_unless(nslog_append_sink_flush(sink) == NSLOG_NO_ERROR,
+		    "Unable to flush append sink");
+	fseek(raw, 0, SEEK_END);
+	fail_unless(ftell(raw) > before,
+		    "Batched records weren't flushed");
+	nslog_remove_message_callback(nslog_append_sink_render, sink);
+	fail_unless(nslog_append_sink_destroy(sink) == NSLOG_NO_ERROR,
+		    "Unable to destroy append sink");
+	fclose(raw);
+	unlink(path);
+}
+END_TEST
+
+START_TEST (test_nslog_append_unframe_garbage)
+{
+	FILE *raw = tmpfile();
+	FILE *text = tmpfile();
+	fail_unless(raw != NULL && text != NULL,
+		    "Unable to create temporary files");
+	fputs("\x1e" "1.0 2/2 3:abc\n", raw);
+	rewind(raw);
+	fail_unless(nslog_append_unframe(raw, text) == NSLOG_PARSE_ERROR,
+		    "Unframing an orphan fragment didn't fail");
+	fclose(raw);
+	fclose(text);
+}
+END_TEST
+
+/**** And the suites are set up here ****/
+
+void
+nslog_basic_suite(SRunner *sr)
+{
+        Suite *s = suite_create("libnslog: Basic tests");
+        TCase *tc_basic = NULL;
+
+	tc_basic = tcase_create("Simple log checks, no filters");
+
+        tcase_add_checked_fixture(tc_basic, with_simple_context_setup,
+                                  with_simple_context_teardown);
         tcase_add_test(tc_basic, test_nslog_trivial_corked_message);
         tcase_add_test(tc_basic, test_nslog_trivial_uncorked_message);
 	tcase_add_test(tc_basic, test_nslog_subcategory_name);
 	tcase_add_test(tc_basic, test_nslog_two_corked_messages);
+	tcase_add_test(tc_basic, test_nslog_category_compiled_level);
+	tcase_add_test(tc_basic, test_nslog_level_map);
+	tcase_add_test(tc_basic, test_nslog_long_corked_message);
+	tcase_add_test(tc_basic, test_nslog_threaded_corked_messages);
+	tcase_add_test(tc_basic, test_nslog_log_after_cleanup);
+	tcase_add_test(tc_basic, test_nslog_category_first_use_race);
+	tcase_add_test(tc_basic, test_nslog_threaded_stats);
 	tcase_add_test(tc_basic, test_nslog_check_bad_level);
+	tcase_add_test(tc_basic, test_nslog_signal_flush);
         suite_add_tcase(s, tc_basic);
 
         tc_basic = tcase_create("Simple filter checks");
@@ -630,10 +3201,16 @@ nslog_basic_suite(SRunner *sr)
         tcase_add_test(tc_basic, test_nslog_simple_filter_uncorked_message);
         tcase_add_test(tc_basic, test_nslog_simple_filter_subcategory_message);
         tcase_add_test(tc_basic, test_nslog_simple_filter_out_subcategory_message);
+	tcase_add_test(tc_basic, test_nslog_filter_swap_while_logging);
         tcase_add_test(tc_basic, test_nslog_basic_filter_sprintf);
         tcase_add_test(tc_basic, test_nslog_parse_and_sprintf);
         tcase_add_test(tc_basic, test_nslog_parse_and_sprintf_all_levels);
 	tcase_add_test(tc_basic, test_nslog_parse_and_sprintf_all_kinds);
+	tcase_add_test(tc_basic, test_nslog_parse_from_buffer);
+	tcase_add_test(tc_basic, test_nslog_parse_cache);
+	tcase_add_test(tc_basic, test_nslog_filter_interning);
+	tcase_add_test(tc_basic, test_nslog_filter_serialise);
+	tcase_add_test(tc_basic, test_nslog_filter_deserialise_garbage);
         suite_add_tcase(s, tc_basic);
 
 	tc_basic = tcase_create("Trivial, varied, filter checks");
@@ -642,6 +3219,10 @@ nslog_basic_suite(SRunner *sr)
 	tcase_add_test(tc_basic, test_nslog_filter_filename);
 	tcase_add_test(tc_basic, test_nslog_filter_full_filename);
 	tcase_add_test(tc_basic, test_nslog_filter_out_filename);
+	tcase_add_test(tc_basic, test_nslog_filter_out_same_length_filename);
+	tcase_add_test(tc_basic, test_nslog_site_data);
+	tcase_add_test(tc_basic, test_nslog_filter_watch);
+	tcase_add_test(tc_basic, test_nslog_control_socket);
 	tcase_add_test(tc_basic, test_nslog_filter_level);
 	tcase_add_test(tc_basic, test_nslog_filter_out_level);
 	tcase_add_test(tc_basic, test_nslog_filter_dirname);
@@ -652,5 +3233,49 @@ nslog_basic_suite(SRunner *sr)
 	tcase_add_test(tc_basic, test_nslog_complex_filter2);
 	suite_add_tcase(s, tc_basic);
 
+	tc_basic = tcase_create("Structured logging checks");
+	tcase_add_checked_fixture(tc_basic, with_kv_context_setup,
+				  with_kv_context_teardown);
+	tcase_add_test(tc_basic, test_nslog_kv_uncorked_message);
+	tcase_add_test(tc_basic, test_nslog_kv_corked_message);
+	tcase_add_test(tc_basic, test_nslog_kv_no_fields);
+	tcase_add_test(tc_basic, test_nslog_kv_fallback_render);
+	tcase_add_test(tc_basic, test_nslog_kv_render_json);
+	suite_add_tcase(s, tc_basic);
+
+	tc_basic = tcase_create("Entry callback and timestamp checks");
+	tcase_add_checked_fixture(tc_basic, with_entry_context_setup,
+				  with_entry_context_teardown);
+	tcase_add_test(tc_basic, test_nslog_entry_uncorked_timestamp);
+	tcase_add_test(tc_basic, test_nslog_entry_corked_timestamp);
+	tcase_add_test(tc_basic, test_nslog_entry_tsc_clock);
+	tcase_add_test(tc_basic, test_nslog_entry_tsc_recalibrate);
+	tcase_add_test(tc_basic, test_nslog_entry_priority_lane);
+	tcase_add_test(tc_basic, test_nslog_entry_priority_lane_off);
+	tcase_add_test(tc_basic, test_nslog_message_callbacks);
+	tcase_add_test(tc_basic, test_nslog_message_callbacks_while_logging);
+	tcase_add_test(tc_basic, test_nslog_message_callbacks_with_kv);
+	tcase_add_test(tc_basic, test_nslog_format_matches_snprintf);
+	tcase_add_test(tc_basic, test_nslog_site_prefix);
+	tcase_add_test(tc_basic, test_nslog_history);
+	tcase_add_test(tc_basic, test_nslog_history_more_writers_than_slots);
+	tcase_add_test(tc_basic, test_nslog_backlog);
+	tcase_add_test(tc_basic, test_nslog_backlog_after_cleanup);
+	tcase_add_test(tc_basic, test_nslog_sink_stats);
+	tcase_add_test(tc_basic, test_nslog_count);
+	tcase_add_test(tc_basic, test_nslog_count_after_cleanup);
+	suite_add_tcase(s, tc_basic);
+
+	tc_basic = tcase_create("Binary log sink checks");
+	tcase_add_checked_fixture(tc_basic, with_trivial_filter_context_setup,
+				  with_trivial_filter_context_teardown);
+	tcase_add_test(tc_basic, test_nslog_binary_sink_roundtrip);
+	tcase_add_test(tc_basic, test_nslog_binary_decode_live);
+	tcase_add_test(tc_basic, test_nslog_binary_sink_write_error);
+	tcase_add_test(tc_basic, test_nslog_binary_decode_garbage);
+	tcase_add_test(tc_basic, test_nslog_append_sink);
+	tcase_add_test(tc_basic, test_nslog_append_unframe_garbage);
+	suite_add_tcase(s, tc_basic);
+
         srunner_add_suite(sr, s);
 }
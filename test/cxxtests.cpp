@@ -0,0 +1,182 @@
+/* test/cxxtests.cpp
+ *
+ * Tests for the C++ layer over libnslog (nslog.hpp)
+ *
+ * Copyright 2017 The NetSurf Browser Project
+ *                Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * Format checking and category names are checked by the compiler, so
+ * building this is most of the test.  Running it checks that entries are
+ * made under the right categories, with their arguments passed correctly.
+ */
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "nslog/nslog.hpp"
+
+NSLOG_CXX_DECLARE_CATEGORY(cxx);
+NSLOG_CXX_DECLARE_SUBCATEGORY(cxx, sub);
+NSLOG_CXX_DECLARE_CATEGORY(scope);
+NSLOG_CXX_DECLARE_SUBCATEGORY(scope, inner);
+
+NSLOG_CXX_DEFINE_CATEGORY(cxx, "C++ tests");
+NSLOG_CXX_DEFINE_SUBCATEGORY(cxx, sub, "C++ test subcategory");
+NSLOG_CXX_DEFINE_CATEGORY(scope, "C++ test scope");
+NSLOG_CXX_DEFINE_SUBCATEGORY(scope, inner, "C++ test inner scope");
+
+static constexpr bool same(const char *a, const char *b)
+{
+	while (*a != '\0' && *a == *b) {
+		a++;
+		b++;
+	}
+	return *a == *b;
+}
+
+/* Category names are built by the compiler */
+static_assert(same(__nslog_cxx_category_cxx::name.data, "cxx"));
+static_assert(same(__nslog_cxx_category_sub::name.data, "cxx/sub"));
+static_assert(same(__nslog_cxx_category_inner::name.data, "scope/inner"));
+static_assert(sizeof(__nslog_cxx_category_inner::name.data) ==
+	      sizeof("scope/inner"));
+
+#define FORMAT_OK(fmt, args...)						\
+	::nslog::detail::check_format(					\
+		fmt, decltype(::nslog::detail::arg_types(args)){})
+
+/* Formats are checked against their arguments by the compiler */
+static const std::string str;
+static const char *cstr;
+static const std::size_t size = 0;
+static const long lng = 0;
+static const long long llng = 0;
+static const double dbl = 0;
+static const long double ldbl = 0;
+static const void *ptr;
+
+static_assert(FORMAT_OK("No arguments"));
+static_assert(FORMAT_OK("100%% sure"));
+static_assert(FORMAT_OK("%d %i %u %x %c", 1, 2, 3u, 4, 'c'));
+static_assert(FORMAT_OK("%s and %s", str, cstr));
+static_assert(FORMAT_OK("%zu %ld %lld", size, lng, llng));
+static_assert(FORMAT_OK("%-8.3f %Lg", dbl, ldbl));
+static_assert(FORMAT_OK("%*d %.*s", 4, 1, 3, cstr));
+static_assert(FORMAT_OK("%p %p", ptr, nullptr));
+static_assert(FORMAT_OK("Failed: %m"));
+
+static_assert(!FORMAT_OK("%d"));
+static_assert(!FORMAT_OK("No arguments", 1));
+static_assert(!FORMAT_OK("%d", str));
+static_assert(!FORMAT_OK("%s", 1));
+static_assert(!FORMAT_OK("%d", llng));
+static_assert(!FORMAT_OK("%lld", 1));
+static_assert(!FORMAT_OK("%f", ldbl));
+static_assert(!FORMAT_OK("%ls", cstr));
+static_assert(!FORMAT_OK("%*d", dbl, 1));
+static_assert(!FORMAT_OK("%p", 1));
+static_assert(!FORMAT_OK("%n", ptr));
+static_assert(!FORMAT_OK("Trailing %"));
+
+static int failures = 0;
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "FAIL: %s\n", what);
+	failures++;
+}
+
+static struct {
+	int count;
+	nslog_category_t *category;
+	char message[256];
+} captured;
+
+static void capture(void *context, nslog_entry_context_t *ctx,
+		    const char *fmt, va_list args)
+{
+	(void)context;
+	captured.count++;
+	captured.category = ctx->category;
+	vsnprintf(captured.message, sizeof(captured.message), fmt, args);
+}
+
+static bool was_logged(nslog_category_t &category, const char *message)
+{
+	bool ret = (captured.count == 1 && captured.category == &category &&
+		    strcmp(captured.message, message) == 0);
+	captured.count = 0;
+	return ret;
+}
+
+static void test_arguments(void)
+{
+	std::string world = "world";
+
+	NSLOGXX(cxx, INFO, "Hello %s", world);
+	if (!was_logged(__nslog_category_cxx, "Hello world"))
+		fail("std::string not passed as a C string");
+	NSLOGXX(sub, WARNING, "%d %s %zu %.*s", -1, "two", size + 3, 4,
+		"fourteen");
+	if (!was_logged(__nslog_category_sub, "-1 two 3 four"))
+		fail("Arguments not passed as they were given");
+	/* The compile time name is used rather than one being built */
+	if (__nslog_category_sub.name != __nslog_cxx_category_sub::name.data)
+		fail("Compile time category name not used");
+}
+
+static void log_in_scope(void)
+{
+	NSLOG_SCOPED(cxx, INFO, "Scoped %d", 1);
+}
+
+static void test_scopes(void)
+{
+	log_in_scope();
+	if (!was_logged(__nslog_category_cxx, "Scoped 1"))
+		fail("Call site category not used outside a scope");
+	{
+		nslog::scoped_category outer(__nslog_category_scope);
+		log_in_scope();
+		if (!was_logged(__nslog_category_scope, "Scoped 1"))
+			fail("Scope's category not used");
+		{
+			nslog::scoped_category inner(__nslog_category_inner);
+			log_in_scope();
+			if (!was_logged(__nslog_category_inner, "Scoped 1"))
+				fail("Innermost scope's category not used");
+		}
+		log_in_scope();
+		if (!was_logged(__nslog_category_scope, "Scoped 1"))
+			fail("Outer scope's category not restored");
+		/* Only the scoped macro uses the scope's category */
+		NSLOGXX(cxx, INFO, "Unscoped");
+		if (!was_logged(__nslog_category_cxx, "Unscoped"))
+			fail("Scope's category used by NSLOGXX");
+	}
+	log_in_scope();
+	if (!was_logged(__nslog_category_cxx, "Scoped 1"))
+		fail("Call site category not restored after the scope");
+	if (nslog::scoped_category::current() != nullptr)
+		fail("Scope still current after it ended");
+}
+
+int main(void)
+{
+	if (nslog_set_render_callback(capture, NULL) != NSLOG_NO_ERROR ||
+	    nslog_uncork() != NSLOG_NO_ERROR) {
+		fail("Unable to set up nslog");
+		return EXIT_FAILURE;
+	}
+
+	test_arguments();
+	test_scopes();
+
+	nslog_cleanup();
+
+	printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,129 @@
+/* test/filterbench.c
+ *
+ * Filter parsing throughput benchmark for libnslog
+ *
+ * Copyright 2017 The NetSurf Browser Project
+ *                Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This is not run as part of the test suite.  Run it by hand as:
+ *
+ *     filterbench [leaves [iterations [threads]]]
+ *
+ * It builds a balanced filter with the given number of simple filters as
+ * leaves, then parses it repeatedly on each of the given number of threads
+ * at once, reporting the parse rate and throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nslog/nslog.h"
+
+struct bench {
+	const char *text;
+	size_t len;
+	int iterations;
+	int failures;
+};
+
+static char *build_filter(int leaves, int *counter, char *out)
+{
+	static const char *ops[] = { " || ", " && ", " ^ " };
+
+	if (leaves == 1) {
+		int n = (*counter)++;
+		switch (n % 5) {
+		case 0: return out + sprintf(out, "cat:render/layout%d", n);
+		case 1: return out + sprintf(out, "lvl:WARNING");
+		case 2: return out + sprintf(out, "file:content/handlers/html%d.c", n);
+		case 3: return out + sprintf(out, "dir:desktop/frontend%d", n);
+		default: return out + sprintf(out, "!func:box_layout_%d", n);
+		}
+	}
+	*out++ = '(';
+	out = build_filter(leaves / 2, counter, out);
+	out += sprintf(out, "%s", ops[leaves % 3]);
+	out = build_filter(leaves - (leaves / 2), counter, out);
+	*out++ = ')';
+	*out = '\0';
+	return out;
+}
+
+static void *parse_loop(void *pw)
+{
+	struct bench *bench = pw;
+	int i;
+
+	for (i = 0; i < bench->iterations; i++) {
+		nslog_filter_t *filter;
+		if (nslog_filter_from_buffer(bench->text, bench->len,
+					     &filter) != NSLOG_NO_ERROR) {
+			bench->failures++;
+			continue;
+		}
+		nslog_filter_unref(filter);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int leaves = (argc > 1) ? atoi(argv[1]) : 4096;
+	int iterations = (argc > 2) ? atoi(argv[2]) : 100;
+	int nthreads = (argc > 3) ? atoi(argv[3]) : 1;
+	struct bench *benches;
+	pthread_t *threads;
+	struct timespec start, end;
+	double secs;
+	int counter = 0, failures = 0, i;
+	char *text;
+
+	if (leaves < 1 || iterations < 1 || nthreads < 1) {
+		fprintf(stderr, "usage: %s [leaves [iterations [threads]]]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	text = malloc((size_t)leaves * 64);
+	benches = calloc(nthreads, sizeof(*benches));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (text == NULL || benches == NULL || threads == NULL)
+		return EXIT_FAILURE;
+	build_filter(leaves, &counter, text);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		benches[i].text = text;
+		benches[i].len = strlen(text);
+		benches[i].iterations = iterations;
+		pthread_create(&threads[i], NULL, parse_loop, &benches[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		failures += benches[i].failures;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		((end.tv_nsec - start.tv_nsec) / 1e9);
+	printf("%d leaves, %zu bytes, %d parses on %d threads in %.3fs\n",
+	       leaves, strlen(text), iterations * nthreads, nthreads, secs);
+	printf("%.1f parses/s, %.2f MB/s\n",
+	       (iterations * nthreads) / secs,
+	       ((double)strlen(text) * iterations * nthreads) / secs / 1e6);
+
+	nslog_cleanup();
+	free(threads);
+	free(benches);
+	free(text);
+
+	if (failures != 0) {
+		fprintf(stderr, "%d parses failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
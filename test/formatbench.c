@@ -0,0 +1,104 @@
+/* test/formatbench.c
+ *
+ * Message formatting benchmark for libnslog
+ *
+ * Copyright 2017 The NetSurf Browser Project
+ *                Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This is not run as part of the test suite.  Run it by hand as:
+ *
+ *     formatbench [iterations]
+ *
+ * It logs a few typical messages the given number of times to a message
+ * callback, which makes nslog render each of them.  It then logs the same
+ * messages with a '-' flag (which changes nothing without a width) on
+ * every conversion, which makes nslog leave them to the C library, and
+ * finally renders them with snprintf() alone for reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nslog/nslog.h"
+
+NSLOG_DEFINE_CATEGORY(bench, "Formatting benchmark");
+
+static size_t total;
+
+static void sink(void *context, nslog_entry_t *entry,
+		 const char *msg, size_t len)
+{
+	(void)context;
+	(void)entry;
+	(void)msg;
+	total += len;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+#define BENCH_MESSAGES(log, f)						\
+	do {								\
+		log("fetch %" f "p finished: %" f "d bytes in %" f "u ms", \
+		    (void *)&total, i, 250u);				\
+		log("url %" f "s has %" f "zu chars",			\
+		    "http://www.netsurf-browser.org/", (size_t)31);	\
+		log("box %" f "lx width %" f "ld height %" f "ld",	\
+		    0xfeedul, 800l, -600l);				\
+		log("token '%" f ".*s' at %" f "d", 5, "hello world", i); \
+	} while (0)
+
+#define NSLOG_MESSAGE(fmt, args...) NSLOG(bench, INFO, fmt, ##args)
+
+#define SNPRINTF_MESSAGE(fmt, args...)					\
+	total += snprintf(buf, sizeof(buf), fmt, ##args)
+
+int main(int argc, char **argv)
+{
+	int iterations = (argc > 1) ? atoi(argv[1]) : 1000000;
+	double start, fast_secs, libc_secs, snprintf_secs;
+	char buf[1024];
+	int i;
+
+	if (iterations < 1) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	nslog_add_message_callback(sink, NULL);
+	nslog_uncork();
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		BENCH_MESSAGES(NSLOG_MESSAGE, "");
+	fast_secs = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		BENCH_MESSAGES(NSLOG_MESSAGE, "-");
+	libc_secs = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		BENCH_MESSAGES(SNPRINTF_MESSAGE, "");
+	snprintf_secs = now() - start;
+
+	printf("%d messages, %zu bytes\n", iterations * 4, total);
+	printf("nslog formatter:     %.1f messages/s\n",
+	       (iterations * 4) / fast_secs);
+	printf("nslog via C library: %.1f messages/s\n",
+	       (iterations * 4) / libc_secs);
+	printf("snprintf() alone:    %.1f messages/s\n",
+	       (iterations * 4) / snprintf_secs);
+	printf("speedup:             %.2fx\n", libc_secs / fast_secs);
+
+	nslog_cleanup();
+
+	return EXIT_SUCCESS;
+}
@@ -1,12 +1,12 @@
-#!/bin/sh 
+#!/bin/sh
 
 set -e
 
 TEST_PATH=$1
-TEST_PFX=$4
+TEST_EXT=$2
 
-for TEST in basic explicitfilter; do
-    ${TEST_PATH}/${TEST_PFX}${TEST}
+for TEST in testrunner cxxtests; do
+    ${TEST_PATH}/test_${TEST}${TEST_EXT}
 done
 
 exit 0
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2017 Daniel Silverstone <dsilvers@netsurf-browser.org>
+ *
+ * This file is part of libnslog.
+ *
+ * Licensed under the MIT License,
+ *		  http://www.opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * \file
+ * Render a binary log stream as text
+ *
+ * Usage: nslog-decode [file]
+ *
+ * Reads the stream written by a binary log sink from the named file (or
+ * standard input) and writes the log entries as text to standard output.
+ * A pipe from a running program is followed, each entry written out as it
+ * arrives.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "nslog/nslog.h"
+
+int main(int argc, char **argv)
+{
+	FILE *in = stdin;
+	struct stat st;
+	nslog_error err;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "--help") == 0)) {
+		fprintf(stderr, "usage: %s [file]\n", argv[0]);
+		return 2;
+	}
+
+	if (argc == 2 && strcmp(argv[1], "-") != 0) {
+		in = fopen(argv[1], "rb");
+		if (in == NULL) {
+			fprintf(stderr, "%s: %s: %s\n",
+				argv[0], argv[1], strerror(errno));
+			return 1;
+		}
+	}
+
+	/* Otherwise entries from a pipe would sit in stdout's buffer */
+	if (fstat(fileno(in), &st) == 0 && S_ISFIFO(st.st_mode))
+		setvbuf(stdout, NULL, _IOLBF, 0);
+
+	err = nslog_binary_decode(in, stdout);
+
+	if (in != stdin)
+		fclose(in);
+
+	switch (err) {
+	case NSLOG_NO_ERROR:
+		return 0;
+	case NSLOG_PARSE_ERROR:
+		fprintf(stderr, "%s: malformed log stream\n", argv[0]);
+		break;
+	case NSLOG_NO_MEMORY:
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		break;
+	default:
+		fprintf(stderr, "%s: I/O error\n", argv[0]);
+		break;
+	}
+	return 1;
+}